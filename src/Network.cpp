@@ -1,5 +1,14 @@
 #include "Network.h"
 #include "NetworkLogger.h"
+#include "NetworkPacket.h"
+#include "NetworkFec.h"
+#include "NetworkHash.h"
+#include "NetworkPacketPool.h"
+#include "NetworkReactor.h"
+#include "NetworkUdp.h"
+#include "NetworkLoopback.h"
+#include "NetworkSpectator.h"
+#include "NetworkRendezvous.h"
 
 #include <chrono>
 #include <iostream>
@@ -12,90 +21,121 @@
 #include <fstream>
 #include <thread>
 
-struct NetworkMetric
-{
-    float waits;
-    float update_rate;
-    float rollbacks;
-    float ping;
-
-} static m_metrics { 0, 60, 0 };
-
+#ifdef __linux__
+#include <time.h>
+#endif
 
+#ifndef WIN32
+#include <fcntl.h>
+#endif
 
-static std::atomic<bool> saving_metrics(true);
-void write_metrics()
-{
-    std::ofstream network_data("network_metrics.csv");
-    network_data << "Update Rate, Waits / Sec, Rollbacks / Sec, Ping" << std::endl;
-    while(saving_metrics) {
-        // we write metrics once every second
-        std::this_thread::sleep_for( std::chrono::seconds(1));
+// Messages from a session go to its own logger
+#define LogSession LogMessageTo(*m_logger)
 
-        network_data << m_metrics.update_rate << "," << m_metrics.waits << "," << m_metrics.rollbacks << "," << m_metrics.ping << std::endl;
+// Defined under a name made from the windows and input size, see SHOBU_BUILD_STAMP
+const int SHOBU_BUILD_STAMP = 1;
 
-        // reset metrics
-        m_metrics.waits = 0;
-        m_metrics.update_rate = 1600;
-        m_metrics.rollbacks = 0;
-    }
+// How many times to send the handshake to deal with packet loss.  Input packets are protected by parity packets instead
+const int HANDSHAKE_REPEATS = 2;
 
+// Weight of each packet in the packet loss average
+const float LOSS_WEIGHT = 0.02f;
 
-}
+// Ping time stamps wrap around after 65 seconds
+const unsigned int PING_TIME_MASK = 0xFFFF;
 
+// While idle only send a packet every this many updates
+const int IDLE_SEND_INTERVAL = 4;
 
-#define MAX_INPUT_DELAY 7
+// How long the client waits for the host to answer
+const int CONNECT_TIMEOUT_MS = 4000;
 
-// Amount of inputs to store for rollbacks
-const int OLD_FRAMES = 5;
+// How often the host checks whether it should stop waiting for a client
+const int HANDSHAKE_POLL_MS = 100;
 
-// the MAX number of game ticks it is possible to roll back to
-const int MAX_ROLLBACK = 15;
+// Weight of each packet in the receive latency average
+const float RECEIVE_LATENCY_WEIGHT = 0.05f;
 
-// How manytimes to send each packet to deal with packet lost
-const int SEND_REPEATS = 2;
+// Weight of the existing average when averaging the time between updates
+const float UPDATE_RATE_WEIGHT = 0.90f;
 
-//static std::ofstream netlog;
+// Microseconds of metrics in each line of the metrics file
+const long long METRICS_INTERVAL = 1000000;
 
-// Thread use for listening to incoming network traffic
-void listenThreadFunc(void* network)
+// Bit fields only hold 32 bits, so hashes are sent in two halves
+static void writeHash(PacketWriter& writer, uint64_t hash)
 {
-    while(1)
-    {
-        if(((ShobuNetwork*)network)->networkUpdate()) {
-            LogNull << "Terminated Network Thr  ead" << endline;
-            return;
-        }
-
-        std::this_thread::sleep_for( std::chrono::milliseconds(1));
-    }
+    writer.writeBits(static_cast<uint32_t>(hash), 32);
+    writer.writeBits(static_cast<uint32_t>(hash >> 32), 32);
 }
 
-void packetDelayFunc(void* network)
+static uint64_t readHash(PacketReader& reader)
 {
-    while(((ShobuNetwork*)network)->connected())
-    {
-        ((ShobuNetwork*)network)->sendDelayedPackets();
-        std::this_thread::sleep_for( std::chrono::milliseconds(16));
-    }
+    uint64_t low = reader.readBits(32);
+    uint64_t high = reader.readBits(32);
+    return low | (high << 32);
 }
+
+//static std::ofstream netlog;
+
 ShobuNetwork::ShobuNetwork()
 {
-    m_input_buffer_size = 0;
+    m_client = 0;
+    m_updateCallback = nullptr;
+    m_inputCallback = nullptr;
+
+    m_strategies[PREDICT_REPEAT] = &m_repeat_predictor;
+    m_strategies[PREDICT_HOLD] = &m_hold_predictor;
+    m_strategies[PREDICT_MARKOV] = &m_markov_predictor;
+    m_predictor = &m_repeat_predictor;
+    m_strategy = PREDICT_REPEAT;
+    m_compare_predictions = false;
+
+    // A rollback goes back at most MAX_ROLLBACK frames from the newest
+    m_snapshots.setSlots(MAX_ROLLBACK+1);
+    m_prediction_stats = PredictionStats();
+    for(int i=0; i<PREDICTION_STRATEGIES; i++) {
+        m_strategy_stats[i] = PredictionStats();
+    }
+    m_clock = &systemClock();
+    m_update_time = 0;
+
+    memset(&m_metrics, 0, sizeof(m_metrics));
+    m_metrics.update_rate = 60;
+    m_last_metrics = m_metrics;
+    m_last_update = -1;
+    m_metrics_start = -1;
+
+    // Sessions only keep their messages in memory until given files, so many sessions never share one
+    m_own_logger.reset(new NetworkLogger(nullptr));
+    m_logger = m_own_logger.get();
+    m_snapshots.setLogger(m_logger);
+
+    m_broadcaster = nullptr;
+    m_broadcast_tick = -1;
+
+    m_connect_time = 0;
+    m_using_relay = false;
+    m_force_relay = false;
+    m_rendezvous_token = 0;
+    m_fall_back = false;
 
 
     // initialize local history of input buffer
     for(unsigned int i=0; i<MAX_INPUTS; i++) {
-        local_buffer[i] = 0;
-        remote_buffer[i] = 0;
-        m_check_buffer[i] = 0;
+        local_buffer[i] = NetworkInput::fromInt(0);
+        remote_buffer[i] = NetworkInput::fromInt(0);
+        m_predicted[i] = NetworkInput::fromInt(0);
+        m_guessed[i] = false;
     }
+    resetChecks();
 
     m_connected = false;
 
     m_remote_tick = 0;
     m_local_tick = -1;
     m_rollback_tick = -1;
+    m_stored_tick = -1;
 
     m_remote_synced = true;
 
@@ -103,17 +143,10 @@ ShobuNetwork::ShobuNetwork()
 
     m_delay = 2;
 
-    m_stateSynced = true;
-
-
-    // seed RNG for simulated packet loss
-    srand(time(nullptr));
+    m_input_bits = 32;
 
+    m_stateSynced = true;
 
-    // Setup variables for testing network latency
-    m_testPacketLoss = 0;
-    m_testNetworkLatency = false;
-    m_packetDelay = 4;
 
     delayRollbacks = false;
 //    netlog.open("net.log");
@@ -130,140 +163,234 @@ ShobuNetwork::ShobuNetwork()
 
     m_ping = 0;
 
+    m_reactor = nullptr;
+    m_use_uring = false;
+
+    m_udp = nullptr;
+    m_conditioned = nullptr;
+    m_poll_transport = false;
+
+    m_reactor_cpu = -1;
+    m_spin_budget = 0;
+    m_realtime_priority = 0;
+
+    m_receive_latency = -1;
+    m_max_receive_latency = -1;
+    m_last_max_receive_latency = -1;
+
+    m_packet_loss = 0;
+    m_remote_packet_loss = 0;
+    m_recovered_packets = 0;
+    m_parity_size = 0;
+
+    m_remote_time_stamp = 0;
+    m_remote_time_received = 0;
+    m_remote_time_known = false;
+
     m_tick_delta = 0;
 
+    resetAcks();
 
-}
 
-void ShobuNetwork::createInputBuffer(int p_size)
-{
-    m_input_buffer_size = p_size;
 }
 
-void ShobuNetwork::sendDelayedPackets()
+void ShobuNetwork::flushPackets()
 {
-    if(!m_testNetworkLatency) return;
-
-    for(auto it = m_packets.begin(); it != m_packets.end(); it++) {
-        if(it->timer > 0) {
-            it->timer--;
-        } else {
-            for(int i=0; i<SEND_REPEATS; ++i) {
-                sendto(m_socket,  it->packet, 128, 0, (struct sockaddr*)&m_remote_addr,
-                                  sizeof(struct sockaddr));
-            }
-            delete [] it->packet;
-            m_packets.erase(it--);
-        }
+    if(m_transport) {
+        m_transport->flush(m_pool);
     }
+
+    m_capture.flush();
 }
 
 void ShobuNetwork::sendWaitCommand()
 {
-    char tmp_buffer[64];
+    char* tmp_buffer = m_pool.acquire();
+    if(!tmp_buffer) {
+        return;
+    }
+
     tmp_buffer[0] = 'w';
     tmp_buffer[1] = m_client;
 
     // Request the input we are missing since the last rollback
     memcpy(&tmp_buffer[2], &m_local_tick, 4);
 
-    sendto(m_socket, tmp_buffer, 64, 0, (struct sockaddr*)&m_remote_addr,
-           sizeof(struct sockaddr));
+    queuePacket(tmp_buffer, 6);
 }
 
 bool ShobuNetwork::initializeHost(int port)
 {
-
-    createSocket();
-
-    // Initialize Host Address
-    struct sockaddr_in host_address;
-    memset(&host_address, 0, sizeof(host_address));
-    host_address.sin_family = PF_INET;
-    host_address.sin_addr.s_addr = htonl(INADDR_ANY);
-    host_address.sin_port = htons(port);
-
-    // Bind to port
-    if(bind(m_socket, (struct sockaddr*)&host_address, sizeof(host_address)) < 0 ) {
+    if(!createSocket() || !m_udp->bind(port)) {
         return false;
     }
 
     m_client = 's';
 
-    // Create thread for writing metrics
-    std::thread(write_metrics).detach();
+    setMetricsFile(m_metrics_filename.empty() ? nullptr : m_metrics_filename.c_str());
 
     return true;
 }
 
 bool ShobuNetwork::initializeClient(const char* ip_addr, int port)
 {
-    createSocket();
+    if(!createSocket()) {
+        return false;
+    }
 
-    // Initialize remote host address
-    m_host_address.sin_family = PF_INET;
-    m_host_address.sin_port = htons(port);
-    m_host_address.sin_addr.s_addr = inet_addr(ip_addr);
+    // Send to the remote host
+    if(!m_udp->setRemote(ip_addr, port)) {
+        return false;
+    }
 
     m_client = 'c';
 
     return true;
 }
 
+bool ShobuNetwork::initializeLoopback(ShobuNetwork& client)
+{
+    std::unique_ptr<LoopbackTransport> host_end, client_end;
+    LoopbackTransport::createPair(host_end, client_end);
+
+    closeTransport();
+    m_transport = std::move(host_end);
+    m_client = 's';
+
+    client.closeTransport();
+    client.m_transport = std::move(client_end);
+    client.m_client = 'c';
+
+    // Nothing can be lost, so the handshake is done right away
+    client.sendConnectRequest();
+
+    char net_buffer[32];
+    if(receiveConnectRequest(net_buffer, m_transport->receiveOne(net_buffer, sizeof(net_buffer)))) {
+        client.receiveHandshake(net_buffer, client.m_transport->receiveOne(net_buffer, sizeof(net_buffer)));
+    }
+
+    return m_connected && client.m_connected;
+}
+
+bool ShobuNetwork::acceptClient(NetworkTransport* transport, const char* request, int size)
+{
+    closeTransport();
+    m_transport.reset(transport);
+    m_client = 's';
+
+    return receiveConnectRequest(request, size);
+}
+
 void ShobuNetwork::waitForClient()
 {
-    char tmp_buffer[2];
+    char net_buffer[32];
+    runHostThread = true;
+    while(!m_connected && runHostThread) {
+        // Check every so often whether we should stop waiting
+        if(!m_transport->wait(HANDSHAKE_POLL_MS)) {
+            continue;
+        }
+
+        receiveConnectRequest(net_buffer, m_transport->receiveOne(net_buffer, sizeof(net_buffer)));
+    }
+
+    runHostThread = false;
+}
+
+bool ShobuNetwork::receiveConnectRequest(const char* net_buffer, int recv_bytes)
+{
+    if(recv_bytes <= 0) {
+        return false;
+    }
+
+    switch(net_buffer[0]) {
+    case 'c': // client requested a connection
+        // Inputs of a different size can't be decoded
+        if(recv_bytes >= 2 && net_buffer[1] != SHOBU_INPUT_SIZE) {
+            LogSession << "Client's inputs are " << (int)net_buffer[1] << " bytes instead of " << SHOBU_INPUT_SIZE << endline;
+            return false;
+        }
+
+        // Resends are sized by the input buffers, so they have to match too
+        if(!sameWindows(net_buffer, recv_bytes, 2)) {
+            return false;
+        }
+
+        LogSession << "Client connected. Input Delay is " << (unsigned int)m_delay << ". Sending handshake.." << endline;
+
+        m_transport->replyToSender();
+        sendHandshake();
+        m_connected = true;
+
+        // Start listening to the client
+        startListening();
+
+        return true;
+    case 'p': // Whole punch testing
+        LogNull << "Hole punch from server" << endline;
+        break;
+    default:
+        LogNull << "Unknown packet received...: " <<  net_buffer << endline;
+        break;
+    }
+
+    return false;
+}
+
+void ShobuNetwork::sendHandshake()
+{
+    char tmp_buffer[16];
     tmp_buffer[0] = 'a';
 
     // Need to send the amount of input delay to use
     memcpy(&tmp_buffer[1], &m_delay, 1);
 
-    struct sockaddr_in host_addr;
-    socklen_t host_addr_size = sizeof(host_addr);
-    char net_buffer[32];
-    runHostThread = true;
-    while(!m_connected && runHostThread) {
-        int recv_bytes = recvfrom(m_socket, net_buffer, 32, 0, (struct sockaddr*)&host_addr, &host_addr_size);
-
-        if(recv_bytes > 0) {
-            switch(net_buffer[0]) {
-            case 'c': // client requested a connection
-                LogMessage << "Client connected. Input Delay is " << (unsigned int)m_delay << ". Sending handshake.." << endline;
-
-                m_remote_addr = host_addr;
-                // Send handshake
-                for(int i=0; i<SEND_REPEATS; i++) {
-                    sendto(m_socket, tmp_buffer, 2, 0, (sockaddr*)&m_remote_addr,
-                                sizeof(struct sockaddr));
-                }
-                m_connected = true;
+    // and how many bits of each input are sent
+    tmp_buffer[2] = static_cast<char>(m_input_bits);
 
-                // Start thread to listen to the client
-                std::thread(listenThreadFunc, this).detach();
-                if(m_testNetworkLatency) {
-                    std::thread(packetDelayFunc, this).detach();
-                }
+    // and how big inputs are
+    tmp_buffer[3] = static_cast<char>(SHOBU_INPUT_SIZE);
 
-                break;
-            case 'p': // Whole punch testing
-                LogNull << "Hole punch from server" << endline;
-                break;
-            default:
-                LogNull << "Unknown packet received...: " <<  net_buffer << endline;
-                break;
-            }
+    // and the windows we were built with
+    PacketWriter writer(&tmp_buffer[4], sizeof(tmp_buffer)-4);
+    writer.writeVarint(MAX_INPUTS);
+    writer.writeVarint(MAX_ROLLBACK);
+
+    for(int i=0; i<HANDSHAKE_REPEATS; i++) {
+        m_transport->sendNow(tmp_buffer, 4 + writer.size());
+    }
+}
+
+bool ShobuNetwork::sameWindows(const char* net_buffer, int recv_bytes, int offset)
+{
+    // Defaults from before the windows could be changed
+    unsigned int inputs = 64;
+    unsigned int rollback = 15;
+    if(recv_bytes > offset) {
+        PacketReader reader(net_buffer+offset, recv_bytes-offset);
+        inputs = reader.readVarint();
+        rollback = reader.readVarint();
+        if(reader.error()) {
+            return false;
         }
     }
 
-    runHostThread = false;
+    if(inputs != MAX_INPUTS || rollback != static_cast<unsigned int>(MAX_ROLLBACK)) {
+        LogSession << "The other side keeps " << inputs << " inputs and rolls back " << rollback << " frames instead of "
+                   << MAX_INPUTS << " and " << MAX_ROLLBACK << ", build both with the same SHOBU_MAX_INPUTS and SHOBU_MAX_ROLLBACK" << endline;
+        return false;
+    }
+
+    return true;
 }
 
 void ShobuNetwork::sendDisconnect()
 {
     char tmp_buffer[1];
     tmp_buffer[0] = 'd';
-    sendto(m_socket, tmp_buffer, 1, 0, (struct sockaddr*)&m_remote_addr,
-           sizeof(struct sockaddr));
+    if(m_transport) {
+        m_transport->sendNow(tmp_buffer, 1);
+    }
 }
 
 void ShobuNetwork::printBuffer()
@@ -275,224 +402,507 @@ void ShobuNetwork::connectToHost()
 
     runClientThread = true;
 
-    char tmp_buffer[1];
-    tmp_buffer[0] = 'c';
-
-
-    LogNull << "Sending handshake to the server" << endline;
-    sendto(m_socket, tmp_buffer, 1, 0, (sockaddr*)&m_host_address,
-                sizeof(struct sockaddr));
+    sendConnectRequest();
 
     // Set a timeout
-    fd_set fds;
-    struct timeval timeout;
-    int rc;
-    timeout.tv_sec = 4;
-    timeout.tv_usec = 0;
-    FD_ZERO(&fds);
-    FD_SET(m_socket, &fds);
-    rc = select(sizeof(fds)*8, &fds, NULL, NULL, &timeout);
-    if(rc ==-1) {
-        LogNull << "Select error" << endline;
-        return;
-    } else if(rc >= 0) {
-        if(!FD_ISSET(m_socket, &fds)) {
-            LogNull << "Could not connect to host, Timed out" << endline;
-            return;
-        }
-    } else {
+    if(!m_transport->wait(CONNECT_TIMEOUT_MS)) {
+        LogNull << "Could not connect to host, Timed out" << endline;
+        runClientThread = false;
         return;
     }
 
-    struct sockaddr_in host_addr;
-    socklen_t host_addr_size = sizeof(host_addr);
     char net_buffer[32];
-    int recv_bytes = recvfrom(m_socket, net_buffer, 32, 0, (struct sockaddr*)&host_addr, &host_addr_size);
+    if(receiveHandshake(net_buffer, m_transport->receiveOne(net_buffer, sizeof(net_buffer)))) {
+        // Sleeping to avoid input carrying over
+        m_clock->sleep(1000000);
+    }
+
+    runClientThread = false;
+}
+
+void ShobuNetwork::sendConnectRequest()
+{
+    char tmp_buffer[16];
+    tmp_buffer[0] = 'c';
+    tmp_buffer[1] = static_cast<char>(SHOBU_INPUT_SIZE);
+
+    PacketWriter writer(&tmp_buffer[2], sizeof(tmp_buffer)-2);
+    writer.writeVarint(MAX_INPUTS);
+    writer.writeVarint(MAX_ROLLBACK);
+
+    LogNull << "Sending handshake to the server" << endline;
+    m_transport->sendNow(tmp_buffer, 2 + writer.size());
+}
 
-    if(recv_bytes < 2) {
+bool ShobuNetwork::receiveHandshake(const char* net_buffer, int recv_bytes)
+{
+    if(recv_bytes < 3) {
         LogNull << "Packet size is too small." << endline;
-        return;
+        return false;
     }
 
     switch(net_buffer[0]) {
     case 'a': // server sent handshake
+        // Hosts that don't send their input size use ints
+        if((recv_bytes >= 4 ? net_buffer[3] : 4) != SHOBU_INPUT_SIZE) {
+            LogSession << "Host's inputs are a different size than our " << SHOBU_INPUT_SIZE << " bytes" << endline;
+            return false;
+        }
+
+        if(!sameWindows(net_buffer, recv_bytes, 4)) {
+            return false;
+        }
+
         memcpy(&m_delay, &net_buffer[1], 1 );
-        m_remote_addr = m_host_address;
         LogNull << "Received handshake from server. Input delay is " << (int)m_delay << endline;
         setInputDelay(m_delay);
+        setInputBits(net_buffer[2]);
 
+        m_connected = true;
 
-        // Sleeping to avoid input carrying over
-        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        // Start listening to the remote host's packets
+        startListening();
 
-        m_connected = true;
+        return true;
+    default:
+        break;
+    }
+
+    return false;
+}
+
+bool ShobuNetwork::networkUpdate()
+{
+    if(!m_transport->wait(1000)) {
+        LogNull << "1 second without client packet." << endline;
+        return false;
+    }
+
+    return !receivePackets();
+}
+
+bool ShobuNetwork::receivePackets()
+{
+    if(!m_connected || !m_transport) {
+        return false;
+    }
+
+    if(!m_transport->receive(receivePacket, this)) {
+        disconnect();
+    }
+
+    return m_connected;
+}
+
+void ShobuNetwork::receivePacket(void* data, const char* packet, int size, long long receive_time)
+{
+    ShobuNetwork* network = static_cast<ShobuNetwork*>(data);
+    network->updateReceiveLatency(receive_time);
+    network->tracePacket(TRACE_RECEIVE, packet, size);
+    network->handlePacket(packet, size);
+}
+
+void ShobuNetwork::handlePacket(const char* net_buffer, int recv_bytes)
+{
+    int new_remote_tick = 0;
 
-        // Start thread which listens to the remote host's packets
-        std::thread(listenThreadFunc, this).detach();
+    if(recv_bytes <= 0) { // TODO make sure packet length is what we expect for each case!
+        return;
+    }
 
-        // Thread which handles simulated network latency
-        if(m_testNetworkLatency) {
-            std::thread(packetDelayFunc, this).detach();
+    switch(net_buffer[0]) {
+    case 'a':
+        LogNull << "Received Handshake from server" << endline;
+        break;
+    case 'c': // The client is still waiting, so our handshake was lost
+        if(m_client == 's') {
+            sendHandshake();
+        }
+        break;
+    case 'f':
+        receiveInputPacket(net_buffer, recv_bytes, false);
+        break;
+    case 'x': { // Parity packet
+        char packet[MAX_PACKET_SIZE];
+        int size = m_fec_decoder.recover(net_buffer, recv_bytes, packet);
+        if(size > 0) {
+            LogNull << "Rebuilt lost packet from parity" << endline;
+            receiveInputPacket(packet, size, true);
+        }
+        break;
+    }
+    case 'd':
+        LogNull << "Remote client/host disconnected." << endline;
+        disconnectWithoutMessage();
+        break;
+    case 'F': // The other player went to the relay, so the direct path only works one way
+        if(isRelayFallBack(net_buffer, recv_bytes)) {
+            m_fall_back = true;
+        }
+        break;
+    case 'R': // The rendezvous server acknowledged the relay
+        break;
+    case 'w': // Wait command
+        if(recv_bytes < 6) {
+            break;
         }
 
+        memcpy(&new_remote_tick, &net_buffer[2], 4);
+        LogNull << "Received wait command at tick: " << new_remote_tick << endline;
+
+        // Only counts when we're waiting too
+        if(m_wait) {
+            m_remote_wait = true;
+        }
         break;
+
     default:
+        LogSession << "Got unknown network request " << (int)net_buffer[0] << endline;
         break;
     }
+}
 
-    runClientThread = false;
+void ShobuNetwork::setReactor(NetworkReactor* reactor)
+{
+    m_reactor = reactor;
 }
 
-bool ShobuNetwork::networkUpdate()
+int ShobuNetwork::getSocket()
 {
+    if(m_udp) {
+        return m_udp->getSocket();
+    }
 
-    std::unique_lock<std::mutex> lock(m_mutex);
+    return -1;
+}
 
-    fd_set fds;
-    struct timeval timeout;
-    int rc;
+int ShobuNetwork::getReceiveHandle()
+{
+    if(m_transport) {
+        return m_transport->getHandle();
+    }
 
-    // set timeout
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
-    FD_ZERO(&fds);
-    FD_SET(m_socket, &fds);
-    rc = select(sizeof(fds)*8, &fds, NULL, NULL, &timeout);
-    if(rc ==-1) {
-        LogNull << "Select error" << endline;
-        return true;
-    } else if(rc > 0) {
-        if(!FD_ISSET(m_socket, &fds)) {
-            LogNull << "No sockets set..." << endline;
-            return false;
-        }
+    return -1;
+}
+
+bool ShobuNetwork::usingIoUring()
+{
+    return m_udp && m_udp->usingIoUring();
+}
+
+void ShobuNetwork::setLowLatency(int cpu, int spin_budget, int realtime_priority)
+{
+    m_reactor_cpu = cpu;
+    m_spin_budget = spin_budget;
+    m_realtime_priority = realtime_priority;
+}
+
+int ShobuNetwork::getReceiveLatency()
+{
+    return static_cast<int>(m_receive_latency);
+}
+
+int ShobuNetwork::getMaxReceiveLatency()
+{
+    return m_last_max_receive_latency >= 0 ? m_last_max_receive_latency : m_max_receive_latency.load();
+}
+
+void ShobuNetwork::updateReceiveLatency(long long receive_time)
+{
+#ifdef __linux__
+    if(receive_time == 0) {
+        return;
+    }
+
+    // The kernel time stamps packets with the real time clock
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long latency = (now.tv_sec*1000000000LL + now.tv_nsec - receive_time) / 1000;
+    if(latency < 0) {
+        return;
+    }
+
+    if(m_receive_latency < 0) {
+        m_receive_latency = static_cast<float>(latency);
     } else {
-        LogNull << "1 second without client packet." << endline;
-        return false;
+        m_receive_latency = m_receive_latency*(1-RECEIVE_LATENCY_WEIGHT) + RECEIVE_LATENCY_WEIGHT*latency;
     }
 
-    struct sockaddr_in remote_addr;
-    socklen_t remote_addr_size = sizeof(remote_addr);
-    char net_buffer[128];
-    int new_remote_tick = 0;
-    int state =0;
+    if(latency > m_max_receive_latency) {
+        m_max_receive_latency = static_cast<int>(latency);
+    }
+#endif
+}
 
-    unsigned int r_time_stamp = 0;
+void ShobuNetwork::startListening()
+{
+    // Run every packet through the simulated network
+    if(!m_conditioned && (m_send_conditions.active() || m_receive_conditions.active() || !m_replay.empty())) {
+        m_conditioned = new ConditionedTransport(m_transport.release(), seededConditions(m_send_conditions, true),
+                                                 seededConditions(m_receive_conditions, false), *m_clock);
+        if(!m_replay.empty()) {
+            m_conditioned->setReceiveReplay(m_replay);
+        }
+        m_transport.reset(m_conditioned);
+    }
 
-    unsigned int r_packet_id = 0;
+    m_transport->start();
 
-    int r_tick_delta;
+    // Nothing to wait on or poll, packets are handed over as they arrive
+    if(m_transport->drivenExternally()) {
+        return;
+    }
 
-    // Wait for data from remote client
-    int recv_bytes = recvfrom(m_socket, net_buffer, 128, 0, (struct sockaddr*)&remote_addr, &remote_addr_size);
+    // Transports without anything to wait on are polled at the start of each update
+    m_poll_transport = m_transport->getHandle() < 0;
+    if(m_poll_transport) {
+        return;
+    }
 
-    if(recv_bytes > 0) { // TODO make sure packet length is what we expect for each case!
+    // Sessions without a shared reactor get one of their own
+    if(!m_reactor) {
+        m_own_reactor.reset(new NetworkReactor());
+        m_own_reactor->setCpu(m_reactor_cpu);
+        m_own_reactor->setSpinBudget(m_spin_budget);
+        m_own_reactor->setRealtimePriority(m_realtime_priority);
+        m_own_reactor->start();
+        m_reactor = m_own_reactor.get();
+    }
 
-        switch(net_buffer[0]) {
-        case 'a':
-            LogNull << "Received Handshake from server" << endline;
-            break;
-        case 'f':
-            // Check to see if the remote game is not the server if this is the client, and vice versa
-            if(net_buffer[1] != m_client && !delayRollbacks) {
-                memcpy(&new_remote_tick, &net_buffer[2], 4);
-                memcpy(&r_packet_id, &net_buffer[6+m_input_buffer_size*4+4], 4);
+    m_reactor->add(this);
+}
 
+void ShobuNetwork::stopListening()
+{
+    if(m_reactor && !m_poll_transport) {
+        m_reactor->remove(this);
+    }
+}
 
-                memcpy(&r_time_stamp, &net_buffer[6+m_input_buffer_size*4+8], 4);
+void ShobuNetwork::applyConditions()
+{
+    if(!m_connected || !m_transport) {
+        return;
+    }
 
-                // only store input buffer when get the packets in order
-                if( (r_packet_id > m_lastPacketId) &&
-                    (new_remote_tick > m_remote_tick) &&
-                    (new_remote_tick <= m_rollback_tick + m_input_buffer_size) ) {
+    if(m_conditioned) {
+        m_conditioned->setConditions(seededConditions(m_send_conditions, true), seededConditions(m_receive_conditions, false));
+        return;
+    }
 
-                    m_lastPacketId = r_packet_id;
-                    m_remote_tick = new_remote_tick;
-                    m_tick_delta = (m_local_tick - m_remote_tick);
+    // Wrap the transport in a conditioner.  Removing the session waits for a delivery in progress
+    if(m_send_conditions.active() || m_receive_conditions.active()) {
+        stopListening();
+        startListening();
+    }
+}
 
-                    // Copy remote inputs into the buffer
-                    for(int i=0; i<m_input_buffer_size; i++) {
-                        int input;
-                        memcpy(&input, &net_buffer[6+i*4], 4);
-                        setRemoteInput(input, i+m_remote_tick-m_sync);
-                    }
+NetworkConditions ShobuNetwork::seededConditions(const NetworkConditions& conditions, bool send) const
+{
+    // The two directions, and the two ends of a loopback match, would otherwise lose the same packets
+    NetworkConditions seeded = conditions;
+    if(seeded.seed == 0) {
+        seeded.seed = static_cast<unsigned int>(hashMix(static_cast<uint64_t>(m_client), send ? 1 : 2));
+        if(seeded.seed == 0) {
+            seeded.seed = 1;
+        }
+    }
+    return seeded;
+}
 
-                    memcpy(&state, &net_buffer[6+m_input_buffer_size*4], 4);
+void ShobuNetwork::receiveInputPacket(const char* buffer, int size, bool recovered)
+{
+    PacketReader reader(buffer, size);
+    reader.readByte();
+    char r_client = reader.readByte();
 
+    unsigned char version = reader.readByte();
+    if(version != PACKET_VERSION) {
+        LogNull << "Unsupported input packet version " << (int)version << endline;
+        return;
+    }
 
-                    LogNull << "Got Tick: " << new_remote_tick << "\t LOCAL: " << m_local_tick
-                               << "\t Input: " << getInput(m_remote_tick)
-                               << "\t Packet ID: " << r_packet_id
-                               << "\t Packet Length: " << recv_bytes
-                               << endline;
+    // The packet is decoded straight into the queue read by update()
+    RemoteUpdate* remote = m_remote_updates.acquire();
+    if(!remote) {
+        // The remote client resends everything we haven't acknowledged, so nothing is lost
+        LogNull << "Remote update queue is full" << endline;
+        return;
+    }
 
+    unsigned int r_packet_id = reader.readVarint();
+    remote->tick = reader.readSignedVarint();
+    remote->ack = reader.readSignedVarint();
+    remote->loss = reader.readByte();
 
-                    // Get and check that the game states are synced
-                    checkState(state);
+    unsigned int r_time_stamp = reader.readVarint();
+    unsigned int r_echo = reader.readVarint();
+    unsigned int r_hold = reader.readVarint();
 
-                    // Compare local and remote deltas
-                    memcpy(&r_tick_delta, &net_buffer[6+m_input_buffer_size*4+12], 4);
+    remote->tick_delta = reader.readSignedVarint();
 
-                    // Attempt to keep the client game ticks in sync with a 1 frame tolerence
-                    //m_remote_synced = m_local_tick <= (m_remote_tick + m_delay+1);
-                    m_remote_synced = r_tick_delta+1 >= m_tick_delta;
-                    //LogMessage << "Remote Delta: " << r_tick_delta << "     Local Delta: " << m_local_tick - m_remote_tick << endline;
+    remote->checked = reader.readSignedVarint();
+    remote->check_count = reader.readVarint();
+    if(remote->check_count > CHECKS_PER_PACKET) {
+        LogNull << "Malformed input packet. Length: " << size << endline;
+        return;
+    }
+    if(remote->check_count > 0) {
+        remote->first_check = remote->tick - static_cast<int>(reader.readVarint());
+        for(int i=0; i<remote->check_count; i++) {
+            remote->checks[i] = readHash(reader);
+        }
+        remote->input_check = readHash(reader);
+    }
 
-                } else if(new_remote_tick > m_remote_tick + m_input_buffer_size) {
-                    LogNull << "Got Future Tick " << new_remote_tick << " , Old remote tick is " << m_remote_tick << endline;
-                } else if(new_remote_tick != m_remote_tick) {
-                    LogNull << "Got Old tick " << new_remote_tick << " , Current tick is " << m_remote_tick << endline;
-                }
-            }
-            // m_remote_addr = remote_addr;
+    // Only the inputs the remote client hasn't seen acknowledged are sent, up to the last one that fit
+    remote->last_input = remote->tick + reader.readSignedVarint();
+    remote->input_count = reader.readVarint();
+    if(remote->input_count > MAX_RESEND || !reader.readInputs(remote->inputs, remote->input_count, m_input_bits)) {
+        LogNull << "Malformed input packet. Length: " << size << endline;
+        return;
+    }
 
+    // Check to see if the remote game is not the server if this is the client, and vice versa
+    if(r_client == m_client || delayRollbacks) {
+        return;
+    }
 
-            sendPingResponse(r_time_stamp);
-            break;
-        case 'd':
-            LogNull << "Remote client/host disconnected." << endline;
-            disconnectWithoutMessage();
-            break;
-        case 'r':
-            memcpy(&new_remote_tick, &net_buffer[2], 4);
-
-            // Send the requested frame
-            LogNull << "Received request for input for tick: " << new_remote_tick << endline;
-            if(new_remote_tick > m_local_tick) {
-                sendInput(m_local_tick);
-            } else {
-                sendInput(new_remote_tick);
+    // Keep the packet in case a later parity packet needs it to rebuild a lost one
+    m_fec_decoder.addPacket(buffer, size, r_packet_id);
+
+    // Packets that arrive out of order, or are rebuilt from parity after later ones arrived,
+    // may still have inputs the later ones left out
+    remote->old = r_packet_id <= m_lastPacketId;
+    remote->recovered = recovered;
+    if(remote->old) {
+        LogNull << "Got Old packet " << r_packet_id << " , Last packet is " << m_lastPacketId << endline;
+        m_remote_updates.publish();
+        return;
+    }
+
+    // Gaps in the packet ids are packets lost on the way
+    updatePacketLoss(r_packet_id - m_lastPacketId - 1);
+
+    m_lastPacketId = r_packet_id;
+
+    LogNull << "Got Tick: " << remote->tick
+               << "\t Packet ID: " << r_packet_id
+               << "\t Packet Length: " << size
+               << endline;
+
+    // Remember the remote time stamp so the next packet we send can echo it back
+    unsigned int now = m_clock->nowMs();
+    remote->time_stamp = r_time_stamp;
+    remote->receive_time = now;
+
+    // An echo of 0 means the remote client has not received a packet from us yet.
+    // Don't count the time the remote client held the time stamp before echoing it
+    if(r_echo > 0) {
+        remote->round_trip = static_cast<int>((now - (r_echo-1) - r_hold) & PING_TIME_MASK);
+    } else {
+        remote->round_trip = -1;
+    }
+
+    m_remote_updates.publish();
+}
+
+void ShobuNetwork::processRemoteUpdates()
+{
+    while(RemoteUpdate* remote = m_remote_updates.front()) {
+        applyRemoteUpdate(*remote);
+        m_remote_updates.pop();
+    }
+}
+
+void ShobuNetwork::discardRemoteUpdates()
+{
+    while(m_remote_updates.front()) {
+        m_remote_updates.pop();
+    }
+}
+
+void ShobuNetwork::applyRemoteUpdate(const RemoteUpdate& remote)
+{
+    int last_input_tick = remote.last_input;
+    int first_input_tick = last_input_tick - remote.input_count + 1;
+
+    // Don't overwrite inputs that may still be needed for a rollback
+    if(last_input_tick >= m_stored_tick + (int)MAX_INPUTS) {
+        LogNull << "Got Future Tick " << remote.tick << " , Old remote tick is " << m_remote_tick << endline;
+        return;
+    }
+
+    if(remote.ack > m_remote_ack) {
+        m_remote_ack = remote.ack;
+    }
+
+    // Copy remote inputs into the buffer when they continue from the last one we have
+    if(first_input_tick <= m_remote_input_tick+1 && last_input_tick > m_remote_input_tick) {
+        for(int tick=m_remote_input_tick+1; tick<=last_input_tick; tick++) {
+            setRemoteInput(remote.inputs[tick-first_input_tick], tick);
+
+            // Predictors learn from every input in order
+            m_predictor->observe(tick, remote.inputs[tick-first_input_tick]);
+            if(m_compare_predictions) {
+                for(int i=0; i<PREDICTION_STRATEGIES; i++) {
+                    if(m_strategies[i] != m_predictor) {
+                        m_strategies[i]->observe(tick, remote.inputs[tick-first_input_tick]);
+                    }
+                }
             }
-            break;
-        case 'w': // Wait command
-            memcpy(&new_remote_tick, &net_buffer[2], 4);
-            LogNull << "Received wait command at tick: " << new_remote_tick << endline;
+        }
 
-            // Only true when we're waiting too
-            m_remote_wait = m_wait;
-            break;
+        m_remote_input_tick = last_input_tick;
 
-        case 'o': // Ping response
-            memcpy(&r_time_stamp, &net_buffer[2], 4);
-            updatePing(r_time_stamp);
-            //LogMessage << "Got Ping Reply " << r_time_stamp << endline;
-            break;
-        default:
-            LogMessage << "Got unknown network request " << (int)net_buffer[0] << endline;
-            break;
+        // Only count the rebuilt packets that had inputs we were missing
+        if(remote.recovered) {
+            ++m_recovered_packets;
         }
-    } else if(recv_bytes == 0) {
-        LogNull << "Socket was closed" << endline;
-    } else {
-        LogNull << "Socket error: " << strerror(errno) << endline;
-        disconnect();
+    }
+
+    // Keep the remote states to check against ours once we confirm those frames
+    receiveChecks(remote);
+
+    // Packets that arrived out of order only fill in what's missing
+    if(remote.old || remote.tick < m_remote_tick) {
+        LogNull << "Got Old tick " << remote.tick << " , Current tick is " << m_remote_tick << endline;
+        return;
+    }
+
+    m_remote_tick = remote.tick;
+    m_tick_delta = (m_local_tick - m_remote_tick);
+
+    // How much of our traffic the remote client is losing
+    m_remote_packet_loss = remote.loss / 255.0f;
+
+    // Attempt to keep the client game ticks in sync with a 1 frame tolerence
+    m_remote_synced = remote.tick_delta+1 >= m_tick_delta;
+
+    m_remote_time_stamp = remote.time_stamp;
+    m_remote_time_received = remote.receive_time;
+    m_remote_time_known = true;
+
+    if(remote.round_trip >= 0) {
+        updatePing(remote.round_trip);
+    }
+}
 
+void ShobuNetwork::updatePacketLoss(unsigned int lost)
+{
+    // The first packet has nothing to compare against
+    if(m_lastPacketId == 0) {
+        return;
     }
 
-    if(!m_connected) {
-        return true;
+    if(lost > 64) {
+        lost = 64;
     }
-    return false;
+
+    for(unsigned int i=0; i<lost; i++) {
+        m_packet_loss = m_packet_loss*(1.0f-LOSS_WEIGHT) + LOSS_WEIGHT;
+    }
+    m_packet_loss = m_packet_loss*(1.0f-LOSS_WEIGHT);
 }
 
 void ShobuNetwork::sendInput()
@@ -504,160 +914,492 @@ void ShobuNetwork::sendInput(int frame)
 {
     if(delayRollbacks) return;
 
-    LogNull << "Sending Input: (" << frame << ")" << this->getLocalInput(m_local_tick)
+    // The last update's parity packet goes out ahead of this update's packet
+    if(m_parity_size > 0) {
+        char* parity_packet = m_pool.acquire();
+        if(parity_packet) {
+            memcpy(parity_packet, m_parity, m_parity_size);
+            queuePacket(parity_packet, m_parity_size);
+        }
+        m_parity_size = 0;
+    }
+
+    // Resend every input the remote client hasn't acknowledged yet
+    int newest_input_tick = frame + m_delay;
+    int first_input_tick = m_remote_ack + 1;
+    if(first_input_tick <= newest_input_tick - (int)MAX_INPUTS) {
+        LogSession << "Inputs from frame " << first_input_tick << " were overwritten before the remote client got them" << endline;
+        first_input_tick = newest_input_tick - MAX_INPUTS + 1;
+    }
+
+    // Nothing changed since the last packet, so only send one every few updates to keep the ping and ack fresh
+    bool idle = frame == m_sent_tick && m_remote_input_tick == m_sent_ack && m_remote_ack == m_sent_remote_ack;
+    if(idle && ++m_idle_updates < IDLE_SEND_INTERVAL) {
+        return;
+    }
+
+    m_idle_updates = 0;
+    m_sent_tick = frame;
+    m_sent_ack = m_remote_input_tick;
+    m_sent_remote_ack = m_remote_ack;
+
+    LogNull << "Sending Input: (" << frame << ")" << getLocalInput(m_local_tick).toInt()
                << "\t Packet Id: " << m_packetId
                << endline;
 
 
-    char* tmp_buffer = new char[128];
-
-    tmp_buffer[0] = 'f';
-    tmp_buffer[1] = m_client;
-    memcpy(&tmp_buffer[2], &frame, 4);
-    for(unsigned int i=0; i<static_cast<unsigned int>(m_input_buffer_size); i++) {
-        memcpy(&tmp_buffer[6+i*4], &local_buffer[(MAX_INPUTS+frame-m_input_buffer_size+1+m_delay+i) % MAX_INPUTS], 4);
+    char* tmp_buffer = m_pool.acquire();
+    if(!tmp_buffer) {
+        LogNull << "Out of packet buffers" << endline;
+        return;
     }
 
-    // Add game state value used to test for syncing
-    memcpy(&tmp_buffer[6+4*m_input_buffer_size], &m_check_buffer[(frame-MAX_ROLLBACK+MAX_INPUTS) % MAX_INPUTS], 4);
-
+    PacketWriter writer(tmp_buffer, MAX_PACKET_SIZE);
+    writer.writeByte('f');
+    writer.writeByte(m_client);
+    writer.writeByte(PACKET_VERSION);
 
     // Add packet id
-    memcpy(&tmp_buffer[6+4*m_input_buffer_size+4], &m_packetId, 4);
+    unsigned int packet_id = m_packetId;
+    writer.writeVarint(packet_id);
 
     ++m_packetId;
 
-    // Add time stamp
-    unsigned int time_stamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-    memcpy(&tmp_buffer[6+4*m_input_buffer_size+8], &time_stamp, 4);
+    writer.writeSignedVarint(frame);
+
+    // Acknowledge the last remote input we have without gaps
+    writer.writeSignedVarint(m_remote_input_tick);
+
+    // Let the remote client know how many of its packets are lost so it can adjust its parity packets
+    writer.writeByte(static_cast<unsigned char>(m_packet_loss*255.0f));
+
+    // Add time stamp.  Only the low 16 bits are needed to measure the round trip
+    unsigned int time_stamp = m_clock->nowMs();
+    writer.writeVarint(time_stamp & PING_TIME_MASK);
+
+    // Echo the last remote time stamp along with how long we held on to it
+    if(m_remote_time_known) {
+        writer.writeVarint(m_remote_time_stamp+1);
+        writer.writeVarint((time_stamp - m_remote_time_received) & PING_TIME_MASK);
+    } else {
+        writer.writeVarint(0);
+        writer.writeVarint(0);
+    }
 
     // Send tick delta
-    memcpy(&tmp_buffer[6+4*m_input_buffer_size+12], &m_tick_delta, 4);
+    writer.writeSignedVarint(m_tick_delta);
+
+    // Acknowledge the remote state hashes we have
+    writer.writeSignedVarint(m_received_check);
+
+    // Send the state hashes of our confirmed frames the remote client doesn't have yet, as long as we still have them.
+    // Each frame is compared as soon as both clients confirmed it, so a desync is found at the frame it started
+    if(m_check_cursor <= m_remote_checked || m_check_cursor - m_remote_checked > CHECKS_IN_FLIGHT) {
+        m_check_cursor = m_remote_checked+1;
+    }
+    if(m_check_cursor < m_local_tick - (int)MAX_INPUTS + 1) {
+        m_check_cursor = m_local_tick - MAX_INPUTS + 1;
+    }
+
+    int first_check = m_check_cursor;
+    int check_count = m_rollback_tick - first_check + 1;
+    if(check_count > CHECKS_PER_PACKET) {
+        check_count = CHECKS_PER_PACKET;
+    }
+    if(check_count < 0 || m_chain_tick < first_check + check_count - 1) {
+        check_count = 0;
+    }
+
+    writer.writeVarint(check_count);
+    if(check_count > 0) {
+        writer.writeVarint(frame - first_check);
+        for(int i=0; i<check_count; i++) {
+            writeHash(writer, m_check_buffer[inputIndex(first_check+i)]);
+        }
+
+        // The input chain at the last one tells a simulation that diverged from inputs that did
+        writeHash(writer, m_input_chain[inputIndex(first_check+check_count-1)]);
+        m_check_cursor += check_count;
+    }
+
+    PacketWriter header = writer;
+    int last_input_tick = writeInputs(writer, frame, first_input_tick, newest_input_tick);
+
+    // When they don't all fit, carry on from where the last packet stopped without waiting for the remote client
+    // to acknowledge it.  Once a window of them is unacknowledged start over from the first one, in case one was lost
+    if(last_input_tick < newest_input_tick && m_input_cursor > first_input_tick && m_input_cursor <= newest_input_tick
+       && m_input_cursor - first_input_tick < MAX_RESEND) {
+        writer = header;
+        last_input_tick = writeInputs(writer, frame, m_input_cursor, newest_input_tick);
+    }
+    m_input_cursor = last_input_tick+1;
+
+    if(writer.overflow()) {
+        LogSession << "Input packet is larger than " << MAX_PACKET_SIZE << " bytes" << endline;
+        m_pool.release(tmp_buffer);
+        return;
+    }
+
+    int size = writer.size();
+
+    // Send as much parity as the remote client's packet loss calls for, a frame after the packets it covers
+    m_fec_encoder.setLossRate(m_remote_packet_loss);
+    m_parity_size = m_fec_encoder.addPacket(tmp_buffer, size, packet_id, m_client, m_parity);
+
+    queuePacket(tmp_buffer, size);
+}
+
+int ShobuNetwork::writeInputs(PacketWriter& writer, int frame, int first, int last)
+{
+    if(last > first + MAX_RESEND - 1) {
+        last = first + MAX_RESEND - 1;
+    }
+
+    int input_count = last - first + 1;
+    if(input_count < 0) {
+        input_count = 0;
+    }
+
+    NetworkInput inputs[MAX_RESEND];
+    for(int i=0; i<input_count; i++) {
+        inputs[i] = getLocalInput(first+i);
+    }
+
+    // Wide inputs that change every frame may not all fit.  The remote client only takes inputs that continue
+    // from the ones it has, so leave out the newest until they do
+    PacketWriter header = writer;
+    writer.writeSignedVarint(last - frame);
+    writer.writeVarint(input_count);
+    writer.writeInputs(inputs, input_count, m_input_bits);
+    while(writer.overflow() && input_count > 1) {
+        last -= input_count - input_count/2;
+        input_count /= 2;
+        writer = header;
+        writer.writeSignedVarint(last - frame);
+        writer.writeVarint(input_count);
+        writer.writeInputs(inputs, input_count, m_input_bits);
+    }
+
+    return last;
+}
+
+void ShobuNetwork::queuePacket(char* packet, int size)
+{
+    tracePacket(TRACE_SEND, packet, size);
+
+    if(!m_transport) {
+        m_pool.release(packet);
+        return;
+    }
+
+    m_transport->send(packet, size, m_pool);
+}
+
+void ShobuNetwork::updatePing(int round_trip)
+{
+    // Weight the ping average towards the existing ping value
+    m_ping = m_ping*0.90+0.10*round_trip;
+
+    traceEvent(TRACE_PING, round_trip);
+}
+
+void ShobuNetwork::traceEvent(TraceEventType type, int round_trip)
+{
+    if(!m_capture.isOpen()) {
+        return;
+    }
+
+    TraceEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.time = m_capture.now();
+    event.round_trip = round_trip;
+    m_capture.record(event);
+}
 
-    // Don't send packets when testing for latency right now.  They are sent later
-    if(m_testNetworkLatency) {
-        DelayedPacket packet = {tmp_buffer, m_packetDelay, 128 };
-        m_packets.push_back(packet);
+void ShobuNetwork::tracePacket(TraceEventType type, const char* packet, int size)
+{
+    if(!m_capture.isOpen() || size <= 0) {
+        return;
     }
 
-    // Simulate packet loss
-    if(m_testPacketLoss > 0 && (rand()%m_testPacketLoss)==0) {
+    TraceEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.time = m_capture.now();
+    event.packet_type = packet[0];
+    event.size = size;
+
+    event.packet_id = inputPacketId(packet, size);
+
+    if(type == TRACE_SEND) {
+        m_capture.record(event);
         return;
     }
 
-    if(!m_testNetworkLatency) {
-        for(int i=0; i<SEND_REPEATS; i++) {
-            sendto(m_socket, tmp_buffer, 128, 0, (struct sockaddr*)&m_remote_addr,
-                              sizeof(struct sockaddr));
+    // Received input packets are compared with the last one before receiveInputPacket moves it on
+    if(event.packet_id > 0) {
+        if(event.packet_id <= m_lastPacketId) {
+            event.old = true;
+        } else if(m_lastPacketId > 0) {
+            event.lost = event.packet_id - m_lastPacketId - 1;
         }
-        delete [] tmp_buffer;
     }
+
+    m_capture.recordReceived(event);
+}
+
+int ShobuNetwork::getPing()
+{
+    return m_ping;
 }
 
+int ShobuNetwork::getPacketLoss()
+{
+    return static_cast<int>(m_packet_loss*100.0f);
+}
+
+bool ShobuNetwork::connectThroughRendezvous(const char* server, int port, const char* key)
+{
+    long long start = m_clock->nowMs();
+    m_using_relay = false;
+    m_rendezvous_token = 0;
+    m_fall_back = false;
+
+    int key_size = strlen(key);
+    if(key_size == 0 || key_size > RENDEZVOUS_KEY_SIZE) {
+        LogSession << "Rendezvous keys are 1 to " << RENDEZVOUS_KEY_SIZE << " bytes" << endline;
+        return false;
+    }
+
+    struct sockaddr_in server_address;
+    if(!createSocket() || !UdpTransport::resolve(server, port, server_address)) {
+        return false;
+    }
+
+    char request[MAX_PACKET_SIZE];
+    PacketWriter writer(request, sizeof(request));
+    writer.writeByte('r');
+    writer.writeByte(RENDEZVOUS_VERSION);
+    writer.writeVarint(key_size);
+    for(int i=0; i<key_size; i++) {
+        writer.writeByte(key[i]);
+    }
+
+    // Register until the server introduces the other player
+    char net_buffer[MAX_PACKET_SIZE];
+    struct sockaddr_in peer;
+    uint32_t token = 0;
+    char role = 0;
+    while(!role) {
+        if(m_clock->nowMs() - start > RENDEZVOUS_TIMEOUT_MS) {
+            LogSession << "Nobody else showed up with the rendezvous key " << key << endline;
+            closeTransport();
+            return false;
+        }
+
+        m_udp->sendTo(server_address, request, writer.size());
+        if(!m_transport->wait(RENDEZVOUS_RETRY_MS)) {
+            continue;
+        }
+
+        int size = m_transport->receiveOne(net_buffer, sizeof(net_buffer));
+        if(size <= 0 || net_buffer[0] != 'e') {
+            continue;
+        }
+
+        PacketReader reader(net_buffer+1, size-1);
+        unsigned char version = reader.readByte();
+        unsigned char player = reader.readByte();
+        uint32_t id = reader.readVarint();
+
+        // Address and port come in network order
+        memset(&peer, 0, sizeof(peer));
+        peer.sin_family = AF_INET;
+        unsigned char* ip = reinterpret_cast<unsigned char*>(&peer.sin_addr.s_addr);
+        unsigned char* peer_port = reinterpret_cast<unsigned char*>(&peer.sin_port);
+        for(int i=0; i<4; i++) {
+            ip[i] = reader.readByte();
+        }
+        peer_port[0] = reader.readByte();
+        peer_port[1] = reader.readByte();
+
+        if(reader.error() || version != RENDEZVOUS_VERSION || (player != 's' && player != 'c')) {
+            continue;
+        }
+
+        role = player;
+        token = id;
+    }
+
+    m_client = role;
+    m_rendezvous_address = server_address;
+    m_rendezvous_token = token;
+
+    // Both players send to each other so each side's NAT lets the other's packets in.
+    // Either player going to the relay makes the server send the other one there too
+    m_udp->setRemote(peer);
+    if(m_force_relay || !meetPlayer(m_clock->nowMs() + RENDEZVOUS_PUNCH_MS, nullptr, token)) {
+        LogSession << "Could not reach the other player directly, relaying through the rendezvous server" << endline;
+
+        m_using_relay = true;
+        m_udp->setRemote(server_address);
+        if(!meetPlayer(m_clock->nowMs() + RENDEZVOUS_RELAY_MS, &server_address, token)) {
+            LogSession << "Could not connect through the relay" << endline;
+            closeTransport();
+            return false;
+        }
+    }
+
+    m_connect_time = static_cast<int>(m_clock->nowMs() - start);
+    LogSession << "Connected " << (m_using_relay ? "through the relay" : "directly") << " in " << m_connect_time << " ms" << endline;
+
+    return true;
+}
 
-void ShobuNetwork::sendPingResponse(unsigned int time_stamp)
+bool ShobuNetwork::meetPlayer(long long deadline, const struct sockaddr_in* relay, uint32_t token)
 {
+    char net_buffer[MAX_PACKET_SIZE];
+    bool relay_ready = relay == nullptr;
+    long long last_send = 0;
+    bool sent = false;
+
+    while(m_clock->nowMs() < deadline) {
+        long long now = m_clock->nowMs();
+        if(!sent || now - last_send >= RENDEZVOUS_RETRY_MS) {
+            sent = true;
+            last_send = now;
+
+            if(!relay_ready) {
+                sendRelayRequest(*relay, token);
+            } else if(m_client == 'c') {
+                sendConnectRequest();
+            } else if(!relay) {
+                // Lets the client's connect request through the host's NAT
+                char punch = 'p';
+                m_transport->sendNow(&punch, 1);
+            }
+        }
 
-    char* tmp_buffer = new char[32];
+        if(!m_transport->wait(RENDEZVOUS_RETRY_MS)) {
+            continue;
+        }
 
-    tmp_buffer[0] = 'o';
-    tmp_buffer[1] = m_client;
-    memcpy(&tmp_buffer[2], &time_stamp, 4);
+        int size = m_transport->receiveOne(net_buffer, sizeof(net_buffer));
+        if(size <= 0) {
+            continue;
+        }
 
-    // Don't send packets when testing for latency right now.  They are sent later
-    if(m_testNetworkLatency) {
-        DelayedPacket packet = {tmp_buffer, m_packetDelay, 32 };
-        m_packets.push_back(packet);
-    }
+        // Once relaying, packets straight from the other player would connect us directly behind its back
+        const struct sockaddr_in& sender = m_udp->getSender();
+        if(relay && (sender.sin_addr.s_addr != relay->sin_addr.s_addr || sender.sin_port != relay->sin_port)) {
+            continue;
+        }
 
-    // Simulate packet loss
-    if(m_testPacketLoss > 0 && (rand()%m_testPacketLoss)==0) {
-        return;
-    }
+        // The server acknowledged the relay, so connect through it right away
+        if(net_buffer[0] == 'R') {
+            relay_ready = true;
+            sent = false;
+            continue;
+        }
 
-    if(!m_testNetworkLatency) {
-        for(int i=0; i<SEND_REPEATS; i++) {
-            sendto(m_socket, tmp_buffer, 32, 0, (struct sockaddr*)&m_remote_addr,
-                              sizeof(struct sockaddr));
+        // The other player gave up on reaching us directly
+        if(!relay && isRelayFallBack(net_buffer, size)) {
+            return false;
         }
-        delete [] tmp_buffer;
-    }
-}
 
-void ShobuNetwork::updatePing(unsigned int time_stamp)
-{
-    unsigned int diff = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() - time_stamp;
+        if(m_client == 's' ? receiveConnectRequest(net_buffer, size) : receiveHandshake(net_buffer, size)) {
+            return true;
+        }
+    }
 
-    // Weight the ping average towards the existing ping value
-    m_ping = m_ping*0.90+0.10*diff;
+    return false;
 }
 
-int ShobuNetwork::getPing()
+void ShobuNetwork::sendRelayRequest(const struct sockaddr_in& server, uint32_t token)
 {
-    return m_ping;
+    char request[16];
+    PacketWriter writer(request, sizeof(request));
+    writer.writeByte('R');
+    writer.writeByte(RENDEZVOUS_VERSION);
+    writer.writeVarint(token);
+    writer.writeByte(m_client);
+    m_udp->sendTo(server, request, writer.size());
 }
 
-void ShobuNetwork::connectToMS(const char* key)
+bool ShobuNetwork::isRelayFallBack(const char* packet, int size)
 {
-    createSocket();
+    if(size <= 0 || packet[0] != 'F' || m_rendezvous_token == 0) {
+        return false;
+    }
 
-    struct sockaddr_in host_address;
-    // Initialize remote host address
-    host_address.sin_family = PF_INET;
-    host_address.sin_port = htons(60417);
-    host_address.sin_addr.s_addr = inet_addr("toasty-walrus-shobu.rhcloud.com");
+    PacketReader reader(packet+1, size-1);
+    unsigned char version = reader.readByte();
+    uint32_t token = reader.readVarint();
 
-    sendto(m_socket, key, strlen(key), 0, (struct sockaddr*)&host_address,
-                      sizeof(struct sockaddr));
+    return !reader.error() && version == RENDEZVOUS_VERSION && token == m_rendezvous_token;
 }
 
-void ShobuNetwork::sendInputRequest()
+void ShobuNetwork::fallBackToRelay()
 {
-    char tmp_buffer[64];
-    tmp_buffer[0] = 'r';
-    tmp_buffer[1] = m_client;
+    if(!m_udp || m_rendezvous_token == 0) {
+        return;
+    }
 
-    // Request the input we are missing since the last rollback
-    int request_tick = m_rollback_tick+m_input_buffer_size;
-    memcpy(&tmp_buffer[2], &request_tick, 4);
+    if(!m_using_relay) {
+        LogSession << "The other player couldn't reach us directly, relaying through the rendezvous server" << endline;
+        m_using_relay = true;
+        m_udp->setRemote(m_rendezvous_address);
+    }
 
-    sendto(m_socket, tmp_buffer, 64, 0, (struct sockaddr*)&m_remote_addr,
-           sizeof(struct sockaddr));
+    // Asked again every time the server says so, in case the last request was lost
+    sendRelayRequest(m_rendezvous_address, m_rendezvous_token);
 }
 
-void ShobuNetwork::addInputState(int state)
+void ShobuNetwork::addInputState(const NetworkInput& state)
 {
     setLocalInput(state, m_local_tick+m_delay);
 }
 
 bool ShobuNetwork::hasInput(int frame)
 {
-    return m_remote_tick+m_delay-1 >= frame;
+    return m_remote_input_tick >= frame;
 }
 
-int ShobuNetwork::getInput(int frame)
+const NetworkInput& ShobuNetwork::getInput(int frame)
 {
-    int offset = (MAX_INPUTS + frame) % MAX_INPUTS;
-    return remote_buffer[offset];
+    return remote_buffer[inputIndex(frame)];
 }
 
-int ShobuNetwork::getLocalInput(int frame)
+const NetworkInput& ShobuNetwork::getLocalInput(int frame)
 {
-    int offset = (MAX_INPUTS + frame) % MAX_INPUTS;
-    return local_buffer[offset];
+    return local_buffer[inputIndex(frame)];
 }
 
-void ShobuNetwork::setRemoteInput(int input, int tick) 
+void ShobuNetwork::setRemoteInput(const NetworkInput& input, int tick) 
 {
     if(tick == 0) {
-        LogNull << "ASDF: " << input << endline;
+        LogNull << "ASDF: " << input.toInt() << endline;
     }
-    remote_buffer[(MAX_INPUTS+tick)%MAX_INPUTS] = input;
+    remote_buffer[inputIndex(tick)] = input;
+}
+
+void ShobuNetwork::setLocalInput(const NetworkInput& input, int tick) 
+{
+    local_buffer[inputIndex(tick)] = input;
 }
 
-void ShobuNetwork::setLocalInput(int input, int tick) 
+void ShobuNetwork::resetAcks()
 {
-    local_buffer[(MAX_INPUTS+tick)%MAX_INPUTS] = input;
+    // Inputs before the first delayed tick are never sent and are always 0
+    m_remote_input_tick = m_delay - 1;
+    m_remote_ack = m_delay - 1;
+
+    m_sent_tick = -2;
+    m_sent_ack = -2;
+    m_sent_remote_ack = -2;
+    m_idle_updates = 0;
+    m_input_cursor = m_delay;
 }
 
 void ShobuNetwork::setInputDelay(int delay)
@@ -665,15 +1407,26 @@ void ShobuNetwork::setInputDelay(int delay)
     if(delay > MAX_INPUT_DELAY) {
         delay = MAX_INPUT_DELAY;
     }
-    createInputBuffer(OLD_FRAMES+2*delay);
 
     m_delay = delay;
 
-    // m_sync is directly dependent on m_delay
-    m_sync = m_input_buffer_size - delay  - 1;
+    resetAcks();
 }
 
 
+void ShobuNetwork::setInputBits(int bits)
+{
+    if(bits < 1 || bits > 32) {
+        bits = 32;
+    }
+
+    m_input_bits = bits;
+
+    if(m_broadcaster) {
+        m_broadcaster->setInputBits(bits);
+    }
+}
+
 void ShobuNetwork::setLocalTick(int tick)
 {
     m_local_tick = tick;
@@ -688,11 +1441,8 @@ void ShobuNetwork::disconnect()
 {
     if(m_connected) {
         sendDisconnect();
-#ifdef WIN32
-         WSACleanup( );
-#else
-        close(m_socket);
-#endif
+        stopListening();
+        m_transport->close();
         LogNull << "Last local tick " << m_local_tick <<  ", Rollback " << m_rollback_tick << endline;
         m_connected = false;
     }
@@ -702,11 +1452,8 @@ void ShobuNetwork::disconnect()
 void ShobuNetwork::disconnectWithoutMessage()
 {
     if(m_connected) {
-#ifdef WIN32
-         WSACleanup( );
-#else
-        close(m_socket);
-#endif
+        stopListening();
+        m_transport->close();
         LogNull << "Last local tick " << m_local_tick << endline;
 
         m_connected = false;
@@ -719,103 +1466,266 @@ bool ShobuNetwork::connected()
 
 bool ShobuNetwork::createSocket()
 {
-    int tmp_socket;
-
-#ifdef WIN32
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(1, 1), &wsaData) != 0) {
-        LogNull << "Could not initialize Winsock" << endline;
-    }
+    closeTransport();
 
-#endif
+    m_udp = new UdpTransport();
+    m_udp->setIoUring(m_use_uring);
+    m_transport.reset(m_udp);
 
-    // Create the Socket
-    tmp_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    return m_udp->open();
+}
 
-    // When an error on socket creation has occured
-    if(tmp_socket < 0) {
-        return false;
+void ShobuNetwork::closeTransport()
+{
+    if(!m_transport) {
+        return;
     }
 
-    m_socket = tmp_socket;
-
-    return true;
+    // Hand back buffers the old transport may still be sending
+    m_transport->close();
+    m_transport->flush(m_pool);
+    m_transport.reset();
+    m_udp = nullptr;
+    m_conditioned = nullptr;
+    m_poll_transport = false;
 }
 
-void ShobuNetwork::rollBack()
+bool ShobuNetwork::rollBack(int first)
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
-
-    // Return the game to the last common state    
-    m_restoreCallback(m_userData);
-
     // decide up to what game tick to advance to in which the clients maintain a common state
-    int min_tick = m_local_tick < m_remote_tick + m_delay? m_local_tick : m_remote_tick + m_delay;
+    int min_tick = m_local_tick < m_remote_input_tick ? m_local_tick : m_remote_input_tick;
+
+    // Return the game to the state before the first frame to run again
+    if(m_snapshots.empty()) {
+        m_restoreCallback(m_userData);
+    } else if(!m_snapshots.restore(first-1)) {
+        // The store callback isn't kept up to date with snapshots, so there's nothing to go back to.  Running the
+        // frames again on top of the current state would only hide the desync, so report it instead
+        LogSession << "No snapshot of frame " << first-1 << ", the state can't be rolled back" << endline;
+        if(m_desync_tick < 0) {
+            m_desync_tick = first;
+        }
+        m_stateSynced = false;
+
+        // Take the frames as they ran, so the same rollback isn't tried every update
+        m_rollback_tick = min_tick;
+        m_stored_tick = min_tick;
+        return false;
+    }
 
-    int frame=m_rollback_tick+1;
+    int frame=first;
     for(; frame <= min_tick; frame++) {
 
-        m_updateCallback(m_userData, local_buffer[(frame + MAX_INPUTS) % MAX_INPUTS ],
-                        remote_buffer[(frame + MAX_INPUTS) % MAX_INPUTS]);
+        runUpdate(local_buffer[inputIndex(frame)], remote_buffer[inputIndex(frame)]);
+        saveSnapshot(frame);
 
         // Get value for state divergence checking
-        m_check_buffer[frame % MAX_INPUTS] = m_syncCallback(m_userData);
+        m_check_buffer[inputIndex(frame)] = stateCheck();
 
 //        if(m_client == 's') {
-//            LogMessage << frame << " " <<  local_buffer[(frame + MAX_INPUTS) % MAX_INPUTS ] << " " << remote_buffer[(frame + MAX_INPUTS) % MAX_INPUTS] << " " << m_check_buffer[frame % MAX_INPUTS] << endline;
+//            LogMessage << frame << " " <<  local_buffer[inputIndex(frame)] << " " << remote_buffer[inputIndex(frame)] << " " << m_check_buffer[inputIndex(frame)] << endline;
 //        } else {
-//            LogMessage << frame << " " << remote_buffer[(frame + MAX_INPUTS) % MAX_INPUTS] << " " <<  local_buffer[(frame + MAX_INPUTS) % MAX_INPUTS ] << " " << m_check_buffer[frame % MAX_INPUTS] << endline;
+//            LogMessage << frame << " " << remote_buffer[inputIndex(frame)] << " " <<  local_buffer[inputIndex(frame)] << " " << m_check_buffer[inputIndex(frame)] << endline;
 //        }
     }
 
     // Keep track of the last game tick we stored the state at.
     m_rollback_tick = min_tick;
+    m_stored_tick = min_tick;
 
     // Both clients should now be in sync, so store the state
-    m_storeCallback(m_userData);
+    if(m_snapshots.empty()) {
+        m_storeCallback(m_userData);
+    }
 
 
     // Process the rest of the input up to the current tick
     for(; frame<=m_local_tick; frame++) {
-        // Repeat the last state for the remote buffer as simple form of input prediction.
-        m_updateCallback(m_userData, local_buffer[(frame + MAX_INPUTS) % MAX_INPUTS ],
-                        remote_buffer[(m_rollback_tick + MAX_INPUTS) % MAX_INPUTS ]);
+        // Guess the remote input from what's arrived so far
+        runUpdate(local_buffer[inputIndex(frame)], predictInput(frame));
+        saveSnapshot(frame);
+        m_check_buffer[inputIndex(frame)] = stateCheck();
+    }
+
+    return true;
+}
+
+int ShobuNetwork::firstMisprediction(int first, int last)
+{
+    // Compare each stretch up to the end of the buffers at once
+    while(first <= last) {
+        int index = inputIndex(first);
+        int count = std::min(last-first+1, static_cast<int>(MAX_INPUTS)-index);
+
+        int same = firstDifference(&m_predicted[index], &remote_buffer[index], count);
+        if(same < count) {
+            return first+same;
+        }
+
+        first += count;
+    }
+
+    return last+1;
+}
+
+const NetworkInput& ShobuNetwork::predictInput(int frame)
+{
+    int index = inputIndex(frame);
+    m_predicted[index] = m_predictor->predict(frame);
+    m_guessed[index] = true;
+
+    if(m_compare_predictions) {
+        for(int i=0; i<PREDICTION_STRATEGIES; i++) {
+            m_strategy_guesses[i][index] = m_strategies[i] == m_predictor ? m_predicted[index] : m_strategies[i]->predict(frame);
+        }
+    }
+
+    return m_predicted[index];
+}
+
+void ShobuNetwork::scorePredictions(int first, int last)
+{
+    for(int frame=first; frame<=last; frame++) {
+        int index = inputIndex(frame);
+        if(!m_guessed[index]) {
+            continue;
+        }
+        m_guessed[index] = false;
+
+        bool wrong = m_predicted[index] != remote_buffer[index];
+        m_prediction_stats.predicted++;
+        m_prediction_stats.wrong += wrong ? 1 : 0;
+
+        for(int i=0; i<PREDICTION_STRATEGIES; i++) {
+            if(m_compare_predictions) {
+                m_strategy_stats[i].predicted++;
+                m_strategy_stats[i].wrong += m_strategy_guesses[i][index] != remote_buffer[index] ? 1 : 0;
+            } else if(i == m_strategy) {
+                m_strategy_stats[i].predicted++;
+                m_strategy_stats[i].wrong += wrong ? 1 : 0;
+            }
+        }
+    }
+}
+
+void ShobuNetwork::resetPredictors()
+{
+    m_predictor->reset();
+    for(int i=0; i<PREDICTION_STRATEGIES; i++) {
+        m_strategies[i]->reset();
+    }
+}
+
+void ShobuNetwork::setPrediction(PredictionStrategy strategy)
+{
+    m_predictor = m_strategies[strategy];
+    m_strategy = strategy;
+}
+
+void ShobuNetwork::setPredictor(InputPredictor* predictor)
+{
+    if(!predictor) {
+        setPrediction(PREDICT_REPEAT);
+        return;
     }
 
+    m_predictor = predictor;
+    m_strategy = -1;
 }
 
 
 
-const float avg_weight = 0.90f;
-static auto last_time = std::chrono::high_resolution_clock::now();
+void ShobuNetwork::updateMetrics()
+{
+    long long now = m_clock->now();
+    if(m_last_update < 0) {
+        m_last_update = now;
+        m_metrics_start = now;
+    }
+
+    float diff = static_cast<float>(now - m_last_update);
+    m_metrics.update_rate = m_metrics.update_rate*UPDATE_RATE_WEIGHT+(1.0f-UPDATE_RATE_WEIGHT)*diff;
+    m_metrics.ping = m_ping;
+    m_last_update = now;
+
+    if(now - m_metrics_start < METRICS_INTERVAL) {
+        return;
+    }
+    m_metrics_start = now;
+
+    if(m_metrics_file.is_open()) {
+        m_metrics_file << m_metrics.update_rate << "," << m_metrics.waits << "," << m_metrics.rollbacks << "," << m_metrics.ping << std::endl;
+    }
+
+    // Start counting the next second
+    m_last_metrics = m_metrics;
+    m_last_max_receive_latency = m_max_receive_latency.exchange(-1);
+    m_metrics.waits = 0;
+    m_metrics.rollbacks = 0;
+}
 
-void update_metrics()
+void ShobuNetwork::setMetricsFile(const char* filename)
 {
-    auto now = std::chrono::high_resolution_clock::now();
-    auto dur = now - last_time;
+    m_metrics_filename = filename ? filename : "";
 
-    float diff = std::chrono::duration_cast<std::chrono::microseconds>(dur).count();
+    // Only hosts write metrics
+    if(m_metrics_file.is_open()) {
+        m_metrics_file.close();
+    }
+    if(!filename || m_client != 's') {
+        return;
+    }
 
-    m_metrics.update_rate = m_metrics.update_rate*avg_weight+(1.0f-avg_weight)*diff;
+    m_metrics_file.open(filename);
+    m_metrics_file << "Update Rate, Waits / Sec, Rollbacks / Sec, Ping" << std::endl;
+}
 
-    last_time = now;
+void ShobuNetwork::setLogFile(const char* filename)
+{
+    m_own_logger.reset(new NetworkLogger(filename));
+    m_logger = m_own_logger.get();
+    m_snapshots.setLogger(m_logger);
 }
 
 void ShobuNetwork::update(int local_input)
 {
+    update(NetworkInput::fromInt(local_input));
+}
+
+void ShobuNetwork::update(const NetworkInput& local_input)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
+    updateSession(local_input);
+
+    m_update_time.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+}
+
+void ShobuNetwork::updateSession(const NetworkInput& local_input)
+{
+    // Nothing hands packets to polled transports, so take them now
+    if(m_poll_transport) {
+        receivePackets();
+    }
+
+    // Sending only happens here, so the remote address changes here too
+    if(m_fall_back.exchange(false)) {
+        fallBackToRelay();
+    }
 
     // Wait on the other client to catch up to the current tick before continuing
     // This is usually set while waiting for the start of a match after loading
     if(m_wait) {
 
-        std::unique_lock<std::mutex> lock(m_mutex);
+        // Anything received now belongs to the previous match.  The remote client resends what we haven't acknowledged
+        discardRemoteUpdates();
 
         // Tell the other client this game is waiting
         sendWaitCommand();
 
         // Doesn't update the game until we know the remote game has caught up
         if(!m_remote_wait) {
+            flushPackets();
             return;
         }
 
@@ -824,6 +1734,8 @@ void ShobuNetwork::update(int local_input)
         m_remote_tick = 0;
         m_local_tick = -1;
         m_rollback_tick = -1;
+        m_stored_tick = -1;
+        resetAcks();
 
         m_remote_synced = true;
 
@@ -831,34 +1743,67 @@ void ShobuNetwork::update(int local_input)
 
         // Clear input buffers
         for(unsigned int i=0; i<MAX_INPUTS; i++) {
-            local_buffer[i] = 0;
-            remote_buffer[i] = 0;
-            m_check_buffer[i] = 0;
+            local_buffer[i] = NetworkInput::fromInt(0);
+            remote_buffer[i] = NetworkInput::fromInt(0);
+            m_predicted[i] = NetworkInput::fromInt(0);
+            m_guessed[i] = false;
         }
 
+        resetPredictors();
+        resetChecks();
+        m_snapshots.invalidate();
+
     }
 
+    // Take in everything the network thread received since the last update
+    processRemoteUpdates();
+
     // Used for recording network metrics
-    update_metrics();
-    m_metrics.ping = m_ping;
+    updateMetrics();
 
-    // If we are desynced and we have the inputs from the remote client to resync, rollback
+    // If we have new inputs from the remote client for frames that ran without them, check whether they were predicted right
     if(!delayRollbacks && m_rollbacks && m_local_tick > m_rollback_tick && hasInput(m_rollback_tick+1) ) {
-        rollBack();
+        int min_tick = m_local_tick < m_remote_input_tick ? m_local_tick : m_remote_input_tick;
+        scorePredictions(m_rollback_tick+1, min_tick);
+
+        int wrong = firstMisprediction(m_rollback_tick+1, min_tick);
+
+        // Snapshots of every frame let a rollback start from the first wrong one.  With only the stored state,
+        // resimulate anyway once it's getting old, so the inputs it needs are never overwritten
+        if(!m_snapshots.empty() && wrong <= min_tick) {
+            if(rollBack(wrong)) {
+                // record how many rollbacks occured
+                ++m_metrics.rollbacks;
+                traceEvent(TRACE_ROLLBACK, 0);
+            }
+        } else if(m_snapshots.empty() && (wrong <= min_tick || min_tick - m_stored_tick >= MAX_ROLLBACK)) {
+            rollBack(m_stored_tick+1);
 
-        // record how many rollbacks occured
-        ++m_metrics.rollbacks;
+            // record how many rollbacks occured
+            ++m_metrics.rollbacks;
+            traceEvent(TRACE_ROLLBACK, 0);
+        } else {
+            // Every prediction was right, so the frames already run are confirmed as they are
+            m_rollback_tick = min_tick;
+
+            if(!m_snapshots.empty()) {
+                m_stored_tick = m_rollback_tick;
+            } else if(m_rollback_tick == m_local_tick) {
+                m_stored_tick = m_rollback_tick;
+                m_storeCallback(m_userData);
+            }
+        }
     }
 
-    int next_local = 0;
-    int next_remote = 0;
+    NetworkInput next_local;
+    NetworkInput next_remote;
 
     // Want to stay close to the other client's game tick so we don't drift out of sync. 
     // So we sometimes wait a cycle to let the other client catch up
 
     if(delayRollbacks) {
         // Update with no input.  Typicall this is used while loading
-        m_updateCallback(m_userData, 0, 0);
+        runUpdate(NetworkInput::fromInt(0), NetworkInput::fromInt(0));
     } else if(((m_rollbacks && m_remote_synced && m_local_tick < m_rollback_tick + MAX_ROLLBACK)
             || (!m_rollbacks && m_remote_synced && hasInput(m_local_tick+1)))) {
 
@@ -869,18 +1814,32 @@ void ShobuNetwork::update(int local_input)
 
         // Update input state for the current frame with what's stored in the local and remote input buffers
         next_local = getLocalInput(m_local_tick);
-        next_remote = hasInput(m_local_tick) ? getInput(m_local_tick) : getInput(m_remote_tick+m_delay);
+        if(hasInput(m_local_tick)) {
+            next_remote = getInput(m_local_tick);
+            m_predicted[inputIndex(m_local_tick)] = next_remote;
+        } else {
+            next_remote = predictInput(m_local_tick);
+        }
+
+        // The state before the first frame, in case it has to be run again
+        if(m_local_tick == 0) {
+            saveSnapshot(-1);
+        }
 
         // Update the game state
-        m_updateCallback(m_userData, next_local, next_remote);
+        runUpdate(next_local, next_remote);
+        saveSnapshot(m_local_tick);
+
+        // Get value for state divergence checking.  Frames run with predicted inputs keep it when the prediction was right
+        m_check_buffer[inputIndex(m_local_tick)] = stateCheck();
 
         // If the last frame was synced and we have input for this frame, we are still synced, so store game state
         if(m_local_tick == (m_rollback_tick + 1) && hasInput(m_local_tick) && !delayRollbacks) {
             m_rollback_tick++;
-            m_storeCallback(m_userData);
-
-            // Get value for state divergence checking
-            m_check_buffer[(m_rollback_tick+MAX_INPUTS) % MAX_INPUTS] = m_syncCallback(m_userData);
+            m_stored_tick = m_rollback_tick;
+            if(m_snapshots.empty()) {
+                m_storeCallback(m_userData);
+            }
 
 //                if(m_client == 's') {
 //                    LogMessage << m_rollback_tick << " " << next_local << " " << next_remote << " " << m_syncCallback(m_userData) << endline;
@@ -893,48 +1852,201 @@ void ShobuNetwork::update(int local_input)
         // Only skip 1 frame when out of sync to let the remote client catch up
         m_remote_synced = true;
 
-        // Might as well request input from the remote client while waiting
-        sendInputRequest();
-
         // Increment waiting count for metrics
         ++m_metrics.waits;
+        traceEvent(TRACE_WAIT, 0);
     }
 
+    // Confirmed frames' inputs go into the chain sent with their state hashes, and get checked against the remote ones
+    chainInputs(m_rollback_tick);
+    checkState();
+
     // Send updated input buffer to the remote client
     sendInput();
 
+    // Everything queued during the update goes out together
+    flushPackets();
+
+    broadcastFrames();
+}
+
+void ShobuNetwork::setBroadcaster(SpectatorBroadcaster* broadcaster)
+{
+    m_broadcaster = broadcaster;
+    m_broadcast_tick = m_rollback_tick < 0 ? -1 : m_rollback_tick;
+
+    if(m_broadcaster) {
+        m_broadcaster->setInputBits(m_input_bits);
+    }
+}
+
+void ShobuNetwork::broadcastFrames()
+{
+    if(!m_broadcaster) {
+        return;
+    }
+
+    // The match started over
+    if(m_rollback_tick < m_broadcast_tick) {
+        m_broadcast_tick = m_rollback_tick;
+    }
+
+    // Frames older than the input buffers are gone
+    if(m_broadcast_tick < m_local_tick - (int)MAX_INPUTS) {
+        LogSession << "Spectators missed frames " << m_broadcast_tick+1 << " to " << m_local_tick - (int)MAX_INPUTS << endline;
+        m_broadcast_tick = m_local_tick - (int)MAX_INPUTS;
+    }
+
+    // Only frames both players have the inputs for never change
+    while(m_broadcast_tick < m_rollback_tick) {
+        int frame = m_broadcast_tick+1;
+        const NetworkInput& local = local_buffer[inputIndex(frame)];
+        const NetworkInput& remote = remote_buffer[inputIndex(frame)];
+
+        // Spectators see the host as player 1
+        bool added = m_client == 's' ? m_broadcaster->addFrame(frame, local, remote) : m_broadcaster->addFrame(frame, remote, local);
+        if(!added) {
+            break;
+        }
+        m_broadcast_tick = frame;
+    }
 }
 
 bool ShobuNetwork::testRollback(int p1_input, int p2_input)
 {
+    // Needs the game's own store and restore, the snapshots are in use
+    if(!m_storeCallback || !m_restoreCallback) {
+        return false;
+    }
+
     // Store the current game state
     m_storeCallback(m_userData);
 
     // Run the game update
-    m_updateCallback(m_userData, p1_input, p2_input);
+    runUpdate(NetworkInput::fromInt(p1_input), NetworkInput::fromInt(p2_input));
 
     // Get value to check for a state desync
-    int sync_check = m_syncCallback(m_userData);
+    uint64_t sync_check = stateCheck();
 
     // Return to previous state
     m_restoreCallback(m_userData);
 
     // Run update again to return to the current state
-    m_updateCallback(m_userData, p1_input, p2_input);
+    runUpdate(NetworkInput::fromInt(p1_input), NetworkInput::fromInt(p2_input));
 
     // Test if the state diverged
-    return sync_check != m_syncCallback(m_userData);
+    return sync_check != stateCheck();
 }
 
-void ShobuNetwork::checkState(int state)
+void ShobuNetwork::receiveChecks(const RemoteUpdate& remote)
 {
-    // We check the state more than MAX_ROLLBACK ticks ago to be sure both clients have processed inputs for it.
-    if(m_check_buffer[(m_remote_tick-MAX_ROLLBACK+MAX_INPUTS)%MAX_INPUTS] != state) {
-        LogMessage << "Desync:" << m_remote_tick-MAX_ROLLBACK << "  " << local_buffer[(m_remote_tick-MAX_ROLLBACK+MAX_INPUTS-1)%MAX_INPUTS] << "   "
-                  << remote_buffer[(m_remote_tick-MAX_ROLLBACK+MAX_INPUTS-1)%MAX_INPUTS] << endline;
-        m_stateSynced = false;
+    if(remote.checked > m_remote_checked) {
+        m_remote_checked = remote.checked;
+    }
+
+    for(int i=0; i<remote.check_count; i++) {
+        int frame = remote.first_check + i;
+        if(frame <= m_received_check || frame > m_received_check + (int)MAX_INPUTS) {
+            continue;
+        }
+
+        RemoteCheck& check = m_remote_checks[inputIndex(frame)];
+        check.frame = frame;
+        check.state = remote.checks[i];
+        check.has_inputs = i == remote.check_count-1;
+        check.inputs = remote.input_check;
+    }
+
+    while(m_remote_checks[inputIndex(m_received_check+1)].frame == m_received_check+1) {
+        m_received_check++;
+    }
+}
+
+void ShobuNetwork::checkState()
+{
+    // Our hashes of frames too far back have been overwritten, which only happens after a long stall
+    int oldest = m_local_tick - MAX_INPUTS + 1;
+    if(m_received_check < oldest-1) {
+        m_received_check = oldest-1;
+        while(m_remote_checks[inputIndex(m_received_check+1)].frame == m_received_check+1) {
+            m_received_check++;
+        }
+    }
+    if(m_checked_tick < oldest-1) {
+        m_checked_tick = oldest-1;
+    }
+
+    int last = m_rollback_tick < m_received_check ? m_rollback_tick : m_received_check;
+    for(int frame=m_checked_tick+1; frame<=last; frame++) {
+        const RemoteCheck& check = m_remote_checks[inputIndex(frame)];
+
+        if(m_check_buffer[inputIndex(frame)] != check.state && m_desync_tick < 0) {
+            LogSession << "Desync at frame " << frame << ", inputs " << local_buffer[inputIndex(frame)].toInt() << "   "
+                       << remote_buffer[inputIndex(frame)].toInt() << endline;
+            m_desync_tick = frame;
+            m_stateSynced = false;
+        }
+
+        // When the inputs still match but the states don't, the game's simulation isn't deterministic
+        if(check.has_inputs && frame <= m_chain_tick && m_input_chain[inputIndex(frame)] != check.inputs
+           && !m_inputs_differ) {
+            LogSession << "Inputs differ from the remote client's by frame " << frame << endline;
+            m_inputs_differ = true;
+            m_stateSynced = false;
+        }
+    }
+
+    if(last > m_checked_tick) {
+        m_checked_tick = last;
+    }
+}
+
+uint64_t ShobuNetwork::stateCheck()
+{
+    if(m_syncCallback) {
+        return static_cast<uint32_t>(m_syncCallback(m_userData));
+    }
+
+    // Without a sync callback, the library hashes the state itself.  Arenas that may hold addresses are left out
+    return m_snapshots.hash();
+}
+
+void ShobuNetwork::chainInputs(int last)
+{
+    for(int frame=m_chain_tick+1; frame<=last; frame++) {
+        // The host's input first, so both clients hash them the same way
+        NetworkInput inputs[2];
+        inputs[0] = m_client == 's' ? local_buffer[inputIndex(frame)] : remote_buffer[inputIndex(frame)];
+        inputs[1] = m_client == 's' ? remote_buffer[inputIndex(frame)] : local_buffer[inputIndex(frame)];
+
+        m_chain = hash64(inputs, sizeof(inputs), m_chain);
+        m_input_chain[inputIndex(frame)] = m_chain;
+    }
+
+    if(last > m_chain_tick) {
+        m_chain_tick = last;
+    }
+}
 
+void ShobuNetwork::resetChecks()
+{
+    for(unsigned int i=0; i<MAX_INPUTS; i++) {
+        m_check_buffer[i] = 0;
+        m_input_chain[i] = 0;
+    }
+
+    m_chain = 0;
+    m_chain_tick = -1;
+    for(unsigned int i=0; i<MAX_INPUTS; i++) {
+        m_remote_checks[i].frame = -1;
     }
+
+    m_checked_tick = -1;
+    m_received_check = -1;
+    m_remote_checked = -1;
+    m_check_cursor = 0;
+    m_desync_tick = -1;
+    m_inputs_differ = false;
 }
 
 bool ShobuNetwork::stateIsSynced()
@@ -944,58 +2056,138 @@ bool ShobuNetwork::stateIsSynced()
 
 void ShobuNetwork::forceSynced()
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
     LogNull << "Forcing sync" << endline;
     delayRollbacks = false;
 
+    // Nothing is queued while syncing is stopped, so anything here was queued as it stopped
+    discardRemoteUpdates();
+
 }
 
 void ShobuNetwork::stopSync()
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
     LogNull << "Stopping sync" << endline;
     m_remote_tick = 0;
     m_local_tick = -1;
     m_rollback_tick = -1;
+    m_stored_tick = -1;
+    resetAcks();
 
     m_remote_synced = true;
 
     m_stateSynced = true;
     delayRollbacks = true;
 
+    // Inputs the network thread queued belong to the frames being thrown away
+    discardRemoteUpdates();
+
     // Clear input buffers
     for(unsigned int i=0; i<MAX_INPUTS; i++) {
-        local_buffer[i] = 0;
-        remote_buffer[i] = 0;
-        m_check_buffer[i] = 0;
+        local_buffer[i] = NetworkInput::fromInt(0);
+        remote_buffer[i] = NetworkInput::fromInt(0);
+        m_predicted[i] = NetworkInput::fromInt(0);
+        m_guessed[i] = false;
+    }
+
+    resetPredictors();
+    resetChecks();
+    m_snapshots.invalidate();
+}
+
+void ShobuNetwork::addStateRegion(void* data, size_t size)
+{
+    m_snapshots.addRegion(data, size);
+}
+
+void ShobuNetwork::clearStateRegions()
+{
+    m_snapshots.clearRegions();
+}
+
+void ShobuNetwork::addStateArena(StateArena& arena, bool hashed)
+{
+    m_snapshots.addRegion(arena.data(), arena.capacity(), arena.usedCounter(), hashed);
+    warnUnchecked();
+}
+
+void ShobuNetwork::warnUnchecked()
+{
+    // Checked while the match is set up, whichever of the callbacks and the arena is registered last
+    if(!m_syncCallback && !m_snapshots.hashesAll()) {
+        LogSession << "Without a sync callback, desyncs in arenas that aren't hashed go unnoticed" << endline;
     }
+}
 
+bool ShobuNetwork::setIncrementalSnapshots(bool incremental)
+{
+    return m_snapshots.setIncremental(incremental);
 }
 
 void ShobuNetwork::setPacketLoss(int frequency)
 {
-    if(frequency >= 0) {
-        m_testPacketLoss = frequency;
+    if(frequency > 0) {
+        m_send_conditions.loss_good = 1.0f / frequency;
+    } else if(frequency == 0) {
+        m_send_conditions.loss_good = 0;
     }
+    applyConditions();
 }
 
 void ShobuNetwork::setPacketDelay(int delay)
 {
+    // Updates are 1/60 of a second
     if(delay > 0) {
-        m_packetDelay = delay;
-        m_testNetworkLatency = true;
+        m_send_conditions.latency = delay * 16667;
     } else {
-        m_packetDelay = 0;
-        m_testNetworkLatency = false;
+        m_send_conditions.latency = 0;
+    }
+    applyConditions();
+}
+
+void ShobuNetwork::setClock(NetworkClock& clock)
+{
+    m_clock = &clock;
+}
+
+void ShobuNetwork::setNetworkConditions(const NetworkConditions& send, const NetworkConditions& receive)
+{
+    m_send_conditions = send;
+    m_receive_conditions = receive;
+    applyConditions();
+}
+
+bool ShobuNetwork::startCapture(const char* filename)
+{
+    return m_capture.open(filename, *m_clock);
+}
+
+void ShobuNetwork::stopCapture()
+{
+    m_capture.close();
+}
+
+bool ShobuNetwork::replayCapture(const char* filename)
+{
+    m_replay.clear();
+    if(!filename) {
+        return true;
+    }
+
+    if(!loadTraceReplay(filename, m_replay)) {
+        m_replay.clear();
+        return false;
     }
+
+    LogSession << "Replaying the fates of " << m_replay.size() << " packets from " << filename << endline;
+    return true;
 }
 
 void ShobuNetwork::setRollbacks(bool value)
 {
     if(value) {
-        LogMessage << "Network rollbacks enabled" << endline;
+        LogSession << "Network rollbacks enabled" << endline;
     } else {
-        LogMessage << "Network rollbacks disabled" << endline;
+        LogSession << "Network rollbacks disabled" << endline;
     }
 
     m_rollbacks = value;
@@ -1003,6 +2195,7 @@ void ShobuNetwork::setRollbacks(bool value)
 
 void ShobuNetwork::wait()
 {
+    m_remote_wait = false;
     m_wait = true;
 }
 
@@ -1014,17 +2207,46 @@ bool ShobuNetwork::isHost()
 void ShobuNetwork::registerCallbacks(void (*update)(void *, int, int), void (*store)(void *), void (*restore)(void *), int (*sync)(void*), void *data)
 {
     m_updateCallback = update;
+    m_inputCallback = nullptr;
+    m_storeCallback = store;
+    m_restoreCallback = restore;
+    m_syncCallback = sync;
+    m_userData = data;
+
+    warnUnchecked();
+}
+
+void ShobuNetwork::registerInputCallbacks(void (*update)(void*, const NetworkInput&, const NetworkInput&), void (*store)(void*),
+                                          void (*restore)(void*), int (*sync)(void*), void* data)
+{
+    m_updateCallback = nullptr;
+    m_inputCallback = update;
     m_storeCallback = store;
     m_restoreCallback = restore;
     m_syncCallback = sync;
     m_userData = data;
+
+    warnUnchecked();
+}
+
+void ShobuNetwork::runUpdate(const NetworkInput& local_input, const NetworkInput& remote_input)
+{
+    if(m_inputCallback) {
+        m_inputCallback(m_userData, local_input, remote_input);
+    } else {
+        m_updateCallback(m_userData, local_input.toInt(), remote_input.toInt());
+    }
 }
 
 ShobuNetwork::~ShobuNetwork() {
     disconnect();
+    stopListening();
+
+    // Joins the listening thread when this session had its own
+    m_own_reactor.reset();
 
-    // stop metrics thread
-    saving_metrics = false;
+    // The logger goes before the snapshots, which may still log while they let go of the state's pages
+    m_snapshots.setLogger(nullptr);
 }
 
 
@@ -14,11 +14,97 @@
 #include <unistd.h>
 #endif
 
-#include <mutex>
 #include <atomic>
-#include <list>
+#include <fstream>
+#include <memory>
+#include <string>
+#include "NetworkFec.h"
+#include "NetworkInput.h"
+#include "NetworkPredictor.h"
+#include "NetworkSnapshot.h"
+#include "NetworkArena.h"
+#include "NetworkPacketPool.h"
+#include "NetworkRing.h"
+#include "NetworkTransport.h"
+#include "NetworkConditioner.h"
+#include "NetworkTrace.h"
+#include "NetworkClock.h"
+
+// The session's windows can be changed at compile time, like -DSHOBU_MAX_ROLLBACK=30.
+// They change the size of ShobuNetwork, so the game has to be built with the same definitions as the library
+
+// Inputs kept for each player.  A power of two, so finding a frame in the buffers is a mask instead of a division
+#ifndef SHOBU_MAX_INPUTS
+#define SHOBU_MAX_INPUTS 64
+#endif
+
+// Most game ticks it is possible to roll back
+#ifndef SHOBU_MAX_ROLLBACK
+#define SHOBU_MAX_ROLLBACK 15
+#endif
+
+// Largest input delay setInputDelay accepts
+#ifndef SHOBU_MAX_INPUT_DELAY
+#define SHOBU_MAX_INPUT_DELAY 7
+#endif
+
+const unsigned int MAX_INPUTS = SHOBU_MAX_INPUTS;
+const int MAX_ROLLBACK = SHOBU_MAX_ROLLBACK;
+const int MAX_INPUT_DELAY = SHOBU_MAX_INPUT_DELAY;
+
+static_assert(MAX_INPUTS >= 2 && (MAX_INPUTS & (MAX_INPUTS-1)) == 0, "SHOBU_MAX_INPUTS must be a power of two");
+
+// At most half the buffer is resent, and that has to cover every input a rollback can still need
+static_assert(2*(MAX_ROLLBACK + MAX_INPUT_DELAY) <= static_cast<int>(MAX_INPUTS), "SHOBU_MAX_INPUTS is too small for the rollback window and input delay");
+
+// Programs mixing parts built with different windows or input sizes fail to link, instead of each part
+// seeing a different ShobuNetwork.  The definitions have to be plain numbers for this
+#define SHOBU_BUILD_STAMP_NAME(inputs, rollback, delay, size) shobuBuiltWith_##inputs##_##rollback##_##delay##_##size
+#define SHOBU_BUILD_STAMP_EXPAND(inputs, rollback, delay, size) SHOBU_BUILD_STAMP_NAME(inputs, rollback, delay, size)
+#define SHOBU_BUILD_STAMP SHOBU_BUILD_STAMP_EXPAND(SHOBU_MAX_INPUTS, SHOBU_MAX_ROLLBACK, SHOBU_MAX_INPUT_DELAY, SHOBU_INPUT_SIZE)
+
+extern const int SHOBU_BUILD_STAMP;
+#if defined(_MSC_VER)
+#define SHOBU_STRINGIFY_TEXT(text) #text
+#define SHOBU_STRINGIFY(text) SHOBU_STRINGIFY_TEXT(text)
+#pragma detect_mismatch("shobu_build", SHOBU_STRINGIFY(SHOBU_BUILD_STAMP))
+#elif defined(__GNUC__)
+__attribute__((used)) static const int* const shobu_build_stamp = &SHOBU_BUILD_STAMP;
+#endif
+
+// Position of a frame in the input buffers, for negative frames too
+inline int inputIndex(int frame)
+{
+    return frame & (MAX_INPUTS-1);
+}
+
+// Most unacknowledged inputs resent in a single packet
+const int MAX_RESEND = MAX_INPUTS/2;
+
+// Received packets that can wait for the next update
+const unsigned int REMOTE_UPDATE_QUEUE = 64;
+
+// Most frames whose state hashes are sent in a single packet
+const int CHECKS_PER_PACKET = 8;
+
+// Frames whose state hashes can be sent before the remote client says it has them.  Past this,
+// sending starts again from the first one it's missing, in case it was lost
+const int CHECKS_IN_FLIGHT = MAX_INPUTS/2;
+
+class NetworkReactor;
+class UdpTransport;
+class NetworkLogger;
+class SpectatorBroadcaster;
+class PacketWriter;
 
-const unsigned int MAX_INPUTS = 60;
+// Statistics of a session over one second
+struct NetworkMetrics
+{
+    float waits;
+    float update_rate;  // Average microseconds between updates
+    float rollbacks;
+    float ping;
+};
 
 class ShobuNetwork
 {
@@ -34,43 +120,166 @@ class ShobuNetwork
     bool initializeHost(int port);
 
     /*! Creates a new network client that attempts to connect to a remote host
-     * \param ip_addr
+     * \param ip_addr address or host name of the host
      * \param port
      * \return false on failure, true on success
      */
     bool initializeClient(const char* ip_addr, int port);
 
+    /*! Connects this session as the host to another session in the same process without using sockets.
+     *  Neither session listens on a thread, each update takes the packets waiting for it,
+     *  so both sessions must be updated from the same thread.  Used to simulate matches faster than real time
+     * \param client the session to connect as the client
+     * \return false on failure, true on success
+     */
+    bool initializeLoopback(ShobuNetwork& client);
+
+    /*! Accept a client that sent a connect request to a NetworkServer.  Used by NetworkServer
+     * \param transport sends to the client through the server's socket.  The session takes it over
+     * \param request the connect request
+     * \param size length of the request
+     * \return false on failure, true on success
+     */
+    bool acceptClient(NetworkTransport* transport, const char* request, int size);
+
 
     // Handles updating the game state in network mode
     void update(int local_input);
 
+    // Same for games with wide inputs, registered with registerInputCallbacks
+    void update(const NetworkInput& local_input);
+
+    // Returns the total microseconds spent in update, for measuring what each session costs
+    long long getUpdateTime() { return m_update_time / 1000; }
+
+    // Returns the metrics of the last full second of updates
+    const NetworkMetrics& getMetrics() { return m_last_metrics; }
+
+    /*! Write the metrics to a file once a second of the session's clock.  Only hosts write them, and none do until given a file.
+     *  Takes effect on the next initializeHost, or right away when already hosting
+     * \param filename the file, or nullptr to not write metrics
+     */
+    void setMetricsFile(const char* filename);
+
+    /*! Log this session's messages to a file.  Otherwise the session's logger only keeps the latest of them in memory
+     * \param filename the file, or nullptr to keep messages only in memory
+     */
+    void setLogFile(const char* filename);
+
+    // Returns the logger the session's messages go to
+    NetworkLogger* getLogger() { return m_logger; }
+
 
     void waitForClient();
     void connectToHost();
+
+    /*! Wait up to a second for packets and handle them.
+     *  Only needed when polling the socket yourself; a connected session is already listening on a reactor
+     * \return true when the connection has ended
+     */
     bool networkUpdate();
 
+    /*! Handle every packet waiting on the transport without blocking.  Called by the reactor
+     * \return false when the connection has ended
+     */
+    bool receivePackets();
+
+    /*! Share a reactor thread with other sessions instead of starting one for this session.
+     *  Must be called before connecting
+     */
+    void setReactor(NetworkReactor* reactor);
+
+    /*! Hand every confirmed frame to a broadcaster so spectators can watch.
+     *  Frames are handed over during update, the broadcaster sends them from its own thread
+     * \param broadcaster the broadcaster, or nullptr to stop
+     */
+    void setBroadcaster(SpectatorBroadcaster* broadcaster);
+
+    // Returns the UDP socket, or -1 when not using one
+    int getSocket();
+
+    // File descriptor the reactor waits on, or -1 when packets are taken at the start of each update
+    int getReceiveHandle();
+
+    /*! Send and receive through io_uring instead of the standard socket calls.
+     *  Must be called before connecting.  Falls back to the socket calls when the kernel doesn't support it
+     * \param enable true to try io_uring
+     */
+    void setIoUring(bool enable) { m_use_uring = enable; }
+
+    // Returns true when the current connection is using io_uring
+    bool usingIoUring();
+
+    /*! Lower receive latency at the cost of CPU time.  Applies to the reactor this session starts, so call before connecting.
+     *  A shared reactor is set up through NetworkReactor instead
+     * \param cpu core to pin the receive thread to, or -1 to leave it unpinned
+     * \param spin_budget microseconds to keep polling for packets after each one before sleeping, 0 to never spin
+     * \param realtime_priority SCHED_FIFO priority of the receive thread, or 0 for normal scheduling
+     */
+    void setLowLatency(int cpu, int spin_budget, int realtime_priority);
+
+    // Returns the average microseconds from the kernel receiving a packet until it's handled, or -1 when unknown
+    int getReceiveLatency();
+
+    // Returns the longest microseconds from the kernel receiving a packet until it's handled during the last full second
+    // of updates, or so far when none has passed yet.  -1 when unknown
+    int getMaxReceiveLatency();
+
     void sendInput(int frame);
     void sendInput();
 
-    void sendInputRequest();
-
-    void addInputState(int state);
+    void addInputState(const NetworkInput& state);
 
     bool hasInput(int frame);
 
-    int getInput(int frame);
-    int getLocalInput(int frame);
+    const NetworkInput& getInput(int frame);
+    const NetworkInput& getLocalInput(int frame);
 
-    void setRemoteInput(int input, int tick);
-    void setLocalInput(int input, int tick);
+    void setRemoteInput(const NetworkInput& input, int tick);
+    void setLocalInput(const NetworkInput& input, int tick);
 
     void setSynced() { m_remote_synced = true; }
 
     void setInputDelay(int delay);
     int getInputDelay() { return (int)m_delay; }
 
+    /*! Set how many bits of each input are sent over the network.
+     *  Inputs are masked to this width, so only use it when the game's inputs are small bit fields.
+     *  The host's value is sent to the client during the handshake.
+     * \param bits significant bits per input, from 1 to 32
+     */
+    void setInputBits(int bits);
+    int getInputBits() { return m_input_bits; }
+
     void setRollbacks(bool value);
 
+    /*! Guess the remote player's input with one of the built in strategies.  Repeating the last input is the default
+     * \param strategy the strategy
+     */
+    void setPrediction(PredictionStrategy strategy);
+
+    /*! Guess the remote player's input with the game's own predictor
+     * \param predictor the predictor, which must outlive the session, or nullptr to go back to the built in strategy
+     */
+    void setPredictor(InputPredictor* predictor);
+
+    /*! Tell PREDICT_HOLD which bits of the input are buttons, every bit of int inputs by default and none of wider ones.
+     *  The rest are predicted to stay as they were
+     * \param buttons set bits are buttons
+     */
+    void setPredictionButtons(const NetworkInput& buttons) { m_hold_predictor.setButtons(buttons); }
+
+    /*! Also run every built in strategy alongside the predictor in use and count how often each would have been wrong,
+     *  to find out which suits a game best.  Set it before the match so every strategy learns from the start
+     */
+    void setComparePredictions(bool compare) { m_compare_predictions = compare; }
+
+    // How often the predictor in use was wrong
+    void getPredictionStats(PredictionStats& stats) { stats = m_prediction_stats; }
+
+    // How often a built in strategy was or would have been wrong.  Only counted while comparing or using it
+    void getPredictionStats(PredictionStrategy strategy, PredictionStats& stats) { stats = m_strategy_stats[strategy]; }
+
     void setLocalTick(int tick);
     int remoteTick();
 
@@ -82,7 +291,24 @@ class ShobuNetwork
 
     void sendDisconnect();
 
-    void connectToMS(const char* key);
+    /*! Meet the other player through a RendezvousServer and connect to them,
+     *  directly when both sides can punch through and through the server's relay otherwise.
+     *  The first of the two players to register hosts.  Blocks until connected or RENDEZVOUS_TIMEOUT_MS passes
+     * \param server host name or address of the rendezvous server
+     * \param port the server's port
+     * \param key text both players agree on, like a lobby name, up to RENDEZVOUS_KEY_SIZE bytes
+     * \return false on failure, true once connected
+     */
+    bool connectThroughRendezvous(const char* server, int port, const char* key);
+
+    // Milliseconds the last connectThroughRendezvous took, including waiting for the other player
+    int getConnectTime() { return m_connect_time; }
+
+    // Returns true when packets go through the rendezvous server's relay
+    bool usingRelay() { return m_using_relay; }
+
+    // Skip punching through and always relay, for measuring the relay
+    void setForceRelay(bool force) { m_force_relay = force; }
 
     int getLocalTick() { return m_local_tick; }
     int getRemoteTick() { return m_remote_tick; }
@@ -100,6 +326,9 @@ class ShobuNetwork
     // Indicates if the current state is synced;
     bool stateIsSynced();
 
+    // First frame whose state differed from the remote client's, or -1 while they all matched
+    int getDesyncFrame() { return m_desync_tick; }
+
     // Override desync detection and set network's state to synced
     void forceSynced();
 
@@ -109,6 +338,12 @@ class ShobuNetwork
     // Returns the current average with the remote client ping
     int getPing();
 
+    // Returns the current average percent of packets lost from the remote client
+    int getPacketLoss();
+
+    // Returns how many lost packets were rebuilt from parity packets and had inputs that hadn't arrived yet
+    int getRecoveredPackets() { return m_recovered_packets; }
+
 
     /*!
      * \return true when this client the host
@@ -119,11 +354,49 @@ class ShobuNetwork
      * \param update a function which updates the game's state
      * \param store a function which stores the game's state
      * \param restore a function which restore the game's state
-     * \param method that returns an integer used to check if the game's state is synced
+     * \param sync method that returns an integer used to check if the game's state is synced.  Can be nullptr
+     *        when the state's memory is registered with addStateRegion, which is then hashed instead.
+     *        Arenas are only hashed when added as hashed
      * \param data user data that is passed into each callback
      */
     void registerCallbacks(void (*update)(void*, int, int), void (*store)(void*), void (*restore)(void*), int (*sync)(void*), void* data);
 
+    /*! Register the callbacks of a game whose inputs are wider than an int, see SHOBU_INPUT_SIZE.
+     *  The update is given both players' inputs by reference, the other callbacks are the same as registerCallbacks
+     */
+    void registerInputCallbacks(void (*update)(void*, const NetworkInput&, const NetworkInput&), void (*store)(void*),
+                                void (*restore)(void*), int (*sync)(void*), void* data);
+
+    /*! Let the library keep a snapshot of the game's state for every frame instead of calling the store and restore callbacks,
+     *  which can then be nullptr.  Register all the memory the state lives in before the match.
+     *  A rollback then only goes back to the frame before the first wrong prediction.  Regions added during a match
+     *  drop the snapshots taken so far, and a rollback past them reports a desync as there's no state to go back to
+     * \param data start of the memory, which must stay where it is
+     * \param size bytes of it
+     */
+    void addStateRegion(void* data, size_t size);
+
+    // Go back to the store and restore callbacks
+    void clearStateRegions();
+
+    /*! Keep the game's objects allocated from an arena in the snapshots, as a state region that only copies
+     *  the part of the arena in use.  Rolling back also frees whatever was allocated after the restored frame
+     * \param arena an initialized arena that lives as long as the session
+     * \param hashed true when its objects only point at each other with ArenaPtr, so the arena is the same on both peers
+     *        and is hashed with the regions when there's no sync callback.  An arena holding addresses needs a sync callback
+     *        to find its desyncs
+     */
+    void addStateArena(StateArena& arena, bool hashed = false);
+
+    /*! Only copy the pages of the state regions the game wrote to since the last frame, for states of several MB
+     *  that change a little each frame.  The regions' whole pages are write protected between frames,
+     *  so nothing but the game's update may write to them.  Linux only.  Like adding a region, switching during a match
+     *  drops the snapshots taken so far
+     * \param incremental true to track written pages, false to copy the whole state every frame
+     * \return false when written pages can't be tracked, and the whole state is copied
+     */
+    bool setIncrementalSnapshots(bool incremental);
+
     /*! Set packet loss frequency.
      * \param frequency chance of packet loss is 1/frequency
      */
@@ -131,19 +404,45 @@ class ShobuNetwork
 
     //! Sets packet delay before sending
     /*! Used to simulate network latency.
-     * \param delay total frames to wait before sending a packet. Must be >= 0
+     * \param delay total updates at 60 updates a second to wait before sending a packet. Must be >= 0
      */
     void setPacketDelay(int delay);
 
-    /*!  Wait on the other client to sync to the current tick
-     *   then reset the current tick to 0
+    /*! Simulate a network with latency, jitter, reordering, duplicates, burst loss and limited bandwidth.
+     *  Applies right away when connected.  Without a seed each direction gets one of its own
+     * \param send conditions of packets sent to the remote client
+     * \param receive conditions of packets received from it
      */
-    void wait();
+    void setNetworkConditions(const NetworkConditions& send, const NetworkConditions& receive);
 
+    /*! Take the time from another clock, like a VirtualClock to simulate faster than real time.
+     *  Pings, simulated network conditions, traces and metrics are all timed with it.  Set it before connecting
+     * \param clock the clock, which must outlive the session
+     */
+    void setClock(NetworkClock& clock);
 
+    /*! Record every packet sent and received with its time, size and id, along with pings, rollbacks and waits.
+     *  Read the trace back with TraceReader or summarizeTrace
+     * \param filename trace file to create
+     * \return false when the file can't be created
+     */
+    bool startCapture(const char* filename);
 
-    // Sends packets after a delay.  Used to test code during network latency
-    void sendDelayedPackets();
+    // Stop recording and write the rest of the trace
+    void stopCapture();
+
+    /*! Receive packets with the same losses and delays as a recorded trace.
+     *  Replaces the receive conditions and takes effect on the next connection.
+     *  Replaying each client's trace on that client reproduces both directions of the match
+     * \param filename trace captured by startCapture, or nullptr to stop replaying
+     * \return false when the trace can't be read
+     */
+    bool replayCapture(const char* filename);
+
+    /*!  Wait on the other client to sync to the current tick
+     *   then reset the current tick to 0
+     */
+    void wait();
 
     // Don't rollback when this is set
     std::atomic<bool> delayRollbacks;
@@ -158,75 +457,320 @@ private:
 
     //ShobuNetwork(const ShobuNetwork&) {}
 
-    // Handles returning to the common state of both clients and running inputs up to the current game tick
-    void rollBack();
+    /*! Handles returning to the common state of both clients and running inputs up to the current game tick
+     * \param first first frame to run again.  The stored state is from the frame before it
+     * \return false when there's no snapshot of that frame, and the session is marked desynced
+     */
+    bool rollBack(int first);
+
+    // Keep a snapshot of a frame that may have to be run again
+    void saveSnapshot(int frame)
+    {
+        if(!m_snapshots.empty()) {
+            m_snapshots.save(frame);
+        }
+    }
+
+    /*! Compare the remote inputs frames were run with against the ones that arrived for them
+     * \return the first frame that was run with the wrong input, or last+1 when every prediction was right
+     */
+    int firstMisprediction(int first, int last);
+
+    // Guess the remote input of a frame and remember the guess
+    const NetworkInput& predictInput(int frame);
+
+    // Count the right and wrong guesses of frames whose remote inputs arrived
+    void scorePredictions(int first, int last);
+
+    // Forget what the predictors learned, at the start of a match
+    void resetPredictors();
 
-    // Check for game state divergence with the remote client
-    void checkState(int state);
+    // Value compared with the remote client's to find desyncs, the sync callback's or a hash of the state regions
+    uint64_t stateCheck();
+
+    // Log when the game registered arenas that aren't hashed and has no sync callback to check them
+    void warnUnchecked();
+
+    // Extend the hash chain of both players' inputs up to a confirmed frame
+    void chainInputs(int last);
+
+    // Forget the hashes of every frame, at the start of a match
+    void resetChecks();
 
     /*! Used internally by ShobuNetwork to create a socket
      * \return false on failure, true on success
      */
     bool createSocket();
 
-    void createInputBuffer(int p_size);
+    // Close and delete the transport of a previous connection
+    void closeTransport();
 
+    /*! Read the windows the other side was built with, which follow the input size in the handshake.
+     *  Peers built before they were sent have the old defaults
+     * \return false when they differ from ours
+     */
+    bool sameWindows(const char* net_buffer, int recv_bytes, int offset);
 
-    // Sends out a response to a ping
-    void sendPingResponse(unsigned int time_stamp);
+    // Client side of the handshake
+    void sendConnectRequest();
+    bool receiveHandshake(const char* net_buffer, int recv_bytes);
 
-    // Update current ping
-    void updatePing(unsigned int time_stamp);
+    // Host side of the handshake.  Returns true when a client was accepted
+    bool receiveConnectRequest(const char* net_buffer, int recv_bytes);
+    void sendHandshake();
 
+    // Does the work of update
+    void updateSession(const NetworkInput& local_input);
 
-    void sendWaitCommand();
+    // Run the game's update with whichever callback it registered
+    void runUpdate(const NetworkInput& local_input, const NetworkInput& remote_input);
+
+    // Handles a packet from the transport
+    static void receivePacket(void* data, const char* packet, int size, long long receive_time);
+
+
+    /*! Update current ping average
+     * \param round_trip milliseconds for one of our time stamps to be echoed back
+     */
+    void updatePing(int round_trip);
+
+    // Reset input acknowledgements at the start of a match
+    void resetAcks();
+
+    // Handles a single packet from the remote client
+    void handlePacket(const char* net_buffer, int recv_bytes);
+
+    // Start and stop handing packets from the reactor to this session
+    void startListening();
+    void stopListening();
 
-    int m_socket;  /// Socket which the connection is bound to
+    // Run the packets of a connected session through the conditions set, or through none
+    void applyConditions();
 
-    struct sockaddr_in m_host_address;  /// Address of the remote host
+    // Conditions of one direction, seeded by the role and direction when no seed was set
+    NetworkConditions seededConditions(const NetworkConditions& conditions, bool send) const;
 
-    struct sockaddr_in m_remote_addr;  /// Address of client
+    // Decodes an input packet received directly or rebuilt from parity and queues it for update()
+    void receiveInputPacket(const char* buffer, int size, bool recovered);
 
-    int m_input_buffer_size;
+    // Apply every packet the network thread queued since the last update
+    void processRemoteUpdates();
+
+    // Drop every queued packet without applying it
+    void discardRemoteUpdates();
+
+    // Update the packet loss average with the number of packets lost before the last one received
+    void updatePacketLoss(unsigned int lost);
+
+    /*! Write a run of our inputs into an input packet, leaving out the newest ones that don't fit
+     * \param frame the frame the packet is sent at
+     * \return the last input written
+     */
+    int writeInputs(PacketWriter& writer, int frame, int first, int last);
+
+    // Add a packet from m_pool to the batch sent at the end of the update
+    void queuePacket(char* packet, int size);
+
+    // Send every packet queued during this update
+    void flushPackets();
+
+    // Record a packet in the trace being captured
+    void tracePacket(TraceEventType type, const char* packet, int size);
+
+    // Record a rollback, wait or ping in the trace being captured
+    void traceEvent(TraceEventType type, int round_trip);
+
+
+    void sendWaitCommand();
 
     unsigned char m_delay;  /// number of frames of input delay
-    int m_sync;   /// the frame of the input buffer used for syncing (= m_input_buffer_size - m_delay - 1)
+
+    int m_input_bits; /// number of significant bits in each input sent over the network
 
     std::atomic<bool> m_remote_synced; /// flag that keeps track of whether or not the clients are synced
     int m_remote_tick; /// Current tick of the remote game
     int m_local_tick;  /// Current tick of the local game
     int m_rollback_tick; /// Last known tick where the local and remote game states were in sync.  Used only if rollbacks are enabled
+    int m_stored_tick; /// Tick the game's state was last stored at.  Behind m_rollback_tick when predicted frames turned out right
+    SnapshotRing m_snapshots; /// Snapshots of every recent frame when the game registered its state's memory
+    int m_remote_input_tick; /// Last tick we have every remote input up to
+    int m_remote_ack; /// Last tick of our inputs the remote client has acknowledged
 
-    bool m_connected;  /// flag that keeps track of the status of the remote connection
+    std::atomic<bool> m_connected;  /// flag that keeps track of the status of the remote connection
 
     char m_client; /// flag indicating client or server.  'c'=client, 's'=server
 
-    std::mutex m_mutex; /// Used to lock when modifying buffers
-
     // Store at MAX_INPUTS inputs and loop to the front of the buffer when reaching the end
-    int remote_buffer[MAX_INPUTS];
-    int local_buffer[MAX_INPUTS];
+    NetworkInput remote_buffer[MAX_INPUTS];
+    NetworkInput local_buffer[MAX_INPUTS];
+
+    // Remote input each frame was run with, so frames run before it arrived only roll back when it was different
+    NetworkInput m_predicted[MAX_INPUTS];
+
+    // Set for frames whose remote input was guessed, until the input arrives
+    bool m_guessed[MAX_INPUTS];
+
+    // What each built in strategy guessed when comparing them
+    NetworkInput m_strategy_guesses[PREDICTION_STRATEGIES][MAX_INPUTS];
+
+    RepeatPredictor m_repeat_predictor;
+    HoldPredictor m_hold_predictor;
+    MarkovPredictor m_markov_predictor;
+    InputPredictor* m_strategies[PREDICTION_STRATEGIES];
+
+    // The predictor in use, and which built in one it is or -1
+    InputPredictor* m_predictor;
+    int m_strategy;
+
+    bool m_compare_predictions;
+    PredictionStats m_prediction_stats;
+    PredictionStats m_strategy_stats[PREDICTION_STRATEGIES];
 
     // A list of values for each game tick thats used to check for state divergence
-    int m_check_buffer[MAX_INPUTS];
+    uint64_t m_check_buffer[MAX_INPUTS];
+
+    // Hash of both players' inputs for every confirmed frame up to each one
+    uint64_t m_input_chain[MAX_INPUTS];
+    uint64_t m_chain;
+    int m_chain_tick;
+
+    // Last remote frame whose state was compared
+    int m_checked_tick;
+
+    // State hashes the remote client sent for frames we may not have confirmed yet
+    struct RemoteCheck {
+        int frame;
+        uint64_t state;
+
+        // Only the last frame of each packet has the input chain
+        bool has_inputs;
+        uint64_t inputs;
+    };
+    RemoteCheck m_remote_checks[MAX_INPUTS];
+
+    // Last remote frame we have the hash of with none missing before it, and the same of ours for the remote client
+    int m_received_check;
+    int m_remote_checked;
+
+    // Next of our frames to send the hash of
+    int m_check_cursor;
+
+    // First frame that differed, -1 while synced
+    int m_desync_tick;
+    bool m_inputs_differ;
 
     // If set to true, rollbacks will be enabled
     bool m_rollbacks;
 
-    // When > 0, simulate packet loss.  Packet loss is simulated at 100/m_testPackLoss %
-    int m_testPacketLoss;
+    // Simulated network conditions applied to the transport when listening starts
+    NetworkConditions m_send_conditions;
+    NetworkConditions m_receive_conditions;
 
-    // Used in testing network latency
-    bool m_testNetworkLatency;
-    int m_packetDelay;
+    // Fates of received packets from a trace being replayed
+    std::vector<PacketFate> m_replay;
 
-    struct DelayedPacket {
-        char* packet;
-        int timer;
-        std::size_t size;
-    };
+    // Trace being captured
+    TraceWriter m_capture;
+
+    // Where the time comes from
+    NetworkClock* m_clock;
+
+    // Nanoseconds spent in update
+    std::atomic<long long> m_update_time;
+
+    // Update the metrics and write them out once a second
+    void updateMetrics();
+
+    // Metrics of the current and last second
+    NetworkMetrics m_metrics;
+    NetworkMetrics m_last_metrics;
+
+    // Clock time of the last update and of the start of the current second
+    long long m_last_update;
+    long long m_metrics_start;
+
+    std::string m_metrics_filename;
+    std::ofstream m_metrics_file;
+
+    /*! Send connect requests, or punches when hosting, until the other player's handshake completes
+     * \param deadline clock time in milliseconds to give up at
+     * \param relay the rendezvous server to ask for a relay first, or nullptr when connecting directly
+     * \param token the match the server paired us into
+     */
+    bool meetPlayer(long long deadline, const struct sockaddr_in* relay, uint32_t token);
 
-    std::list<DelayedPacket> m_packets;
+    // Ask the rendezvous server to relay our packets to the other player
+    void sendRelayRequest(const struct sockaddr_in& server, uint32_t token);
+
+    // Whether a packet is the rendezvous server telling us the other player went to the relay
+    bool isRelayFallBack(const char* packet, int size);
+
+    // Move a session that connected directly over to the relay, once the other player went there
+    void fallBackToRelay();
+
+    int m_connect_time;
+    bool m_using_relay;
+    bool m_force_relay;
+
+    // Rendezvous server and match of the last connectThroughRendezvous, the token is 0 otherwise
+    struct sockaddr_in m_rendezvous_address;
+    uint32_t m_rendezvous_token;
+
+    // Set by the receiving thread when the server says the other player relays
+    std::atomic<bool> m_fall_back;
+
+    // Hand newly confirmed frames to the broadcaster
+    void broadcastFrames();
+
+    SpectatorBroadcaster* m_broadcaster;
+
+    // Last frame handed to the broadcaster
+    int m_broadcast_tick;
+
+    // Where the session's messages go, the session's own logger
+    NetworkLogger* m_logger;
+    std::unique_ptr<NetworkLogger> m_own_logger;
+
+    // Buffers for every packet sent, so nothing is allocated while updating
+    PacketPool m_pool;
+
+    // Sends and receives packets.  Declared after the pool so its buffers are handed back first
+    std::unique_ptr<NetworkTransport> m_transport;
+
+    // The transport when it's a UDP socket, otherwise nullptr
+    UdpTransport* m_udp;
+
+    // The transport when packets run through the simulated network, otherwise nullptr
+    ConditionedTransport* m_conditioned;
+
+    // Set when the transport has nothing the reactor can wait on
+    bool m_poll_transport;
+
+    // Reactor which hands received packets to this session
+    NetworkReactor* m_reactor;
+
+    // Set when this session started its own reactor
+    std::unique_ptr<NetworkReactor> m_own_reactor;
+
+    // Try io_uring when connecting
+    bool m_use_uring;
+
+    // Low latency settings for the reactor this session starts
+    int m_reactor_cpu;
+    int m_spin_budget;
+    int m_realtime_priority;
+
+    // Receive latency in microseconds, measured against the kernel's time stamps
+    std::atomic<float> m_receive_latency;
+    std::atomic<int> m_max_receive_latency;
+
+    // Longest receive latency of the last full second of updates
+    int m_last_max_receive_latency;
+
+    /*! Add a packet to the receive latency
+     * \param receive_time when the kernel received the packet in nanoseconds, or 0 when unknown
+     */
+    void updateReceiveLatency(long long receive_time);
 
     // Set to false when a state desynced is detected
     bool m_stateSynced;
@@ -239,21 +783,107 @@ private:
     unsigned int m_lastPacketId;
 
     // When true hold game updates until the other client has synced up
-    bool m_wait;
+    std::atomic<bool> m_wait;
 
     // Other client is waiting
-    bool m_remote_wait;
+    std::atomic<bool> m_remote_wait;
 
 
     // Current average packet round trip time
     int m_ping;
 
+    // Average fraction of the remote client's packets we lose, and of ours it loses
+    std::atomic<float> m_packet_loss;
+    float m_remote_packet_loss;
+
+    // Builds parity packets for the packets we send
+    FecEncoder m_fec_encoder;
+
+    // Rebuilds lost packets from the remote client's parity packets
+    FecDecoder m_fec_decoder;
+
+    // Total lost packets rebuilt from parity packets
+    std::atomic<int> m_recovered_packets;
+
+    // Parity packet sent with the next update's packets instead of right after the last one it covers,
+    // so a burst of loss is less likely to take both
+    char m_parity[MAX_PACKET_SIZE];
+    int m_parity_size;
+
+    // An input packet decoded by the network thread
+    struct RemoteUpdate {
+        int tick;
+        int ack;
+        int tick_delta;
+
+        // Set when the packet arrived after a later one, so only its inputs and state hashes are used
+        bool old;
+
+        // Set when the packet was rebuilt from parity
+        bool recovered;
+
+        unsigned char loss;
+
+        // Last of our frames the remote client has the hash of, with none missing before it
+        int checked;
+
+        // State hashes of a run of confirmed frames, and the input chain at the last one
+        int first_check;
+        int check_count;
+        uint64_t checks[CHECKS_PER_PACKET];
+        uint64_t input_check;
+
+        unsigned int time_stamp;
+        unsigned int receive_time;
+
+        // Round trip time of the echoed time stamp, -1 when nothing was echoed
+        int round_trip;
+
+        // Frame of the last input, and how many inputs up to it were sent
+        int last_input;
+        int input_count;
+        NetworkInput inputs[MAX_RESEND];
+    };
+
+    // Apply a packet from the network thread to the input buffers
+    void applyRemoteUpdate(const RemoteUpdate& remote);
+
+    /*! Keep the state hashes the remote client sent until we confirm the frames too
+     * \param remote the packet they came in
+     */
+    void receiveChecks(const RemoteUpdate& remote);
+
+    // Compare the state hashes of every frame both clients have confirmed since the last check
+    void checkState();
+
+    // Received packets handed from the network thread to update() without locking
+    SpscRing<RemoteUpdate, REMOTE_UPDATE_QUEUE> m_remote_updates;
+
     // Keep track of the game tick difference between the client
     int m_tick_delta;
 
+    // Last remote time stamp received and when we got it. Echoed back in the next packet for measuring ping
+    unsigned int m_remote_time_stamp;
+    unsigned int m_remote_time_received;
+
+    // Set once a remote time stamp has been received.  A clock can read 0 so the times can't say
+    bool m_remote_time_known;
+
+    // What the last input packet sent contained. Used to skip sending packets while idle
+    int m_sent_tick;
+    int m_sent_ack;
+    int m_sent_remote_ack;
+    int m_idle_updates;
+
+    // First input the next packet sends when the unacknowledged ones don't all fit in one
+    int m_input_cursor;
+
     // Update callback function
     void (*m_updateCallback)(void *data, int p1_input, int p2_input);
 
+    // Update callback of games with wide inputs, used instead when set
+    void (*m_inputCallback)(void *data, const NetworkInput& p1_input, const NetworkInput& p2_input);
+
     // Store state callback function
     void (*m_storeCallback)(void *data);
 
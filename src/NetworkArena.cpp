@@ -0,0 +1,105 @@
+#include "NetworkArena.h"
+#include "NetworkLogger.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Bytes at the start of the arena holding the offset, a cache line so objects don't share it
+const size_t ARENA_HEADER_SIZE = 64;
+
+static_assert(sizeof(size_t) <= ARENA_HEADER_SIZE, "The arena's offset must fit in its header");
+
+StateArena::StateArena()
+{
+    m_data = nullptr;
+    m_capacity = 0;
+    m_used = nullptr;
+}
+
+StateArena::~StateArena()
+{
+    if(m_data == nullptr) {
+        return;
+    }
+
+#ifdef WIN32
+    VirtualFree(m_data, 0, MEM_RELEASE);
+#else
+    munmap(m_data, m_capacity);
+#endif
+}
+
+bool StateArena::initialize(size_t capacity)
+{
+    if(m_data != nullptr) {
+        LogNull << "The state arena is already mapped" << endline;
+        return false;
+    }
+
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    size_t page_size = info.dwPageSize;
+#else
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    capacity = (capacity + ARENA_HEADER_SIZE + page_size-1) & ~(page_size-1);
+
+    // Fresh pages are zeroed, so every peer's arena starts out the same
+#ifdef WIN32
+    void* memory = VirtualAlloc(nullptr, capacity, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if(memory == nullptr) {
+        LogNull << "Failed to map the state arena: " << GetLastError() << endline;
+        return false;
+    }
+#else
+    void* memory = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED) {
+        LogNull << "Failed to map the state arena: " << strerror(errno) << endline;
+        return false;
+    }
+#endif
+
+    m_data = static_cast<char*>(memory);
+    m_capacity = capacity;
+    m_used = new(m_data) size_t(ARENA_HEADER_SIZE);
+
+    return true;
+}
+
+void* StateArena::allocate(size_t size, size_t alignment)
+{
+    if(m_used == nullptr) {
+        return nullptr;
+    }
+
+    size = (size + ARENA_ALIGNMENT-1) & ~(ARENA_ALIGNMENT-1);
+
+    // Every offset is already aligned to ARENA_ALIGNMENT
+    size_t start = *m_used;
+    if(alignment > ARENA_ALIGNMENT) {
+        start = (start + alignment-1) & ~(alignment-1);
+    }
+
+    if(start + size > m_capacity) {
+        return nullptr;
+    }
+
+    *m_used = start + size;
+    return m_data + start;
+}
+
+void StateArena::reset()
+{
+    if(m_used != nullptr) {
+        *m_used = ARENA_HEADER_SIZE;
+    }
+}
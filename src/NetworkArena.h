@@ -0,0 +1,108 @@
+#ifndef SHOBU_NETWORK_ARENA_H
+#define SHOBU_NETWORK_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+// Every allocation starts on this many bytes unless asked for more
+const size_t ARENA_ALIGNMENT = 16;
+
+/*! Memory for the game's simulation objects that the library can snapshot as one block.
+ *  The arena is mapped once and never moves, so pointers between objects in it stay valid when an old frame
+ *  is restored, and nothing has to be serialized.  Allocation only bumps an offset kept at the start of the arena,
+ *  so rolling back the block also frees everything allocated since.
+ *  Register it with ShobuNetwork::addStateArena and allocate from it during the update callback, on one thread.
+ *  Each peer's arena is mapped wherever the system puts it, so objects link to each other with ArenaPtr,
+ *  which is the same on every peer
+ */
+class StateArena
+{
+    public:
+    StateArena();
+    ~StateArena();
+
+    StateArena(const StateArena&) = delete;
+    StateArena& operator=(const StateArena&) = delete;
+
+    /*! Map the arena's memory
+     * \param capacity bytes the arena can hand out, rounded up to whole pages
+     * \return false when the memory couldn't be mapped
+     */
+    bool initialize(size_t capacity);
+
+    /*! Take memory from the arena in constant time.  Only the thread running the update may allocate,
+     *  so every peer lays its objects out in the same order.
+     *  The memory isn't cleared, it may hold objects from frames that were rolled back
+     * \param size bytes wanted
+     * \param alignment power of two the memory must start on
+     * \return the memory, or nullptr when the arena is full
+     */
+    void* allocate(size_t size, size_t alignment = ARENA_ALIGNMENT);
+
+    /*! Allocate and construct an object.  Its destructor is never called, the arena is freed all at once
+     * \return the object, or nullptr when the arena is full
+     */
+    template<typename T, typename... Args>
+    T* create(Args&&... args)
+    {
+        void* memory = allocate(sizeof(T), alignof(T));
+        return memory ? new(memory) T(std::forward<Args>(args)...) : nullptr;
+    }
+
+    // Free everything allocated, like at the start of a match
+    void reset();
+
+    // Start of the arena's memory, including the offset kept at its start
+    char* data() { return m_data; }
+
+    // Bytes mapped
+    size_t capacity() const { return m_capacity; }
+
+    // Bytes from the start in use, the only ones a snapshot has to copy
+    size_t used() const { return m_used ? *m_used : 0; }
+    const size_t* usedCounter() const { return m_used; }
+
+    private:
+    char* m_data;
+    size_t m_capacity;
+
+    // Lives in the arena, so a snapshot of it includes where the next allocation goes
+    size_t* m_used;
+};
+
+/*! Pointer from an object in a StateArena to another object in the same arena.  It keeps the distance to the object
+ *  rather than its address, so it holds the same bytes on every peer and the state hashes the same, wherever
+ *  each peer's arena was mapped.  Can't point at itself, that distance is kept for nullptr
+ */
+template<typename T>
+class ArenaPtr
+{
+    public:
+    ArenaPtr() : m_offset(0) {}
+    ArenaPtr(T* object) { set(object); }
+    ArenaPtr(const ArenaPtr& other) { set(other.get()); }
+
+    ArenaPtr& operator=(const ArenaPtr& other) { set(other.get()); return *this; }
+    ArenaPtr& operator=(T* object) { set(object); return *this; }
+
+    T* get() const
+    {
+        return m_offset ? reinterpret_cast<T*>(reinterpret_cast<intptr_t>(this) + m_offset) : nullptr;
+    }
+
+    T* operator->() const { return get(); }
+    T& operator*() const { return *get(); }
+    explicit operator bool() const { return m_offset != 0; }
+
+    private:
+    void set(T* object)
+    {
+        m_offset = object ? reinterpret_cast<intptr_t>(object) - reinterpret_cast<intptr_t>(this) : 0;
+    }
+
+    intptr_t m_offset;
+};
+
+#endif // SHOBU_NETWORK_ARENA_H
@@ -0,0 +1,39 @@
+#include "NetworkClock.h"
+
+#include <chrono>
+#include <thread>
+
+long long SystemClock::now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SystemClock::sleep(long long microseconds)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(microseconds));
+}
+
+VirtualClock::VirtualClock() : m_now(0)
+{
+}
+
+long long VirtualClock::now()
+{
+    return m_now.load(std::memory_order_acquire);
+}
+
+void VirtualClock::sleep(long long microseconds)
+{
+    advance(microseconds);
+}
+
+void VirtualClock::advance(long long microseconds)
+{
+    m_now.fetch_add(microseconds, std::memory_order_acq_rel);
+}
+
+NetworkClock& systemClock()
+{
+    static SystemClock clock;
+    return clock;
+}
@@ -0,0 +1,56 @@
+#ifndef SHOBU_NETWORK_CLOCK_H
+#define SHOBU_NETWORK_CLOCK_H
+
+#include <atomic>
+
+/*! Where a session gets the time from.
+ *  Sessions use the system clock unless given another one, so a test can drive them with virtual time
+ */
+class NetworkClock
+{
+    public:
+    virtual ~NetworkClock() {}
+
+    // Microseconds since some fixed point in the past.  Never goes backwards
+    virtual long long now() = 0;
+
+    // Block the calling thread until the time has passed
+    virtual void sleep(long long microseconds) = 0;
+
+    // Milliseconds used for packet time stamps.  Wraps around
+    unsigned int nowMs() { return static_cast<unsigned int>(now() / 1000); }
+};
+
+/*! Real time from the operating system's monotonic clock
+ */
+class SystemClock : public NetworkClock
+{
+    public:
+    long long now();
+    void sleep(long long microseconds);
+};
+
+/*! Time that only moves when told to, so hours of play can be simulated in seconds
+ *  and everything timed by the clock happens the same way each run.
+ *  Sleeping moves the time forward instead of blocking.
+ *  Use it with sessions that are polled, like ones connected with initializeLoopback
+ */
+class VirtualClock : public NetworkClock
+{
+    public:
+    VirtualClock();
+
+    long long now();
+    void sleep(long long microseconds);
+
+    // Move the time forward
+    void advance(long long microseconds);
+
+    private:
+    std::atomic<long long> m_now;
+};
+
+// Clock shared by every session that isn't given one
+NetworkClock& systemClock();
+
+#endif // SHOBU_NETWORK_CLOCK_H
@@ -0,0 +1,596 @@
+#include "NetworkConditioner.h"
+#include "NetworkLogger.h"
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+// Shape of the pareto tail.  With 2 the average extra latency is the jitter
+const double PARETO_SHAPE = 2.0;
+
+const double PI = 3.14159265358979323846;
+
+NetworkConditions::NetworkConditions()
+{
+    latency = 0;
+    jitter = 0;
+    distribution = LATENCY_CONSTANT;
+    reorder = 0;
+    duplicate = 0;
+    loss_good = 0;
+    loss_bad = 0;
+    good_to_bad = 0;
+    bad_to_good = 0;
+    bandwidth = 0;
+    seed = 0;
+}
+
+bool NetworkConditions::active() const
+{
+    return latency > 0 || jitter > 0 || duplicate > 0 || loss_good > 0 || (loss_bad > 0 && good_to_bad > 0) || bandwidth > 0;
+}
+
+NetworkConditioner::NetworkConditioner()
+{
+    for(int i=0; i<CONDITIONER_SLOTS; i++) {
+        m_free[i] = CONDITIONER_SLOTS-1-i;
+        m_entries[i].due = -1;
+    }
+    m_free_count = CONDITIONER_SLOTS;
+
+    for(int i=0; i<WHEEL_SIZE; i++) {
+        m_wheel[i] = -1;
+    }
+
+    m_cursor = -1;
+    m_replay_next = 0;
+    m_last_due = 0;
+    m_link_free = 0;
+    m_bad_state = false;
+
+    m_dropped = 0;
+    m_duplicated = 0;
+    m_delivered = 0;
+
+    setConditions(NetworkConditions());
+}
+
+void NetworkConditioner::setConditions(const NetworkConditions& conditions)
+{
+    m_conditions = conditions;
+
+    // xorshift never leaves 0
+    m_random = conditions.seed != 0 ? conditions.seed : 0x9E3779B9;
+}
+
+void NetworkConditioner::setReplay(const std::vector<PacketFate>& fates)
+{
+    m_replay.clear();
+    m_replay_next = 0;
+    m_replay_inputs.clear();
+
+    for(unsigned int i=0; i<fates.size(); i++) {
+        unsigned int id = fates[i].packet_id;
+        if(id == 0) {
+            m_replay.push_back(fates[i]);
+            continue;
+        }
+
+        // Ids the trace skips arrive right away
+        if(id > m_replay_inputs.size()) {
+            PacketFate arrives;
+            arrives.packet_id = 0;
+            arrives.lost = false;
+            arrives.delay = 0;
+            m_replay_inputs.resize(id, arrives);
+        }
+        m_replay_inputs[id-1] = fates[i];
+    }
+}
+
+PacketFate NetworkConditioner::replayFate(const char* packet, int size)
+{
+    unsigned int id = inputPacketId(packet, size);
+    if(id > 0 && !m_replay_inputs.empty()) {
+        return m_replay_inputs[(id-1) % m_replay_inputs.size()];
+    }
+
+    if(!m_replay.empty()) {
+        const PacketFate& fate = m_replay[m_replay_next];
+        m_replay_next = (m_replay_next+1) % m_replay.size();
+        return fate;
+    }
+
+    // Nothing in the trace like it, so it arrives right away
+    PacketFate fate;
+    fate.packet_id = id;
+    fate.lost = false;
+    fate.delay = 0;
+    return fate;
+}
+
+float NetworkConditioner::random()
+{
+    m_random ^= m_random << 13;
+    m_random ^= m_random >> 17;
+    m_random ^= m_random << 5;
+
+    return (m_random >> 8) / 16777216.0f;
+}
+
+long long NetworkConditioner::sampleLatency()
+{
+    double latency = m_conditions.latency;
+    double jitter = m_conditions.jitter;
+
+    switch(m_conditions.distribution) {
+    case LATENCY_UNIFORM:
+        latency += (random()*2-1) * jitter;
+        break;
+    case LATENCY_NORMAL: {
+        // Box-Muller transform
+        double u1 = random();
+        double u2 = random();
+        if(u1 < 1e-7) {
+            u1 = 1e-7;
+        }
+        latency += std::sqrt(-2*std::log(u1)) * std::cos(2*PI*u2) * jitter;
+        break;
+    }
+    case LATENCY_PARETO: {
+        double u = random();
+        latency += jitter * (std::pow(1-u, -1/PARETO_SHAPE) - 1);
+        break;
+    }
+    default:
+        break;
+    }
+
+    if(latency < 0) {
+        return 0;
+    }
+
+    return static_cast<long long>(latency);
+}
+
+int NetworkConditioner::add(const char* packet, int size, long long now)
+{
+    if(m_cursor < 0) {
+        m_cursor = now / WHEEL_TICK;
+    }
+
+    // The trace already says what happened to the packet
+    if(replaying()) {
+        PacketFate fate = replayFate(packet, size);
+        if(fate.lost || !schedule(packet, size, now + fate.delay)) {
+            m_dropped++;
+            return 0;
+        }
+        return 1;
+    }
+
+    // Move between the good and bad state, then lose the packet with the chance of the current state
+    if(m_bad_state) {
+        if(random() < m_conditions.bad_to_good) {
+            m_bad_state = false;
+        }
+    } else if(random() < m_conditions.good_to_bad) {
+        m_bad_state = true;
+    }
+
+    float loss = m_bad_state ? m_conditions.loss_bad : m_conditions.loss_good;
+    if(loss > 0 && random() < loss) {
+        m_dropped++;
+        return 0;
+    }
+
+    // The packet can't start going out until the link is done with the ones before it
+    long long sent = now;
+    if(m_conditions.bandwidth > 0) {
+        if(m_link_free > sent) {
+            sent = m_link_free;
+        }
+        sent += size * 1000000LL / m_conditions.bandwidth;
+        m_link_free = sent;
+    }
+
+    int copies = 1;
+    if(m_conditions.duplicate > 0 && random() < m_conditions.duplicate) {
+        copies = 2;
+    }
+
+    int scheduled = 0;
+    for(int i=0; i<copies; i++) {
+        long long due = sent + sampleLatency();
+
+        // Keep packets in order unless this one may overtake the others
+        bool overtake = m_conditions.reorder > 0 && random() < m_conditions.reorder;
+        if(!overtake && due < m_last_due) {
+            due = m_last_due;
+        }
+        if(due > m_last_due) {
+            m_last_due = due;
+        }
+
+        if(schedule(packet, size, due)) {
+            scheduled++;
+        } else {
+            m_dropped++;
+        }
+    }
+
+    if(scheduled == 2) {
+        m_duplicated++;
+    }
+
+    return scheduled;
+}
+
+bool NetworkConditioner::schedule(const char* packet, int size, long long due)
+{
+    if(m_free_count == 0 || size > MAX_PACKET_SIZE) {
+        return false;
+    }
+
+    int index = m_free[--m_free_count];
+    Entry& entry = m_entries[index];
+    entry.due = due;
+    entry.size = size;
+    memcpy(entry.packet, packet, size);
+
+    // Packets already due go in the slot delivered next
+    long long tick = due / WHEEL_TICK;
+    if(tick < m_cursor) {
+        tick = m_cursor;
+    }
+
+    // Keep the slot ordered by due time, after packets due at the same time
+    int* link = &m_wheel[tick & (WHEEL_SIZE-1)];
+    while(*link != -1 && m_entries[*link].due <= due) {
+        link = &m_entries[*link].next;
+    }
+    entry.next = *link;
+    *link = index;
+
+    return true;
+}
+
+int NetworkConditioner::deliver(long long now, PacketHandler handler, void* data)
+{
+    if(m_cursor < 0) {
+        return 0;
+    }
+
+    int delivered = 0;
+    long long now_tick = now / WHEEL_TICK;
+
+    // Visit every slot that passed since the last delivery, but each slot at most once
+    for(long long tick = m_cursor; tick <= now_tick && tick < m_cursor + WHEEL_SIZE; tick++) {
+        int& head = m_wheel[tick & (WHEEL_SIZE-1)];
+
+        // Slots also hold packets due on later turns of the wheel, which stay
+        while(head != -1 && m_entries[head].due <= now) {
+            int index = head;
+            head = m_entries[index].next;
+
+            handler(data, m_entries[index].packet, m_entries[index].size, 0);
+
+            m_entries[index].due = -1;
+            m_free[m_free_count++] = index;
+            delivered++;
+        }
+    }
+
+    if(now_tick > m_cursor) {
+        m_cursor = now_tick;
+    }
+
+    m_delivered += delivered;
+    return delivered;
+}
+
+long long NetworkConditioner::nextDue()
+{
+    long long next = -1;
+    for(int i=0; i<CONDITIONER_SLOTS; i++) {
+        if(m_entries[i].due >= 0 && (next < 0 || m_entries[i].due < next)) {
+            next = m_entries[i].due;
+        }
+    }
+
+    return next;
+}
+
+ConditionedTransport::ConditionedTransport(NetworkTransport* transport, const NetworkConditions& send, const NetworkConditions& receive, NetworkClock& clock)
+{
+    m_transport.reset(transport);
+    m_clock = &clock;
+
+    m_send.setConditions(send);
+    m_receive.setConditions(receive);
+    m_send_active = m_send.active();
+    m_conditions_changed = false;
+
+    m_handler = nullptr;
+    m_handler_data = nullptr;
+    m_pool = nullptr;
+
+    m_threaded = false;
+    m_sends_queued = false;
+
+#ifdef __linux__
+    m_epoll = -1;
+    m_timer = -1;
+    m_wake = -1;
+#endif
+}
+
+ConditionedTransport::~ConditionedTransport()
+{
+#ifdef __linux__
+    if(m_epoll >= 0) {
+        ::close(m_epoll);
+    }
+    if(m_timer >= 0) {
+        ::close(m_timer);
+    }
+    if(m_wake >= 0) {
+        ::close(m_wake);
+    }
+#endif
+}
+
+void ConditionedTransport::start()
+{
+    m_transport->start();
+
+#ifdef __linux__
+    // The reactor waits on the wrapped transport and on a timer for the next packet due
+    int handle = m_transport->getHandle();
+    if(handle < 0) {
+        return;
+    }
+
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    m_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    m_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_epoll < 0 || m_timer < 0 || m_wake < 0) {
+        LogNull << "Could not create conditioner timer, packets are delivered each update" << endline;
+        return;
+    }
+
+    int handles[3] = { handle, m_timer, m_wake };
+    for(int i=0; i<3; i++) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = handles[i];
+        if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, handles[i], &event) < 0) {
+            LogNull << "Could not add conditioner handle to epoll" << endline;
+            return;
+        }
+    }
+
+    m_threaded = true;
+#endif
+}
+
+void ConditionedTransport::setConditions(const NetworkConditions& send, const NetworkConditions& receive)
+{
+    if(!m_threaded) {
+        m_send.setConditions(send);
+        m_receive.setConditions(receive);
+        m_send_active = m_send.active();
+        return;
+    }
+
+    // The reactor thread owns the conditioners, so hand the conditions over
+    {
+        std::lock_guard<std::mutex> lock(m_conditions_mutex);
+        m_new_send = send;
+        m_new_receive = receive;
+    }
+    m_conditions_changed = true;
+
+    // Sends go through the conditioner right away, and the reactor schedules them under the new conditions
+    if(send.active()) {
+        m_send_active = true;
+    }
+    wake();
+}
+
+void ConditionedTransport::wake()
+{
+#ifdef __linux__
+    uint64_t value = 1;
+    if(write(m_wake, &value, sizeof(value)) < 0) {
+        LogNull << "Could not wake conditioner" << endline;
+    }
+#endif
+}
+
+void ConditionedTransport::send(char* packet, int size, PacketPool& pool)
+{
+    if(!m_send_active) {
+        m_transport->send(packet, size, pool);
+        return;
+    }
+
+    // The reactor thread owns the send conditioner, so hand the packet over
+    if(m_threaded) {
+        QueuedSend* queued = m_sends.acquire();
+        if(queued) {
+            queued->time = m_clock->now();
+            queued->size = size;
+            memcpy(queued->packet, packet, size);
+            m_sends.publish();
+            m_sends_queued = true;
+        }
+        pool.release(packet);
+        return;
+    }
+
+    m_send.add(packet, size, m_clock->now());
+    pool.release(packet);
+}
+
+void ConditionedTransport::flush(PacketPool& pool)
+{
+    if(m_threaded) {
+        // Wake the reactor thread up once for everything sent this update
+        if(m_sends_queued) {
+            wake();
+            m_sends_queued = false;
+        }
+    } else {
+        m_pool = &pool;
+        m_send.deliver(m_clock->now(), sendConditioned, this);
+    }
+
+    m_transport->flush(pool);
+}
+
+void ConditionedTransport::sendConditioned(void* data, const char* packet, int size, long long)
+{
+    ConditionedTransport* transport = static_cast<ConditionedTransport*>(data);
+
+    // Only the session thread may use its pool
+    if(transport->m_pool) {
+        char* buffer = transport->m_pool->acquire();
+        if(buffer) {
+            memcpy(buffer, packet, size);
+            transport->m_transport->send(buffer, size, *transport->m_pool);
+            return;
+        }
+    }
+
+    transport->m_transport->sendNow(packet, size);
+}
+
+void ConditionedTransport::conditionPacket(void* data, const char* packet, int size, long long receive_time)
+{
+    ConditionedTransport* transport = static_cast<ConditionedTransport*>(data);
+
+    if(!transport->m_receive.active()) {
+        transport->m_handler(transport->m_handler_data, packet, size, receive_time);
+        return;
+    }
+
+    transport->m_receive.add(packet, size, transport->m_clock->now());
+}
+
+bool ConditionedTransport::receive(PacketHandler handler, void* data)
+{
+    m_handler = handler;
+    m_handler_data = data;
+
+#ifdef __linux__
+    if(m_threaded) {
+        // Clear the timer and wake up event so they only fire again when needed
+        uint64_t value;
+        if(read(m_timer, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+            LogNull << "Could not read conditioner timer" << endline;
+        }
+        if(read(m_wake, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+            LogNull << "Could not read conditioner wake up" << endline;
+        }
+
+        if(m_conditions_changed.exchange(false)) {
+            std::lock_guard<std::mutex> lock(m_conditions_mutex);
+            m_send.setConditions(m_new_send);
+            m_receive.setConditions(m_new_receive);
+            m_send_active = m_send.active();
+        }
+
+        // Schedule what the session sent since the last wake up, then send what's due
+        while(QueuedSend* queued = m_sends.front()) {
+            m_send.add(queued->packet, queued->size, queued->time);
+            m_sends.pop();
+        }
+        m_send.deliver(m_clock->now(), sendConditioned, this);
+    }
+#endif
+
+    bool result = m_transport->receive(conditionPacket, this);
+
+    m_receive.deliver(m_clock->now(), handler, data);
+
+#ifdef __linux__
+    if(m_threaded) {
+        armTimer();
+    }
+#endif
+
+    return result;
+}
+
+void ConditionedTransport::armTimer()
+{
+#ifdef __linux__
+    long long next = m_send.nextDue();
+    long long next_receive = m_receive.nextDue();
+    if(next < 0 || (next_receive >= 0 && next_receive < next)) {
+        next = next_receive;
+    }
+
+    // A zero time disarms the timer, so packets already due fire after a nanosecond
+    struct itimerspec time;
+    memset(&time, 0, sizeof(time));
+    if(next >= 0) {
+        long long wait = next - m_clock->now();
+        if(wait < 0) {
+            wait = 0;
+        }
+        time.it_value.tv_sec = wait / 1000000;
+        time.it_value.tv_nsec = (wait % 1000000) * 1000 + 1;
+    }
+
+    if(timerfd_settime(m_timer, 0, &time, nullptr) < 0) {
+        LogNull << "Could not set conditioner timer" << endline;
+    }
+#endif
+}
+
+void ConditionedTransport::sendNow(const char* packet, int size)
+{
+    m_transport->sendNow(packet, size);
+}
+
+bool ConditionedTransport::wait(int timeout)
+{
+    return m_transport->wait(timeout);
+}
+
+int ConditionedTransport::receiveOne(char* buffer, int size)
+{
+    return m_transport->receiveOne(buffer, size);
+}
+
+void ConditionedTransport::replyToSender()
+{
+    m_transport->replyToSender();
+}
+
+void ConditionedTransport::close()
+{
+    m_transport->close();
+}
+
+int ConditionedTransport::getHandle()
+{
+#ifdef __linux__
+    if(m_threaded) {
+        return m_epoll;
+    }
+#endif
+
+    // Delayed packets are only delivered when polled
+    return -1;
+}
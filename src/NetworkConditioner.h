@@ -0,0 +1,261 @@
+#ifndef SHOBU_NETWORK_CONDITIONER_H
+#define SHOBU_NETWORK_CONDITIONER_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "NetworkTransport.h"
+#include "NetworkRing.h"
+#include "NetworkTrace.h"
+#include "NetworkClock.h"
+
+// Packets a conditioner can hold at once.  Any more are dropped
+const int CONDITIONER_SLOTS = 256;
+
+// Resolution of each slot of the timing wheel in microseconds
+const int WHEEL_TICK = 100;
+
+// Slots in the timing wheel.  Must be a power of two
+const int WHEEL_SIZE = 4096;
+
+// Shape of the random part of the latency
+enum LatencyDistribution
+{
+    LATENCY_CONSTANT,   // Always exactly the latency
+    LATENCY_UNIFORM,    // Evenly spread within jitter of the latency
+    LATENCY_NORMAL,     // Bell curve around the latency with jitter as the standard deviation
+    LATENCY_PARETO      // Latency plus a long tail with jitter as the scale, like a busy wireless link
+};
+
+/*! Describes the conditions of one direction of a link.
+ *  Everything defaults to a perfect link
+ */
+struct NetworkConditions
+{
+    NetworkConditions();
+
+    // One way latency and how far it varies, in microseconds
+    int latency;
+    int jitter;
+    LatencyDistribution distribution;
+
+    // Chance a packet may overtake earlier ones.  Otherwise jitter never reorders packets
+    float reorder;
+
+    // Chance a packet arrives twice
+    float duplicate;
+
+    // Gilbert-Elliott burst loss.  The link moves between a good and a bad state before each packet
+    // and loses packets with the chance of the state it's in
+    float loss_good;
+    float loss_bad;
+    float good_to_bad;
+    float bad_to_good;
+
+    // Most bytes per second the link carries, 0 for no limit
+    int bandwidth;
+
+    // Seed for the random numbers so runs can be repeated
+    unsigned int seed;
+
+    // Returns true when any condition differs from a perfect link
+    bool active() const;
+};
+
+/*! Applies NetworkConditions to packets in one direction.
+ *  Packets are copied in and scheduled on a timing wheel with microsecond time stamps,
+ *  so nothing is allocated per packet.  Only use from one thread
+ */
+class NetworkConditioner
+{
+    public:
+    NetworkConditioner();
+
+    void setConditions(const NetworkConditions& conditions);
+    const NetworkConditions& getConditions() { return m_conditions; }
+
+    /*! Give packets the fates from a trace instead of using the conditions.
+     *  Input packets get the fate of the one with the same id, other packets take the rest in order.
+     *  Starts over at the end of the trace
+     */
+    void setReplay(const std::vector<PacketFate>& fates);
+
+    // Returns true when packets are conditioned or replayed
+    bool active() const { return m_conditions.active() || replaying(); }
+
+    /*! Schedule a packet, which may also drop or duplicate it
+     * \param packet the packet, which is copied
+     * \param size length of the packet
+     * \param now current time in microseconds
+     * \return number of copies scheduled
+     */
+    int add(const char* packet, int size, long long now);
+
+    /*! Hand every packet whose time has come to the handler in the order they are due
+     * \param now current time in microseconds
+     * \return number of packets handed over
+     */
+    int deliver(long long now, PacketHandler handler, void* data);
+
+    // Returns when the next packet is due in microseconds, or -1 when nothing is scheduled
+    long long nextDue();
+
+    // Totals for checking the conditions behave as configured
+    int getDropped() { return m_dropped; }
+    int getDuplicated() { return m_duplicated; }
+    int getDelivered() { return m_delivered; }
+
+    private:
+    struct Entry {
+        long long due;
+        int size;
+        int next;
+        char packet[MAX_PACKET_SIZE];
+    };
+
+    // Schedule a single copy of a packet
+    bool schedule(const char* packet, int size, long long due);
+
+    // Random number from 0 to 1
+    float random();
+
+    bool replaying() const { return !m_replay.empty() || !m_replay_inputs.empty(); }
+
+    // Fate of a packet from the trace
+    PacketFate replayFate(const char* packet, int size);
+
+    // Random latency in microseconds from the distribution
+    long long sampleLatency();
+
+    NetworkConditions m_conditions;
+
+    Entry m_entries[CONDITIONER_SLOTS];
+
+    // Stack of unused entries
+    int m_free[CONDITIONER_SLOTS];
+    int m_free_count;
+
+    // First entry of each slot, ordered by due time, or -1
+    int m_wheel[WHEEL_SIZE];
+
+    // Every slot before this tick has been delivered
+    long long m_cursor;
+
+    // Due time of the last packet scheduled, so jitter alone doesn't reorder
+    long long m_last_due;
+
+    // When the link finishes sending the packets before it, for the bandwidth limit
+    long long m_link_free;
+
+    // Currently in the bad state of the burst loss model
+    bool m_bad_state;
+
+    unsigned int m_random;
+
+    // Fates from a trace of packets without an id and the one the next of them gets
+    std::vector<PacketFate> m_replay;
+    unsigned int m_replay_next;
+
+    // Fates of input packets from a trace by id, starting at 1
+    std::vector<PacketFate> m_replay_inputs;
+
+    int m_dropped;
+    int m_duplicated;
+    int m_delivered;
+};
+
+/*! Wraps another transport and runs its packets through a conditioner in each direction.
+ *  When the transport can be waited on, packets are delivered on the reactor thread at the microsecond they are due.
+ *  Otherwise they are delivered when the session polls it
+ */
+class ConditionedTransport : public NetworkTransport
+{
+    public:
+    /*! \param transport the transport to wrap.  It is deleted with this one
+     * \param send conditions of packets sent to the remote client
+     * \param receive conditions of packets received from it
+     * \param clock clock packets are timed with
+     */
+    ConditionedTransport(NetworkTransport* transport, const NetworkConditions& send, const NetworkConditions& receive, NetworkClock& clock);
+    ~ConditionedTransport();
+
+    void send(char* packet, int size, PacketPool& pool);
+    void flush(PacketPool& pool);
+    void sendNow(const char* packet, int size);
+    bool receive(PacketHandler handler, void* data);
+    bool wait(int timeout);
+    int receiveOne(char* buffer, int size);
+    void replyToSender();
+    void start();
+    void close();
+    int getHandle();
+    bool drivenExternally() { return m_transport->drivenExternally(); }
+
+    // Replay a trace on received packets.  Call before start
+    void setReceiveReplay(const std::vector<PacketFate>& fates) { m_receive.setReplay(fates); }
+
+    /*! Change the conditions while packets are flowing.  Packets already scheduled keep their fate.
+     *  When the reactor thread delivers the packets it takes them the next time it wakes up
+     */
+    void setConditions(const NetworkConditions& send, const NetworkConditions& receive);
+
+    private:
+    // Receives packets from the wrapped transport into the receive conditioner
+    static void conditionPacket(void* data, const char* packet, int size, long long receive_time);
+
+    // Sends a packet from the send conditioner
+    static void sendConditioned(void* data, const char* packet, int size, long long);
+
+    // Schedule the timer for the next packet due in either direction
+    void armTimer();
+
+    // Have the reactor thread look at the sends and conditions handed to it
+    void wake();
+
+    std::unique_ptr<NetworkTransport> m_transport;
+
+    NetworkClock* m_clock;
+
+    NetworkConditioner m_send;
+    NetworkConditioner m_receive;
+
+    // Whether sends go through the send conditioner, read by the session thread
+    std::atomic<bool> m_send_active;
+
+    // Conditions set while the reactor thread owns the conditioners, waiting for it to take them
+    std::mutex m_conditions_mutex;
+    NetworkConditions m_new_send;
+    NetworkConditions m_new_receive;
+    std::atomic<bool> m_conditions_changed;
+
+    // Handler of the current receive call
+    PacketHandler m_handler;
+    void* m_handler_data;
+
+    // Pool sends from the send conditioner are taken from while polling
+    PacketPool* m_pool;
+
+    // Set when packets are delivered on the reactor thread
+    bool m_threaded;
+
+    // Packet sent by the session thread, waiting for the reactor thread to schedule it
+    struct QueuedSend {
+        long long time;
+        int size;
+        char packet[MAX_PACKET_SIZE];
+    };
+
+    // Sends handed from the session thread to the reactor thread
+    SpscRing<QueuedSend, 64> m_sends;
+    bool m_sends_queued;
+
+#ifdef __linux__
+    // Waits on the wrapped transport, the timer and the wake up event
+    int m_epoll;
+    int m_timer;
+    int m_wake;
+#endif
+};
+
+#endif // SHOBU_NETWORK_CONDITIONER_H
@@ -0,0 +1,102 @@
+#ifndef SHOBU_NETWORK_DEQUE_H
+#define SHOBU_NETWORK_DEQUE_H
+
+#include <atomic>
+
+/*! Chase-Lev work stealing deque of pointers.
+ *  The thread which owns it pushes and pops at the bottom without contention,
+ *  any other thread can steal from the top.  Only a steal racing the owner for the last item uses a compare and swap.
+ *  Capacity is fixed so nothing is allocated.  SIZE must be a power of two.
+ */
+template <unsigned int SIZE>
+class WorkStealingDeque
+{
+    static_assert((SIZE & (SIZE-1)) == 0, "WorkStealingDeque size must be a power of two");
+
+    public:
+    WorkStealingDeque() : m_top(0), m_bottom(0)
+    {
+        for(unsigned int i=0; i<SIZE; i++) {
+            m_items[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    /*! Owner: add an item
+     * \param item must not be nullptr
+     * \return false when the deque is full
+     */
+    bool push(void* item)
+    {
+        long long bottom = m_bottom.load(std::memory_order_relaxed);
+        long long top = m_top.load(std::memory_order_acquire);
+        if(bottom - top >= static_cast<long long>(SIZE)) {
+            return false;
+        }
+
+        m_items[bottom & (SIZE-1)].store(item, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(bottom+1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /*! Owner: take the newest item
+     * \return nullptr when the deque is empty or a thief took the last item
+     */
+    void* pop()
+    {
+        long long bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long top = m_top.load(std::memory_order_relaxed);
+
+        if(top > bottom) {
+            m_bottom.store(bottom+1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        void* item = m_items[bottom & (SIZE-1)].load(std::memory_order_relaxed);
+        if(top == bottom) {
+            // Last item, which a thief may be taking at the same time
+            if(!m_top.compare_exchange_strong(top, top+1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            m_bottom.store(bottom+1, std::memory_order_relaxed);
+        }
+
+        return item;
+    }
+
+    /*! Any thread: take the oldest item
+     * \return nullptr when the deque is empty or another thread got the item first
+     */
+    void* steal()
+    {
+        long long top = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long bottom = m_bottom.load(std::memory_order_acquire);
+
+        if(top >= bottom) {
+            return nullptr;
+        }
+
+        void* item = m_items[top & (SIZE-1)].load(std::memory_order_relaxed);
+        if(!m_top.compare_exchange_strong(top, top+1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+
+        return item;
+    }
+
+    private:
+    std::atomic<void*> m_items[SIZE];
+
+    // Thieves take from the top, the owner works at the bottom.  Padded onto separate cache lines instead of aligned,
+    // since new only honours extended alignment from C++17
+    char m_items_padding[64];
+    std::atomic<long long> m_top;
+    char m_top_padding[64 - sizeof(std::atomic<long long>)];
+    std::atomic<long long> m_bottom;
+    char m_bottom_padding[64 - sizeof(std::atomic<long long>)];
+};
+
+#endif // SHOBU_NETWORK_DEQUE_H
@@ -0,0 +1,208 @@
+#include "NetworkExecutor.h"
+
+NetworkExecutor::NetworkExecutor() : m_running(false)
+{
+    m_task = nullptr;
+    m_items = nullptr;
+    m_count = 0;
+    m_generation = 0;
+    m_remaining = 0;
+    m_finished = 0;
+    m_steals = 0;
+}
+
+NetworkExecutor::~NetworkExecutor()
+{
+    stop();
+}
+
+bool NetworkExecutor::start(int threads)
+{
+    if(m_running) {
+        return false;
+    }
+
+    if(threads <= 0) {
+        threads = static_cast<int>(std::thread::hardware_concurrency());
+        if(threads <= 0) {
+            threads = 1;
+        }
+    }
+
+    m_running = true;
+
+    for(int i=1; i<threads; i++) {
+        m_workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+    for(unsigned int i=0; i<m_workers.size(); i++) {
+        m_workers[i]->thread = std::thread(&NetworkExecutor::work, this, i+1);
+    }
+
+    return true;
+}
+
+void NetworkExecutor::stop()
+{
+    if(!m_running) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_park_mutex);
+        m_running = false;
+    }
+    m_park.notify_all();
+
+    for(unsigned int i=0; i<m_workers.size(); i++) {
+        m_workers[i]->thread.join();
+    }
+    m_workers.clear();
+}
+
+void NetworkExecutor::run(Task task, void* const* items, int count)
+{
+    if(count <= 0) {
+        return;
+    }
+
+    m_task = task;
+    m_items = items;
+    m_count = count;
+    m_remaining = count;
+    m_finished = 0;
+
+    // Every thread's share is queued before any thread starts, so a worker still waking up can have its share stolen.
+    // Workers don't touch their deques between runs
+    int threads = getThreads();
+    for(int index=0; index<threads; index++) {
+        int begin, end;
+        share(index, begin, end);
+
+        // Pointers into the items are never null, unlike the items themselves.  Only the first EXECUTOR_QUEUE_SIZE fit
+        WorkStealingDeque<EXECUTOR_QUEUE_SIZE>& deque = queue(index);
+        for(int i=begin; i<end; i++) {
+            if(!deque.push(const_cast<void**>(&m_items[i]))) {
+                break;
+            }
+        }
+    }
+
+    // Workers that are spinning see the new generation right away, the rest are woken
+    {
+        std::lock_guard<std::mutex> lock(m_park_mutex);
+        m_generation.fetch_add(1, std::memory_order_release);
+    }
+    m_park.notify_all();
+
+    unsigned int seed = 0x9E3779B9u;
+    execute(0, seed);
+
+    // Workers may still be looking for something to steal, they must be done with this run before the next one
+    int workers = static_cast<int>(m_workers.size());
+    while(m_finished.load(std::memory_order_acquire) < workers) {
+        std::this_thread::yield();
+    }
+}
+
+void NetworkExecutor::work(int index)
+{
+    unsigned int seen = 0;
+    unsigned int seed = 0x9E3779B9u * (index+1);
+
+    while(true) {
+        // Spin for a while since runs usually come every frame, then sleep until the next one
+        unsigned int generation = m_generation.load(std::memory_order_acquire);
+        for(int i=0; i<EXECUTOR_SPIN && generation == seen && m_running; i++) {
+            std::this_thread::yield();
+            generation = m_generation.load(std::memory_order_acquire);
+        }
+
+        if(generation == seen) {
+            std::unique_lock<std::mutex> lock(m_park_mutex);
+            m_park.wait(lock, [&]{ return m_generation.load(std::memory_order_acquire) != seen || !m_running; });
+            generation = m_generation.load(std::memory_order_acquire);
+        }
+
+        if(!m_running) {
+            return;
+        }
+
+        seen = generation;
+        execute(index, seed);
+        m_finished.fetch_add(1, std::memory_order_release);
+    }
+}
+
+void NetworkExecutor::execute(int index, unsigned int& seed)
+{
+    WorkStealingDeque<EXECUTOR_QUEUE_SIZE>& own = queue(index);
+
+    // The part of the share that didn't fit in the deque is run right away
+    int begin, end;
+    share(index, begin, end);
+    for(int i=begin+static_cast<int>(EXECUTOR_QUEUE_SIZE); i<end; i++) {
+        m_task(m_items[i]);
+        m_remaining.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    while(m_remaining.load(std::memory_order_acquire) > 0) {
+        void* slot = own.pop();
+        if(!slot) {
+            slot = steal(index, seed);
+        }
+
+        if(!slot) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        m_task(*static_cast<void**>(slot));
+        m_remaining.fetch_sub(1, std::memory_order_acq_rel);
+    }
+}
+
+void NetworkExecutor::share(int index, int& begin, int& end)
+{
+    // Each thread gets an equal, contiguous part of the items
+    int threads = getThreads();
+    begin = static_cast<int>(static_cast<long long>(m_count) * index / threads);
+    end = static_cast<int>(static_cast<long long>(m_count) * (index+1) / threads);
+}
+
+void* NetworkExecutor::steal(int index, unsigned int& seed)
+{
+    int threads = getThreads();
+    if(threads == 1) {
+        return nullptr;
+    }
+
+    // Start with a random thread so thieves don't all go after the same one
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    int start = static_cast<int>(seed % threads);
+
+    for(int i=0; i<threads; i++) {
+        int victim = (start+i) % threads;
+        if(victim == index) {
+            continue;
+        }
+
+        void* slot = queue(victim).steal();
+        if(slot) {
+            m_steals.fetch_add(1, std::memory_order_relaxed);
+            return slot;
+        }
+    }
+
+    return nullptr;
+}
+
+WorkStealingDeque<EXECUTOR_QUEUE_SIZE>& NetworkExecutor::queue(int index)
+{
+    if(index == 0) {
+        return m_caller.queue;
+    }
+
+    return m_workers[index-1]->queue;
+}
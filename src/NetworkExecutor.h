@@ -0,0 +1,102 @@
+#ifndef SHOBU_NETWORK_EXECUTOR_H
+#define SHOBU_NETWORK_EXECUTOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "NetworkDeque.h"
+
+// Tasks each thread can queue before running the rest right away
+const unsigned int EXECUTOR_QUEUE_SIZE = 1024;
+
+// Times an idle worker checks for work before sleeping until the next run
+const int EXECUTOR_SPIN = 2000;
+
+/*! Runs a task over many items on a pool of threads, like updating thousands of sessions every frame.
+ *  Each thread's share of the items is queued in its own work stealing deque before the run starts, and
+ *  threads steal from the others once they run out, so a few slow sessions don't hold up a whole thread's share.
+ *  No locks are taken per item.  The thread calling run works too.
+ *  Sessions that talk to each other in the same process, like a loopback pair, must be updated by the same item
+ */
+class NetworkExecutor
+{
+    public:
+    typedef void (*Task)(void* item);
+
+    NetworkExecutor();
+
+    // Stops the threads if they're still running
+    ~NetworkExecutor();
+
+    /*! Start the worker threads
+     * \param threads threads running tasks including the one calling run, 0 for one per core
+     * \return false on failure, true on success
+     */
+    bool start(int threads);
+
+    // Stop and join the worker threads
+    void stop();
+
+    /*! Call task once with every item and return when they're all done.
+     *  Only one thread may call run at a time
+     * \param task function to call, from any of the threads
+     * \param items what to call it with
+     * \param count number of items
+     */
+    void run(Task task, void* const* items, int count);
+
+    // Threads running tasks including the caller
+    int getThreads() { return static_cast<int>(m_workers.size()) + 1; }
+
+    // Items a thread took from another thread's deque
+    long long getSteals() { return m_steals; }
+
+    private:
+    struct Worker {
+        std::thread thread;
+        WorkStealingDeque<EXECUTOR_QUEUE_SIZE> queue;
+    };
+
+    // Worker thread, waits for each run and helps finish it
+    void work(int index);
+
+    // Run the items of this thread's share that weren't queued, then run queued items until none are left
+    void execute(int index, unsigned int& seed);
+
+    // Items a thread queues at the start of a run, as indexes from begin up to end
+    void share(int index, int& begin, int& end);
+
+    // Take an item from another thread
+    void* steal(int index, unsigned int& seed);
+
+    // Deque of a thread, 0 is the thread calling run
+    WorkStealingDeque<EXECUTOR_QUEUE_SIZE>& queue(int index);
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    Worker m_caller;
+
+    std::atomic<bool> m_running;
+
+    // Current run
+    Task m_task;
+    void* const* m_items;
+    int m_count;
+
+    // Incremented to start a run
+    std::atomic<unsigned int> m_generation;
+
+    // Items not yet finished, and workers still in the run
+    std::atomic<int> m_remaining;
+    std::atomic<int> m_finished;
+
+    std::atomic<long long> m_steals;
+
+    // Only used to put idle workers to sleep
+    std::mutex m_park_mutex;
+    std::condition_variable m_park;
+};
+
+#endif // SHOBU_NETWORK_EXECUTOR_H
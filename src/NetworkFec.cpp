@@ -0,0 +1,199 @@
+#include "NetworkFec.h"
+
+#include <cstring>
+
+FecEncoder::FecEncoder()
+{
+    m_next = 0;
+    m_total = 0;
+    m_group_size = 0;
+    m_interval = 0;
+    m_since_parity = 0;
+}
+
+void FecEncoder::setLossRate(float loss)
+{
+    // Clean links don't pay for any parity.  The worse the link, the smaller and more overlapped the groups get
+    if(loss < 0.01f) {
+        setRedundancy(0, 0);
+    } else if(loss < 0.05f) {
+        setRedundancy(4, 4);
+    } else if(loss < 0.15f) {
+        setRedundancy(4, 2);
+    } else {
+        setRedundancy(2, 1);
+    }
+}
+
+void FecEncoder::setRedundancy(int group_size, int interval)
+{
+    if(group_size > MAX_FEC_GROUP) {
+        group_size = MAX_FEC_GROUP;
+    }
+
+    if(group_size < 0) {
+        group_size = 0;
+    }
+
+    if(interval < 1) {
+        interval = 1;
+    }
+
+    m_group_size = group_size;
+    m_interval = interval;
+}
+
+int FecEncoder::addPacket(const char* packet, int size, unsigned int packet_id, char client, char* parity)
+{
+    if(size > MAX_PACKET_SIZE) {
+        return 0;
+    }
+
+    SentPacket& sent = m_packets[m_next];
+    sent.id = packet_id;
+    sent.size = size;
+    memcpy(sent.data, packet, size);
+
+    m_next = (m_next+1) % MAX_FEC_GROUP;
+    if(m_total < MAX_FEC_GROUP) {
+        m_total++;
+    }
+
+    if(m_group_size == 0 || ++m_since_parity < m_interval) {
+        return 0;
+    }
+
+    m_since_parity = 0;
+
+    int group_size = m_group_size < m_total ? m_group_size : m_total;
+    int first = (m_next - group_size + MAX_FEC_GROUP) % MAX_FEC_GROUP;
+
+    // Parity only works over consecutive packet ids
+    for(int i=1; i<group_size; i++) {
+        if(m_packets[(first+i) % MAX_FEC_GROUP].id != m_packets[first].id + i) {
+            return 0;
+        }
+    }
+
+    PacketWriter writer(parity, MAX_PACKET_SIZE);
+    writer.writeByte('x');
+    writer.writeByte(client);
+    writer.writeByte(PACKET_VERSION);
+    writer.writeVarint(m_packets[first].id);
+    writer.writeByte(static_cast<unsigned char>(group_size));
+
+    int parity_size = 0;
+    for(int i=0; i<group_size; i++) {
+        int length = m_packets[(first+i) % MAX_FEC_GROUP].size;
+        writer.writeVarint(length);
+
+        if(length > parity_size) {
+            parity_size = length;
+        }
+    }
+
+    int header_size = writer.size();
+    if(writer.overflow() || header_size + parity_size > MAX_PACKET_SIZE) {
+        return 0;
+    }
+
+    // Xor every packet in the group together. Shorter packets are padded with zeros
+    char* payload = parity + header_size;
+    memset(payload, 0, parity_size);
+    for(int i=0; i<group_size; i++) {
+        const SentPacket& group_packet = m_packets[(first+i) % MAX_FEC_GROUP];
+        for(int j=0; j<group_packet.size; j++) {
+            payload[j] ^= group_packet.data[j];
+        }
+    }
+
+    return header_size + parity_size;
+}
+
+FecDecoder::FecDecoder()
+{
+    for(int i=0; i<FEC_HISTORY; i++) {
+        m_packets[i].id = 0;
+        m_packets[i].size = 0;
+    }
+}
+
+void FecDecoder::addPacket(const char* packet, int size, unsigned int packet_id)
+{
+    if(size > MAX_PACKET_SIZE) {
+        return;
+    }
+
+    ReceivedPacket& received = m_packets[packet_id % FEC_HISTORY];
+    received.id = packet_id;
+    received.size = size;
+    memcpy(received.data, packet, size);
+}
+
+int FecDecoder::recover(const char* parity, int size, char* packet)
+{
+    PacketReader reader(parity, size);
+    reader.readByte();
+    reader.readByte();
+
+    if(reader.readByte() != PACKET_VERSION) {
+        return 0;
+    }
+
+    unsigned int first_id = reader.readVarint();
+    int group_size = reader.readByte();
+
+    if(reader.error() || group_size < 1 || group_size > MAX_FEC_GROUP) {
+        return 0;
+    }
+
+    int lengths[MAX_FEC_GROUP];
+    int missing = -1;
+    for(int i=0; i<group_size; i++) {
+        // Read unsigned, so a corrupt length can't turn negative
+        unsigned int length = reader.readVarint();
+        if(length > MAX_PACKET_SIZE) {
+            return 0;
+        }
+        lengths[i] = static_cast<int>(length);
+
+        const ReceivedPacket& received = m_packets[(first_id+i) % FEC_HISTORY];
+        if(received.id != first_id+i) {
+            // Can only rebuild a single packet
+            if(missing >= 0) {
+                return 0;
+            }
+            missing = i;
+        } else if(received.size != lengths[i]) {
+            return 0;
+        }
+    }
+
+    if(reader.error() || missing < 0) {
+        return 0;
+    }
+
+    // The xor of every packet in the group comes right after the lengths
+    const char* payload = parity + reader.position();
+    int payload_size = size - reader.position();
+
+    int length = lengths[missing];
+    if(length <= 0 || length > payload_size) {
+        return 0;
+    }
+
+    memcpy(packet, payload, length);
+    for(int i=0; i<group_size; i++) {
+        if(i == missing) {
+            continue;
+        }
+
+        const ReceivedPacket& received = m_packets[(first_id+i) % FEC_HISTORY];
+        int overlap = received.size < length ? received.size : length;
+        for(int j=0; j<overlap; j++) {
+            packet[j] ^= received.data[j];
+        }
+    }
+
+    return length;
+}
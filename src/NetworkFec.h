@@ -0,0 +1,92 @@
+#ifndef SHOBU_NETWORK_FEC_H
+#define SHOBU_NETWORK_FEC_H
+
+#include "NetworkPacket.h"
+
+// Most packets a single parity packet can protect
+const int MAX_FEC_GROUP = 8;
+
+// Number of received packets kept around for rebuilding a lost packet
+const int FEC_HISTORY = 32;
+
+/*! Builds xor parity packets over a sliding group of sent packets.
+ *  Any single lost packet of a group can be rebuilt from the parity packet
+ *  and the rest of the group without waiting for a resend.
+ */
+class FecEncoder
+{
+    public:
+    FecEncoder();
+
+    /*! Pick how much parity to send from the loss rate the remote client measured
+     * \param loss fraction of packets lost, from 0 to 1
+     */
+    void setLossRate(float loss);
+
+    /*! Set the parity layout directly
+     * \param group_size packets covered by each parity packet. 0 disables parity
+     * \param interval a parity packet is sent after every interval packets
+     */
+    void setRedundancy(int group_size, int interval);
+
+    int getGroupSize() { return m_group_size; }
+
+    /*! Adds a sent packet to the sliding group
+     * \param packet the sent packet
+     * \param size length of the packet
+     * \param packet_id the id written in the packet
+     * \param client 'c' or 's', written into the parity packet
+     * \param parity buffer of at least MAX_PACKET_SIZE bytes the parity packet is written to
+     * \return size of the parity packet, 0 when no parity packet should be sent yet
+     */
+    int addPacket(const char* packet, int size, unsigned int packet_id, char client, char* parity);
+
+    private:
+    struct SentPacket {
+        unsigned int id;
+        int size;
+        char data[MAX_PACKET_SIZE];
+    };
+
+    // The last MAX_FEC_GROUP packets sent
+    SentPacket m_packets[MAX_FEC_GROUP];
+    int m_next;
+    int m_total;
+
+    int m_group_size;
+    int m_interval;
+
+    // Packets sent since the last parity packet
+    int m_since_parity;
+};
+
+/*! Rebuilds lost packets from parity packets made by a FecEncoder
+ */
+class FecDecoder
+{
+    public:
+    FecDecoder();
+
+    // Remember a received packet so it can be used to rebuild a lost packet in the same group
+    void addPacket(const char* packet, int size, unsigned int packet_id);
+
+    /*! Try to rebuild the single missing packet of a parity group
+     * \param parity the received parity packet
+     * \param size length of the parity packet
+     * \param packet buffer of at least MAX_PACKET_SIZE bytes the rebuilt packet is written to
+     * \return size of the rebuilt packet, 0 when nothing was missing or more than one packet is missing
+     */
+    int recover(const char* parity, int size, char* packet);
+
+    private:
+    struct ReceivedPacket {
+        unsigned int id;
+        int size;
+        char data[MAX_PACKET_SIZE];
+    };
+
+    // Indexed by packet id % FEC_HISTORY
+    ReceivedPacket m_packets[FEC_HISTORY];
+};
+
+#endif // SHOBU_NETWORK_FEC_H
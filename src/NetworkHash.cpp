@@ -0,0 +1,165 @@
+#include "NetworkHash.h"
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SHOBU_HASH_SSE2
+#endif
+
+const uint64_t PRIME32_1 = 0x9E3779B1ULL;
+const uint64_t PRIME32_2 = 0x85EBCA77ULL;
+const uint64_t PRIME32_3 = 0xC2B2AE3DULL;
+const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+// Bytes taken into the lanes at a time
+const size_t HASH_STRIPE = 64;
+
+// Stripes between scrambling the lanes, so no bits of the input stay in the high end of a lane for long
+const size_t HASH_STRIPES_PER_BLOCK = 16;
+
+// Xored into each lane's input, the start of XXH3's secret
+alignas(16) static const uint64_t HASH_KEYS[8] = {
+    0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL,
+    0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL, 0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL
+};
+
+// Low and high 64 bits of a 128 bit product, xored together
+static uint64_t multiplyFold(uint64_t a, uint64_t b)
+{
+    uint64_t low_low = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    uint64_t high_low = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t low_high = (a & 0xFFFFFFFF) * (b >> 32);
+    uint64_t high_high = (a >> 32) * (b >> 32);
+
+    uint64_t cross = (low_low >> 32) + (high_low & 0xFFFFFFFF) + low_high;
+    uint64_t upper = (high_low >> 32) + (cross >> 32) + high_high;
+    uint64_t lower = (cross << 32) | (low_low & 0xFFFFFFFF);
+
+    return lower ^ upper;
+}
+
+static uint64_t avalanche(uint64_t hash)
+{
+    hash ^= hash >> 37;
+    hash *= 0x165667919E3779F9ULL;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+#ifdef SHOBU_HASH_SSE2
+// Each lane gets the product of the two halves of its input xor its key, plus its neighbour's input
+static void accumulate(__m128i* lanes, const unsigned char* stripe, size_t stripes)
+{
+    const __m128i* keys = reinterpret_cast<const __m128i*>(HASH_KEYS);
+
+    for(size_t s=0; s<stripes; s++, stripe+=HASH_STRIPE) {
+        for(int i=0; i<4; i++) {
+            __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(stripe) + i);
+            __m128i keyed = _mm_xor_si128(data, _mm_load_si128(keys + i));
+            __m128i product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+            lanes[i] = _mm_add_epi64(lanes[i], _mm_add_epi64(product, swapped));
+        }
+    }
+}
+
+static void scramble(__m128i* lanes)
+{
+    const __m128i* keys = reinterpret_cast<const __m128i*>(HASH_KEYS);
+    const __m128i prime = _mm_set1_epi32(static_cast<int>(PRIME32_1));
+
+    for(int i=0; i<4; i++) {
+        __m128i lane = _mm_xor_si128(lanes[i], _mm_srli_epi64(lanes[i], 47));
+        lane = _mm_xor_si128(lane, _mm_load_si128(keys + i));
+
+        // 64 by 32 bit multiply out of two 32 by 32 bit ones
+        __m128i low = _mm_mul_epu32(lane, prime);
+        __m128i high = _mm_mul_epu32(_mm_shuffle_epi32(lane, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+        lanes[i] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+    }
+}
+#else
+static void accumulate(uint64_t* lanes, const unsigned char* stripe, size_t stripes)
+{
+    for(size_t s=0; s<stripes; s++, stripe+=HASH_STRIPE) {
+        uint64_t data[8];
+        memcpy(data, stripe, sizeof(data));
+
+        for(int i=0; i<8; i++) {
+            uint64_t keyed = data[i] ^ HASH_KEYS[i];
+            lanes[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32) + data[i^1];
+        }
+    }
+}
+
+static void scramble(uint64_t* lanes)
+{
+    for(int i=0; i<8; i++) {
+        uint64_t lane = lanes[i] ^ (lanes[i] >> 47);
+        lanes[i] = (lane ^ HASH_KEYS[i]) * PRIME32_1;
+    }
+}
+#endif
+
+uint64_t hash64(const void* data, size_t size, uint64_t seed)
+{
+    const unsigned char* input = static_cast<const unsigned char*>(data);
+
+    alignas(16) uint64_t start[8] = {
+        PRIME32_3 + seed, PRIME64_1 + seed, PRIME64_2 + seed, PRIME64_3 + seed,
+        PRIME64_4 + seed, PRIME32_2 + seed, PRIME64_5 + seed, PRIME32_1 + seed
+    };
+
+#ifdef SHOBU_HASH_SSE2
+    __m128i lanes[4];
+    for(int i=0; i<4; i++) {
+        lanes[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(start) + i);
+    }
+#else
+    uint64_t* lanes = start;
+#endif
+
+    size_t stripes = size / HASH_STRIPE;
+    for(; stripes >= HASH_STRIPES_PER_BLOCK; stripes -= HASH_STRIPES_PER_BLOCK) {
+        accumulate(lanes, input, HASH_STRIPES_PER_BLOCK);
+        scramble(lanes);
+        input += HASH_STRIPES_PER_BLOCK * HASH_STRIPE;
+    }
+    accumulate(lanes, input, stripes);
+    input += stripes * HASH_STRIPE;
+
+    // Whatever doesn't fill a stripe is padded with zeros
+    size_t rest = size % HASH_STRIPE;
+    if(rest > 0) {
+        unsigned char last[HASH_STRIPE];
+        memset(last, 0, sizeof(last));
+        memcpy(last, input, rest);
+        accumulate(lanes, last, 1);
+    }
+
+#ifdef SHOBU_HASH_SSE2
+    uint64_t result[8];
+    for(int i=0; i<4; i++) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(result) + i, lanes[i]);
+    }
+#else
+    const uint64_t* result = lanes;
+#endif
+
+    uint64_t hash = (static_cast<uint64_t>(size) * PRIME64_1) ^ seed;
+    for(int i=0; i<8; i+=2) {
+        hash += multiplyFold(result[i] ^ HASH_KEYS[i], result[i+1] ^ HASH_KEYS[i+1]);
+    }
+
+    return avalanche(hash);
+}
+
+uint64_t hashMix(uint64_t hash, uint64_t value)
+{
+    return avalanche(multiplyFold(hash ^ PRIME64_2, value ^ PRIME64_3) + hash);
+}
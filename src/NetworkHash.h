@@ -0,0 +1,20 @@
+#ifndef SHOBU_NETWORK_HASH_H
+#define SHOBU_NETWORK_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*! 64 bit hash of a block of memory, built like XXH3: 64 bytes at a time into eight lanes, two lanes
+ *  per instruction with SSE2.  Builds with and without SSE2 give the same hash, so peers can compare them.
+ *  Not meant to stand up to anyone crafting collisions, only to tell states apart
+ * \param data the memory
+ * \param size bytes of it
+ * \param seed hash of whatever came before, to hash several blocks as one
+ * \return the hash
+ */
+uint64_t hash64(const void* data, size_t size, uint64_t seed = 0);
+
+// Mix a value into a hash
+uint64_t hashMix(uint64_t hash, uint64_t value);
+
+#endif // SHOBU_NETWORK_HASH_H
@@ -0,0 +1,101 @@
+#ifndef SHOBU_NETWORK_HISTOGRAM_H
+#define SHOBU_NETWORK_HISTOGRAM_H
+
+#include <atomic>
+
+// Buckets each power of two is split into
+const int HISTOGRAM_STEPS = 4;
+
+// Enough buckets for anything up to 2^40 nanoseconds, about 18 minutes
+const int HISTOGRAM_BUCKETS = 40 * HISTOGRAM_STEPS;
+
+/*! Counts latencies in buckets that grow with the latency, so percentiles are within about 20% at any scale.
+ *  Any thread can record while another reads
+ */
+class LatencyHistogram
+{
+    public:
+    LatencyHistogram() { reset(); }
+
+    void record(long long nanoseconds)
+    {
+        m_counts[bucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Add the counts of another histogram
+    void add(const LatencyHistogram& other)
+    {
+        for(int i=0; i<HISTOGRAM_BUCKETS; i++) {
+            m_counts[i].fetch_add(other.m_counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+
+    void reset()
+    {
+        for(int i=0; i<HISTOGRAM_BUCKETS; i++) {
+            m_counts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    long long count() const
+    {
+        long long total = 0;
+        for(int i=0; i<HISTOGRAM_BUCKETS; i++) {
+            total += m_counts[i].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    /*! Latency below which a fraction of the recorded latencies fall
+     * \param fraction like 0.99 for the 99th percentile
+     * \return nanoseconds at the top of the bucket the percentile is in, 0 when nothing was recorded
+     */
+    long long percentile(double fraction) const
+    {
+        long long total = count();
+        if(total == 0) {
+            return 0;
+        }
+
+        long long wanted = static_cast<long long>(fraction * total);
+        long long seen = 0;
+        for(int i=0; i<HISTOGRAM_BUCKETS; i++) {
+            seen += m_counts[i].load(std::memory_order_relaxed);
+            if(seen > wanted) {
+                return upper(i);
+            }
+        }
+
+        return upper(HISTOGRAM_BUCKETS-1);
+    }
+
+    private:
+    static int bucket(long long nanoseconds)
+    {
+        if(nanoseconds < HISTOGRAM_STEPS) {
+            return nanoseconds < 0 ? 0 : static_cast<int>(nanoseconds);
+        }
+
+        // The power of two, then which step of it
+        int power = 63 - __builtin_clzll(static_cast<unsigned long long>(nanoseconds));
+        int step = static_cast<int>((nanoseconds >> (power-2)) & (HISTOGRAM_STEPS-1));
+        int index = (power-1) * HISTOGRAM_STEPS + step;
+
+        return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS-1;
+    }
+
+    static long long upper(int index)
+    {
+        if(index < HISTOGRAM_STEPS) {
+            return index;
+        }
+
+        int power = index / HISTOGRAM_STEPS + 1;
+        int step = index % HISTOGRAM_STEPS;
+        return (1LL << power) + (static_cast<long long>(step+1) << (power-2)) - 1;
+    }
+
+    std::atomic<long long> m_counts[HISTOGRAM_BUCKETS];
+};
+
+#endif // SHOBU_NETWORK_HISTOGRAM_H
@@ -0,0 +1,98 @@
+#ifndef SHOBU_NETWORK_INPUT_H
+#define SHOBU_NETWORK_INPUT_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SHOBU_INPUT_SSE2
+#endif
+
+// Bytes of one player's input for one frame, like -DSHOBU_INPUT_SIZE=16 for analog sticks.
+// It changes the size of ShobuNetwork, so the game has to be built with the same definition as the library
+#ifndef SHOBU_INPUT_SIZE
+#define SHOBU_INPUT_SIZE 4
+#endif
+
+static_assert(SHOBU_INPUT_SIZE >= 4 && SHOBU_INPUT_SIZE <= 64 && SHOBU_INPUT_SIZE % 4 == 0,
+              "SHOBU_INPUT_SIZE must be a multiple of 4 from 4 to 64");
+
+// 32 bit words in an input.  Each is sent as the bits that changed from the input before it
+const int INPUT_WORDS = SHOBU_INPUT_SIZE / 4;
+
+/*! One player's input for one frame.  A plain block of bytes the game lays out however it likes,
+ *  as long as both players agree.  Games with int inputs never see it, their input is the first word
+ */
+struct NetworkInput
+{
+    uint32_t words[INPUT_WORDS];
+
+    static NetworkInput fromInt(int value)
+    {
+        NetworkInput input;
+        memset(&input, 0, sizeof(input));
+        input.words[0] = static_cast<uint32_t>(value);
+        return input;
+    }
+
+    int toInt() const { return static_cast<int>(words[0]); }
+
+    bool operator==(const NetworkInput& other) const;
+    bool operator!=(const NetworkInput& other) const { return !(*this == other); }
+};
+
+static_assert(sizeof(NetworkInput) == SHOBU_INPUT_SIZE, "NetworkInput must have no padding");
+
+inline bool NetworkInput::operator==(const NetworkInput& other) const
+{
+#ifdef SHOBU_INPUT_SSE2
+    // 16 bytes at a time, then whatever is left a word at a time
+    int i = 0;
+    for(; i+4 <= INPUT_WORDS; i+=4) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words+i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(other.words+i));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xFFFF) {
+            return false;
+        }
+    }
+    for(; i<INPUT_WORDS; i++) {
+        if(words[i] != other.words[i]) {
+            return false;
+        }
+    }
+    return true;
+#else
+    return memcmp(words, other.words, sizeof(words)) == 0;
+#endif
+}
+
+/*! Compare two runs of inputs, 16 bytes at a time with SSE2 however wide each input is
+ * \return index of the first input that differs, or count when they're all equal
+ */
+inline int firstDifference(const NetworkInput* a, const NetworkInput* b, int count)
+{
+    const unsigned char* x = reinterpret_cast<const unsigned char*>(a);
+    const unsigned char* y = reinterpret_cast<const unsigned char*>(b);
+    int bytes = count * SHOBU_INPUT_SIZE;
+
+    int i = 0;
+#ifdef SHOBU_INPUT_SSE2
+    for(; i+16 <= bytes; i+=16) {
+        __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x+i));
+        __m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y+i));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(left, right)) != 0xFFFF) {
+            break;
+        }
+    }
+#endif
+    for(; i<bytes; i++) {
+        if(x[i] != y[i]) {
+            return i / SHOBU_INPUT_SIZE;
+        }
+    }
+
+    return count;
+}
+
+#endif // SHOBU_NETWORK_INPUT_H
@@ -16,6 +16,21 @@ NetworkLogger::NetworkLogger()
     m_scrollAmount = 1;
 }
 
+NetworkLogger::NetworkLogger(const char* filename)
+{
+    id = 1;
+
+    end_section = true;
+
+    if(filename) {
+        log_file.open(filename);
+    }
+
+    m_offset = 0;
+
+    m_scrollAmount = 1;
+}
+
 // returns the only Logger instance
 NetworkLogger* NetworkLogger::getInstance()
 {
@@ -29,7 +44,9 @@ NetworkLogger::~NetworkLogger()
 {
     log_file.flush();
     // free instance pointer
-    instance = 0;
+    if(instance == this) {
+        instance = 0;
+    }
 }
 
 
@@ -56,6 +73,9 @@ void NetworkLogger::printMessage(const char c)
         if(event_type == Message) {
             message_lines.push_back(message_string.str());
             message_string.str("");
+            if(message_lines.size() > LOG_MAX_LINES) {
+                message_lines.pop_front();
+            }
             m_offset = message_lines.size();
         }
 
@@ -6,12 +6,17 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+// Messages a logger keeps for getMessageLog, older ones are forgotten
+const unsigned int LOG_MAX_LINES = 1000;
+
 enum LogType { Warning, Error, Debug, Message };
 class NetworkLogger
 {
     public:
-
-
+    /*! Create a logger of its own, like one for each session
+     * \param filename file to write to, or nullptr to only keep messages for getMessageLog
+     */
+    explicit NetworkLogger(const char* filename);
 
 	// Destructor 
     ~NetworkLogger();
@@ -107,6 +112,12 @@ private:
 __LINE__, LogType::Message), \
 *NetworkLogger::getInstance())
 
+// Like LogMessage, but to a logger other than the shared one
+#define LogMessageTo(logger) \
+((logger).setPlace(__FILE__, __FUNCTION__,\
+__LINE__, LogType::Message), \
+(logger))
+
 #define LogNull *NetworkLogNothing::getInstance()
 
 template <typename T>
@@ -0,0 +1,143 @@
+#include "NetworkLoopback.h"
+#include "NetworkLogger.h"
+
+#include <cstring>
+
+LoopbackTransport::LoopbackTransport(std::shared_ptr<Link> link, int side)
+{
+    m_link = link;
+    m_side = side;
+}
+
+LoopbackTransport::~LoopbackTransport()
+{
+    close();
+}
+
+void LoopbackTransport::createPair(std::unique_ptr<LoopbackTransport>& first, std::unique_ptr<LoopbackTransport>& second)
+{
+    std::shared_ptr<Link> link(new Link());
+    for(int i=0; i<2; i++) {
+        link->queues[i].first = 0;
+        link->queues[i].count = 0;
+        link->closed[i] = false;
+    }
+
+    first.reset(new LoopbackTransport(link, 0));
+    second.reset(new LoopbackTransport(link, 1));
+}
+
+void LoopbackTransport::push(char* packet, int size, PacketPool& pool)
+{
+    Queue& queue = m_link->queues[1-m_side];
+
+    // Nobody is listening on the other end
+    if(m_link->closed[m_side] || m_link->closed[1-m_side] || queue.count == LOOPBACK_QUEUE_SIZE) {
+        pool.release(packet);
+        return;
+    }
+
+    Packet& queued = queue.packets[(queue.first+queue.count) % LOOPBACK_QUEUE_SIZE];
+    queued.buffer = packet;
+    queued.size = size;
+    queued.pool = &pool;
+    queue.count++;
+}
+
+void LoopbackTransport::send(char* packet, int size, PacketPool& pool)
+{
+    // The buffer itself is handed over and released by the receiver once handled
+    push(packet, size, pool);
+}
+
+void LoopbackTransport::flush(PacketPool&)
+{
+    // Packets are already waiting in the other end's queue
+}
+
+void LoopbackTransport::sendNow(const char* packet, int size)
+{
+    char* buffer = m_link->spare.acquire();
+    if(!buffer || size > MAX_PACKET_SIZE) {
+        if(buffer) {
+            m_link->spare.release(buffer);
+        }
+        return;
+    }
+
+    memcpy(buffer, packet, size);
+    push(buffer, size, m_link->spare);
+}
+
+bool LoopbackTransport::receive(PacketHandler handler, void* data)
+{
+    Queue& queue = m_link->queues[m_side];
+
+    while(queue.count > 0 && !m_link->closed[m_side]) {
+        Packet packet = queue.packets[queue.first];
+        queue.first = (queue.first+1) % LOOPBACK_QUEUE_SIZE;
+        queue.count--;
+
+        handler(data, packet.buffer, packet.size, 0);
+        packet.pool->release(packet.buffer);
+    }
+
+    return true;
+}
+
+bool LoopbackTransport::wait(int)
+{
+    // Nothing can arrive while this thread blocks, since both ends run on it
+    return m_link->queues[m_side].count > 0;
+}
+
+int LoopbackTransport::receiveOne(char* buffer, int size)
+{
+    Queue& queue = m_link->queues[m_side];
+    if(queue.count == 0 || m_link->closed[m_side]) {
+        return 0;
+    }
+
+    Packet packet = queue.packets[queue.first];
+    queue.first = (queue.first+1) % LOOPBACK_QUEUE_SIZE;
+    queue.count--;
+
+    int length = packet.size < size ? packet.size : size;
+    memcpy(buffer, packet.buffer, length);
+    packet.pool->release(packet.buffer);
+
+    return length;
+}
+
+void LoopbackTransport::replyToSender()
+{
+    // There is only ever one other end
+}
+
+void LoopbackTransport::close()
+{
+    if(m_link->closed[m_side]) {
+        return;
+    }
+    m_link->closed[m_side] = true;
+
+    // Hand every waiting buffer back while both pools still exist
+    drain(m_link->queues[0]);
+    drain(m_link->queues[1]);
+}
+
+void LoopbackTransport::drain(Queue& queue)
+{
+    while(queue.count > 0) {
+        Packet& packet = queue.packets[queue.first];
+        packet.pool->release(packet.buffer);
+
+        queue.first = (queue.first+1) % LOOPBACK_QUEUE_SIZE;
+        queue.count--;
+    }
+}
+
+int LoopbackTransport::getHandle()
+{
+    return -1;
+}
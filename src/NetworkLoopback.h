@@ -0,0 +1,74 @@
+#ifndef SHOBU_NETWORK_LOOPBACK_H
+#define SHOBU_NETWORK_LOOPBACK_H
+
+#include <memory>
+#include "NetworkTransport.h"
+
+// Packets that can be waiting in each direction.  Room for every buffer of both pools
+const int LOOPBACK_QUEUE_SIZE = PACKET_POOL_SIZE*2;
+
+/*! Connects two sessions in the same process without sockets.
+ *  Packets are handed over without being copied and without any system calls,
+ *  so two sessions can be run in lockstep far faster than real time.
+ *  Both ends must be used from the same thread
+ */
+class LoopbackTransport : public NetworkTransport
+{
+    public:
+    ~LoopbackTransport();
+
+    /*! Create two transports connected to each other
+     * \param first set to one end
+     * \param second set to the other end
+     */
+    static void createPair(std::unique_ptr<LoopbackTransport>& first, std::unique_ptr<LoopbackTransport>& second);
+
+    void send(char* packet, int size, PacketPool& pool);
+    void flush(PacketPool& pool);
+    void sendNow(const char* packet, int size);
+    bool receive(PacketHandler handler, void* data);
+    bool wait(int timeout);
+    int receiveOne(char* buffer, int size);
+    void replyToSender();
+    void close();
+    int getHandle();
+
+    private:
+    // A packet waiting to be received.  It's still owned by the sender's pool
+    struct Packet {
+        char* buffer;
+        int size;
+        PacketPool* pool;
+    };
+
+    // Packets going one way
+    struct Queue {
+        Packet packets[LOOPBACK_QUEUE_SIZE];
+        int first;
+        int count;
+    };
+
+    // State shared by both ends
+    struct Link {
+        Queue queues[2];
+        bool closed[2];
+
+        // Buffers for packets sent without a pool
+        PacketPool spare;
+    };
+
+    LoopbackTransport(std::shared_ptr<Link> link, int side);
+
+    // Add a packet to the other end's queue
+    void push(char* packet, int size, PacketPool& pool);
+
+    // Release every packet in a queue back to its pool
+    static void drain(Queue& queue);
+
+    std::shared_ptr<Link> m_link;
+
+    // Index of the queue this end receives from
+    int m_side;
+};
+
+#endif // SHOBU_NETWORK_LOOPBACK_H
@@ -0,0 +1,260 @@
+#include "NetworkPacket.h"
+
+static uint32_t inputMask(int bits)
+{
+    return bits >= 32 ? 0xFFFFFFFFu : ((1u << bits) - 1);
+}
+
+static NetworkInput maskInput(const NetworkInput& input, uint32_t mask)
+{
+    NetworkInput masked;
+    for(int i=0; i<INPUT_WORDS; i++) {
+        masked.words[i] = input.words[i] & mask;
+    }
+    return masked;
+}
+
+PacketWriter::PacketWriter(char* buffer, int capacity)
+{
+    m_buffer = reinterpret_cast<unsigned char*>(buffer);
+    m_capacity = capacity;
+    m_position = 0;
+    m_bit = 0;
+    m_overflow = false;
+}
+
+void PacketWriter::alignByte()
+{
+    if(m_bit > 0) {
+        m_bit = 0;
+        m_position++;
+    }
+}
+
+void PacketWriter::writeByte(unsigned char value)
+{
+    alignByte();
+
+    if(m_position >= m_capacity) {
+        m_overflow = true;
+        return;
+    }
+
+    m_buffer[m_position++] = value;
+}
+
+void PacketWriter::writeVarint(uint32_t value)
+{
+    while(value >= 0x80) {
+        writeByte(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    writeByte(static_cast<unsigned char>(value));
+}
+
+void PacketWriter::writeSignedVarint(int32_t value)
+{
+    uint32_t zigzag = (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+    writeVarint(zigzag);
+}
+
+void PacketWriter::writeBits(uint32_t value, int bits)
+{
+    for(int i=bits-1; i>=0; i--) {
+        if(m_bit == 0) {
+            if(m_position >= m_capacity) {
+                m_overflow = true;
+                return;
+            }
+            m_buffer[m_position] = 0;
+        }
+
+        if((value >> i) & 1) {
+            m_buffer[m_position] |= static_cast<unsigned char>(0x80 >> m_bit);
+        }
+
+        if(++m_bit == 8) {
+            m_bit = 0;
+            m_position++;
+        }
+    }
+}
+
+void PacketWriter::writeGamma(uint32_t value)
+{
+    int length = 0;
+    while((value >> (length+1)) != 0) {
+        length++;
+    }
+
+    writeBits(0, length);
+    writeBits(value, length+1);
+}
+
+void PacketWriter::writeInputs(const NetworkInput* inputs, int count, int bits)
+{
+    uint32_t mask = inputMask(bits);
+    NetworkInput previous = NetworkInput::fromInt(0);
+
+    int i = 0;
+    while(i < count) {
+        NetworkInput value = maskInput(inputs[i], mask);
+
+        int run = 1;
+        while(i+run < count && maskInput(inputs[i+run], mask) == value) {
+            run++;
+        }
+
+        writeGamma(run);
+
+        if(INPUT_WORDS == 1) {
+            writeBits(value.words[0] ^ previous.words[0], bits);
+        } else {
+            uint32_t changed = 0;
+            for(int word=0; word<INPUT_WORDS; word++) {
+                if(value.words[word] != previous.words[word]) {
+                    changed |= 1u << word;
+                }
+            }
+
+            writeBits(changed, INPUT_WORDS);
+            for(int word=0; word<INPUT_WORDS; word++) {
+                if(changed & (1u << word)) {
+                    writeBits(value.words[word] ^ previous.words[word], bits);
+                }
+            }
+        }
+
+        previous = value;
+        i += run;
+    }
+}
+
+int PacketWriter::size() const
+{
+    return m_bit > 0 ? m_position+1 : m_position;
+}
+
+PacketReader::PacketReader(const char* buffer, int size)
+{
+    m_buffer = reinterpret_cast<const unsigned char*>(buffer);
+    m_size = size;
+    m_position = 0;
+    m_bit = 0;
+    m_error = false;
+}
+
+void PacketReader::alignByte()
+{
+    if(m_bit > 0) {
+        m_bit = 0;
+        m_position++;
+    }
+}
+
+unsigned char PacketReader::readByte()
+{
+    alignByte();
+
+    if(m_position >= m_size) {
+        m_error = true;
+        return 0;
+    }
+
+    return m_buffer[m_position++];
+}
+
+uint32_t PacketReader::readVarint()
+{
+    uint32_t value = 0;
+    for(int shift=0; shift<35; shift+=7) {
+        unsigned char byte = readByte();
+        value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+
+        if(!(byte & 0x80)) {
+            return value;
+        }
+    }
+
+    // More than 5 bytes can't be a 32 bit value
+    m_error = true;
+    return 0;
+}
+
+int32_t PacketReader::readSignedVarint()
+{
+    uint32_t zigzag = readVarint();
+    return static_cast<int32_t>((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+}
+
+uint32_t PacketReader::readBits(int bits)
+{
+    uint32_t value = 0;
+    for(int i=0; i<bits; i++) {
+        if(m_position >= m_size) {
+            m_error = true;
+            return 0;
+        }
+
+        value = (value << 1) | ((m_buffer[m_position] >> (7-m_bit)) & 1);
+
+        if(++m_bit == 8) {
+            m_bit = 0;
+            m_position++;
+        }
+    }
+
+    return value;
+}
+
+uint32_t PacketReader::readGamma()
+{
+    int length = 0;
+    while(!m_error && readBits(1) == 0) {
+        if(++length > 31) {
+            m_error = true;
+            return 0;
+        }
+    }
+
+    if(m_error) {
+        return 0;
+    }
+
+    return (1u << length) | readBits(length);
+}
+
+bool PacketReader::readInputs(NetworkInput* inputs, int count, int bits)
+{
+    uint32_t mask = inputMask(bits);
+    NetworkInput previous = NetworkInput::fromInt(0);
+
+    int total = 0;
+    while(total < count) {
+        uint32_t run = readGamma();
+        if(m_error || run == 0 || run > static_cast<uint32_t>(count-total)) {
+            m_error = true;
+            return false;
+        }
+
+        NetworkInput value = previous;
+        if(INPUT_WORDS == 1) {
+            value.words[0] = (readBits(bits) ^ previous.words[0]) & mask;
+        } else {
+            uint32_t changed = readBits(INPUT_WORDS);
+            for(int word=0; word<INPUT_WORDS; word++) {
+                if(changed & (1u << word)) {
+                    value.words[word] = (readBits(bits) ^ previous.words[word]) & mask;
+                }
+            }
+        }
+
+        for(uint32_t i=0; i<run; i++) {
+            inputs[total++] = value;
+        }
+
+        previous = value;
+    }
+
+    return !m_error;
+}
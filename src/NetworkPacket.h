@@ -0,0 +1,100 @@
+#ifndef SHOBU_NETWORK_PACKET_H
+#define SHOBU_NETWORK_PACKET_H
+
+#include <cstdint>
+#include "NetworkInput.h"
+
+// Version of the compact wire format used by input packets
+const unsigned char PACKET_VERSION = 5;
+
+// Largest datagram the library will send or accept
+const int MAX_PACKET_SIZE = 256;
+
+// Size of the fixed 'f' packet header: type, client and version bytes
+const int PACKET_HEADER_SIZE = 3;
+
+/*! Serializes values into a packet buffer.
+ *  Bytes and bit fields may be interleaved; any partially written byte is
+ *  padded with zeros before the next byte aligned value is written.
+ */
+class PacketWriter
+{
+    public:
+    PacketWriter(char* buffer, int capacity);
+
+    void writeByte(unsigned char value);
+
+    // Writes an unsigned integer using 7 bits per byte
+    void writeVarint(uint32_t value);
+
+    // Writes a signed integer zig-zag encoded so small negative values stay small
+    void writeSignedVarint(int32_t value);
+
+    // Writes the lowest 'bits' bits of value, most significant bit first
+    void writeBits(uint32_t value, int bits);
+
+    /*! Writes a run of inputs.  Equal consecutive inputs are collapsed into a single
+     *  run and each run is stored as the xor with the previous run's value.
+     *  Wide inputs also say which words changed in each run, so only those are written
+     * \param inputs the inputs to encode
+     * \param count total inputs
+     * \param bits number of significant bits in each word
+     */
+    void writeInputs(const NetworkInput* inputs, int count, int bits);
+
+    // Total bytes written, including any partially filled byte
+    int size() const;
+
+    // True when a write went past the end of the buffer
+    bool overflow() const { return m_overflow; }
+
+    private:
+    // Writes an integer >= 1 using Elias gamma coding
+    void writeGamma(uint32_t value);
+
+    void alignByte();
+
+    unsigned char* m_buffer;
+    int m_capacity;
+    int m_position;
+    int m_bit;
+    bool m_overflow;
+};
+
+/*! Reads values written by a PacketWriter.
+ *  Reading past the end of the packet sets the error flag and returns zeros.
+ */
+class PacketReader
+{
+    public:
+    PacketReader(const char* buffer, int size);
+
+    unsigned char readByte();
+    uint32_t readVarint();
+    int32_t readSignedVarint();
+    uint32_t readBits(int bits);
+
+    /*! Reads a run of inputs written by PacketWriter::writeInputs
+     * \return false when the packet is malformed
+     */
+    bool readInputs(NetworkInput* inputs, int count, int bits);
+
+    // True when the packet was too short or malformed
+    bool error() const { return m_error; }
+
+    // Total bytes read, including any partially read byte
+    int position() const { return m_bit > 0 ? m_position+1 : m_position; }
+
+    private:
+    uint32_t readGamma();
+
+    void alignByte();
+
+    const unsigned char* m_buffer;
+    int m_size;
+    int m_position;
+    int m_bit;
+    bool m_error;
+};
+
+#endif // SHOBU_NETWORK_PACKET_H
@@ -0,0 +1,112 @@
+#include "NetworkPacketPool.h"
+
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/uio.h>
+#include <time.h>
+
+long long packetReceiveTime(struct msghdr* msg)
+{
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec time;
+            memcpy(&time, CMSG_DATA(cmsg), sizeof(time));
+            return time.tv_sec*1000000000LL + time.tv_nsec;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+PacketPool::PacketPool()
+{
+    for(int i=0; i<PACKET_POOL_SIZE; i++) {
+        m_free[i] = PACKET_POOL_SIZE-1-i;
+    }
+    m_free_count = PACKET_POOL_SIZE;
+}
+
+char* PacketPool::acquire()
+{
+    if(m_free_count == 0) {
+        return nullptr;
+    }
+
+    return m_buffers[m_free[--m_free_count]];
+}
+
+void PacketPool::release(char* buffer)
+{
+    int index = static_cast<int>((buffer - m_buffers[0]) / MAX_PACKET_SIZE);
+    if(index < 0 || index >= PACKET_POOL_SIZE || m_free_count == PACKET_POOL_SIZE) {
+        return;
+    }
+
+    m_free[m_free_count++] = index;
+}
+
+PacketBatch::PacketBatch()
+{
+    m_count = 0;
+}
+
+bool PacketBatch::add(char* buffer, int size)
+{
+    if(m_count == MAX_PACKET_BATCH) {
+        return false;
+    }
+
+    m_buffers[m_count] = buffer;
+    m_sizes[m_count] = size;
+    m_count++;
+
+    return true;
+}
+
+int PacketBatch::flush(int socket, const struct sockaddr_in& address, PacketPool& pool)
+{
+    int sent = 0;
+
+#ifdef __linux__
+    struct mmsghdr messages[MAX_PACKET_BATCH];
+    struct iovec iovecs[MAX_PACKET_BATCH];
+
+    for(int i=0; i<m_count; i++) {
+        iovecs[i].iov_base = m_buffers[i];
+        iovecs[i].iov_len = m_sizes[i];
+
+        messages[i].msg_hdr.msg_name = const_cast<struct sockaddr_in*>(&address);
+        messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_control = nullptr;
+        messages[i].msg_hdr.msg_controllen = 0;
+        messages[i].msg_hdr.msg_flags = 0;
+    }
+
+    // sendmmsg can send fewer packets than asked, so keep going until it fails
+    while(sent < m_count) {
+        int result = sendmmsg(socket, &messages[sent], m_count-sent, 0);
+        if(result <= 0) {
+            break;
+        }
+        sent += result;
+    }
+#else
+    for(int i=0; i<m_count; i++) {
+        if(sendto(socket, m_buffers[i], m_sizes[i], 0, (const struct sockaddr*)&address,
+                  sizeof(struct sockaddr)) >= 0) {
+            sent++;
+        }
+    }
+#endif
+
+    for(int i=0; i<m_count; i++) {
+        pool.release(m_buffers[i]);
+    }
+    m_count = 0;
+
+    return sent;
+}
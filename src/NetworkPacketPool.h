@@ -0,0 +1,86 @@
+#ifndef SHOBU_NETWORK_PACKET_POOL_H
+#define SHOBU_NETWORK_PACKET_POOL_H
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include "NetworkPacket.h"
+
+#ifdef __linux__
+// Room for the kernel time stamp of a received packet
+const int RECEIVE_CONTROL_SIZE = CMSG_SPACE(sizeof(struct timespec));
+
+/*! Find the time the kernel received a packet on a socket with SO_TIMESTAMPNS set
+ * \param msg the message the packet was received with
+ * \return nanoseconds since the epoch, or 0 when the packet has no time stamp
+ */
+long long packetReceiveTime(struct msghdr* msg);
+#endif
+
+// Total packet buffers owned by each session
+const int PACKET_POOL_SIZE = 128;
+
+// Most packets sent with a single system call
+const int MAX_PACKET_BATCH = 32;
+
+/*! Fixed set of packet buffers that are reused instead of allocated for every packet
+ */
+class PacketPool
+{
+    public:
+    PacketPool();
+
+    /*! Take a buffer out of the pool
+     * \return a buffer of MAX_PACKET_SIZE bytes, or nullptr when every buffer is in use
+     */
+    char* acquire();
+
+    // Return a buffer taken with acquire
+    void release(char* buffer);
+
+    // Buffers that are not in use
+    int available() { return m_free_count; }
+
+    private:
+    char m_buffers[PACKET_POOL_SIZE][MAX_PACKET_SIZE];
+
+    // Stack of free buffer indices
+    int m_free[PACKET_POOL_SIZE];
+    int m_free_count;
+};
+
+/*! Packets queued during an update and sent together
+ */
+class PacketBatch
+{
+    public:
+    PacketBatch();
+
+    /*! Queue a packet for sending
+     * \param buffer a buffer from the pool. It is released back to the pool once sent
+     * \param size length of the packet
+     * \return false when the batch is full
+     */
+    bool add(char* buffer, int size);
+
+    /*! Send every queued packet with as few system calls as possible
+     * \param socket the socket to send on
+     * \param address where to send the packets
+     * \param pool the pool the queued buffers are released to
+     * \return number of packets sent
+     */
+    int flush(int socket, const struct sockaddr_in& address, PacketPool& pool);
+
+    int size() { return m_count; }
+
+    private:
+    char* m_buffers[MAX_PACKET_BATCH];
+    int m_sizes[MAX_PACKET_BATCH];
+    int m_count;
+};
+
+#endif // SHOBU_NETWORK_PACKET_POOL_H
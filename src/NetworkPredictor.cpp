@@ -0,0 +1,181 @@
+#include "NetworkPredictor.h"
+
+// Weight of the newest hold in each button's average
+const float HOLD_WEIGHT = 0.25f;
+
+// Counts are halved when one reaches this, so old habits fade
+const unsigned int MARKOV_MAX_COUNT = 255;
+
+void RepeatPredictor::reset()
+{
+    m_last = NetworkInput::fromInt(0);
+}
+
+void RepeatPredictor::observe(int, const NetworkInput& input)
+{
+    m_last = input;
+}
+
+HoldPredictor::HoldPredictor()
+{
+    // Int inputs are usually a bit for each button, wider ones usually hold analog values too
+    m_buttons = NetworkInput::fromInt(INPUT_WORDS == 1 ? -1 : 0);
+
+    reset();
+}
+
+void HoldPredictor::reset()
+{
+    m_last = NetworkInput::fromInt(0);
+    m_last_frame = -1;
+
+    for(int i=0; i<BUTTONS; i++) {
+        m_changed[i] = 0;
+        m_held[i] = 0;
+        m_released[i] = 0;
+    }
+}
+
+void HoldPredictor::observe(int frame, const NetworkInput& input)
+{
+    for(int word=0; word<INPUT_WORDS; word++) {
+        uint32_t changed = (input.words[word] ^ m_last.words[word]) & m_buttons.words[word];
+
+        for(int bit=0; changed; bit++, changed >>= 1) {
+            if(!(changed & 1)) {
+                continue;
+            }
+
+            // The button was held or released until now
+            int button = word*32 + bit;
+            float length = static_cast<float>(frame - m_changed[button]);
+            float& average = (m_last.words[word] >> bit) & 1 ? m_held[button] : m_released[button];
+            average = average > 0 ? average*(1.0f-HOLD_WEIGHT) + length*HOLD_WEIGHT : length;
+
+            m_changed[button] = frame;
+        }
+    }
+
+    m_last = input;
+    m_last_frame = frame;
+}
+
+NetworkInput HoldPredictor::predict(int frame)
+{
+    NetworkInput guess = m_last;
+
+    for(int button=0; button<BUTTONS; button++) {
+        int word = button / 32;
+        int bit = button % 32;
+        if(!((m_buttons.words[word] >> bit) & 1)) {
+            continue;
+        }
+
+        float average = (m_last.words[word] >> bit) & 1 ? m_held[button] : m_released[button];
+        if(average > 0 && frame - m_changed[button] >= average - 0.5f) {
+            guess.words[word] ^= 1u << bit;
+        }
+    }
+
+    return guess;
+}
+
+MarkovPredictor::MarkovPredictor() : m_table(CONTEXTS * SUCCESSORS)
+{
+    reset();
+}
+
+void MarkovPredictor::reset()
+{
+    for(unsigned int i=0; i<m_table.size(); i++) {
+        m_table[i].input = NetworkInput::fromInt(0);
+        m_table[i].count = 0;
+    }
+
+    m_last = NetworkInput::fromInt(0);
+    m_last_frame = -1;
+    m_held = 1;
+}
+
+int MarkovPredictor::context(const NetworkInput& input, int held)
+{
+    uint32_t hash = 2166136261u;
+    for(int i=0; i<INPUT_WORDS; i++) {
+        hash = (hash ^ input.words[i]) * 16777619u;
+    }
+    hash = (hash ^ static_cast<uint32_t>(held)) * 16777619u;
+
+    return static_cast<int>((hash ^ (hash >> 16)) & (CONTEXTS-1)) * SUCCESSORS;
+}
+
+void MarkovPredictor::observe(int frame, const NetworkInput& input)
+{
+    if(m_last_frame >= 0) {
+        Successor* successors = &m_table[context(m_last, m_held)];
+
+        // Count the input, or make room for it in place of the least common one
+        int found = -1;
+        int rarest = 0;
+        for(int i=0; i<SUCCESSORS; i++) {
+            if(successors[i].count > 0 && successors[i].input == input) {
+                found = i;
+                break;
+            }
+            if(successors[i].count < successors[rarest].count) {
+                rarest = i;
+            }
+        }
+
+        if(found < 0) {
+            successors[rarest].input = input;
+            successors[rarest].count = 1;
+        } else if(++successors[found].count >= MARKOV_MAX_COUNT) {
+            for(int i=0; i<SUCCESSORS; i++) {
+                successors[i].count /= 2;
+            }
+        }
+    }
+
+    if(input == m_last && m_last_frame >= 0) {
+        m_held = m_held < MAX_HELD ? m_held+1 : MAX_HELD;
+    } else {
+        m_held = 1;
+    }
+
+    m_last = input;
+    m_last_frame = frame;
+}
+
+const NetworkInput& MarkovPredictor::next(const NetworkInput& input, int held)
+{
+    const Successor* successors = &m_table[context(input, held)];
+
+    int best = -1;
+    unsigned int best_count = 0;
+    for(int i=0; i<SUCCESSORS; i++) {
+        if(successors[i].count > best_count) {
+            best = i;
+            best_count = successors[i].count;
+        }
+    }
+
+    return best < 0 ? input : successors[best].input;
+}
+
+NetworkInput MarkovPredictor::predict(int frame)
+{
+    // Follow the most common path one frame at a time
+    NetworkInput guess = m_last;
+    int held = m_held;
+    for(int i=m_last_frame+1; i<=frame; i++) {
+        NetworkInput following = next(guess, held);
+        if(following == guess) {
+            held = held < MAX_HELD ? held+1 : MAX_HELD;
+        } else {
+            guess = following;
+            held = 1;
+        }
+    }
+
+    return guess;
+}
@@ -0,0 +1,141 @@
+#ifndef SHOBU_NETWORK_PREDICTOR_H
+#define SHOBU_NETWORK_PREDICTOR_H
+
+#include <vector>
+#include "NetworkInput.h"
+
+// Built in ways of guessing the remote player's input for frames it hasn't arrived for yet
+enum PredictionStrategy
+{
+    // The last input received, held
+    PREDICT_REPEAT,
+
+    // Each button held or released for as long as that button usually is
+    PREDICT_HOLD,
+
+    // Whatever the remote player most often did next after holding the same input as long
+    PREDICT_MARKOV,
+
+    PREDICTION_STRATEGIES
+};
+
+struct PredictionStats
+{
+    // Frames run with a predicted input, and how many of those predictions were wrong
+    long long predicted;
+    long long wrong;
+};
+
+/*! Guesses the remote player's input for frames that run before it arrives.
+ *  Every right guess is a frame that doesn't have to be run again, so a game can use its own knowledge of how it's played.
+ *  Only called from the thread updating the session
+ */
+class InputPredictor
+{
+    public:
+    virtual ~InputPredictor() {}
+
+    // Forget everything learned, at the start of a match
+    virtual void reset() = 0;
+
+    /*! Learn from the remote player's input, which arrives for every frame in order
+     * \param frame frame the input is for
+     * \param input the input
+     */
+    virtual void observe(int frame, const NetworkInput& input) = 0;
+
+    /*! Guess the input of a frame after the last one observed
+     * \param frame frame to guess the input of
+     * \return the guess
+     */
+    virtual NetworkInput predict(int frame) = 0;
+};
+
+// Predicts the last input received
+class RepeatPredictor : public InputPredictor
+{
+    public:
+    RepeatPredictor() { reset(); }
+
+    void reset();
+    void observe(int frame, const NetworkInput& input);
+    NetworkInput predict(int) { return m_last; }
+
+    private:
+    NetworkInput m_last;
+};
+
+/*! Treats the bits of the input that are buttons as such and learns how long each one is usually held and left released.
+ *  A button is predicted to let go once it's been held longer than usual, and the same for pressing it again.
+ *  Every other bit, like those of analog sticks, is predicted to stay as it was
+ */
+class HoldPredictor : public InputPredictor
+{
+    public:
+    HoldPredictor();
+
+    /*! Set which bits of the input are buttons.  Every bit of int inputs is by default, and none of wider inputs
+     * \param buttons set bits are buttons
+     */
+    void setButtons(const NetworkInput& buttons) { m_buttons = buttons; }
+
+    void reset();
+    void observe(int frame, const NetworkInput& input);
+    NetworkInput predict(int frame);
+
+    private:
+    static const int BUTTONS = INPUT_WORDS * 32;
+
+    NetworkInput m_buttons;
+    NetworkInput m_last;
+    int m_last_frame;
+
+    // Frame each button last changed on
+    int m_changed[BUTTONS];
+
+    // Average frames each button is held and released for, 0 until it's been seen
+    float m_held[BUTTONS];
+    float m_released[BUTTONS];
+};
+
+/*! Counts what the remote player does next after holding each input for a number of frames, and predicts the most common.
+ *  Picks up on habits like always letting go of a button after a few frames, or following one move with another
+ */
+class MarkovPredictor : public InputPredictor
+{
+    public:
+    MarkovPredictor();
+
+    void reset();
+    void observe(int frame, const NetworkInput& input);
+    NetworkInput predict(int frame);
+
+    private:
+    // Inputs that followed one context and how often
+    struct Successor {
+        NetworkInput input;
+        unsigned int count;
+    };
+
+    static const int CONTEXTS = 1024;
+    static const int SUCCESSORS = 4;
+
+    // Frames held beyond this count the same
+    static const int MAX_HELD = 15;
+
+    // Position in the table of an input held for some frames
+    static int context(const NetworkInput& input, int held);
+
+    // Most common input after this one held this long, or the same input when nothing was learned
+    const NetworkInput& next(const NetworkInput& input, int held);
+
+    std::vector<Successor> m_table;
+
+    NetworkInput m_last;
+    int m_last_frame;
+
+    // Frames the last input has been held for
+    int m_held;
+};
+
+#endif // SHOBU_NETWORK_PREDICTOR_H
@@ -0,0 +1,264 @@
+#include "NetworkReactor.h"
+#include "Network.h"
+#include "NetworkLogger.h"
+
+#include <vector>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Most socket events handled per wake up
+const int MAX_REACTOR_EVENTS = 64;
+
+NetworkReactor::NetworkReactor()
+{
+    m_running = false;
+
+    m_cpu = -1;
+    m_spin_budget = 0;
+    m_realtime_priority = 0;
+
+#ifdef __linux__
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    m_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    // The wake up event is the only one registered without a session
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &event);
+#endif
+}
+
+NetworkReactor::~NetworkReactor()
+{
+    stop();
+
+#ifdef __linux__
+    close(m_wake);
+    close(m_epoll);
+#endif
+}
+
+bool NetworkReactor::start()
+{
+    if(m_running) {
+        return true;
+    }
+
+#ifdef __linux__
+    if(m_epoll < 0 || m_wake < 0) {
+        LogNull << "Could not create epoll instance" << endline;
+        return false;
+    }
+#endif
+
+    m_running = true;
+    m_thread = std::thread(&NetworkReactor::run, this);
+
+    return true;
+}
+
+void NetworkReactor::stop()
+{
+    if(!m_thread.joinable()) {
+        return;
+    }
+
+    m_running = false;
+
+#ifdef __linux__
+    uint64_t value = 1;
+    if(write(m_wake, &value, sizeof(value)) < 0) {
+        LogNull << "Could not wake the reactor thread" << endline;
+    }
+#endif
+
+    // A session may stop its own reactor from a packet handler
+    if(std::this_thread::get_id() == m_thread.get_id()) {
+        m_thread.detach();
+    } else {
+        m_thread.join();
+    }
+}
+
+bool NetworkReactor::add(ShobuNetwork* network)
+{
+    std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+    if(std::this_thread::get_id() != m_thread.get_id()) {
+        lock.lock();
+    }
+
+#ifdef __linux__
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = network;
+    if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, network->getReceiveHandle(), &event) < 0) {
+        LogNull << "Could not add socket to epoll: " << strerror(errno) << endline;
+        return false;
+    }
+
+    // Let the kernel spin on the network device instead of waiting for an interrupt
+    if(m_spin_budget > 0 && network->getSocket() >= 0) {
+        int busy_poll = m_spin_budget;
+        if(setsockopt(network->getSocket(), SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) < 0) {
+            LogNull << "Could not set SO_BUSY_POLL: " << strerror(errno) << endline;
+        }
+    }
+#endif
+
+    m_sessions.insert(network);
+    return true;
+}
+
+void NetworkReactor::remove(ShobuNetwork* network)
+{
+    // Packets are handed out while holding the lock, so this waits for any in progress.
+    // The reactor thread already holds it when a session removes itself from a packet handler
+    std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+    if(std::this_thread::get_id() != m_thread.get_id()) {
+        lock.lock();
+    }
+
+    if(m_sessions.erase(network) == 0) {
+        return;
+    }
+
+#ifdef __linux__
+    epoll_ctl(m_epoll, EPOLL_CTL_DEL, network->getReceiveHandle(), nullptr);
+#endif
+}
+
+void NetworkReactor::applyThreadSettings()
+{
+#ifdef __linux__
+    if(m_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(m_cpu, &cpus);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if(error != 0) {
+            LogNull << "Could not pin reactor thread to cpu " << m_cpu << ": " << strerror(error) << endline;
+        }
+    }
+
+    if(m_realtime_priority > 0) {
+        struct sched_param param;
+        param.sched_priority = m_realtime_priority;
+        int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if(error != 0) {
+            LogNull << "Could not set real time priority: " << strerror(error) << endline;
+        }
+    }
+#else
+    if(m_cpu >= 0 || m_realtime_priority > 0) {
+        LogNull << "Reactor thread settings are only supported on Linux" << endline;
+    }
+#endif
+}
+
+void NetworkReactor::run()
+{
+    applyThreadSettings();
+
+#ifdef __linux__
+    struct epoll_event events[MAX_REACTOR_EVENTS];
+
+    // Poll without sleeping until the spin budget has passed since the last packet
+    std::chrono::steady_clock::time_point spin_end = std::chrono::steady_clock::now();
+
+    while(m_running) {
+        int timeout = -1;
+        if(m_spin_budget > 0 && std::chrono::steady_clock::now() < spin_end) {
+            timeout = 0;
+        }
+
+        int count = epoll_wait(m_epoll, events, MAX_REACTOR_EVENTS, timeout);
+        if(count < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            LogNull << "epoll error: " << strerror(errno) << endline;
+            break;
+        }
+
+        if(count == 0) {
+            continue;
+        }
+
+        if(m_spin_budget > 0) {
+            spin_end = std::chrono::steady_clock::now() + std::chrono::microseconds(m_spin_budget);
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for(int i=0; i<count; i++) {
+            ShobuNetwork* network = static_cast<ShobuNetwork*>(events[i].data.ptr);
+
+            // Woken up to stop
+            if(!network) {
+                uint64_t value;
+                if(read(m_wake, &value, sizeof(value)) < 0) {
+                    LogNull << "Could not read wake up event" << endline;
+                }
+                continue;
+            }
+
+            // The session may have been removed by an earlier event
+            if(m_sessions.count(network) == 0) {
+                continue;
+            }
+
+            network->receivePackets();
+        }
+    }
+#else
+    std::vector<ShobuNetwork*> sessions;
+
+    while(m_running) {
+        fd_set fds;
+        FD_ZERO(&fds);
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            sessions.assign(m_sessions.begin(), m_sessions.end());
+        }
+
+        if(sessions.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+
+        int max_socket = 0;
+        for(unsigned int i=0; i<sessions.size(); i++) {
+            FD_SET(sessions[i]->getReceiveHandle(), &fds);
+            if(sessions[i]->getReceiveHandle() > max_socket) {
+                max_socket = sessions[i]->getReceiveHandle();
+            }
+        }
+
+        // Without a way to wake select up, check for stopping every 10ms
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 10000;
+        if(select(max_socket+1, &fds, NULL, NULL, &timeout) <= 0) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for(unsigned int i=0; i<sessions.size(); i++) {
+            if(m_sessions.count(sessions[i]) && FD_ISSET(sessions[i]->getReceiveHandle(), &fds)) {
+                sessions[i]->receivePackets();
+            }
+        }
+    }
+#endif
+}
@@ -0,0 +1,88 @@
+#ifndef SHOBU_NETWORK_REACTOR_H
+#define SHOBU_NETWORK_REACTOR_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+class ShobuNetwork;
+
+/*! Waits on the sockets of any number of sessions from a single thread and
+ *  hands every received packet to its session as soon as it arrives.
+ *  Uses epoll on Linux and select everywhere else.
+ */
+class NetworkReactor
+{
+    public:
+    NetworkReactor();
+
+    // Stops the thread if it's still running
+    ~NetworkReactor();
+
+    /*! Start the thread which waits for packets
+     * \return false on failure, true on success
+     */
+    bool start();
+
+    // Stop and join the thread.  Sessions stay registered until removed
+    void stop();
+
+    bool running() { return m_running; }
+
+    /*! Pin the thread to a single core.  Must be called before start
+     * \param cpu index of the core, or -1 to let the scheduler choose
+     */
+    void setCpu(int cpu) { m_cpu = cpu; }
+
+    /*! Keep polling for packets instead of sleeping for a while after each one arrives.
+     *  Also used as the SO_BUSY_POLL time of the sessions' sockets.  Linux only.  Must be called before start
+     * \param microseconds how long to spin, 0 to always sleep until a packet arrives
+     */
+    void setSpinBudget(int microseconds) { m_spin_budget = microseconds; }
+
+    /*! Run the thread with real time scheduling.  Usually needs root or CAP_SYS_NICE.  Must be called before start
+     * \param priority SCHED_FIFO priority from 1 to 99, or 0 for normal scheduling
+     */
+    void setRealtimePriority(int priority) { m_realtime_priority = priority; }
+
+    /*! Start handing the session's packets to it
+     * \return false on failure, true on success
+     */
+    bool add(ShobuNetwork* network);
+
+    /*! Stop handing packets to the session.
+     *  Once this returns the session is never called from the reactor thread again
+     */
+    void remove(ShobuNetwork* network);
+
+    private:
+    // Thread which waits for packets
+    void run();
+
+    // Apply the core and scheduling settings to the calling thread
+    void applyThreadSettings();
+
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+
+    // Held while handing packets to sessions so they can be removed safely
+    std::mutex m_mutex;
+
+    // Sessions that are currently registered
+    std::unordered_set<ShobuNetwork*> m_sessions;
+
+    // Low latency settings
+    int m_cpu;
+    int m_spin_budget;
+    int m_realtime_priority;
+
+#ifdef __linux__
+    int m_epoll;
+
+    // Wakes the thread up when stopping
+    int m_wake;
+#endif
+};
+
+#endif // SHOBU_NETWORK_REACTOR_H
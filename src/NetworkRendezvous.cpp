@@ -0,0 +1,520 @@
+#include "NetworkRendezvous.h"
+#include "NetworkUdp.h"
+#include "NetworkPacket.h"
+#include "NetworkPacketPool.h"
+#include "NetworkLogger.h"
+
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <random>
+
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+// How long the thread blocks on the socket before checking whether it should stop
+static const int RENDEZVOUS_POLL_MS = 100;
+
+// Milliseconds between looking for players and matches to forget
+static const int RENDEZVOUS_EXPIRE_MS = 1000;
+
+static long long steadyMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Same clock as the kernel's packet time stamps
+static long long wallNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static bool sameAddress(const struct sockaddr_in& a, const struct sockaddr_in& b)
+{
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+RendezvousServer::RendezvousServer() : m_running(false)
+{
+    m_socket = -1;
+    m_seed = 0;
+    m_last_expire = 0;
+
+    m_waiting_count = 0;
+    m_matches = 0;
+    m_relays = 0;
+    m_relayed_packets = 0;
+    m_relayed_bytes = 0;
+    m_unknown_packets = 0;
+    m_forward_time = 0;
+    m_max_forward_time = 0;
+}
+
+RendezvousServer::~RendezvousServer()
+{
+    stop();
+}
+
+bool RendezvousServer::start(int port)
+{
+    if(m_running) {
+        return false;
+    }
+
+#ifdef WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(1, 1), &wsaData) != 0) {
+        LogNull << "Could not initialize Winsock" << endline;
+    }
+#endif
+
+    m_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(m_socket < 0) {
+        LogMessage << "Could not create rendezvous socket" << endline;
+        return false;
+    }
+
+    struct sockaddr_in host_address;
+    memset(&host_address, 0, sizeof(host_address));
+    host_address.sin_family = PF_INET;
+    host_address.sin_addr.s_addr = htonl(INADDR_ANY);
+    host_address.sin_port = htons(port);
+
+    if(bind(m_socket, (struct sockaddr*)&host_address, sizeof(host_address)) < 0) {
+        LogMessage << "Could not bind rendezvous socket to port " << port << endline;
+#ifdef WIN32
+        closesocket(m_socket);
+#else
+        ::close(m_socket);
+#endif
+        m_socket = -1;
+        return false;
+    }
+
+    // Tokens only have to be hard to guess, not secret
+    std::random_device random;
+    m_seed = random() | 1;
+
+    m_running = true;
+    m_thread = std::thread(&RendezvousServer::run, this);
+
+    LogMessage << "Rendezvous server listening on port " << port << endline;
+    return true;
+}
+
+void RendezvousServer::stop()
+{
+    if(!m_running) {
+        return;
+    }
+
+    m_running = false;
+    m_thread.join();
+
+#ifdef WIN32
+    closesocket(m_socket);
+    WSACleanup();
+#else
+    ::close(m_socket);
+#endif
+    m_socket = -1;
+
+    m_waiting.clear();
+    m_pairs.clear();
+    m_matched.clear();
+    m_routes.clear();
+    m_waiting_count = 0;
+    m_relays = 0;
+}
+
+void RendezvousServer::getStats(RendezvousStats& stats)
+{
+    stats.waiting = m_waiting_count;
+    stats.matches = m_matches;
+    stats.relays = m_relays;
+    stats.relayed_packets = m_relayed_packets;
+    stats.relayed_bytes = m_relayed_bytes;
+    stats.unknown_packets = m_unknown_packets;
+    stats.forward_time = m_forward_time;
+    stats.max_forward_time = m_max_forward_time;
+}
+
+unsigned long long RendezvousServer::addressKey(const struct sockaddr_in& address)
+{
+    return (static_cast<unsigned long long>(address.sin_addr.s_addr) << 16) | address.sin_port;
+}
+
+void RendezvousServer::run()
+{
+#ifdef __linux__
+    // Wake up every so often to check whether we should stop
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = RENDEZVOUS_POLL_MS * 1000;
+    setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Time stamp packets so the time spent relaying them includes waiting in the socket
+    int timestamps = 1;
+    setsockopt(m_socket, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(timestamps));
+
+    char buffers[RECEIVE_BATCH][MAX_PACKET_SIZE];
+    char control[RECEIVE_BATCH][RECEIVE_CONTROL_SIZE];
+    struct sockaddr_in addresses[RECEIVE_BATCH];
+    struct mmsghdr messages[RECEIVE_BATCH];
+    struct iovec iovecs[RECEIVE_BATCH];
+
+    // Relayed packets go out straight from the receive buffers
+    struct sockaddr_in destinations[RECEIVE_BATCH];
+    struct mmsghdr forwards[RECEIVE_BATCH];
+    struct iovec forward_iovecs[RECEIVE_BATCH];
+    long long received[RECEIVE_BATCH];
+
+    while(m_running) {
+        for(int i=0; i<RECEIVE_BATCH; i++) {
+            iovecs[i].iov_base = buffers[i];
+            iovecs[i].iov_len = MAX_PACKET_SIZE;
+
+            memset(&messages[i].msg_hdr, 0, sizeof(messages[i].msg_hdr));
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_name = &addresses[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+            messages[i].msg_hdr.msg_control = control[i];
+            messages[i].msg_hdr.msg_controllen = RECEIVE_CONTROL_SIZE;
+        }
+
+        // Block for the first packet, then take whatever else is already waiting
+        int count = recvmmsg(m_socket, messages, RECEIVE_BATCH, MSG_WAITFORONE, nullptr);
+        long long now = steadyMs();
+        if(count < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LogMessage << "Rendezvous socket error: " << strerror(errno) << endline;
+                break;
+            }
+            expire(now);
+            continue;
+        }
+
+        int forward_count = 0;
+        for(int i=0; i<count; i++) {
+            const struct sockaddr_in* destination = handle(buffers[i], messages[i].msg_len, addresses[i], now);
+            if(!destination) {
+                continue;
+            }
+
+            destinations[forward_count] = *destination;
+            forward_iovecs[forward_count].iov_base = buffers[i];
+            forward_iovecs[forward_count].iov_len = messages[i].msg_len;
+
+            memset(&forwards[forward_count].msg_hdr, 0, sizeof(forwards[forward_count].msg_hdr));
+            forwards[forward_count].msg_hdr.msg_iov = &forward_iovecs[forward_count];
+            forwards[forward_count].msg_hdr.msg_iovlen = 1;
+            forwards[forward_count].msg_hdr.msg_name = &destinations[forward_count];
+            forwards[forward_count].msg_hdr.msg_namelen = sizeof(destinations[forward_count]);
+
+            received[forward_count] = packetReceiveTime(&messages[i].msg_hdr);
+            if(received[forward_count] == 0) {
+                received[forward_count] = wallNs();
+            }
+            forward_count++;
+        }
+
+        // sendmmsg can send fewer packets than asked, so keep going until it fails
+        int sent = 0;
+        while(sent < forward_count) {
+            int result = sendmmsg(m_socket, &forwards[sent], forward_count-sent, 0);
+            if(result <= 0) {
+                break;
+            }
+            sent += result;
+        }
+
+        long long sent_time = wallNs();
+        for(int i=0; i<sent; i++) {
+            long long forward_time = sent_time - received[i];
+            m_forward_time.fetch_add(forward_time, std::memory_order_relaxed);
+            if(forward_time > m_max_forward_time) {
+                m_max_forward_time = forward_time;
+            }
+        }
+
+        expire(now);
+    }
+#else
+    char buffer[MAX_PACKET_SIZE];
+    while(m_running) {
+        fd_set fds;
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = RENDEZVOUS_POLL_MS * 1000;
+        FD_ZERO(&fds);
+        FD_SET(m_socket, &fds);
+        long long now = steadyMs();
+        if(select(m_socket+1, &fds, NULL, NULL, &timeout) <= 0) {
+            expire(now);
+            continue;
+        }
+
+        struct sockaddr_in address;
+        socklen_t address_size = sizeof(address);
+        int size = recvfrom(m_socket, buffer, MAX_PACKET_SIZE, 0, (struct sockaddr*)&address, &address_size);
+        long long received = wallNs();
+        now = steadyMs();
+        if(size <= 0) {
+            continue;
+        }
+
+        const struct sockaddr_in* destination = handle(buffer, size, address, now);
+        if(destination) {
+            send(buffer, size, *destination);
+
+            long long forward_time = wallNs() - received;
+            m_forward_time.fetch_add(forward_time, std::memory_order_relaxed);
+            if(forward_time > m_max_forward_time) {
+                m_max_forward_time = forward_time;
+            }
+        }
+
+        expire(now);
+    }
+#endif
+}
+
+const struct sockaddr_in* RendezvousServer::handle(const char* packet, int size, const struct sockaddr_in& address, long long now)
+{
+    if(size <= 0) {
+        return nullptr;
+    }
+
+    // Everything from a relayed player goes to the other player, except asking for the relay again
+    std::unordered_map<unsigned long long, uint32_t>::iterator route = m_routes.find(addressKey(address));
+    if(route != m_routes.end() && packet[0] != 'R') {
+        std::unordered_map<uint32_t, Pair>::iterator found = m_pairs.find(route->second);
+        if(found == m_pairs.end()) {
+            return nullptr;
+        }
+
+        Pair& pair = found->second;
+        int other = sameAddress(pair.relay[0], address) ? 1 : 0;
+        if(!pair.relaying[other]) {
+            // Keep telling the other player until it comes over too
+            sendFallBack(route->second, other);
+            return nullptr;
+        }
+
+        pair.last_used = now;
+        m_relayed_packets.fetch_add(1, std::memory_order_relaxed);
+        m_relayed_bytes.fetch_add(size, std::memory_order_relaxed);
+        return &pair.relay[other];
+    }
+
+    switch(packet[0]) {
+    case 'r': // Player is looking for the other player with a key
+        registerPlayer(packet, size, address, now);
+        break;
+    case 'R': // Player couldn't reach the other player directly
+        startRelay(packet, size, address, now);
+        break;
+    default:
+        m_unknown_packets.fetch_add(1, std::memory_order_relaxed);
+        break;
+    }
+
+    return nullptr;
+}
+
+void RendezvousServer::registerPlayer(const char* packet, int size, const struct sockaddr_in& address, long long now)
+{
+    PacketReader reader(packet+1, size-1);
+    unsigned char version = reader.readByte();
+    unsigned int length = reader.readVarint();
+    if(reader.error() || version != RENDEZVOUS_VERSION || length == 0 || length > RENDEZVOUS_KEY_SIZE
+       || reader.position()+1+length > static_cast<unsigned int>(size)) {
+        return;
+    }
+    std::string key(&packet[1+reader.position()], length);
+
+    // One of the players missed who the other is
+    std::unordered_map<std::string, uint32_t>::iterator matched = m_matched.find(key);
+    if(matched != m_matched.end()) {
+        Pair& pair = m_pairs[matched->second];
+        for(int i=0; i<2; i++) {
+            if(sameAddress(pair.players[i], address)) {
+                sendEndpoint(matched->second, i);
+                return;
+            }
+        }
+    }
+
+    std::unordered_map<std::string, Waiting>::iterator waiting = m_waiting.find(key);
+    if(waiting == m_waiting.end()) {
+        Waiting& first = m_waiting[key];
+        first.address = address;
+        first.time = now;
+        m_waiting_count = m_waiting.size();
+        return;
+    }
+
+    if(sameAddress(waiting->second.address, address)) {
+        waiting->second.time = now;
+        return;
+    }
+
+    // Both players are here
+    uint32_t token = 0;
+    while(token == 0 || m_pairs.count(token) > 0) {
+        m_seed ^= m_seed << 13;
+        m_seed ^= m_seed >> 17;
+        m_seed ^= m_seed << 5;
+        token = m_seed;
+    }
+
+    Pair& pair = m_pairs[token];
+    pair.key = key;
+    pair.players[0] = waiting->second.address;
+    pair.players[1] = address;
+    pair.relaying[0] = false;
+    pair.relaying[1] = false;
+    pair.last_used = now;
+
+    m_matched[key] = token;
+    m_waiting.erase(waiting);
+    m_waiting_count = m_waiting.size();
+    ++m_matches;
+
+    sendEndpoint(token, 0);
+    sendEndpoint(token, 1);
+}
+
+void RendezvousServer::sendEndpoint(uint32_t token, int player)
+{
+    const Pair& pair = m_pairs[token];
+    const struct sockaddr_in& other = pair.players[1-player];
+
+    char packet[16];
+    PacketWriter writer(packet, sizeof(packet));
+    writer.writeByte('e');
+    writer.writeByte(RENDEZVOUS_VERSION);
+
+    // The first player to register hosts
+    writer.writeByte(player == 0 ? 's' : 'c');
+    writer.writeVarint(token);
+
+    // Address and port as they are, in network order
+    const unsigned char* ip = reinterpret_cast<const unsigned char*>(&other.sin_addr.s_addr);
+    const unsigned char* port = reinterpret_cast<const unsigned char*>(&other.sin_port);
+    for(int i=0; i<4; i++) {
+        writer.writeByte(ip[i]);
+    }
+    writer.writeByte(port[0]);
+    writer.writeByte(port[1]);
+
+    send(packet, writer.size(), pair.players[player]);
+}
+
+void RendezvousServer::startRelay(const char* packet, int size, const struct sockaddr_in& address, long long now)
+{
+    PacketReader reader(packet+1, size-1);
+    unsigned char version = reader.readByte();
+    uint32_t token = reader.readVarint();
+    unsigned char role = reader.readByte();
+    if(reader.error() || version != RENDEZVOUS_VERSION) {
+        return;
+    }
+
+    std::unordered_map<uint32_t, Pair>::iterator found = m_pairs.find(token);
+    if(found == m_pairs.end()) {
+        return;
+    }
+
+    // Only the players of the match can move it to the relay
+    Pair& pair = found->second;
+    int player = role == 's' ? 0 : 1;
+    if(!sameAddress(pair.players[player], address)) {
+        m_unknown_packets.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    bool was_relayed = pair.relaying[0] && pair.relaying[1];
+
+    if(pair.relaying[player] && !sameAddress(pair.relay[player], address)) {
+        m_routes.erase(addressKey(pair.relay[player]));
+    }
+    pair.relay[player] = address;
+    pair.relaying[player] = true;
+    pair.last_used = now;
+    m_routes[addressKey(address)] = token;
+
+    if(!was_relayed && pair.relaying[0] && pair.relaying[1]) {
+        ++m_relays;
+    }
+
+    // Acknowledged by sending it back
+    send(packet, size, address);
+
+    // The other player may think the direct path works, when only its packets get through
+    if(!pair.relaying[1-player]) {
+        sendFallBack(token, 1-player);
+    }
+}
+
+void RendezvousServer::sendFallBack(uint32_t token, int player)
+{
+    char packet[8];
+    PacketWriter writer(packet, sizeof(packet));
+    writer.writeByte('F');
+    writer.writeByte(RENDEZVOUS_VERSION);
+    writer.writeVarint(token);
+
+    send(packet, writer.size(), m_pairs[token].players[player]);
+}
+
+void RendezvousServer::expire(long long now)
+{
+    if(now - m_last_expire < RENDEZVOUS_EXPIRE_MS) {
+        return;
+    }
+    m_last_expire = now;
+
+    for(std::unordered_map<std::string, Waiting>::iterator i = m_waiting.begin(); i != m_waiting.end();) {
+        if(now - i->second.time > RENDEZVOUS_TIMEOUT_MS) {
+            i = m_waiting.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    m_waiting_count = m_waiting.size();
+
+    for(std::unordered_map<uint32_t, Pair>::iterator i = m_pairs.begin(); i != m_pairs.end();) {
+        Pair& pair = i->second;
+        if(now - pair.last_used <= RENDEZVOUS_IDLE_MS) {
+            ++i;
+            continue;
+        }
+
+        if(pair.relaying[0] && pair.relaying[1]) {
+            --m_relays;
+        }
+        for(int player=0; player<2; player++) {
+            if(pair.relaying[player]) {
+                m_routes.erase(addressKey(pair.relay[player]));
+            }
+        }
+
+        std::unordered_map<std::string, uint32_t>::iterator matched = m_matched.find(pair.key);
+        if(matched != m_matched.end() && matched->second == i->first) {
+            m_matched.erase(matched);
+        }
+
+        i = m_pairs.erase(i);
+    }
+}
+
+void RendezvousServer::send(const char* packet, int size, const struct sockaddr_in& address)
+{
+    sendto(m_socket, packet, size, 0, (const struct sockaddr*)&address, sizeof(address));
+}
@@ -0,0 +1,158 @@
+#ifndef SHOBU_NETWORK_RENDEZVOUS_H
+#define SHOBU_NETWORK_RENDEZVOUS_H
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+// Version of the rendezvous packets
+const unsigned char RENDEZVOUS_VERSION = 1;
+
+// Port the rendezvous server listens on unless told otherwise
+const int RENDEZVOUS_PORT = 7400;
+
+// Longest key players meet with
+const int RENDEZVOUS_KEY_SIZE = 64;
+
+// Milliseconds a player waits for the other to show up
+const int RENDEZVOUS_TIMEOUT_MS = 30000;
+
+// Milliseconds between registrations, punches and connect requests while meeting
+const int RENDEZVOUS_RETRY_MS = 50;
+
+// Milliseconds spent punching through to the other player before relaying through the server
+const int RENDEZVOUS_PUNCH_MS = 2000;
+
+// Milliseconds spent connecting through the relay before giving up
+const int RENDEZVOUS_RELAY_MS = 4000;
+
+// Milliseconds a relayed match can go without a packet before it's forgotten
+const int RENDEZVOUS_IDLE_MS = 60000;
+
+struct RendezvousStats
+{
+    // Players waiting for the other player with their key
+    int waiting;
+
+    // Pairs of players that met
+    int matches;
+
+    // Matches currently relayed through the server
+    int relays;
+
+    long long relayed_packets;
+    long long relayed_bytes;
+
+    // Packets from addresses the server doesn't know
+    long long unknown_packets;
+
+    // Nanoseconds from the kernel receiving a relayed packet to the server sending it on, in total and at most
+    long long forward_time;
+    long long max_forward_time;
+};
+
+/*! Introduces two players that know the same key, so they can connect without either forwarding a port.
+ *  Each player registers with the key and gets the address the server saw the other player's packets come from,
+ *  then both punch through to each other.  When that fails the server relays their packets as they are,
+ *  between the two addresses, without adding anything to them.  Once either player asks for the relay,
+ *  the server tells the other player to come over too, so both sides always use the same path
+ */
+class RendezvousServer
+{
+    public:
+    RendezvousServer();
+
+    // Stops the thread if it's still running
+    ~RendezvousServer();
+
+    /*! Bind the port and start the thread
+     * \return false on failure, true on success
+     */
+    bool start(int port);
+
+    // Stop the thread and forget every player
+    void stop();
+
+    void getStats(RendezvousStats& stats);
+
+    private:
+    struct Waiting {
+        struct sockaddr_in address;
+        long long time;
+    };
+
+    // Two players that met.  The first to register hosts
+    struct Pair {
+        std::string key;
+        struct sockaddr_in players[2];
+
+        // Addresses relayed between, once each player asks for the relay
+        struct sockaddr_in relay[2];
+        bool relaying[2];
+
+        long long last_used;
+    };
+
+    // Thread which receives every packet
+    void run();
+
+    /*! Handle a packet
+     * \return the player to forward it to, or nullptr when it was for the server
+     */
+    const struct sockaddr_in* handle(const char* packet, int size, const struct sockaddr_in& address, long long now);
+
+    void registerPlayer(const char* packet, int size, const struct sockaddr_in& address, long long now);
+    void startRelay(const char* packet, int size, const struct sockaddr_in& address, long long now);
+
+    // Tell a player who the other player is
+    void sendEndpoint(uint32_t token, int player);
+
+    // Tell a player the other player is relaying, so it has to relay too
+    void sendFallBack(uint32_t token, int player);
+
+    // Forget players that stopped waiting and matches that went quiet
+    void expire(long long now);
+
+    void send(const char* packet, int size, const struct sockaddr_in& address);
+
+    static unsigned long long addressKey(const struct sockaddr_in& address);
+
+    int m_socket;
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+
+    // Below is only used by the thread
+    std::unordered_map<std::string, Waiting> m_waiting;
+    std::unordered_map<uint32_t, Pair> m_pairs;
+
+    // Match of each key that met, and of each relayed address
+    std::unordered_map<std::string, uint32_t> m_matched;
+    std::unordered_map<unsigned long long, uint32_t> m_routes;
+
+    // Random state tokens are made from
+    uint32_t m_seed;
+
+    long long m_last_expire;
+
+    std::atomic<int> m_waiting_count;
+    std::atomic<int> m_matches;
+    std::atomic<int> m_relays;
+    std::atomic<long long> m_relayed_packets;
+    std::atomic<long long> m_relayed_bytes;
+    std::atomic<long long> m_unknown_packets;
+    std::atomic<long long> m_forward_time;
+    std::atomic<long long> m_max_forward_time;
+};
+
+#endif // SHOBU_NETWORK_RENDEZVOUS_H
@@ -0,0 +1,66 @@
+#ifndef SHOBU_NETWORK_RING_H
+#define SHOBU_NETWORK_RING_H
+
+#include <atomic>
+
+/*! Lock free queue between exactly one producer thread and one consumer thread.
+ *  Items are written in place, so nothing is allocated or copied twice.
+ *  SIZE must be a power of two.
+ */
+template <typename T, unsigned int SIZE>
+class SpscRing
+{
+    static_assert((SIZE & (SIZE-1)) == 0, "SpscRing size must be a power of two");
+
+    public:
+    SpscRing() : m_head(0), m_tail(0) {}
+
+    /*! Producer: get the next free slot to write into
+     * \return nullptr when the ring is full
+     */
+    T* acquire()
+    {
+        unsigned int tail = m_tail.load(std::memory_order_relaxed);
+        if(tail - m_head.load(std::memory_order_acquire) == SIZE) {
+            return nullptr;
+        }
+
+        return &m_items[tail & (SIZE-1)];
+    }
+
+    // Producer: make the slot returned by acquire visible to the consumer
+    void publish()
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed)+1, std::memory_order_release);
+    }
+
+    /*! Consumer: get the oldest published item
+     * \return nullptr when the ring is empty
+     */
+    T* front()
+    {
+        unsigned int head = m_head.load(std::memory_order_relaxed);
+        if(head == m_tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+
+        return &m_items[head & (SIZE-1)];
+    }
+
+    // Consumer: release the item returned by front so it can be reused
+    void pop()
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed)+1, std::memory_order_release);
+    }
+
+    private:
+    T m_items[SIZE];
+
+    // Only written by the consumer
+    std::atomic<unsigned int> m_head;
+
+    // Only written by the producer
+    std::atomic<unsigned int> m_tail;
+};
+
+#endif // SHOBU_NETWORK_RING_H
@@ -0,0 +1,583 @@
+#include "NetworkServer.h"
+#include "Network.h"
+#include "NetworkUdp.h"
+#include "NetworkPacketPool.h"
+#include "NetworkLogger.h"
+
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#endif
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+// Only the application's thread logs, shard threads leave their errors for it
+#define LogServer LogMessageTo(*m_logger)
+
+// Milliseconds of the steady clock, for timing sessions out
+static long long steadyMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ServerTransport::ServerTransport(int socket, const struct sockaddr_in& address) : m_packets(0), m_receive_time(0)
+{
+    m_socket = socket;
+    m_address = address;
+    m_closed = false;
+    m_last_packet = steadyMs();
+
+    m_pending = nullptr;
+    m_pending_size = 0;
+}
+
+void ServerTransport::send(char* packet, int size, PacketPool& pool)
+{
+    // Send what we have so far when the batch is full
+    if(m_batch.size() == MAX_PACKET_BATCH) {
+        m_batch.flush(m_socket, m_address, pool);
+    }
+
+    m_batch.add(packet, size);
+}
+
+void ServerTransport::flush(PacketPool& pool)
+{
+    m_batch.flush(m_socket, m_address, pool);
+}
+
+void ServerTransport::sendNow(const char* packet, int size)
+{
+    if(m_closed) {
+        return;
+    }
+
+    sendto(m_socket, packet, size, 0, (const struct sockaddr*)&m_address, sizeof(m_address));
+}
+
+bool ServerTransport::receive(PacketHandler handler, void* data)
+{
+    if(m_pending && !m_closed) {
+        handler(data, m_pending, m_pending_size, 0);
+    }
+    m_pending = nullptr;
+
+    return true;
+}
+
+bool ServerTransport::deliver(ShobuNetwork* network, const char* packet, int size)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    m_pending = packet;
+    m_pending_size = size;
+    bool connected = network->receivePackets();
+
+    m_packets.fetch_add(1, std::memory_order_relaxed);
+    m_last_packet = steadyMs();
+    m_receive_time.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+
+    return connected;
+}
+
+bool ServerTransport::wait(int)
+{
+    // Packets only come from the server
+    return false;
+}
+
+int ServerTransport::receiveOne(char*, int)
+{
+    return 0;
+}
+
+void ServerTransport::replyToSender()
+{
+    // Always sends to the client the session was created for
+}
+
+void ServerTransport::close()
+{
+    // The socket is shared with every other session of the shard
+    m_closed = true;
+}
+
+int ServerTransport::getHandle()
+{
+    return -1;
+}
+
+NetworkServer::NetworkServer() : m_running(false), m_session_count(0), m_rejected(0), m_handshakes(0)
+{
+    m_accept = nullptr;
+    m_accept_data = nullptr;
+
+    // Sessions keep their own defaults unless set
+    m_delay = -1;
+    m_input_bits = -1;
+
+    m_max_sessions = SERVER_MAX_SESSIONS;
+    m_timeout = SERVER_SESSION_TIMEOUT_MS;
+
+    m_logger.reset(new NetworkLogger(nullptr));
+}
+
+NetworkServer::~NetworkServer()
+{
+    stop();
+}
+
+void NetworkServer::setLogFile(const char* filename)
+{
+    m_logger.reset(new NetworkLogger(filename));
+}
+
+void NetworkServer::setAcceptCallback(AcceptCallback accept, void* data)
+{
+    m_accept = accept;
+    m_accept_data = data;
+}
+
+void NetworkServer::setInputDelay(int delay)
+{
+    m_delay = delay;
+}
+
+void NetworkServer::setInputBits(int bits)
+{
+    m_input_bits = bits;
+}
+
+void NetworkServer::setSessionLimits(int max_sessions, int timeout_ms)
+{
+    m_max_sessions = max_sessions;
+    m_timeout = timeout_ms;
+}
+
+bool NetworkServer::start(int port, int shards)
+{
+    if(m_running) {
+        return false;
+    }
+
+#ifdef WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(1, 1), &wsaData) != 0) {
+        LogNull << "Could not initialize Winsock" << endline;
+    }
+#endif
+
+    if(shards <= 0) {
+        shards = std::thread::hardware_concurrency();
+        if(shards <= 0) {
+            shards = 1;
+        }
+    }
+
+#ifndef SO_REUSEPORT
+    // Only one socket can be bound to the port
+    shards = 1;
+#endif
+
+    for(int i=0; i<shards; i++) {
+        std::unique_ptr<Shard> shard(new Shard());
+        shard->index = i;
+        shard->packets = 0;
+        shard->unknown_packets = 0;
+        shard->timeouts = 0;
+        shard->error = 0;
+        shard->last_sweep = steadyMs();
+
+        shard->socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if(shard->socket < 0) {
+            LogServer << "Could not create server socket" << endline;
+            stop();
+            return false;
+        }
+
+#ifdef SO_REUSEPORT
+        int reuse = 1;
+        if(setsockopt(shard->socket, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) < 0) {
+            LogServer << "Could not share the server port: " << strerror(errno) << endline;
+        }
+#endif
+
+        struct sockaddr_in host_address;
+        memset(&host_address, 0, sizeof(host_address));
+        host_address.sin_family = PF_INET;
+        host_address.sin_addr.s_addr = htonl(INADDR_ANY);
+        host_address.sin_port = htons(port);
+
+        if(bind(shard->socket, (struct sockaddr*)&host_address, sizeof(host_address)) < 0) {
+            LogServer << "Could not bind server socket to port " << port << endline;
+#ifdef WIN32
+            closesocket(shard->socket);
+#else
+            ::close(shard->socket);
+#endif
+            stop();
+            return false;
+        }
+
+        m_shards.push_back(std::move(shard));
+    }
+
+    m_running = true;
+    for(unsigned int i=0; i<m_shards.size(); i++) {
+        m_shards[i]->thread = std::thread(&NetworkServer::run, this, m_shards[i].get());
+    }
+
+    LogServer << "Server listening on port " << port << " with " << (int)m_shards.size() << " shards" << endline;
+    return true;
+}
+
+void NetworkServer::stop()
+{
+    m_running = false;
+
+    for(unsigned int i=0; i<m_shards.size(); i++) {
+        if(m_shards[i]->thread.joinable()) {
+            m_shards[i]->thread.join();
+        }
+    }
+    reportErrors();
+
+    // No thread hands packets to the sessions anymore, so they can go
+    m_owners.clear();
+    m_session_count = 0;
+    for(unsigned int i=0; i<m_shards.size(); i++) {
+        m_shards[i]->sessions.clear();
+        m_shards[i]->closed.clear();
+
+#ifdef WIN32
+        closesocket(m_shards[i]->socket);
+#else
+        ::close(m_shards[i]->socket);
+#endif
+    }
+
+#ifdef WIN32
+    if(!m_shards.empty()) {
+        WSACleanup();
+    }
+#endif
+
+    m_shards.clear();
+}
+
+// Same clock as the kernel's packet time stamps
+static long long wallNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+unsigned long long NetworkServer::addressKey(const struct sockaddr_in& address)
+{
+    return (static_cast<unsigned long long>(address.sin_addr.s_addr) << 16) | address.sin_port;
+}
+
+void NetworkServer::run(Shard* shard)
+{
+#ifdef __linux__
+    // One shard per core, so keep each on its own
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->index % CPU_SETSIZE, &cpus);
+    if(shard->index < static_cast<int>(std::thread::hardware_concurrency())) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    // Wake up every so often to check whether we should stop
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = SERVER_POLL_MS * 1000;
+    setsockopt(shard->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Time stamp packets so their latency includes waiting in the socket
+    int timestamps = 1;
+    setsockopt(shard->socket, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(timestamps));
+
+    char buffers[RECEIVE_BATCH][MAX_PACKET_SIZE];
+    char control[RECEIVE_BATCH][RECEIVE_CONTROL_SIZE];
+    struct sockaddr_in addresses[RECEIVE_BATCH];
+    struct mmsghdr messages[RECEIVE_BATCH];
+    struct iovec iovecs[RECEIVE_BATCH];
+
+    while(m_running) {
+        for(int i=0; i<RECEIVE_BATCH; i++) {
+            iovecs[i].iov_base = buffers[i];
+            iovecs[i].iov_len = MAX_PACKET_SIZE;
+
+            memset(&messages[i].msg_hdr, 0, sizeof(messages[i].msg_hdr));
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_name = &addresses[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+            messages[i].msg_hdr.msg_control = control[i];
+            messages[i].msg_hdr.msg_controllen = RECEIVE_CONTROL_SIZE;
+        }
+
+        // Block for the first packet, then take whatever else is already waiting
+        int count = recvmmsg(shard->socket, messages, RECEIVE_BATCH, MSG_WAITFORONE, nullptr);
+        if(count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            shard->error = errno;
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        sweep(shard);
+        for(int i=0; i<count; i++) {
+            dispatch(shard, buffers[i], messages[i].msg_len, addresses[i]);
+
+            long long received = packetReceiveTime(&messages[i].msg_hdr);
+            if(received > 0) {
+                shard->latency.record(wallNs() - received);
+            }
+        }
+    }
+#else
+    char buffer[MAX_PACKET_SIZE];
+    while(m_running) {
+        fd_set fds;
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = SERVER_POLL_MS * 1000;
+        FD_ZERO(&fds);
+        FD_SET(shard->socket, &fds);
+        if(select(shard->socket+1, &fds, NULL, NULL, &timeout) <= 0) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            sweep(shard);
+            continue;
+        }
+
+        struct sockaddr_in address;
+        socklen_t address_size = sizeof(address);
+        int size = recvfrom(shard->socket, buffer, MAX_PACKET_SIZE, 0, (struct sockaddr*)&address, &address_size);
+        if(size <= 0) {
+            continue;
+        }
+
+        // Without kernel time stamps the latency starts once the packet is read
+        long long received = wallNs();
+
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        sweep(shard);
+        dispatch(shard, buffer, size, address);
+        shard->latency.record(wallNs() - received);
+    }
+#endif
+}
+
+void NetworkServer::dispatch(Shard* shard, const char* packet, int size, const struct sockaddr_in& address)
+{
+    if(size <= 0) {
+        return;
+    }
+
+    unsigned long long key = addressKey(address);
+
+    std::unordered_map<unsigned long long, Session>::iterator found = shard->sessions.find(key);
+    if(found != shard->sessions.end()) {
+        shard->packets.fetch_add(1, std::memory_order_relaxed);
+        if(!found->second.transport->deliver(found->second.network.get(), packet, size)) {
+            close(shard, found);
+        }
+        return;
+    }
+
+    if(packet[0] == 'c') {
+        accept(shard, packet, size, address, key);
+        return;
+    }
+
+    shard->unknown_packets.fetch_add(1, std::memory_order_relaxed);
+}
+
+void NetworkServer::accept(Shard* shard, const char* packet, int size, const struct sockaddr_in& address, unsigned long long key)
+{
+    // Each session takes tens of kilobytes, so anyone can't have the server make as many as they like
+    if(++m_session_count > m_max_sessions) {
+        --m_session_count;
+        ++m_rejected;
+        LogNull << "Server is full, turned away client" << endline;
+        return;
+    }
+
+    std::unique_ptr<ShobuNetwork> network(new ShobuNetwork());
+    if(m_delay >= 0) {
+        network->setInputDelay(m_delay);
+    }
+    if(m_input_bits >= 0) {
+        network->setInputBits(m_input_bits);
+    }
+
+    ServerTransport* transport = new ServerTransport(shard->socket, address);
+    if(!network->acceptClient(transport, packet, size)) {
+        --m_session_count;
+        return;
+    }
+
+    // The application only gets the session once it's connected.  The shard's lock keeps packets from it until it's set up
+    if(m_accept && !m_accept(m_accept_data, network.get(), address)) {
+        LogNull << "Turned away client" << endline;
+        network->disconnect();
+        --m_session_count;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Owner& owner = m_owners[network.get()];
+        owner.shard = shard;
+        owner.key = key;
+        owner.transport = transport;
+    }
+
+    Session& session = shard->sessions[key];
+    session.transport = transport;
+    session.network = std::move(network);
+
+    ++m_handshakes;
+}
+
+void NetworkServer::close(Shard* shard, std::unordered_map<unsigned long long, Session>::iterator session)
+{
+    // The address is free for a new session, and this one waits for the application to remove it
+    shard->closed.push_back(std::move(session->second.network));
+    shard->sessions.erase(session);
+}
+
+void NetworkServer::sweep(Shard* shard)
+{
+    long long now = steadyMs();
+    if(now - shard->last_sweep < SERVER_POLL_MS) {
+        return;
+    }
+    shard->last_sweep = now;
+
+    std::unordered_map<unsigned long long, Session>::iterator session = shard->sessions.begin();
+    while(session != shard->sessions.end()) {
+        std::unordered_map<unsigned long long, Session>::iterator next = session;
+        ++next;
+
+        if(m_timeout > 0 && now - session->second.transport->getLastPacket() > m_timeout) {
+            LogNull << "Session timed out" << endline;
+            session->second.network->disconnectWithoutMessage();
+            shard->timeouts.fetch_add(1, std::memory_order_relaxed);
+            close(shard, session);
+        } else if(!session->second.network->connected()) {
+            close(shard, session);
+        }
+
+        session = next;
+    }
+}
+
+void NetworkServer::removeSession(ShobuNetwork* session)
+{
+    Owner owner;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::unordered_map<ShobuNetwork*, Owner>::iterator found = m_owners.find(session);
+        if(found == m_owners.end()) {
+            return;
+        }
+        owner = found->second;
+        m_owners.erase(found);
+    }
+
+    // Taken out while the shard isn't handing it packets, then deleted outside the lock.
+    // A closed session's address may belong to a new session by now
+    std::unique_ptr<ShobuNetwork> network;
+    {
+        std::lock_guard<std::mutex> lock(owner.shard->mutex);
+        std::unordered_map<unsigned long long, Session>::iterator found = owner.shard->sessions.find(owner.key);
+        if(found != owner.shard->sessions.end() && found->second.network.get() == session) {
+            network = std::move(found->second.network);
+            owner.shard->sessions.erase(found);
+        } else {
+            std::vector<std::unique_ptr<ShobuNetwork>>& closed = owner.shard->closed;
+            for(unsigned int i=0; i<closed.size(); i++) {
+                if(closed[i].get() == session) {
+                    network = std::move(closed[i]);
+                    closed[i] = std::move(closed.back());
+                    closed.pop_back();
+                    break;
+                }
+            }
+        }
+    }
+
+    --m_session_count;
+}
+
+static int sessionMemory()
+{
+    // The index entry is about a key, a session and two pointers of the hash table
+    return sizeof(ShobuNetwork) + sizeof(ServerTransport) + sizeof(unsigned long long) + sizeof(void*)*4;
+}
+
+void NetworkServer::reportErrors()
+{
+    for(unsigned int i=0; i<m_shards.size(); i++) {
+        int error = m_shards[i]->error.exchange(0);
+        if(error != 0) {
+            LogServer << "Server socket error on shard " << (int)i << ", it stopped receiving: " << strerror(error) << endline;
+        }
+    }
+}
+
+void NetworkServer::getStats(ServerStats& stats)
+{
+    reportErrors();
+
+    memset(&stats, 0, sizeof(stats));
+    stats.shards = m_shards.size();
+    stats.handshakes = m_handshakes;
+    stats.session_memory = sessionMemory();
+    stats.rejected = m_rejected;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        stats.sessions = m_owners.size();
+    }
+
+    for(unsigned int i=0; i<m_shards.size(); i++) {
+        stats.packets += m_shards[i]->packets.load(std::memory_order_relaxed);
+        stats.unknown_packets += m_shards[i]->unknown_packets.load(std::memory_order_relaxed);
+        stats.timeouts += m_shards[i]->timeouts.load(std::memory_order_relaxed);
+    }
+}
+
+void NetworkServer::getLatency(LatencyHistogram& latency, bool reset)
+{
+    for(unsigned int i=0; i<m_shards.size(); i++) {
+        latency.add(m_shards[i]->latency);
+        if(reset) {
+            m_shards[i]->latency.reset();
+        }
+    }
+}
+
+bool NetworkServer::getSessionStats(ShobuNetwork* session, SessionStats& stats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::unordered_map<ShobuNetwork*, Owner>::iterator found = m_owners.find(session);
+    if(found == m_owners.end()) {
+        return false;
+    }
+
+    stats.packets = found->second.transport->getPackets();
+    stats.receive_time = found->second.transport->getReceiveTime();
+    stats.update_time = session->getUpdateTime();
+    stats.memory = sessionMemory();
+
+    return true;
+}
@@ -0,0 +1,274 @@
+#ifndef SHOBU_NETWORK_SERVER_H
+#define SHOBU_NETWORK_SERVER_H
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "NetworkTransport.h"
+#include "NetworkHistogram.h"
+
+class NetworkLogger;
+class ShobuNetwork;
+
+// How long a shard thread blocks on its socket before checking whether it should stop
+const int SERVER_POLL_MS = 100;
+
+// Sessions a server holds at once unless set otherwise, about 300 MB of them
+const int SERVER_MAX_SESSIONS = 4096;
+
+// Sessions that receive nothing for this long are disconnected unless set otherwise
+const int SERVER_SESSION_TIMEOUT_MS = 15000;
+
+// Totals across every shard of a server
+struct ServerStats
+{
+    int shards;
+    int sessions;
+    int handshakes;
+
+    // Packets handed to sessions, and ones from addresses without a session
+    long long packets;
+    long long unknown_packets;
+
+    // Connect requests turned away because the server was full
+    long long rejected;
+
+    // Sessions disconnected for receiving nothing
+    long long timeouts;
+
+    // Bytes each session takes, including its transport and index entry
+    int session_memory;
+};
+
+// Cost of a single session
+struct SessionStats
+{
+    long long packets;
+
+    // Microseconds the shard thread spent handling the session's packets
+    long long receive_time;
+
+    // Microseconds spent in the session's update calls
+    long long update_time;
+
+    int memory;
+};
+
+/*! Sends through a server's shared socket to one client.
+ *  The server's shard thread hands packets to the session, so the session never waits on it
+ */
+class ServerTransport : public NetworkTransport
+{
+    public:
+    ServerTransport(int socket, const struct sockaddr_in& address);
+
+    void send(char* packet, int size, PacketPool& pool);
+    void flush(PacketPool& pool);
+    void sendNow(const char* packet, int size);
+    bool receive(PacketHandler handler, void* data);
+    bool wait(int timeout);
+    int receiveOne(char* buffer, int size);
+    void replyToSender();
+    void close();
+    int getHandle();
+    bool drivenExternally() { return true; }
+
+    /*! Hand a packet to the session.  Only called by the shard thread
+     * \return false when the session has disconnected
+     */
+    bool deliver(ShobuNetwork* network, const char* packet, int size);
+
+    long long getPackets() { return m_packets; }
+    long long getReceiveTime() { return m_receive_time / 1000; }
+
+    // Milliseconds of the steady clock when the last packet was handed over, or the session was created
+    long long getLastPacket() { return m_last_packet; }
+
+    private:
+    int m_socket;
+    struct sockaddr_in m_address;
+    bool m_closed;
+
+    // Packets waiting to be sent at the end of the update
+    PacketBatch m_batch;
+
+    // Packet being handed to the session
+    const char* m_pending;
+    int m_pending_size;
+
+    std::atomic<long long> m_packets;
+
+    // Nanoseconds spent handling packets
+    std::atomic<long long> m_receive_time;
+
+    long long m_last_packet;
+};
+
+/*! Hosts any number of matches on one UDP port.
+ *  One socket per shard is bound to the port with SO_REUSEPORT so the kernel spreads clients across them,
+ *  and each shard's thread finds the session a datagram belongs to by its address in the shard's own index.
+ *  New clients are accepted as their connect request arrives, so handshakes never hold up other sessions.
+ *  Sessions are owned by the server and updated by the application
+ */
+class NetworkServer
+{
+    public:
+    NetworkServer();
+    ~NetworkServer();
+
+    /*! Called on a shard thread for every new client once its handshake is answered, before it's handed any packets.
+     *  Set up the session here, like registering callbacks, and keep the pointer to update it.
+     *  Return false to turn the client away, which disconnects and deletes the session
+     */
+    typedef bool (*AcceptCallback)(void* data, ShobuNetwork* session, const struct sockaddr_in& address);
+
+    void setAcceptCallback(AcceptCallback accept, void* data);
+
+    /*! Input delay and bits of each input sent that new sessions tell their clients in the handshake.
+     *  Call before start
+     */
+    void setInputDelay(int delay);
+    void setInputBits(int bits);
+
+    /*! Limit the sessions and how long they may go without a packet.  Call before start
+     * \param max_sessions sessions held at once, including disconnected ones not yet removed.  More clients are turned away
+     * \param timeout_ms sessions receiving nothing for this long are disconnected, 0 to never time out
+     */
+    void setSessionLimits(int max_sessions, int timeout_ms);
+
+    /*! Bind the sockets and start a thread for each
+     * \param port port clients connect to
+     * \param shards sockets and threads to use, 0 for one per core.  Only 1 without SO_REUSEPORT
+     * \return false on failure, true on success
+     */
+    bool start(int port, int shards);
+
+    // Stop every thread, then disconnect and delete every session
+    void stop();
+
+    /*! Log the server's messages to a file.  Otherwise they're only kept in memory.  Shard threads never log,
+     *  their socket errors are logged by getStats and stop on the application's thread
+     * \param filename the file, or nullptr to keep messages only in memory
+     */
+    void setLogFile(const char* filename);
+
+    // Returns the logger the server's messages go to
+    NetworkLogger* getLogger() { return m_logger.get(); }
+
+    /*! Disconnect and delete a session.  It must not be in the middle of an update.
+     *  Sessions that disconnect or time out stop receiving packets but count towards the limit until removed.
+     *  Once this returns the pointer is invalid
+     */
+    void removeSession(ShobuNetwork* session);
+
+    void getStats(ServerStats& stats);
+
+    // Returns false when the session doesn't belong to this server
+    bool getSessionStats(ShobuNetwork* session, SessionStats& stats);
+
+    /*! Add up how long packets took from the kernel receiving them to their session having handled them
+     * \param latency histogram the latencies of every shard are added to
+     * \param reset start counting again afterwards
+     */
+    void getLatency(LatencyHistogram& latency, bool reset);
+
+    private:
+    struct Session {
+        std::unique_ptr<ShobuNetwork> network;
+        ServerTransport* transport;
+    };
+
+    // One socket, its thread and the sessions of the clients the kernel sends to it
+    struct Shard {
+        int socket;
+        int index;
+        std::thread thread;
+
+        // Held while handing packets to sessions so they can be removed safely
+        std::mutex mutex;
+
+        // Sessions by client address
+        std::unordered_map<unsigned long long, Session> sessions;
+
+        // Sessions that disconnected, waiting for the application to remove them
+        std::vector<std::unique_ptr<ShobuNetwork>> closed;
+
+        // Milliseconds of the steady clock the sessions were last checked for timeouts
+        long long last_sweep;
+
+        std::atomic<long long> packets;
+        std::atomic<long long> unknown_packets;
+        std::atomic<long long> timeouts;
+
+        // Error that stopped the thread receiving, 0 while it hasn't or it was logged
+        std::atomic<int> error;
+
+        // Time from the kernel receiving each packet to it being handled
+        LatencyHistogram latency;
+    };
+
+    // Where a session lives, for removing it
+    struct Owner {
+        Shard* shard;
+        unsigned long long key;
+        ServerTransport* transport;
+    };
+
+    // Thread which receives a shard's packets
+    void run(Shard* shard);
+
+    // Hand a datagram to its session, or accept a new client
+    void dispatch(Shard* shard, const char* packet, int size, const struct sockaddr_in& address);
+
+    // Create a session for a client that sent a connect request
+    void accept(Shard* shard, const char* packet, int size, const struct sockaddr_in& address, unsigned long long key);
+
+    // Stop handing packets to a disconnected session and keep it until the application removes it
+    void close(Shard* shard, std::unordered_map<unsigned long long, Session>::iterator session);
+
+    // Disconnect sessions that received nothing for too long
+    void sweep(Shard* shard);
+
+    // Log the errors the shard threads left
+    void reportErrors();
+
+    static unsigned long long addressKey(const struct sockaddr_in& address);
+
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    std::atomic<bool> m_running;
+
+    AcceptCallback m_accept;
+    void* m_accept_data;
+
+    int m_delay;
+    int m_input_bits;
+
+    int m_max_sessions;
+    int m_timeout;
+
+    // Sessions held, reserved before one is created
+    std::atomic<int> m_session_count;
+    std::atomic<long long> m_rejected;
+
+    // Guards the owners.  Never held together with a shard's mutex
+    std::mutex m_mutex;
+    std::unordered_map<ShobuNetwork*, Owner> m_owners;
+
+    std::atomic<int> m_handshakes;
+
+    std::unique_ptr<NetworkLogger> m_logger;
+};
+
+#endif // SHOBU_NETWORK_SERVER_H
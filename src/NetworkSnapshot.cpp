@@ -0,0 +1,681 @@
+#include "NetworkSnapshot.h"
+#include "NetworkHash.h"
+#include "NetworkLogger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <mutex>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SHOBU_SNAPSHOT_STREAM
+#endif
+
+// Messages go to the logger of the session the ring belongs to, if it has one
+#define LogRing if(!m_logger) {} else LogMessageTo(*m_logger)
+
+// Frames kept unless told otherwise
+const int SNAPSHOT_SLOTS = 32;
+
+// Slots that hold no frame
+const int NO_FRAME = INT_MIN;
+
+// Runs of neighbouring tracked pages added to the fault handler's table at a time
+const int RANGES_PER_BLOCK = 64;
+
+// Written pages protected again one run at a time.  Past this, each whole run of tracked pages is protected with
+// one call, which costs about the same as a single page
+const int PROTECT_EACH_RUN = 4;
+
+// Opening up every tracked page at once costs about one single page call for each this many pages
+const int PAGES_PER_PROTECT = 16;
+
+// Copy into memory that won't be read soon without pulling it into the cache.  The destination is aligned
+static void streamCopy(char* destination, const char* source, size_t size)
+{
+    size_t i = 0;
+#ifdef SHOBU_SNAPSHOT_STREAM
+    for(; i+64 <= size; i+=64) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source+i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source+i+16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source+i+32));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source+i+48));
+        _mm_stream_si128(reinterpret_cast<__m128i*>(destination+i), a);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(destination+i+16), b);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(destination+i+32), c);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(destination+i+48), d);
+    }
+#endif
+    memcpy(destination+i, source+i, size-i);
+}
+
+#ifdef __linux__
+/*! A run of neighbouring tracked pages and where the fault handler marks them as written.  Any thread can fault
+ *  while another session changes its own ranges, so every field is read under the sequence number, odd while the
+ *  range is being changed.  A range is never moved, so the owner of a page that faults always finds it
+ */
+struct TrackedRange
+{
+    std::atomic<bool> claimed;
+    std::atomic<unsigned int> sequence;
+
+    std::atomic<uintptr_t> start;
+    std::atomic<uintptr_t> end;
+
+    // Index of the first page in the ring's lists
+    std::atomic<int> first_page;
+
+    std::atomic<std::atomic<unsigned char>*> dirty;
+    std::atomic<int*> dirty_pages;
+    std::atomic<std::atomic<int>*> dirty_count;
+};
+
+// Ranges are kept in blocks that are only ever added, as the fault handler can't wait for a lock
+struct RangeBlock
+{
+    TrackedRange ranges[RANGES_PER_BLOCK];
+    std::atomic<RangeBlock*> next;
+};
+
+static RangeBlock s_ranges;
+static size_t s_page_size = 0;
+static struct sigaction s_previous_handler;
+
+// Rings tracking pages, the handler is installed while there are any
+static std::mutex s_handler_mutex;
+static int s_handler_users = 0;
+
+static void writeRange(TrackedRange& range, uintptr_t start, uintptr_t end, int first_page, std::atomic<unsigned char>* dirty,
+                       int* dirty_pages, std::atomic<int>* dirty_count)
+{
+    range.sequence.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    range.start.store(start, std::memory_order_relaxed);
+    range.end.store(end, std::memory_order_relaxed);
+    range.first_page.store(first_page, std::memory_order_relaxed);
+    range.dirty.store(dirty, std::memory_order_relaxed);
+    range.dirty_pages.store(dirty_pages, std::memory_order_relaxed);
+    range.dirty_count.store(dirty_count, std::memory_order_relaxed);
+
+    range.sequence.fetch_add(1, std::memory_order_release);
+}
+
+// Take a free range, adding a block when every one is taken
+static TrackedRange* claimRange()
+{
+    RangeBlock* block = &s_ranges;
+    while(true) {
+        for(int i=0; i<RANGES_PER_BLOCK; i++) {
+            bool expected = false;
+            if(block->ranges[i].claimed.compare_exchange_strong(expected, true)) {
+                return &block->ranges[i];
+            }
+        }
+
+        RangeBlock* next = block->next.load(std::memory_order_acquire);
+        if(!next) {
+            RangeBlock* added = new RangeBlock();
+            if(block->next.compare_exchange_strong(next, added)) {
+                next = added;
+            } else {
+                delete added;
+            }
+        }
+        block = next;
+    }
+}
+
+static void releaseRange(TrackedRange* range)
+{
+    writeRange(*range, 0, 0, 0, nullptr, nullptr, nullptr);
+    range->claimed.store(false, std::memory_order_release);
+}
+
+// Fault again with the handler that was there before, for a page that isn't tracked
+static void chainHandler(int signal, siginfo_t* info, void* context)
+{
+    if(s_previous_handler.sa_flags & SA_SIGINFO) {
+        s_previous_handler.sa_sigaction(signal, info, context);
+    } else if(s_previous_handler.sa_handler == SIG_DFL || s_previous_handler.sa_handler == SIG_IGN) {
+        // Fault again with the default action
+        sigaction(SIGSEGV, &s_previous_handler, nullptr);
+    } else {
+        s_previous_handler.sa_handler(signal);
+    }
+}
+
+// The first write to a tracked page since the last snapshot.  Remember it and let the write go through
+static void onWrite(int signal, siginfo_t* info, void* context)
+{
+    uintptr_t address = reinterpret_cast<uintptr_t>(info->si_addr);
+
+    for(RangeBlock* block=&s_ranges; block; block=block->next.load(std::memory_order_acquire)) {
+        for(int i=0; i<RANGES_PER_BLOCK; i++) {
+            TrackedRange& range = block->ranges[i];
+
+            unsigned int sequence = range.sequence.load(std::memory_order_acquire);
+            uintptr_t start = range.start.load(std::memory_order_relaxed);
+            uintptr_t end = range.end.load(std::memory_order_relaxed);
+            int first_page = range.first_page.load(std::memory_order_relaxed);
+            std::atomic<unsigned char>* dirty = range.dirty.load(std::memory_order_relaxed);
+            int* dirty_pages = range.dirty_pages.load(std::memory_order_relaxed);
+            std::atomic<int>* dirty_count = range.dirty_count.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if((sequence & 1) || range.sequence.load(std::memory_order_relaxed) != sequence
+               || address < start || address >= end) {
+                continue;
+            }
+
+            uintptr_t offset = (address - start) / s_page_size;
+            int page = first_page + static_cast<int>(offset);
+
+            // Two threads can fault on the same page, only one lists it
+            if(!dirty[page].exchange(1)) {
+                dirty_pages[dirty_count->fetch_add(1)] = page;
+            }
+
+            // Faulting on the page forever would hang instead of crashing
+            if(mprotect(reinterpret_cast<void*>(start + offset*s_page_size), s_page_size, PROT_READ | PROT_WRITE) == 0) {
+                return;
+            }
+            chainHandler(signal, info, context);
+            return;
+        }
+    }
+
+    // Not a page we protected, so it's someone else's handler or a real crash
+    chainHandler(signal, info, context);
+}
+
+// Install the handler for the first ring tracking pages
+static bool acquireHandler(size_t page_size)
+{
+    std::lock_guard<std::mutex> lock(s_handler_mutex);
+    if(s_handler_users > 0) {
+        s_handler_users++;
+        return true;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = onWrite;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    s_page_size = page_size;
+    if(sigaction(SIGSEGV, &action, &s_previous_handler) != 0) {
+        return false;
+    }
+
+    s_handler_users = 1;
+    return true;
+}
+
+// Put the previous handler back once the last ring stops tracking pages
+static void releaseHandler()
+{
+    std::lock_guard<std::mutex> lock(s_handler_mutex);
+    if(--s_handler_users == 0) {
+        sigaction(SIGSEGV, &s_previous_handler, nullptr);
+    }
+}
+#endif
+
+SnapshotRing::SnapshotRing()
+{
+    m_state_size = 0;
+    m_slots = SNAPSHOT_SLOTS;
+    m_copied_size = 0;
+    m_slot_size = 0;
+    m_arena = nullptr;
+    m_last_frame = NO_FRAME;
+
+    m_incremental = false;
+#ifdef __linux__
+    m_page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+    m_page_size = 4096;
+#endif
+    m_dirty_count = 0;
+    m_pages_saved = 0;
+    m_protect_failed = false;
+    m_logger = nullptr;
+}
+
+SnapshotRing::~SnapshotRing()
+{
+    untrack();
+
+#ifdef __linux__
+    if(m_incremental) {
+        releaseHandler();
+    }
+#endif
+}
+
+void SnapshotRing::addRegion(void* data, size_t size, const size_t* used, bool hashed)
+{
+    Region region;
+    region.data = static_cast<char*>(data);
+    region.size = size;
+    region.offset = 0;
+    region.used = used;
+    region.hashed = hashed;
+    m_regions.push_back(region);
+
+    allocate();
+}
+
+void SnapshotRing::clearRegions()
+{
+    m_regions.clear();
+    allocate();
+}
+
+void SnapshotRing::setSlots(int slots)
+{
+    m_slots = 1;
+    while(m_slots < slots) {
+        m_slots *= 2;
+    }
+
+    allocate();
+}
+
+bool SnapshotRing::setIncremental(bool incremental)
+{
+#ifdef __linux__
+    bool wanted = incremental;
+    if(incremental && !m_incremental && !acquireHandler(m_page_size)) {
+        LogRing << "Can't catch writes to the state, copying all of it" << endline;
+        incremental = false;
+    }
+
+    bool was_incremental = m_incremental;
+    m_incremental = incremental;
+    allocate();
+
+    // Only once no page is protected
+    if(was_incremental && !incremental) {
+        releaseHandler();
+    }
+    return incremental == wanted;
+#else
+    // Only full copies without a way to catch the writes
+    return !incremental;
+#endif
+}
+
+void SnapshotRing::stopTracking(int frame)
+{
+    LogRing << "Can't write protect the state, copying all of it from frame " << frame << endline;
+    setIncremental(false);
+    save(frame);
+}
+
+void SnapshotRing::layOut()
+{
+    m_copies.clear();
+    m_pages.clear();
+    m_state_size = 0;
+    m_copied_size = 0;
+
+    for(unsigned int i=0; i<m_regions.size(); i++) {
+        char* data = m_regions[i].data;
+        size_t size = m_regions[i].size;
+        m_state_size += size;
+
+        // Only pages entirely inside the region are protected, the ends are copied
+        uintptr_t address = reinterpret_cast<uintptr_t>(data);
+        uintptr_t first = (address + m_page_size-1) & ~(m_page_size-1);
+        uintptr_t last = (address + size) & ~(m_page_size-1);
+
+        Region copy;
+        copy.used = nullptr;
+        if(m_incremental && first < last) {
+            copy.data = data;
+            copy.size = first - address;
+            if(copy.size > 0) {
+                copy.offset = m_copied_size;
+                m_copies.push_back(copy);
+                m_copied_size += (copy.size + SNAPSHOT_ALIGNMENT-1) & ~(SNAPSHOT_ALIGNMENT-1);
+            }
+
+            for(uintptr_t page=first; page<last; page+=m_page_size) {
+                m_pages.push_back(reinterpret_cast<char*>(page));
+            }
+
+            copy.data = reinterpret_cast<char*>(last);
+            copy.size = address + size - last;
+        } else {
+            copy.data = data;
+            copy.size = size;
+            copy.used = m_regions[i].used;
+        }
+
+        if(copy.size > 0) {
+            copy.offset = m_copied_size;
+            m_copies.push_back(copy);
+            m_copied_size += (copy.size + SNAPSHOT_ALIGNMENT-1) & ~(SNAPSHOT_ALIGNMENT-1);
+        }
+    }
+}
+
+void SnapshotRing::allocate()
+{
+    untrack();
+    m_protect_failed = false;
+    layOut();
+
+    size_t pages = m_pages.size();
+    m_slot_size = m_copied_size + pages*m_page_size;
+
+    std::vector<char>().swap(m_memory);
+    m_arena = nullptr;
+    if(m_slot_size > 0) {
+        m_memory.resize(m_slot_size * m_slots + SNAPSHOT_ALIGNMENT);
+        uintptr_t start = reinterpret_cast<uintptr_t>(&m_memory[0]);
+        m_arena = &m_memory[0] + ((SNAPSHOT_ALIGNMENT - start % SNAPSHOT_ALIGNMENT) % SNAPSHOT_ALIGNMENT);
+    }
+
+    m_frames.assign(m_slots, NO_FRAME);
+    m_last_frame = NO_FRAME;
+    m_lengths.assign(m_copies.size() * m_slots, 0);
+
+    // Room for every page to be written in every frame, so nothing is allocated during the match
+    std::vector<char>(pages*m_page_size).swap(m_shadow);
+    m_written.assign(pages > 0 ? m_slots : 0, std::vector<int>());
+    for(unsigned int i=0; i<m_written.size(); i++) {
+        m_written[i].reserve(pages);
+    }
+
+    m_dirty.reset(pages > 0 ? new std::atomic<unsigned char>[pages] : nullptr);
+    for(size_t i=0; i<pages; i++) {
+        m_dirty[i] = 0;
+    }
+    m_dirty_pages.assign(pages, 0);
+    m_dirty_count = 0;
+
+    m_runs.clear();
+    for(size_t i=0; i<pages; ) {
+        size_t end = i+1;
+        while(end < pages && m_pages[end] == m_pages[end-1] + m_page_size) {
+            end++;
+        }
+
+        Region run;
+        run.data = m_pages[i];
+        run.size = (end-i)*m_page_size;
+        run.offset = i;
+        m_runs.push_back(run);
+
+        i = end;
+    }
+
+#ifdef __linux__
+    // Tell the fault handler about every run
+    for(unsigned int i=0; i<m_runs.size(); i++) {
+        TrackedRange* range = claimRange();
+        uintptr_t start = reinterpret_cast<uintptr_t>(m_runs[i].data);
+        writeRange(*range, start, start + m_runs[i].size, static_cast<int>(m_runs[i].offset), m_dirty.get(),
+                   &m_dirty_pages[0], &m_dirty_count);
+        m_ranges.push_back(range);
+    }
+#endif
+}
+
+void SnapshotRing::track()
+{
+    for(unsigned int i=0; i<m_pages.size(); i++) {
+        memcpy(&m_shadow[i*m_page_size], m_pages[i], m_page_size);
+        m_dirty[i] = 0;
+    }
+    m_dirty_count = 0;
+
+    protectRuns(false);
+}
+
+void SnapshotRing::untrack()
+{
+    if(m_pages.empty()) {
+        return;
+    }
+
+    protectRuns(true);
+
+#ifdef __linux__
+    for(unsigned int i=0; i<m_ranges.size(); i++) {
+        releaseRange(m_ranges[i]);
+    }
+    m_ranges.clear();
+#endif
+
+    m_pages.clear();
+    m_runs.clear();
+}
+
+void SnapshotRing::protectRuns(bool writable)
+{
+#ifdef __linux__
+    int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+
+    for(unsigned int i=0; i<m_runs.size(); i++) {
+        if(mprotect(m_runs[i].data, m_runs[i].size, protection) != 0) {
+            LogRing << "Failed to protect the state: " << strerror(errno) << endline;
+            m_protect_failed = true;
+        }
+    }
+#endif
+}
+
+void SnapshotRing::protect(const int* pages, int count, bool writable)
+{
+#ifdef __linux__
+    int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+
+    for(int i=0; i<count; ) {
+        char* start = m_pages[pages[i]];
+        int end = i+1;
+        while(end < count && m_pages[pages[end]] == start + (end-i)*m_page_size) {
+            end++;
+        }
+
+        if(mprotect(start, (end-i)*m_page_size, protection) != 0) {
+            LogRing << "Failed to protect a page of the state: " << strerror(errno) << endline;
+            m_protect_failed = true;
+        }
+        i = end;
+    }
+#endif
+}
+
+void SnapshotRing::save(int frame)
+{
+    int index = frame & (m_slots-1);
+    char* snapshot = slot(frame);
+    size_t* lengths = m_lengths.data() + index * m_copies.size();
+    for(unsigned int i=0; i<m_copies.size(); i++) {
+        size_t length = m_copies[i].size;
+        if(m_copies[i].used) {
+            size_t used = *m_copies[i].used;
+            length = used < length ? used : length;
+        }
+
+        streamCopy(snapshot + m_copies[i].offset, m_copies[i].data, length);
+        lengths[i] = length;
+    }
+
+    if(!m_pages.empty()) {
+        if(m_last_frame == NO_FRAME || frame != m_last_frame+1) {
+            // Nothing to build on, so start again from every page
+            track();
+            m_frames.assign(m_slots, NO_FRAME);
+            m_written[index].clear();
+            m_pages_saved = static_cast<int>(m_pages.size());
+        } else {
+            // Keep the pages written during the frame as they were before it, and catch up the shadow copy.
+            // In order, so neighbouring pages are protected together
+            int count = m_dirty_count.load(std::memory_order_acquire);
+            std::vector<int>& written = m_written[index];
+            written.assign(m_dirty_pages.begin(), m_dirty_pages.begin()+count);
+            std::sort(written.begin(), written.end());
+
+            char* before = snapshot + m_copied_size;
+            for(int i=0; i<count; i++) {
+                char* shadow = &m_shadow[written[i]*m_page_size];
+                streamCopy(before + i*m_page_size, shadow, m_page_size);
+                memcpy(shadow, m_pages[written[i]], m_page_size);
+                m_dirty[written[i]] = 0;
+            }
+
+            if(count > PROTECT_EACH_RUN) {
+                protectRuns(false);
+            } else {
+                protect(written.data(), count, false);
+            }
+            m_dirty_count = 0;
+            m_pages_saved = count;
+        }
+    }
+
+#ifdef SHOBU_SNAPSHOT_STREAM
+    // Streamed stores have to land before the snapshot is read back
+    _mm_sfence();
+#endif
+
+    m_frames[index] = frame;
+    m_last_frame = frame;
+
+    // Writes to pages left writable would go unnoticed
+    if(m_protect_failed) {
+        stopTracking(frame);
+    }
+}
+
+bool SnapshotRing::restore(int frame)
+{
+    if(m_frames[frame & (m_slots-1)] != frame || frame > m_last_frame) {
+        return false;
+    }
+
+    const char* snapshot = slot(frame);
+    const size_t* lengths = m_lengths.data() + (frame & (m_slots-1)) * m_copies.size();
+    for(unsigned int i=0; i<m_copies.size(); i++) {
+        memcpy(m_copies[i].data, snapshot + m_copies[i].offset, lengths[i]);
+    }
+
+    if(!m_pages.empty()) {
+        // Pages written since the last snapshot go back to how they were in it
+        int written = m_dirty_count.load(std::memory_order_acquire);
+        for(int i=0; i<written; i++) {
+            memcpy(m_pages[m_dirty_pages[i]], &m_shadow[m_dirty_pages[i]*m_page_size], m_page_size);
+        }
+
+        // Every page a later frame wrote has to be writable again to undo it
+        for(int later=m_last_frame; later>frame; later--) {
+            const std::vector<int>& pages = m_written[later & (m_slots-1)];
+            for(unsigned int i=0; i<pages.size(); i++) {
+                if(!m_dirty[pages[i]].exchange(1)) {
+                    m_dirty_pages[m_dirty_count.fetch_add(1)] = pages[i];
+                }
+            }
+        }
+
+        int count = m_dirty_count.load();
+        std::sort(m_dirty_pages.begin()+written, m_dirty_pages.begin()+count);
+
+        int runs = 0;
+        for(int i=written; i<count; i++) {
+            if(i == written || m_pages[m_dirty_pages[i]] != m_pages[m_dirty_pages[i-1]] + m_page_size) {
+                runs++;
+            }
+        }
+
+        // With many scattered pages it's cheaper to open up all of them and protect them again after.
+        // Otherwise the pages are left writable and listed as written, for the next snapshot to protect
+        bool every_page = static_cast<size_t>(runs) * PAGES_PER_PROTECT > m_pages.size();
+        if(every_page) {
+            protectRuns(true);
+        } else {
+            protect(m_dirty_pages.data()+written, count-written, true);
+        }
+
+        // Then the writes are undone, newest first
+        for(int later=m_last_frame; later>frame; later--) {
+            const std::vector<int>& pages = m_written[later & (m_slots-1)];
+            const char* before = slot(later) + m_copied_size;
+
+            for(unsigned int i=0; i<pages.size(); i++) {
+                memcpy(m_pages[pages[i]], before + i*m_page_size, m_page_size);
+                memcpy(&m_shadow[pages[i]*m_page_size], before + i*m_page_size, m_page_size);
+            }
+        }
+
+        if(every_page) {
+            protectRuns(false);
+            for(int i=0; i<count; i++) {
+                m_dirty[m_dirty_pages[i]] = 0;
+            }
+            m_dirty_count = 0;
+        }
+    }
+
+    // The later frames will be run again
+    for(int later=m_last_frame; later>frame && later>m_last_frame-m_slots; later--) {
+        m_frames[later & (m_slots-1)] = NO_FRAME;
+    }
+    m_last_frame = frame;
+
+    if(m_protect_failed) {
+        stopTracking(frame);
+    }
+
+    return true;
+}
+
+uint64_t SnapshotRing::hash() const
+{
+    uint64_t hash = 0;
+    for(unsigned int i=0; i<m_regions.size(); i++) {
+        if(!m_regions[i].hashed) {
+            continue;
+        }
+
+        size_t size = m_regions[i].size;
+        if(m_regions[i].used) {
+            size_t used = *m_regions[i].used;
+            size = used < size ? used : size;
+        }
+
+        hash = hash64(m_regions[i].data, size, hash);
+    }
+
+    return hash;
+}
+
+bool SnapshotRing::hashesAll() const
+{
+    for(unsigned int i=0; i<m_regions.size(); i++) {
+        if(!m_regions[i].hashed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void SnapshotRing::invalidate()
+{
+    m_frames.assign(m_slots, NO_FRAME);
+    m_last_frame = NO_FRAME;
+}
@@ -0,0 +1,174 @@
+#ifndef SHOBU_NETWORK_SNAPSHOT_H
+#define SHOBU_NETWORK_SNAPSHOT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class NetworkLogger;
+struct TrackedRange;
+
+// Bytes each region and each snapshot is aligned to, a cache line
+const size_t SNAPSHOT_ALIGNMENT = 64;
+
+/*! Copies of the game's state for each of the last few frames, in one block of memory allocated up front.
+ *  The game registers the memory its state lives in, and a snapshot copies every region into the frame's slot
+ *  with stores that bypass the cache, since a snapshot is rarely read back.
+ *  Any frame still in the ring can be restored, so a rollback only goes back as far as it has to
+ */
+class SnapshotRing
+{
+    public:
+    SnapshotRing();
+    ~SnapshotRing();
+
+    SnapshotRing(const SnapshotRing&) = delete;
+    SnapshotRing& operator=(const SnapshotRing&) = delete;
+
+    /*! Add memory the game's state lives in.  Allocates room for every slot, so call before the match
+     * \param data start of the memory, which must stay where it is
+     * \param size bytes of it
+     * \param used bytes from the start actually in use when that changes, like in a StateArena.  Only those are copied
+     * \param hashed false to leave the region out of the hash, when it holds addresses that differ between peers
+     */
+    void addRegion(void* data, size_t size, const size_t* used = nullptr, bool hashed = true);
+
+    // Forget every region
+    void clearRegions();
+
+    // True when no regions are registered
+    bool empty() const { return m_regions.empty(); }
+
+    /*! Frames kept.  Rounded up to a power of two and reallocates the ring, so call before the match
+     * \param slots frames to keep, at least one more than the longest rollback
+     */
+    void setSlots(int slots);
+
+    /*! Only copy the pages written since the last snapshot.  Every whole page of the regions is write protected after
+     *  a snapshot and the first write to it is caught, so saving and restoring cost what the game changed rather
+     *  than the size of its state.  The parts of regions that don't fill a page are still copied every frame.
+     *  Nothing but the game's own code may write to the regions, a system call like recv fails on a protected page
+     *  instead of faulting.  Only supported on Linux
+     * \param incremental true to track written pages, false to copy every region whole
+     * \return false when pages can't be tracked here, and every region is copied whole
+     */
+    bool setIncremental(bool incremental);
+
+    // True while only written pages are copied.  Set back to false when the pages can't be protected anymore
+    bool isIncremental() const { return m_incremental; }
+
+    // Copy every region into the slot of a frame
+    void save(int frame);
+
+    /*! Copy a frame's snapshot back into the regions.  Snapshots of later frames are dropped
+     * \return false when the frame is no longer in the ring
+     */
+    bool restore(int frame);
+
+    // Forget every snapshot taken, like at the start of a match
+    void invalidate();
+
+    // Bytes of one snapshot
+    size_t getStateSize() const { return m_state_size; }
+
+    // 64 bit hash of every hashed region as it is now, in the order they were added
+    uint64_t hash() const;
+
+    // True when no region is left out of the hash
+    bool hashesAll() const;
+
+    // Pages copied by the last snapshot when only written pages are
+    int getPagesSaved() const { return m_pages_saved; }
+
+    // Where failures to track pages are logged, nowhere when nullptr
+    void setLogger(NetworkLogger* logger) { m_logger = logger; }
+
+    private:
+    struct Region {
+        char* data;
+        size_t size;
+
+        // Where the region starts in each snapshot
+        size_t offset;
+
+        // Bytes from the start in use, or nullptr when all of them are
+        const size_t* used;
+
+        bool hashed;
+    };
+
+    // Lay the regions out in each snapshot and allocate the ring
+    void allocate();
+
+    // Split the regions into whole pages to track and the rest to copy
+    void layOut();
+
+    // Write protect the whole pages or let them be written again
+    void track();
+    void untrack();
+
+    // Change the protection of every tracked page, or of a sorted list of them a run of neighbouring pages at a time
+    void protectRuns(bool writable);
+    void protect(const int* pages, int count, bool writable);
+
+    // Copy every region whole from a frame on, when pages written to could go unnoticed
+    void stopTracking(int frame);
+
+    char* slot(int frame) { return m_arena + static_cast<size_t>(frame & (m_slots-1)) * m_slot_size; }
+
+    std::vector<Region> m_regions;
+    size_t m_state_size;
+    int m_slots;
+
+    // What is copied whole into the start of every snapshot, every region unless pages are tracked
+    std::vector<Region> m_copies;
+    size_t m_copied_size;
+
+    // Bytes of each copy in each slot, for the regions only partly in use
+    std::vector<size_t> m_lengths;
+
+    // Bytes of one slot.  Tracked pages written during a frame are kept after the copies, as they were before it
+    size_t m_slot_size;
+
+    // The snapshots, aligned within the memory
+    std::vector<char> m_memory;
+    char* m_arena;
+
+    // Frame each slot holds, or a frame that can't be asked for when it holds none
+    std::vector<int> m_frames;
+    int m_last_frame;
+
+    bool m_incremental;
+    size_t m_page_size;
+
+    // Start of every tracked page
+    std::vector<char*> m_pages;
+
+    // Runs of neighbouring tracked pages, with the index of the first page as the offset
+    std::vector<Region> m_runs;
+
+    // Where the fault handler looks up each run
+    std::vector<TrackedRange*> m_ranges;
+
+    // Set when changing the protection of a page failed since the ring was allocated
+    bool m_protect_failed;
+
+    // Every tracked page as of the last snapshot
+    std::vector<char> m_shadow;
+
+    // Pages written during each slot's frame
+    std::vector<std::vector<int>> m_written;
+
+    // Pages written since the last snapshot.  Filled in by the fault handler, so never reallocated while tracking
+    std::unique_ptr<std::atomic<unsigned char>[]> m_dirty;
+    std::vector<int> m_dirty_pages;
+    std::atomic<int> m_dirty_count;
+
+    int m_pages_saved;
+
+    NetworkLogger* m_logger;
+};
+
+#endif // SHOBU_NETWORK_SNAPSHOT_H
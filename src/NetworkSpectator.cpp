@@ -0,0 +1,629 @@
+#include "NetworkSpectator.h"
+#include "NetworkPacket.h"
+#include "NetworkHash.h"
+#include "NetworkLogger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+static_assert(SPECTATOR_REDUNDANCY < SPECTATOR_FRAMES, "Each broadcast must have room for new frames");
+
+static long long steadyMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool sameAddress(const struct sockaddr_in& a, const struct sockaddr_in& b)
+{
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+SpectatorBroadcaster::SpectatorBroadcaster() : m_running(false), m_input_bits(32)
+{
+    m_sent = -1;
+    m_base = 0;
+    m_secret = 0;
+
+    m_spectator_count = 0;
+    m_frame_count = 0;
+    m_packets = 0;
+    m_datagrams = 0;
+    m_catchup_packets = 0;
+    m_send_time = 0;
+}
+
+SpectatorBroadcaster::~SpectatorBroadcaster()
+{
+    stop();
+}
+
+bool SpectatorBroadcaster::start(int port)
+{
+    if(m_running) {
+        return false;
+    }
+
+    if(!m_transport.open()) {
+        LogMessage << "Could not create spectator socket" << endline;
+        return false;
+    }
+
+    if(!m_transport.bind(port)) {
+        LogMessage << "Could not bind spectator socket to port " << port << endline;
+        m_transport.close();
+        return false;
+    }
+
+    std::chrono::steady_clock::duration since = std::chrono::steady_clock::now().time_since_epoch();
+    m_secret = hashMix(static_cast<uint64_t>(since.count()), reinterpret_cast<uintptr_t>(this));
+
+    m_running = true;
+    m_thread = std::thread(&SpectatorBroadcaster::run, this);
+
+    LogMessage << "Broadcasting to spectators on port " << port << endline;
+    return true;
+}
+
+void SpectatorBroadcaster::stop()
+{
+    if(!m_running) {
+        return;
+    }
+
+    m_running = false;
+    m_thread.join();
+    m_transport.close();
+
+    m_spectators.clear();
+    m_spectator_count = 0;
+}
+
+bool SpectatorBroadcaster::addFrame(int frame, const NetworkInput& player1, const NetworkInput& player2)
+{
+    SpectatorFrame* slot = m_handoff.acquire();
+    if(!slot) {
+        return false;
+    }
+
+    slot->frame = frame;
+    slot->inputs[0] = player1;
+    slot->inputs[1] = player2;
+    m_handoff.publish();
+
+    return true;
+}
+
+void SpectatorBroadcaster::getStats(BroadcastStats& stats)
+{
+    stats.spectators = m_spectator_count;
+    stats.frames = m_frame_count;
+    stats.packets = m_packets;
+    stats.datagrams = m_datagrams;
+    stats.catchup_packets = m_catchup_packets;
+    stats.send_time = m_send_time / 1000;
+}
+
+void SpectatorBroadcaster::run()
+{
+    long long next_broadcast = steadyMs();
+
+    while(m_running) {
+        long long now = steadyMs();
+        if(now < next_broadcast) {
+            m_transport.wait(static_cast<int>(next_broadcast - now));
+            now = steadyMs();
+        }
+
+        takeFrames();
+        receive(now);
+
+        if(now < next_broadcast) {
+            continue;
+        }
+        next_broadcast = now + SPECTATOR_INTERVAL_MS;
+
+        broadcast();
+
+        // Forget spectators that stopped sending keep alives
+        for(unsigned int i=0; i<m_spectators.size();) {
+            if(now - m_spectators[i].last_heard > SPECTATOR_TIMEOUT_MS) {
+                m_spectators[i] = m_spectators.back();
+                m_spectators.pop_back();
+            } else {
+                i++;
+            }
+        }
+        m_spectator_count = m_spectators.size();
+    }
+}
+
+void SpectatorBroadcaster::receive(long long now)
+{
+    char packet[MAX_PACKET_SIZE];
+
+    while(m_transport.wait(0)) {
+        struct sockaddr_in address;
+        socklen_t address_size = sizeof(address);
+        int size = recvfrom(m_transport.getSocket(), packet, MAX_PACKET_SIZE, 0, (struct sockaddr*)&address, &address_size);
+        if(size <= 0) {
+            break;
+        }
+
+        switch(packet[0]) {
+        case 'j': // Spectator joined, or is still watching
+            handleJoin(packet, size, address, now);
+            break;
+        case 'l': // Spectator left
+            for(unsigned int i=0; i<m_spectators.size(); i++) {
+                if(sameAddress(m_spectators[i].address, address)) {
+                    m_spectators[i] = m_spectators.back();
+                    m_spectators.pop_back();
+                    break;
+                }
+            }
+            m_spectator_count = m_spectators.size();
+            break;
+        default:
+            LogNull << "Got unknown spectator request " << (int)packet[0] << endline;
+            break;
+        }
+    }
+}
+
+uint32_t SpectatorBroadcaster::joinToken(const struct sockaddr_in& address)
+{
+    uint64_t key = (static_cast<uint64_t>(address.sin_addr.s_addr) << 16) | address.sin_port;
+    uint32_t token = static_cast<uint32_t>(hashMix(m_secret, key));
+
+    // 0 is what spectators send before they have a token
+    return token != 0 ? token : 1;
+}
+
+void SpectatorBroadcaster::handleJoin(const char* packet, int size, const struct sockaddr_in& address, long long now)
+{
+    PacketReader reader(packet+1, size-1);
+    unsigned char version = reader.readByte();
+    uint32_t next_frame = reader.readVarint();
+    uint32_t token = reader.readBits(32);
+    if(reader.error() || version != SPECTATOR_VERSION) {
+        return;
+    }
+
+    // Nothing but the token goes to an address until it sends the token back, and the reply is smaller than the join
+    uint32_t expected = joinToken(address);
+    if(token != expected) {
+        char reply[8];
+        PacketWriter writer(reply, sizeof(reply));
+        writer.writeByte('k');
+        writer.writeByte(SPECTATOR_VERSION);
+        writer.writeBits(expected, 32);
+        if(writer.size() <= size) {
+            m_transport.sendTo(address, reply, writer.size());
+        }
+        return;
+    }
+
+    // Frames from before the history or after the newest one can't be sent
+    int newest = m_base + static_cast<int>(m_history[0].size()) - 1;
+    int next = static_cast<int>(std::min<uint32_t>(next_frame, static_cast<uint32_t>(newest+1)));
+    next = std::max(next, m_base);
+
+    Spectator* spectator = nullptr;
+    for(unsigned int i=0; i<m_spectators.size(); i++) {
+        if(sameAddress(m_spectators[i].address, address)) {
+            spectator = &m_spectators[i];
+            break;
+        }
+    }
+
+    if(!spectator) {
+        Spectator joined;
+        joined.address = address;
+        m_spectators.push_back(joined);
+        m_spectator_count = m_spectators.size();
+
+        spectator = &m_spectators.back();
+    }
+    spectator->last_heard = now;
+
+    // The next broadcast repeats a few frames, anything older has to be sent to the spectator alone.
+    // So does everything when no frames are waiting, since there may not be a next broadcast
+    if(next <= newest && (next < m_sent+1 - SPECTATOR_REDUNDANCY || m_sent >= newest)) {
+        catchUp(address, next);
+    }
+}
+
+void SpectatorBroadcaster::takeFrames()
+{
+    while(SpectatorFrame* frame = m_handoff.front()) {
+        int next = m_base + static_cast<int>(m_history[0].size());
+
+        if(frame->frame >= m_base && frame->frame < next) {
+            // Going back means a new match, or the session going back after a reset
+            for(int i=0; i<2; i++) {
+                m_history[i].resize(frame->frame - m_base);
+            }
+            m_sent = std::min(m_sent, frame->frame-1);
+        } else if(frame->frame != next) {
+            // The frames in between are gone, so start again from this one.  Spectators skip ahead to it
+            LogNull << "Spectator frame " << frame->frame << " isn't after " << next-1 << ", starting again from it" << endline;
+            for(int i=0; i<2; i++) {
+                m_history[i].clear();
+            }
+            m_base = frame->frame;
+            m_sent = frame->frame-1;
+        }
+
+        for(int i=0; i<2; i++) {
+            m_history[i].push_back(frame->inputs[i]);
+        }
+
+        m_handoff.pop();
+    }
+
+    m_frame_count = m_base + m_history[0].size();
+}
+
+void SpectatorBroadcaster::broadcast()
+{
+    int newest = m_base + static_cast<int>(m_history[0].size()) - 1;
+
+    while(m_sent < newest) {
+        int first = std::max(m_base, m_sent+1 - SPECTATOR_REDUNDANCY);
+        int size = 0;
+        int count = encode(first, std::min(newest-first+1, SPECTATOR_FRAMES), size);
+
+        // Inputs too big to repeat any, so only send new frames
+        if(first + count - 1 <= m_sent) {
+            first = m_sent+1;
+            count = encode(first, std::min(newest-first+1, SPECTATOR_FRAMES), size);
+        }
+
+        if(count <= 0) {
+            break;
+        }
+
+        fanOut(size);
+        m_sent = first + count - 1;
+    }
+}
+
+int SpectatorBroadcaster::encode(int first, int count, int& size)
+{
+    int bits = m_input_bits;
+
+    // Inputs that change every frame take more room, so send fewer at a time until they fit
+    while(count > 0) {
+        PacketWriter writer(m_packet, MAX_PACKET_SIZE);
+        writer.writeByte('v');
+        writer.writeByte(SPECTATOR_VERSION);
+        writer.writeByte(bits);
+        writer.writeByte(SHOBU_INPUT_SIZE);
+        writer.writeVarint(first);
+        writer.writeVarint(count);
+        writer.writeVarint(m_base + m_history[0].size()-1);
+        writer.writeVarint(m_base);
+        writer.writeInputs(&m_history[0][first - m_base], count, bits);
+        writer.writeInputs(&m_history[1][first - m_base], count, bits);
+
+        if(!writer.overflow()) {
+            size = writer.size();
+            return count;
+        }
+
+        count /= 2;
+    }
+
+    return 0;
+}
+
+void SpectatorBroadcaster::fanOut(int size)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int total = m_spectators.size();
+    int sent = 0;
+
+    m_packets.fetch_add(1, std::memory_order_relaxed);
+
+#ifdef __linux__
+    // Every message points at the same packet, only the address differs
+    m_iovec.iov_base = m_packet;
+    m_iovec.iov_len = size;
+
+    for(int batch=0; batch<total; batch+=SPECTATOR_BATCH) {
+        int count = std::min(SPECTATOR_BATCH, total-batch);
+        for(int i=0; i<count; i++) {
+            memset(&m_messages[i].msg_hdr, 0, sizeof(m_messages[i].msg_hdr));
+            m_messages[i].msg_hdr.msg_name = &m_spectators[batch+i].address;
+            m_messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            m_messages[i].msg_hdr.msg_iov = &m_iovec;
+            m_messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        // sendmmsg can send fewer packets than asked, so keep going until it fails
+        int done = 0;
+        while(done < count) {
+            int result = sendmmsg(m_transport.getSocket(), &m_messages[done], count-done, 0);
+            if(result <= 0) {
+                break;
+            }
+            done += result;
+        }
+        sent += done;
+    }
+#else
+    for(int i=0; i<total; i++) {
+        if(m_transport.sendTo(m_spectators[i].address, m_packet, size)) {
+            sent++;
+        }
+    }
+#endif
+
+    m_datagrams.fetch_add(sent, std::memory_order_relaxed);
+    m_send_time.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+}
+
+void SpectatorBroadcaster::catchUp(const struct sockaddr_in& address, int first)
+{
+    int newest = m_base + static_cast<int>(m_history[0].size()) - 1;
+
+    for(int i=0; i<SPECTATOR_CATCHUP_PACKETS && first <= newest; i++) {
+        int size = 0;
+        int count = encode(first, std::min(newest-first+1, SPECTATOR_FRAMES), size);
+        if(count <= 0) {
+            break;
+        }
+
+        m_transport.sendTo(address, m_packet, size);
+        m_catchup_packets.fetch_add(1, std::memory_order_relaxed);
+        first += count;
+    }
+}
+
+ShobuSpectator::ShobuSpectator()
+{
+    m_connected = false;
+    m_clock = &systemClock();
+
+    m_updateCallback = nullptr;
+    m_inputCallback = nullptr;
+    m_userData = nullptr;
+    m_relay = nullptr;
+
+    m_buffer_delay = 6;
+    m_buffering = true;
+
+    m_frame = -1;
+    m_received = -1;
+    m_latest = -1;
+    m_relayed = -1;
+    m_skipped = 0;
+    m_token = 0;
+
+    m_last_join = 0;
+    m_stalls = 0;
+}
+
+ShobuSpectator::~ShobuSpectator()
+{
+    disconnect();
+}
+
+bool ShobuSpectator::connect(const char* ip_addr, int port)
+{
+    disconnect();
+
+    if(!m_transport.open()) {
+        LogMessage << "Could not create spectator socket" << endline;
+        return false;
+    }
+    m_transport.setRemote(ip_addr, port);
+
+    for(unsigned int i=0; i<SPECTATOR_BUFFER; i++) {
+        m_frames[i].frame = -1;
+    }
+
+    m_buffering = true;
+    m_frame = -1;
+    m_received = -1;
+    m_latest = -1;
+    m_relayed = -1;
+    m_stalls = 0;
+    m_skipped = 0;
+    m_token = 0;
+
+    m_connected = true;
+    sendJoin();
+
+    return true;
+}
+
+void ShobuSpectator::disconnect()
+{
+    if(!m_connected) {
+        return;
+    }
+
+    char packet = 'l';
+    m_transport.sendNow(&packet, 1);
+    m_transport.close();
+
+    m_connected = false;
+}
+
+void ShobuSpectator::registerCallback(void (*update)(void*, int, int), void* userData)
+{
+    m_updateCallback = update;
+    m_inputCallback = nullptr;
+    m_userData = userData;
+}
+
+void ShobuSpectator::registerInputCallback(void (*update)(void*, const NetworkInput&, const NetworkInput&), void* userData)
+{
+    m_updateCallback = nullptr;
+    m_inputCallback = update;
+    m_userData = userData;
+}
+
+void ShobuSpectator::sendJoin()
+{
+    char packet[16];
+    PacketWriter writer(packet, sizeof(packet));
+    writer.writeByte('j');
+    writer.writeByte(SPECTATOR_VERSION);
+    writer.writeVarint(m_received+1);
+    writer.writeBits(m_token, 32);
+
+    m_transport.sendNow(packet, writer.size());
+    m_last_join = m_clock->nowMs();
+}
+
+bool ShobuSpectator::receivePackets()
+{
+    if(!m_connected) {
+        return false;
+    }
+
+    return m_transport.receive(handlePacket, this);
+}
+
+void ShobuSpectator::handlePacket(void* data, const char* packet, int size, long long)
+{
+    if(size > 0 && packet[0] == 'v') {
+        static_cast<ShobuSpectator*>(data)->handleFrames(packet, size);
+    } else if(size > 0 && packet[0] == 'k') {
+        static_cast<ShobuSpectator*>(data)->handleToken(packet, size);
+    }
+}
+
+void ShobuSpectator::handleToken(const char* packet, int size)
+{
+    PacketReader reader(packet+1, size-1);
+    unsigned char version = reader.readByte();
+    uint32_t token = reader.readBits(32);
+    if(reader.error() || version != SPECTATOR_VERSION) {
+        return;
+    }
+
+    // Join again right away, now with the token
+    m_token = token;
+    sendJoin();
+}
+
+void ShobuSpectator::handleFrames(const char* packet, int size)
+{
+    PacketReader reader(packet+1, size-1);
+    unsigned char version = reader.readByte();
+    int bits = reader.readByte();
+    int input_size = reader.readByte();
+    int first = reader.readVarint();
+    int count = reader.readVarint();
+    int latest = reader.readVarint();
+    int base = reader.readVarint();
+    if(reader.error() || version != SPECTATOR_VERSION || count <= 0 || count > SPECTATOR_FRAMES || bits > 32 || input_size != SHOBU_INPUT_SIZE) {
+        return;
+    }
+
+    NetworkInput inputs[2][SPECTATOR_FRAMES];
+    if(!reader.readInputs(inputs[0], count, bits) || !reader.readInputs(inputs[1], count, bits)) {
+        return;
+    }
+
+    if(m_relay) {
+        m_relay->setInputBits(bits);
+    }
+    m_latest = std::max(m_latest, latest);
+
+    // The broadcaster started again after frames we never got, so skip ahead to where it starts
+    if(base > m_received+1) {
+        LogNull << "Spectator skipped frames " << m_received+1 << " to " << base-1 << endline;
+        m_skipped += base-1 - m_received;
+        m_received = base-1;
+        m_frame = std::max(m_frame, base-1);
+        m_relayed = std::max(m_relayed, base-1);
+        m_latest = std::max(m_latest, base-1);
+    }
+
+    // Frames too far ahead would overwrite ones the game or relay still needs
+    int oldest = m_relay ? std::min(m_frame, m_relayed) : m_frame;
+
+    for(int i=0; i<count; i++) {
+        int frame = first+i;
+        if(frame <= m_received || frame - oldest > static_cast<int>(SPECTATOR_BUFFER)) {
+            continue;
+        }
+
+        SpectatorFrame& stored = m_frames[frame & (SPECTATOR_BUFFER-1)];
+        stored.frame = frame;
+        stored.inputs[0] = inputs[0][i];
+        stored.inputs[1] = inputs[1][i];
+    }
+
+    while(m_frames[(m_received+1) & (SPECTATOR_BUFFER-1)].frame == m_received+1) {
+        m_received++;
+    }
+}
+
+void ShobuSpectator::update()
+{
+    if(!m_connected) {
+        return;
+    }
+
+    receivePackets();
+
+    // Keep the broadcaster sending to us, and ask again for frames we're missing
+    long long now = m_clock->nowMs();
+    if(now - m_last_join >= SPECTATOR_KEEPALIVE_MS || (m_latest > m_received && now - m_last_join >= SPECTATOR_RETRY_MS)) {
+        sendJoin();
+    }
+
+    if(m_relay) {
+        while(m_relayed < m_received) {
+            const SpectatorFrame& frame = m_frames[(m_relayed+1) & (SPECTATOR_BUFFER-1)];
+            if(!m_relay->addFrame(frame.frame, frame.inputs[0], frame.inputs[1])) {
+                break;
+            }
+            m_relayed++;
+        }
+    }
+
+    if(!m_updateCallback && !m_inputCallback) {
+        m_frame = m_relay ? m_relayed : m_received;
+        return;
+    }
+
+    int available = m_received - m_frame;
+    if(m_buffering) {
+        if(available < std::max(m_buffer_delay, 1)) {
+            return;
+        }
+        m_buffering = false;
+    }
+
+    if(available <= 0) {
+        m_buffering = true;
+        m_stalls++;
+        return;
+    }
+
+    runFrame();
+
+    // Fell behind, like after buffering again, so catch up a frame at a time
+    if(m_received - m_frame > 2*m_buffer_delay) {
+        runFrame();
+    }
+}
+
+void ShobuSpectator::runFrame()
+{
+    m_frame++;
+
+    const SpectatorFrame& frame = m_frames[m_frame & (SPECTATOR_BUFFER-1)];
+    if(m_inputCallback) {
+        m_inputCallback(m_userData, frame.inputs[0], frame.inputs[1]);
+    } else {
+        m_updateCallback(m_userData, frame.inputs[0].toInt(), frame.inputs[1].toInt());
+    }
+}
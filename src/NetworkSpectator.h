@@ -0,0 +1,292 @@
+#ifndef SHOBU_NETWORK_SPECTATOR_H
+#define SHOBU_NETWORK_SPECTATOR_H
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "NetworkUdp.h"
+#include "NetworkInput.h"
+#include "NetworkRing.h"
+#include "NetworkClock.h"
+
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+// Version of the spectator packets
+const unsigned char SPECTATOR_VERSION = 3;
+
+// Confirmed frames a session or relay can hand to the broadcaster between broadcasts
+const unsigned int SPECTATOR_HANDOFF_SIZE = 256;
+
+// Most frames in a spectator packet
+const int SPECTATOR_FRAMES = 64;
+
+// Frames repeated from the last broadcast, so a lost packet is covered by the next one
+const int SPECTATOR_REDUNDANCY = 16;
+
+// Milliseconds between broadcasts
+const int SPECTATOR_INTERVAL_MS = 16;
+
+// Milliseconds between a spectator's keep alives, and before a spectator asks again for frames it's missing
+const int SPECTATOR_KEEPALIVE_MS = 1000;
+const int SPECTATOR_RETRY_MS = 50;
+
+// Spectators that haven't been heard from for this long are dropped
+const int SPECTATOR_TIMEOUT_MS = 5000;
+
+// Most packets sent to catch a spectator up at a time
+const int SPECTATOR_CATCHUP_PACKETS = 8;
+
+// Spectators sent to with a single sendmmsg
+const int SPECTATOR_BATCH = 256;
+
+// Frames a spectator keeps ahead of the one it's showing.  Must be a power of two
+const unsigned int SPECTATOR_BUFFER = 1024;
+
+// Inputs of both players for one frame.  Player 1 is the host
+struct SpectatorFrame
+{
+    int frame;
+    NetworkInput inputs[2];
+};
+
+struct BroadcastStats
+{
+    int spectators;
+
+    // Confirmed frames received from the session or relay
+    int frames;
+
+    // Broadcasts encoded, and datagrams sent from them to every spectator
+    long long packets;
+    long long datagrams;
+
+    // Packets sent to spectators that joined late or missed frames
+    long long catchup_packets;
+
+    // Microseconds spent sending broadcasts
+    long long send_time;
+};
+
+/*! Streams a match's confirmed frames to any number of spectators from its own thread.
+ *  Each broadcast is encoded once and sent to every spectator with as few system calls as possible,
+ *  so the players' sessions only hand over frames and never wait on spectators.
+ *  Spectators join by sending to the broadcaster's port and ask again for any frames they missed.
+ *  A join is only answered with a token the spectator has to send back, no bigger than the join, so a join
+ *  from a forged address can't have frames sent to it
+ */
+class SpectatorBroadcaster
+{
+    public:
+    SpectatorBroadcaster();
+
+    // Stops the thread if it's still running
+    ~SpectatorBroadcaster();
+
+    /*! Bind the port spectators join on and start the thread
+     * \return false on failure, true on success
+     */
+    bool start(int port);
+
+    // Stop the thread and forget the spectators
+    void stop();
+
+    /*! Bits of each input, which must match the session's setInputBits
+     * \param bits number of significant bits in each input
+     */
+    void setInputBits(int bits) { m_input_bits = bits; }
+
+    /*! Hand over the next confirmed frame.  Only called by one thread, the session's or the relay's.
+     *  Frames must come in order.  Going back starts a new match from that frame, and skipping ahead
+     *  starts again from the new frame, since the ones in between can't be sent
+     * \return false when the broadcaster hasn't caught up with earlier frames, so try again later
+     */
+    bool addFrame(int frame, const NetworkInput& player1, const NetworkInput& player2);
+
+    void getStats(BroadcastStats& stats);
+
+    private:
+    struct Spectator {
+        struct sockaddr_in address;
+        long long last_heard;
+    };
+
+    // Thread which receives joins and sends broadcasts
+    void run();
+
+    void receive(long long now);
+    void handleJoin(const char* packet, int size, const struct sockaddr_in& address, long long now);
+
+    // Token a spectator at an address has to send back to join
+    uint32_t joinToken(const struct sockaddr_in& address);
+
+    // Take the frames handed over by the session
+    void takeFrames();
+
+    // Send every frame not yet broadcast to every spectator
+    void broadcast();
+
+    /*! Encode frames starting at first, which must be in the history, into the packet buffer
+     * \return frames that fit, with the packet size in size
+     */
+    int encode(int first, int count, int& size);
+
+    // Send the packet in the buffer to every spectator
+    void fanOut(int size);
+
+    // Send frames starting at first to one spectator
+    void catchUp(const struct sockaddr_in& address, int first);
+
+    UdpTransport m_transport;
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+
+    std::atomic<int> m_input_bits;
+
+    SpscRing<SpectatorFrame, SPECTATOR_HANDOFF_SIZE> m_handoff;
+
+    // Below is only used by the thread
+    std::vector<Spectator> m_spectators;
+
+    // Inputs of every frame of the match from m_base, so spectators can join at any time
+    std::vector<NetworkInput> m_history[2];
+    int m_base;
+
+    // Picked at start, so tokens can't be worked out from an address alone
+    uint64_t m_secret;
+
+    // Newest frame broadcast
+    int m_sent;
+
+    char m_packet[MAX_PACKET_SIZE];
+
+#ifdef __linux__
+    struct mmsghdr m_messages[SPECTATOR_BATCH];
+    struct iovec m_iovec;
+#endif
+
+    std::atomic<int> m_spectator_count;
+    std::atomic<int> m_frame_count;
+    std::atomic<long long> m_packets;
+    std::atomic<long long> m_datagrams;
+    std::atomic<long long> m_catchup_packets;
+    std::atomic<long long> m_send_time;
+};
+
+/*! Watches a match from a SpectatorBroadcaster or a relay.
+ *  The game runs without rollbacks from confirmed frames only, a few frames behind the newest one received
+ *  so late packets don't make it stutter.  Everything happens in update on the calling thread
+ */
+class ShobuSpectator
+{
+    public:
+    ShobuSpectator();
+    ~ShobuSpectator();
+
+    /*! Start watching
+     * \param ip_addr address of the broadcaster or relay
+     * \param port its port
+     * \return false on failure, true on success
+     */
+    bool connect(const char* ip_addr, int port);
+
+    // Stop watching and tell the broadcaster
+    void disconnect();
+
+    /*! Register the game's update.  The host's input comes first, so the host's own update function works
+     * \param update called once per frame
+     * \param userData passed to the callback
+     */
+    void registerCallback(void (*update)(void*, int, int), void* userData);
+
+    // Same for games with wide inputs, see ShobuNetwork::registerInputCallbacks
+    void registerInputCallback(void (*update)(void*, const NetworkInput&, const NetworkInput&), void* userData);
+
+    /*! Frames to stay behind the newest one received.  More smooths out jitter at the cost of a longer delay
+     * \param frames frames to buffer before showing the match, and again whenever it runs dry
+     */
+    void setBufferDelay(int frames) { m_buffer_delay = frames; }
+
+    // Use a clock other than the system clock, like a VirtualClock
+    void setClock(NetworkClock& clock) { m_clock = &clock; }
+
+    /*! Pass every frame on to a broadcaster in the same process, making this a relay.
+     *  The update callback is optional for relays
+     */
+    void setRelay(SpectatorBroadcaster* relay) { m_relay = relay; }
+
+    // Take in what arrived and run the next frame when it's time
+    void update();
+
+    /*! Take in every packet waiting without blocking.  Called by update
+     * \return false when the socket failed
+     */
+    bool receivePackets();
+
+    /*! Wait for a packet to arrive
+     * \param timeout most milliseconds to wait
+     * \return true when a packet is waiting
+     */
+    bool wait(int timeout) { return m_connected && m_transport.wait(timeout); }
+
+    // Last frame the game ran, -1 before the first
+    int getFrame() { return m_frame; }
+
+    // Newest frame received with every frame before it
+    int getReceivedFrame() { return m_received; }
+
+    // Times the game had to stop and buffer again after starting
+    int getStalls() { return m_stalls; }
+
+    // Frames skipped because the broadcaster no longer had them
+    int getSkipped() { return m_skipped; }
+
+    private:
+    static void handlePacket(void* data, const char* packet, int size, long long);
+    void handleFrames(const char* packet, int size);
+    void handleToken(const char* packet, int size);
+
+    // Send a join, which also asks for any frames after the ones received
+    void sendJoin();
+
+    // Run the next frame
+    void runFrame();
+
+    UdpTransport m_transport;
+    bool m_connected;
+
+    NetworkClock* m_clock;
+
+    void (*m_updateCallback)(void*, int, int);
+    void (*m_inputCallback)(void*, const NetworkInput&, const NetworkInput&);
+    void* m_userData;
+
+    SpectatorBroadcaster* m_relay;
+
+    int m_buffer_delay;
+    bool m_buffering;
+
+    // Frames received ahead of the game, by frame number
+    SpectatorFrame m_frames[SPECTATOR_BUFFER];
+
+    int m_frame;
+    int m_received;
+
+    // Newest frame the broadcaster has confirmed, from its packets
+    int m_latest;
+
+    int m_skipped;
+
+    // Last frame passed on to the relay
+    int m_relayed;
+
+    // Token from the broadcaster to send back with each join, 0 until it sends one
+    uint32_t m_token;
+
+    long long m_last_join;
+    int m_stalls;
+};
+
+#endif // SHOBU_NETWORK_SPECTATOR_H
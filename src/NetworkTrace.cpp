@@ -0,0 +1,434 @@
+#include "NetworkTrace.h"
+#include "NetworkPacket.h"
+#include "NetworkLogger.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <thread>
+
+// Identifies trace files
+static const char TRACE_MAGIC[4] = { 'S', 'H', 'T', 'R' };
+
+// Largest encoded event
+static const int MAX_EVENT_SIZE = 32;
+
+// Input packets on each side of a replayed packet that set how late a typical packet was
+static const unsigned int REPLAY_WINDOW = 30;
+
+// Most input packets in a row a trace may be missing, over 15 seconds of them.  More means its ids are corrupt
+static const unsigned int MAX_REPLAY_GAP = 1024;
+
+TraceWriter::TraceWriter() : m_open(false), m_recording(0)
+{
+    m_clock = &systemClock();
+    m_start = 0;
+    m_last_time = 0;
+    m_used = 0;
+}
+
+TraceWriter::~TraceWriter()
+{
+    close();
+}
+
+bool TraceWriter::open(const char* filename, NetworkClock& clock)
+{
+    close();
+
+    m_file.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!m_file.is_open()) {
+        LogMessage << "Could not open trace " << filename << endline;
+        return false;
+    }
+
+    m_file.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    m_file.put(TRACE_VERSION);
+
+    // Forget anything left from a previous trace
+    while(m_received.front()) {
+        m_received.pop();
+    }
+
+    m_clock = &clock;
+    m_start = m_clock->now();
+    m_last_time = 0;
+    m_used = 0;
+    m_open = true;
+
+    return true;
+}
+
+void TraceWriter::close()
+{
+    if(!m_open) {
+        return;
+    }
+
+    // Wait out the receiving thread so nothing is handed over after the last flush
+    m_open = false;
+    while(m_recording > 0) {
+        std::this_thread::yield();
+    }
+
+    writeBuffered();
+    m_file.close();
+}
+
+long long TraceWriter::now() const
+{
+    return m_clock->now() - m_start;
+}
+
+void TraceWriter::record(const TraceEvent& event)
+{
+    if(!m_open) {
+        return;
+    }
+
+    write(event);
+}
+
+void TraceWriter::recordReceived(const TraceEvent& event)
+{
+    // Counted before checking the trace is open, so close either sees the call or it sees the trace closed
+    m_recording++;
+
+    // Dropped when the session hasn't flushed for a long time
+    TraceEvent* received = m_open ? m_received.acquire() : nullptr;
+    if(received) {
+        *received = event;
+        m_received.publish();
+    }
+
+    m_recording--;
+}
+
+void TraceWriter::flush()
+{
+    if(!m_open) {
+        return;
+    }
+
+    writeBuffered();
+}
+
+void TraceWriter::writeBuffered()
+{
+    while(TraceEvent* event = m_received.front()) {
+        write(*event);
+        m_received.pop();
+    }
+
+    if(m_used > 0) {
+        m_file.write(m_buffer, m_used);
+        m_used = 0;
+    }
+}
+
+void TraceWriter::write(const TraceEvent& event)
+{
+    if(m_used + MAX_EVENT_SIZE > TRACE_BUFFER_SIZE) {
+        m_file.write(m_buffer, m_used);
+        m_used = 0;
+    }
+
+    PacketWriter writer(&m_buffer[m_used], MAX_EVENT_SIZE);
+    writer.writeByte(event.type);
+
+    // Received events are written late, so the difference can be negative
+    writer.writeSignedVarint(static_cast<int32_t>(event.time - m_last_time));
+    m_last_time = event.time;
+
+    switch(event.type) {
+    case TRACE_SEND:
+    case TRACE_RECEIVE:
+        writer.writeByte(event.packet_type);
+        writer.writeVarint(event.size);
+        writer.writeVarint(event.packet_id);
+        if(event.type == TRACE_RECEIVE) {
+            writer.writeVarint(event.lost);
+            writer.writeByte(event.old ? 1 : 0);
+        }
+        break;
+    case TRACE_PING:
+        writer.writeSignedVarint(event.round_trip);
+        break;
+    default:
+        break;
+    }
+
+    m_used += writer.size();
+}
+
+TraceReader::TraceReader()
+{
+    m_position = 0;
+    m_time = 0;
+    m_malformed = false;
+}
+
+bool TraceReader::open(const char* filename)
+{
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    if(!file.is_open()) {
+        LogMessage << "Could not open trace " << filename << endline;
+        return false;
+    }
+
+    m_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    if(m_data.size() < sizeof(TRACE_MAGIC)+1 || memcmp(&m_data[0], TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        LogMessage << filename << " is not a trace" << endline;
+        return false;
+    }
+
+    if(static_cast<unsigned char>(m_data[sizeof(TRACE_MAGIC)]) != TRACE_VERSION) {
+        LogMessage << "Unsupported trace version " << (int)m_data[sizeof(TRACE_MAGIC)] << endline;
+        return false;
+    }
+
+    m_position = sizeof(TRACE_MAGIC)+1;
+    m_time = 0;
+    m_malformed = false;
+
+    return true;
+}
+
+bool TraceReader::next(TraceEvent& event)
+{
+    if(m_position >= static_cast<int>(m_data.size())) {
+        return false;
+    }
+
+    memset(&event, 0, sizeof(event));
+
+    PacketReader reader(&m_data[m_position], static_cast<int>(m_data.size()) - m_position);
+    event.type = reader.readByte();
+
+    m_time += reader.readSignedVarint();
+    event.time = m_time;
+
+    switch(event.type) {
+    case TRACE_SEND:
+    case TRACE_RECEIVE:
+        event.packet_type = reader.readByte();
+        event.size = reader.readVarint();
+        event.packet_id = reader.readVarint();
+        if(event.type == TRACE_RECEIVE) {
+            event.lost = reader.readVarint();
+            event.old = reader.readByte() != 0;
+        }
+        break;
+    case TRACE_PING:
+        event.round_trip = reader.readSignedVarint();
+        break;
+    case TRACE_ROLLBACK:
+    case TRACE_WAIT:
+        break;
+    default:
+        LogMessage << "Unknown trace event " << (int)event.type << endline;
+        m_malformed = true;
+        return false;
+    }
+
+    if(reader.error()) {
+        LogMessage << "Trace ends in the middle of an event" << endline;
+        m_malformed = true;
+        return false;
+    }
+
+    m_position += reader.position();
+    return true;
+}
+
+unsigned int inputPacketId(const char* packet, int size)
+{
+    if(size <= 0 || packet[0] != 'f') {
+        return 0;
+    }
+
+    // The id follows the type, client and version
+    PacketReader reader(packet, size);
+    reader.readByte();
+    reader.readByte();
+    reader.readByte();
+    unsigned int id = reader.readVarint();
+
+    return reader.error() ? 0 : id;
+}
+
+bool loadTraceReplay(const char* filename, std::vector<PacketFate>& fates)
+{
+    TraceReader reader;
+    if(!reader.open(filename)) {
+        return false;
+    }
+
+    std::vector<TraceEvent> received;
+    long long ping_total = 0;
+    int ping_count = 0;
+
+    TraceEvent event;
+    while(reader.next(event)) {
+        if(event.type == TRACE_RECEIVE) {
+            received.push_back(event);
+        } else if(event.type == TRACE_PING && event.round_trip >= 0) {
+            ping_total += event.round_trip;
+            ping_count++;
+        }
+    }
+
+    if(reader.malformed()) {
+        return false;
+    }
+
+    if(received.empty()) {
+        LogMessage << "Trace " << filename << " has no received packets" << endline;
+        return false;
+    }
+
+    // Half the round trip is the part of the latency every packet has
+    long long base = ping_count > 0 ? ping_total * 1000 / ping_count / 2 : 0;
+
+    // The rate the remote client sends input packets at, from the first and last one received
+    const TraceEvent* first = nullptr;
+    const TraceEvent* last = nullptr;
+    for(unsigned int i=0; i<received.size(); i++) {
+        if(received[i].packet_id > 0 && !received[i].old) {
+            if(!first) {
+                first = &received[i];
+            }
+            last = &received[i];
+        }
+    }
+
+    double interval = 0;
+    if(first && last->packet_id > first->packet_id) {
+        interval = static_cast<double>(last->time - first->time) / (last->packet_id - first->packet_id);
+    }
+
+    // Every id up to the last one gets a fate, so a corrupt id can't be allowed to run far past the ones before it
+    unsigned int last_id = 0;
+    for(unsigned int i=0; i<received.size(); i++) {
+        unsigned int id = received[i].packet_id;
+        if(id > last_id && id - last_id > MAX_REPLAY_GAP) {
+            LogMessage << "Trace " << filename << " has input packet " << id << " too far after " << last_id << endline;
+            return false;
+        }
+        last_id = std::max(last_id, id);
+    }
+
+    // How far each input packet arrived from the steady rate
+    std::vector<double> offsets;
+    for(unsigned int i=0; i<received.size(); i++) {
+        if(received[i].packet_id > 0) {
+            offsets.push_back(received[i].time - received[i].packet_id * interval);
+        }
+    }
+
+    // The rate drifts over a match, so packets are compared with the typical packet around them,
+    // which takes half the round trip
+    std::vector<double> lateness(offsets.size());
+    std::vector<double> window;
+    for(unsigned int i=0; i<offsets.size(); i++) {
+        unsigned int start = i > REPLAY_WINDOW ? i - REPLAY_WINDOW : 0;
+        unsigned int end = std::min<unsigned int>(i + REPLAY_WINDOW + 1, offsets.size());
+
+        window.assign(offsets.begin() + start, offsets.begin() + end);
+        std::nth_element(window.begin(), window.begin() + window.size()/2, window.end());
+        lateness[i] = offsets[i] - window[window.size()/2];
+    }
+
+    // Every input packet id up to the last one gets the fate of the first copy that arrived, or is lost
+    std::vector<PacketFate> inputs(last_id);
+    for(unsigned int id=1; id<=last_id; id++) {
+        inputs[id-1].packet_id = id;
+        inputs[id-1].lost = true;
+        inputs[id-1].delay = 0;
+    }
+
+    fates.clear();
+
+    // Other packets arrive as late as the last input packet and take their fates in order
+    long long late = 0;
+    unsigned int input = 0;
+    for(unsigned int i=0; i<received.size(); i++) {
+        const TraceEvent& packet = received[i];
+
+        if(packet.packet_id > 0) {
+            late = static_cast<long long>(lateness[input++]);
+        }
+
+        long long delay = base + late;
+        if(delay < 0) {
+            delay = 0;
+        }
+
+        if(packet.packet_id == 0) {
+            PacketFate fate;
+            fate.packet_id = 0;
+            fate.lost = false;
+            fate.delay = static_cast<int>(delay);
+            fates.push_back(fate);
+        } else if(inputs[packet.packet_id-1].lost) {
+            inputs[packet.packet_id-1].lost = false;
+            inputs[packet.packet_id-1].delay = static_cast<int>(delay);
+        }
+    }
+
+    fates.insert(fates.end(), inputs.begin(), inputs.end());
+
+    return true;
+}
+
+bool summarizeTrace(const char* filename, TraceSummary& summary)
+{
+    memset(&summary, 0, sizeof(summary));
+
+    TraceReader reader;
+    if(!reader.open(filename)) {
+        return false;
+    }
+
+    long long ping_total = 0;
+    int ping_count = 0;
+
+    TraceEvent event;
+    while(reader.next(event)) {
+        switch(event.type) {
+        case TRACE_SEND:
+            summary.sent++;
+            break;
+        case TRACE_RECEIVE:
+            summary.received++;
+            if(event.old) {
+                summary.old++;
+            } else {
+                summary.lost += event.lost;
+            }
+            break;
+        case TRACE_PING:
+            if(event.round_trip >= 0) {
+                ping_total += event.round_trip;
+                ping_count++;
+            }
+            break;
+        case TRACE_ROLLBACK:
+            summary.rollbacks++;
+            break;
+        case TRACE_WAIT:
+            summary.waits++;
+            break;
+        }
+
+        // Received events are written late, so times aren't always increasing
+        if(event.time > summary.duration) {
+            summary.duration = event.time;
+        }
+    }
+
+    summary.average_ping = ping_count > 0 ? static_cast<int>(ping_total / ping_count) : 0;
+
+    return !reader.malformed();
+}
@@ -0,0 +1,175 @@
+#ifndef SHOBU_NETWORK_TRACE_H
+#define SHOBU_NETWORK_TRACE_H
+
+#include <atomic>
+#include <fstream>
+#include <vector>
+#include "NetworkRing.h"
+#include "NetworkClock.h"
+
+// Version of the trace file format
+const unsigned char TRACE_VERSION = 1;
+
+// Bytes of encoded events kept before writing them to the file
+const int TRACE_BUFFER_SIZE = 4096;
+
+// Events the receiving thread can hand over between updates
+const int TRACE_HANDOFF_SIZE = 256;
+
+enum TraceEventType
+{
+    TRACE_SEND = 's',       // Packet sent to the remote client
+    TRACE_RECEIVE = 'r',    // Packet received from the remote client
+    TRACE_PING = 'p',       // Round trip measured from an input packet
+    TRACE_ROLLBACK = 'b',   // Game rolled back
+    TRACE_WAIT = 'w'        // Game skipped an update to let the remote client catch up
+};
+
+/*! One event of a trace.  Fields that don't apply to the type are 0
+ */
+struct TraceEvent
+{
+    unsigned char type;
+
+    // Microseconds since the trace started
+    long long time;
+
+    // First byte of the packet
+    unsigned char packet_type;
+    int size;
+
+    // Id of input packets
+    unsigned int packet_id;
+
+    // Input packets missing before a received one
+    unsigned int lost;
+
+    // Set on input packets that arrived after a newer one
+    bool old;
+
+    // Round trip in milliseconds of ping events
+    int round_trip;
+};
+
+// What happens to a packet being replayed
+struct PacketFate
+{
+    // Input packet with the same id the fate is for, or 0 when packets without an id take it in order
+    unsigned int packet_id;
+
+    bool lost;
+
+    // Microseconds it takes to arrive
+    int delay;
+};
+
+// Totals of a trace, for comparing runs against the same conditions
+struct TraceSummary
+{
+    int sent;
+    int received;
+    int lost;
+    int old;
+    int rollbacks;
+    int waits;
+    int average_ping;
+    long long duration;
+};
+
+/*! Writes a compact binary trace of a session's packets.
+ *  Each event is a type byte, the time since the last event and its fields, all as varints.
+ *  Events are recorded on the session's thread.  Received packets may be recorded on one other thread
+ *  and are written by the session's thread on the next flush
+ */
+class TraceWriter
+{
+    public:
+    TraceWriter();
+    ~TraceWriter();
+
+    /*! Start a new trace, replacing the file
+     * \param filename trace file to create
+     * \param clock clock event times come from
+     */
+    bool open(const char* filename, NetworkClock& clock);
+    void close();
+    bool isOpen() const { return m_open; }
+
+    // Record an event from the session's thread
+    void record(const TraceEvent& event);
+
+    // Record an event from the thread receiving packets
+    void recordReceived(const TraceEvent& event);
+
+    // Write everything recorded so far
+    void flush();
+
+    // Microseconds since the trace started
+    long long now() const;
+
+    private:
+    void write(const TraceEvent& event);
+
+    // Write the events handed over and the buffer to the file
+    void writeBuffered();
+
+    std::ofstream m_file;
+    std::atomic<bool> m_open;
+
+    // Calls of recordReceived in progress, which close waits out
+    std::atomic<int> m_recording;
+
+    NetworkClock* m_clock;
+
+    // Time the trace started in microseconds
+    long long m_start;
+
+    // Time of the last event written, times are stored as differences
+    long long m_last_time;
+
+    char m_buffer[TRACE_BUFFER_SIZE];
+    int m_used;
+
+    SpscRing<TraceEvent, TRACE_HANDOFF_SIZE> m_received;
+};
+
+/*! Reads a trace written by TraceWriter
+ */
+class TraceReader
+{
+    public:
+    TraceReader();
+
+    bool open(const char* filename);
+
+    /*! Read the next event
+     * \return false at the end of the trace or when it's malformed
+     */
+    bool next(TraceEvent& event);
+
+    // Returns true when next stopped at an event it couldn't read instead of the end of the trace
+    bool malformed() const { return m_malformed; }
+
+    private:
+    std::vector<char> m_data;
+    int m_position;
+    long long m_time;
+    bool m_malformed;
+};
+
+// Id of an input packet, or 0 for any other packet
+unsigned int inputPacketId(const char* packet, int size);
+
+/*! Work out what happened to each packet received in a trace, so a conditioner can replay it.
+ *  Every input packet id up to the last one received gets a fate, lost when it never arrived.
+ *  Each received packet arrives after half the average ping, moved by how much earlier or later it was than the packets around it
+ * \return false when the trace can't be read, is truncated or has unknown events, has no received packets or its packet ids don't add up
+ */
+bool loadTraceReplay(const char* filename, std::vector<PacketFate>& fates);
+
+/*! Add up the events of a trace
+ * \return false when the trace can't be read, is truncated or has unknown events
+ */
+bool summarizeTrace(const char* filename, TraceSummary& summary);
+
+#endif // SHOBU_NETWORK_TRACE_H
@@ -0,0 +1,68 @@
+#ifndef SHOBU_NETWORK_TRANSPORT_H
+#define SHOBU_NETWORK_TRANSPORT_H
+
+#include "NetworkPacketPool.h"
+
+/*! Called for every packet a transport receives
+ * \param data user data passed to receive
+ * \param packet the received packet
+ * \param size length of the packet
+ * \param receive_time when the packet arrived in nanoseconds since the epoch, or 0 when unknown
+ */
+typedef void (*PacketHandler)(void* data, const char* packet, int size, long long receive_time);
+
+/*! Moves a session's packets to and from the remote client
+ */
+class NetworkTransport
+{
+    public:
+    virtual ~NetworkTransport() {}
+
+    /*! Send a packet to the remote client.  It goes out by the next flush at the latest
+     * \param packet buffer from pool. It is released back to the pool once sent
+     * \param size length of the packet
+     * \param pool the pool the packet came from
+     */
+    virtual void send(char* packet, int size, PacketPool& pool) = 0;
+
+    // Send every packet that is still queued
+    virtual void flush(PacketPool& pool) = 0;
+
+    // Send a packet straight away without a pool buffer.  Used for handshakes and disconnects
+    virtual void sendNow(const char* packet, int size) = 0;
+
+    /*! Hand every packet waiting to the handler without blocking
+     * \return false when the transport failed and the connection should end
+     */
+    virtual bool receive(PacketHandler handler, void* data) = 0;
+
+    /*! Wait for a packet to arrive
+     * \param timeout most milliseconds to wait
+     * \return true when a packet is waiting
+     */
+    virtual bool wait(int timeout) = 0;
+
+    /*! Take a single packet without blocking.  Used while connecting
+     * \param buffer where to copy the packet
+     * \param size length of buffer
+     * \return length of the packet, 0 when nothing is waiting, -1 on error
+     */
+    virtual int receiveOne(char* buffer, int size) = 0;
+
+    // Send to whoever sent the last packet from receiveOne from now on.  Used by the host to accept a client
+    virtual void replyToSender() = 0;
+
+    // Called once connected, before packets are received
+    virtual void start() {}
+
+    // Stop sending and receiving
+    virtual void close() = 0;
+
+    // File descriptor the reactor can wait on, or -1 when the session has to poll receive itself
+    virtual int getHandle() = 0;
+
+    // Returns true when something else, like a NetworkServer, calls the session's receivePackets, so it neither polls nor uses a reactor
+    virtual bool drivenExternally() { return false; }
+};
+
+#endif // SHOBU_NETWORK_TRANSPORT_H
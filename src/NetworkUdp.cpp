@@ -0,0 +1,321 @@
+#include "NetworkUdp.h"
+#include "NetworkUring.h"
+#include "NetworkLogger.h"
+
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+#ifndef WIN32
+#include <unistd.h>
+#include <netdb.h>
+#endif
+
+UdpTransport::UdpTransport()
+{
+    m_socket = -1;
+    m_closed = true;
+    m_use_uring = false;
+
+    memset(&m_remote_addr, 0, sizeof(m_remote_addr));
+    memset(&m_sender_addr, 0, sizeof(m_sender_addr));
+}
+
+UdpTransport::~UdpTransport()
+{
+    close();
+}
+
+bool UdpTransport::open()
+{
+#ifdef WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(1, 1), &wsaData) != 0) {
+        LogNull << "Could not initialize Winsock" << endline;
+    }
+#endif
+
+    m_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    // When an error on socket creation has occured
+    if(m_socket < 0) {
+        return false;
+    }
+
+    m_closed = false;
+    return true;
+}
+
+bool UdpTransport::bind(int port)
+{
+    struct sockaddr_in host_address;
+    memset(&host_address, 0, sizeof(host_address));
+    host_address.sin_family = PF_INET;
+    host_address.sin_addr.s_addr = htonl(INADDR_ANY);
+    host_address.sin_port = htons(port);
+
+    return ::bind(m_socket, (struct sockaddr*)&host_address, sizeof(host_address)) >= 0;
+}
+
+bool UdpTransport::setRemote(const char* host, int port)
+{
+    return resolve(host, port, m_remote_addr);
+}
+
+bool UdpTransport::resolve(const char* host, int port, struct sockaddr_in& address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+
+    // Addresses don't need a lookup
+    address.sin_addr.s_addr = inet_addr(host);
+    if(address.sin_addr.s_addr != INADDR_NONE) {
+        return true;
+    }
+
+#ifdef SHOBU_NO_RESOLVE
+    LogMessage << "Could not resolve " << host << ", host names aren't looked up in this build" << endline;
+    return false;
+#else
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    struct addrinfo* found = nullptr;
+    int rc = getaddrinfo(host, nullptr, &hints, &found);
+    if(rc != 0 || !found) {
+        LogMessage << "Could not resolve " << host << ": " << gai_strerror(rc) << endline;
+        return false;
+    }
+
+    memcpy(&address, found->ai_addr, sizeof(address));
+    address.sin_port = htons(port);
+    freeaddrinfo(found);
+
+    return true;
+#endif
+}
+
+bool UdpTransport::sendTo(const struct sockaddr_in& address, const char* packet, int size)
+{
+    return sendto(m_socket, packet, size, 0, (const struct sockaddr*)&address, sizeof(struct sockaddr)) >= 0;
+}
+
+void UdpTransport::send(char* packet, int size, PacketPool& pool)
+{
+    if(m_uring) {
+        // Make room by submitting what we have so far when too many sends are in flight
+        if(m_uring->queueSend(packet, size, m_remote_addr)) {
+            return;
+        }
+        m_uring->submitSends(pool);
+        if(m_uring->queueSend(packet, size, m_remote_addr)) {
+            return;
+        }
+
+        sendNow(packet, size);
+        pool.release(packet);
+        return;
+    }
+
+    // Send what we have so far when the batch is full
+    if(m_batch.size() == MAX_PACKET_BATCH) {
+        m_batch.flush(m_socket, m_remote_addr, pool);
+    }
+
+    m_batch.add(packet, size);
+}
+
+void UdpTransport::flush(PacketPool& pool)
+{
+    // Everything queued this update goes out with a single submit
+    if(m_uring) {
+        m_uring->submitSends(pool);
+        return;
+    }
+
+    m_batch.flush(m_socket, m_remote_addr, pool);
+}
+
+void UdpTransport::sendNow(const char* packet, int size)
+{
+    sendto(m_socket, packet, size, 0, (const struct sockaddr*)&m_remote_addr, sizeof(struct sockaddr));
+}
+
+bool UdpTransport::receive(PacketHandler handler, void* data)
+{
+    if(m_uring) {
+        const char* packets[RECEIVE_BATCH];
+        int sizes[RECEIVE_BATCH];
+        long long times[RECEIVE_BATCH];
+
+        // Packets are handled straight from the buffers the kernel received them into
+        while(!m_closed) {
+            int count = m_uring->receive(packets, sizes, times, RECEIVE_BATCH);
+            if(count < 0) {
+                return false;
+            }
+
+            for(int i=0; i<count && !m_closed; i++) {
+                handler(data, packets[i], sizes[i], times[i]);
+            }
+            m_uring->releaseReceived();
+
+            if(count < RECEIVE_BATCH) {
+                break;
+            }
+        }
+
+        return true;
+    }
+
+#ifdef __linux__
+    struct mmsghdr messages[RECEIVE_BATCH];
+    struct iovec iovecs[RECEIVE_BATCH];
+    char control[RECEIVE_BATCH][RECEIVE_CONTROL_SIZE];
+
+    for(int i=0; i<RECEIVE_BATCH; i++) {
+        iovecs[i].iov_base = m_receive_buffers[i];
+        iovecs[i].iov_len = MAX_PACKET_SIZE;
+
+        memset(&messages[i].msg_hdr, 0, sizeof(messages[i].msg_hdr));
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_control = control[i];
+    }
+
+    // Drain every packet waiting on the socket, a batch at a time
+    while(!m_closed) {
+        // The kernel shrinks the control length to what it used
+        for(int i=0; i<RECEIVE_BATCH; i++) {
+            messages[i].msg_hdr.msg_controllen = RECEIVE_CONTROL_SIZE;
+        }
+
+        int count = recvmmsg(m_socket, messages, RECEIVE_BATCH, MSG_DONTWAIT, nullptr);
+        if(count < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LogNull << "Socket error: " << strerror(errno) << endline;
+                return false;
+            }
+            break;
+        }
+
+        for(int i=0; i<count && !m_closed; i++) {
+            handler(data, m_receive_buffers[i], messages[i].msg_len, packetReceiveTime(&messages[i].msg_hdr));
+        }
+
+        if(count < RECEIVE_BATCH) {
+            break;
+        }
+    }
+#else
+    while(!m_closed) {
+        // Only read while there's something to read so we never block
+        fd_set fds;
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 0;
+        FD_ZERO(&fds);
+        FD_SET(m_socket, &fds);
+        if(select(m_socket+1, &fds, NULL, NULL, &timeout) <= 0) {
+            break;
+        }
+
+        int recv_bytes = recv(m_socket, m_receive_buffers[0], MAX_PACKET_SIZE, 0);
+        if(recv_bytes > 0) {
+            handler(data, m_receive_buffers[0], recv_bytes, 0);
+        } else if(recv_bytes == 0) {
+            LogNull << "Socket was closed" << endline;
+            break;
+        } else {
+            LogNull << "Socket error: " << strerror(errno) << endline;
+            return false;
+        }
+    }
+#endif
+
+    return true;
+}
+
+bool UdpTransport::wait(int timeout)
+{
+    int handle = getHandle();
+
+    fd_set fds;
+    struct timeval time;
+    time.tv_sec = timeout / 1000;
+    time.tv_usec = (timeout % 1000) * 1000;
+    FD_ZERO(&fds);
+    FD_SET(handle, &fds);
+
+    int rc = select(handle+1, &fds, NULL, NULL, &time);
+    if(rc < 0) {
+        LogNull << "Select error" << endline;
+        return false;
+    }
+
+    return rc > 0 && FD_ISSET(handle, &fds);
+}
+
+int UdpTransport::receiveOne(char* buffer, int size)
+{
+    if(!wait(0)) {
+        return 0;
+    }
+
+    socklen_t sender_size = sizeof(m_sender_addr);
+    return recvfrom(m_socket, buffer, size, 0, (struct sockaddr*)&m_sender_addr, &sender_size);
+}
+
+void UdpTransport::replyToSender()
+{
+    m_remote_addr = m_sender_addr;
+}
+
+void UdpTransport::start()
+{
+#ifdef __linux__
+    // Have the kernel time stamp packets so the receive latency can be measured
+    int timestamps = 1;
+    if(setsockopt(m_socket, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(timestamps)) < 0) {
+        LogNull << "Could not enable packet time stamps: " << strerror(errno) << endline;
+    }
+#endif
+
+    if(m_use_uring && !m_uring) {
+        m_uring.reset(new NetworkUring());
+        if(!m_uring->initialize(m_socket)) {
+            LogNull << "Falling back to socket calls" << endline;
+            m_uring.reset();
+        }
+    }
+}
+
+void UdpTransport::close()
+{
+    if(m_closed) {
+        return;
+    }
+    m_closed = true;
+
+#ifdef WIN32
+    closesocket(m_socket);
+    WSACleanup();
+#else
+    ::close(m_socket);
+#endif
+}
+
+int UdpTransport::getHandle()
+{
+    if(m_uring) {
+        return m_uring->getReceiveHandle();
+    }
+
+    return m_socket;
+}
@@ -0,0 +1,108 @@
+#ifndef SHOBU_NETWORK_UDP_H
+#define SHOBU_NETWORK_UDP_H
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include <memory>
+#include "NetworkTransport.h"
+
+// Most packets read from the socket with a single system call
+const int RECEIVE_BATCH = 16;
+
+class NetworkUring;
+
+/*! Sends packets over a UDP socket, through io_uring when it's enabled and supported
+ */
+class UdpTransport : public NetworkTransport
+{
+    public:
+    UdpTransport();
+    ~UdpTransport();
+
+    /*! Create the socket
+     * \return false on failure, true on success
+     */
+    bool open();
+
+    /*! Receive packets sent to a local port
+     * \return false on failure, true on success
+     */
+    bool bind(int port);
+
+    /*! Send packets to this address
+     * \param host name or IPv4 address of the remote client
+     * \param port its port
+     * \return false when the name can't be resolved
+     */
+    bool setRemote(const char* host, int port);
+    void setRemote(const struct sockaddr_in& address) { m_remote_addr = address; }
+
+    // Address the last packet from receiveOne came from
+    const struct sockaddr_in& getSender() const { return m_sender_addr; }
+
+    /*! Look up the IPv4 address of a host name or address.
+     *  Static builds define SHOBU_NO_RESOLVE, since glibc can't look up names without its shared libraries,
+     *  and only take addresses
+     * \return false when it can't be resolved
+     */
+    static bool resolve(const char* host, int port, struct sockaddr_in& address);
+
+    /*! Send a packet to an address other than the remote client
+     * \return false on failure, true on success
+     */
+    bool sendTo(const struct sockaddr_in& address, const char* packet, int size);
+
+    /*! Send and receive through io_uring once started.  Falls back to the socket calls when the kernel doesn't support it
+     * \param enable true to try io_uring
+     */
+    void setIoUring(bool enable) { m_use_uring = enable; }
+
+    // Returns true when packets go through io_uring
+    bool usingIoUring() { return m_uring != nullptr; }
+
+    int getSocket() { return m_socket; }
+
+    void send(char* packet, int size, PacketPool& pool);
+    void flush(PacketPool& pool);
+    void sendNow(const char* packet, int size);
+    bool receive(PacketHandler handler, void* data);
+    bool wait(int timeout);
+    int receiveOne(char* buffer, int size);
+    void replyToSender();
+    void start();
+    void close();
+    int getHandle();
+
+    private:
+    int m_socket;
+
+    // Set once closed, so receiving stops in the middle of a batch
+    bool m_closed;
+
+    // Where packets are sent
+    struct sockaddr_in m_remote_addr;
+
+    // Who sent the last packet from receiveOne
+    struct sockaddr_in m_sender_addr;
+
+    // Packets waiting to be sent at the end of the update
+    PacketBatch m_batch;
+
+    // Buffers packets are received into
+    char m_receive_buffers[RECEIVE_BATCH][MAX_PACKET_SIZE];
+
+    // Try io_uring when starting
+    bool m_use_uring;
+
+    // Set while packets go through io_uring
+    std::unique_ptr<NetworkUring> m_uring;
+};
+
+#endif // SHOBU_NETWORK_UDP_H
@@ -0,0 +1,455 @@
+#include "NetworkUring.h"
+#include "NetworkLogger.h"
+
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// There is no liburing dependency, so the three system calls are made directly
+static int uringSetup(unsigned entries, struct io_uring_params* params)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int uringRegister(int fd, unsigned opcode, void* arg, unsigned args)
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, args));
+}
+
+// Group id of the receive buffers
+const unsigned short URING_BUFFER_GROUP = 0;
+
+// Each receive buffer holds the recvmsg header and the time stamp followed by the packet
+const int URING_BUFFER_SIZE = sizeof(struct io_uring_recvmsg_out) + RECEIVE_CONTROL_SIZE + MAX_PACKET_SIZE;
+
+// A single multishot receive is all the receive ring ever submits
+const unsigned URING_RECEIVE_ENTRIES = 4;
+
+// Every receive buffer can complete before the ring is read
+const unsigned URING_RECEIVE_COMPLETIONS = URING_RECEIVE_BUFFERS*2;
+
+NetworkUring::NetworkUring()
+{
+    m_socket = -1;
+    memset(&m_receive, 0, sizeof(m_receive));
+    memset(&m_send, 0, sizeof(m_send));
+    m_receive.fd = -1;
+    m_send.fd = -1;
+
+    m_buffer_ring = nullptr;
+    m_buffers = nullptr;
+    m_buffers_size = 0;
+
+    // Only the packet and its time stamp are wanted, not the address
+    memset(&m_receive_msg, 0, sizeof(m_receive_msg));
+    m_receive_msg.msg_controllen = RECEIVE_CONTROL_SIZE;
+    m_receive_armed = false;
+    m_taken_count = 0;
+
+    for(int i=0; i<URING_SEND_SLOTS; i++) {
+        m_free_slots[i] = URING_SEND_SLOTS-1-i;
+    }
+    m_free_slot_count = URING_SEND_SLOTS;
+    m_send_queued = 0;
+}
+
+NetworkUring::~NetworkUring()
+{
+    // Closing the rings cancels the receive and unregisters the buffers
+    destroyRing(m_receive);
+    destroyRing(m_send);
+
+    if(m_buffer_ring) {
+        munmap(m_buffer_ring, URING_RECEIVE_BUFFERS*sizeof(struct io_uring_buf));
+    }
+    if(m_buffers) {
+        munmap(m_buffers, m_buffers_size);
+    }
+}
+
+bool NetworkUring::setupRing(Ring& ring, unsigned entries, unsigned cq_entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+
+    ring.fd = uringSetup(entries, &params);
+    if(ring.fd < 0) {
+        LogNull << "io_uring is not available: " << strerror(errno) << endline;
+        return false;
+    }
+
+    ring.sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    ring.cq_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+
+    // Newer kernels map both queues with a single call
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single_mmap) {
+        if(ring.cq_size > ring.sq_size) {
+            ring.sq_size = ring.cq_size;
+        }
+        ring.cq_size = ring.sq_size;
+    }
+
+    ring.sq_ptr = mmap(nullptr, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if(ring.sq_ptr == MAP_FAILED) {
+        ring.sq_ptr = nullptr;
+        return false;
+    }
+
+    if(single_mmap) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = mmap(nullptr, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if(ring.cq_ptr == MAP_FAILED) {
+            ring.cq_ptr = nullptr;
+            return false;
+        }
+    }
+
+    ring.sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        return false;
+    }
+    ring.sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(ring.sq_ptr);
+    ring.sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    ring.sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring.sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring.sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    char* cq = static_cast<char*>(ring.cq_ptr);
+    ring.cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring.cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring.cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+void NetworkUring::destroyRing(Ring& ring)
+{
+    if(ring.sqes) {
+        munmap(ring.sqes, ring.sqes_size);
+    }
+    if(ring.cq_ptr && ring.cq_ptr != ring.sq_ptr) {
+        munmap(ring.cq_ptr, ring.cq_size);
+    }
+    if(ring.sq_ptr) {
+        munmap(ring.sq_ptr, ring.sq_size);
+    }
+    if(ring.fd >= 0) {
+        close(ring.fd);
+    }
+
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+struct io_uring_sqe* NetworkUring::getSqe(Ring& ring)
+{
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring.sq_tail;
+    if(tail - head > *ring.sq_mask) {
+        return nullptr;
+    }
+
+    unsigned index = tail & *ring.sq_mask;
+    ring.sq_array[index] = index;
+
+    struct io_uring_sqe* sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    // The kernel only looks at the entry once it's submitted, so publishing it now is safe
+    __atomic_store_n(ring.sq_tail, tail+1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+bool NetworkUring::initialize(int socket)
+{
+    m_socket = socket;
+
+    if(!setupRing(m_receive, URING_RECEIVE_ENTRIES, URING_RECEIVE_COMPLETIONS) ||
+       !setupRing(m_send, URING_SEND_SLOTS, URING_SEND_SLOTS*2)) {
+        return false;
+    }
+
+    // The buffer ring must be page aligned, which mmap guarantees
+    void* ring = mmap(nullptr, URING_RECEIVE_BUFFERS*sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring == MAP_FAILED) {
+        return false;
+    }
+    m_buffer_ring = static_cast<struct io_uring_buf*>(ring);
+
+    m_buffers_size = URING_RECEIVE_BUFFERS*URING_BUFFER_SIZE;
+    void* buffers = mmap(nullptr, m_buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buffers == MAP_FAILED) {
+        return false;
+    }
+    m_buffers = static_cast<char*>(buffers);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<unsigned long>(m_buffer_ring);
+    reg.ring_entries = URING_RECEIVE_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if(uringRegister(m_receive.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        LogNull << "Could not register io_uring receive buffers: " << strerror(errno) << endline;
+        return false;
+    }
+
+    for(int i=0; i<URING_RECEIVE_BUFFERS; i++) {
+        recycleBuffer(i);
+    }
+
+    if(!armReceive()) {
+        return false;
+    }
+
+    // Kernels without multishot receives fail the request straight away
+    unsigned head = *m_receive.cq_head;
+    if(head != __atomic_load_n(m_receive.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &m_receive.cqes[head & *m_receive.cq_mask];
+        if(cqe->res < 0 && !(cqe->flags & IORING_CQE_F_MORE)) {
+            LogNull << "Multishot receives are not supported: " << strerror(-cqe->res) << endline;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int NetworkUring::getReceiveHandle()
+{
+    return m_receive.fd;
+}
+
+bool NetworkUring::armReceive()
+{
+    struct io_uring_sqe* sqe = getSqe(m_receive);
+    if(!sqe) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = m_socket;
+    sqe->addr = reinterpret_cast<unsigned long>(&m_receive_msg);
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+
+    if(uringEnter(m_receive.fd, 1, 0, 0) < 0) {
+        LogNull << "Could not submit io_uring receive: " << strerror(errno) << endline;
+        return false;
+    }
+
+    m_receive_armed = true;
+    return true;
+}
+
+void NetworkUring::recycleBuffer(unsigned short id)
+{
+    // The ring's tail is stored in the unused field of the first entry
+    unsigned short* ring_tail = &m_buffer_ring[0].resv;
+    unsigned short tail = *ring_tail;
+
+    struct io_uring_buf* buf = &m_buffer_ring[tail & (URING_RECEIVE_BUFFERS-1)];
+    buf->addr = reinterpret_cast<unsigned long>(m_buffers + id*URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = id;
+
+    __atomic_store_n(ring_tail, static_cast<unsigned short>(tail+1), __ATOMIC_RELEASE);
+}
+
+int NetworkUring::receive(const char* packets[], int sizes[], long long times[], int max)
+{
+    int count = 0;
+    int error = 0;
+
+    unsigned head = *m_receive.cq_head;
+    unsigned tail = __atomic_load_n(m_receive.cq_tail, __ATOMIC_ACQUIRE);
+
+    while(head != tail && count < max && m_taken_count < URING_RECEIVE_BUFFERS) {
+        struct io_uring_cqe* cqe = &m_receive.cqes[head & *m_receive.cq_mask];
+        head++;
+
+        // The kernel ends a multishot receive on errors and when it runs out of buffers
+        if(!(cqe->flags & IORING_CQE_F_MORE)) {
+            m_receive_armed = false;
+        }
+
+        if(cqe->res < 0) {
+            if(cqe->res != -ENOBUFS) {
+                error = -cqe->res;
+            }
+            continue;
+        }
+
+        if(!(cqe->flags & IORING_CQE_F_BUFFER)) {
+            continue;
+        }
+
+        unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        m_taken[m_taken_count++] = id;
+
+        char* buffer = m_buffers + id*URING_BUFFER_SIZE;
+        struct io_uring_recvmsg_out* out = reinterpret_cast<struct io_uring_recvmsg_out*>(buffer);
+        if(out->flags & MSG_TRUNC) {
+            continue;
+        }
+
+        char* control = buffer + sizeof(struct io_uring_recvmsg_out) + m_receive_msg.msg_namelen;
+
+        // Only the control fields are needed to read the time stamp
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = out->controllen;
+        times[count] = packetReceiveTime(&msg);
+
+        packets[count] = control + m_receive_msg.msg_controllen;
+        sizes[count] = out->payloadlen;
+        count++;
+    }
+
+    __atomic_store_n(m_receive.cq_head, head, __ATOMIC_RELEASE);
+
+    if(error) {
+        LogNull << "io_uring receive error: " << strerror(error) << endline;
+        return -1;
+    }
+
+    return count;
+}
+
+void NetworkUring::releaseReceived()
+{
+    for(int i=0; i<m_taken_count; i++) {
+        recycleBuffer(m_taken[i]);
+    }
+    m_taken_count = 0;
+
+    if(!m_receive_armed) {
+        armReceive();
+    }
+}
+
+bool NetworkUring::queueSend(char* packet, int size, const struct sockaddr_in& address)
+{
+    if(m_free_slot_count == 0) {
+        return false;
+    }
+
+    struct io_uring_sqe* sqe = getSqe(m_send);
+    if(!sqe) {
+        return false;
+    }
+
+    int index = m_free_slots[--m_free_slot_count];
+    SendSlot& slot = m_send_slots[index];
+
+    slot.packet = packet;
+    slot.address = address;
+    slot.iov.iov_base = packet;
+    slot.iov.iov_len = size;
+
+    memset(&slot.msg, 0, sizeof(slot.msg));
+    slot.msg.msg_name = &slot.address;
+    slot.msg.msg_namelen = sizeof(slot.address);
+    slot.msg.msg_iov = &slot.iov;
+    slot.msg.msg_iovlen = 1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = m_socket;
+    sqe->addr = reinterpret_cast<unsigned long>(&slot.msg);
+    sqe->len = 1;
+    sqe->user_data = index;
+
+    m_send_queued++;
+    return true;
+}
+
+int NetworkUring::submitSends(PacketPool& pool)
+{
+    int submitted = 0;
+    if(m_send_queued > 0) {
+        submitted = uringEnter(m_send.fd, m_send_queued, 0, 0);
+        if(submitted < 0) {
+            LogNull << "Could not submit io_uring sends: " << strerror(errno) << endline;
+            submitted = 0;
+        }
+        m_send_queued -= submitted;
+    }
+
+    // UDP sends usually finish during the submit, so their buffers are reused right away
+    unsigned head = *m_send.cq_head;
+    unsigned tail = __atomic_load_n(m_send.cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail) {
+        struct io_uring_cqe* cqe = &m_send.cqes[head & *m_send.cq_mask];
+        head++;
+
+        int index = static_cast<int>(cqe->user_data);
+        pool.release(m_send_slots[index].packet);
+        m_free_slots[m_free_slot_count++] = index;
+    }
+    __atomic_store_n(m_send.cq_head, head, __ATOMIC_RELEASE);
+
+    return submitted;
+}
+
+#else
+
+NetworkUring::NetworkUring()
+{
+}
+
+NetworkUring::~NetworkUring()
+{
+}
+
+bool NetworkUring::initialize(int socket)
+{
+    LogNull << "io_uring is only available on Linux" << endline;
+    return false;
+}
+
+int NetworkUring::getReceiveHandle()
+{
+    return -1;
+}
+
+int NetworkUring::receive(const char* packets[], int sizes[], long long times[], int max)
+{
+    return -1;
+}
+
+void NetworkUring::releaseReceived()
+{
+}
+
+bool NetworkUring::queueSend(char* packet, int size, const struct sockaddr_in& address)
+{
+    return false;
+}
+
+int NetworkUring::submitSends(PacketPool& pool)
+{
+    return 0;
+}
+
+#endif
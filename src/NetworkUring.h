@@ -0,0 +1,146 @@
+#ifndef SHOBU_NETWORK_URING_H
+#define SHOBU_NETWORK_URING_H
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#ifdef __linux__
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "NetworkPacketPool.h"
+
+// Receive buffers registered with the kernel.  Must be a power of two
+const int URING_RECEIVE_BUFFERS = 64;
+
+// Most sends waiting to be submitted or completed
+const int URING_SEND_SLOTS = 64;
+
+/*! Sends and receives a session's packets through io_uring instead of one system call per batch.
+ *  Packets are received by a multishot recvmsg into buffers registered with the kernel,
+ *  and sends are queued during an update and submitted with a single system call.
+ *  Only available on Linux 6.0 or newer.  initialize fails everywhere else
+ */
+class NetworkUring
+{
+    public:
+    NetworkUring();
+    ~NetworkUring();
+
+    /*! Set up the rings and start receiving on the socket
+     * \param socket a bound UDP socket
+     * \return false when io_uring is not supported, true on success
+     */
+    bool initialize(int socket);
+
+    // File descriptor which becomes readable when packets were received
+    int getReceiveHandle();
+
+    /*! Take packets received since the last call.  Only call from one thread
+     * \param packets set to each packet.  They stay valid until releaseReceived is called
+     * \param sizes set to the length of each packet
+     * \param times set to when the kernel received each packet, or 0 when the socket doesn't have SO_TIMESTAMPNS set
+     * \param max most packets to take
+     * \return number of packets taken, or -1 on error
+     */
+    int receive(const char* packets[], int sizes[], long long times[], int max);
+
+    // Give the buffers of the packets taken with receive back to the kernel
+    void releaseReceived();
+
+    /*! Queue a packet to be sent by the next submitSends
+     * \param packet buffer from pool. It is released back to the pool once the kernel is done with it
+     * \param size length of the packet
+     * \param address where to send the packet
+     * \return false when too many sends are in flight
+     */
+    bool queueSend(char* packet, int size, const struct sockaddr_in& address);
+
+    /*! Submit every queued send with one system call and release the buffers of finished sends
+     * \param pool the pool queued buffers are released to
+     * \return number of sends submitted
+     */
+    int submitSends(PacketPool& pool);
+
+    private:
+#ifdef __linux__
+    // Memory shared with the kernel for a single io_uring instance
+    struct Ring {
+        int fd;
+
+        void* sq_ptr;
+        size_t sq_size;
+        void* cq_ptr;
+        size_t cq_size;
+        struct io_uring_sqe* sqes;
+        size_t sqes_size;
+
+        unsigned* sq_head;
+        unsigned* sq_tail;
+        unsigned* sq_mask;
+        unsigned* sq_array;
+
+        unsigned* cq_head;
+        unsigned* cq_tail;
+        unsigned* cq_mask;
+        struct io_uring_cqe* cqes;
+    };
+
+    static bool setupRing(Ring& ring, unsigned entries, unsigned cq_entries);
+    static void destroyRing(Ring& ring);
+
+    // Next free submission entry, or nullptr when the submission queue is full
+    static struct io_uring_sqe* getSqe(Ring& ring);
+
+    // Submit the multishot receive again after the kernel ended it
+    bool armReceive();
+
+    // Return a receive buffer to the kernel
+    void recycleBuffer(unsigned short id);
+
+    int m_socket;
+
+    // Only used by the thread receiving packets
+    Ring m_receive;
+
+    // Only used by the thread sending packets
+    Ring m_send;
+
+    // Provided buffer ring and the buffers it points at.
+    // The kernel header's flexible array is offset by an empty struct in C++, so the entries are used directly
+    struct io_uring_buf* m_buffer_ring;
+    char* m_buffers;
+    size_t m_buffers_size;
+
+    // Describes the receives, the kernel reads it for every packet
+    struct msghdr m_receive_msg;
+    bool m_receive_armed;
+
+    // Buffers handed out by receive and not released yet
+    unsigned short m_taken[URING_RECEIVE_BUFFERS];
+    int m_taken_count;
+
+    // Every send in flight keeps its message header until it completes
+    struct SendSlot {
+        struct msghdr msg;
+        struct iovec iov;
+        struct sockaddr_in address;
+        char* packet;
+    };
+    SendSlot m_send_slots[URING_SEND_SLOTS];
+
+    // Stack of free send slots
+    int m_free_slots[URING_SEND_SLOTS];
+    int m_free_slot_count;
+
+    // Sends prepared since the last submit
+    unsigned m_send_queued;
+#endif
+};
+
+#endif // SHOBU_NETWORK_URING_H
@@ -1,6 +1,29 @@
+#include <atomic>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <thread>
+#include <mutex>
+#include <vector>
 #include "Network.h"
+#include "NetworkRendezvous.h"
+#include "NetworkServer.h"
+#include "NetworkDeque.h"
+#include "NetworkExecutor.h"
+#include "NetworkFec.h"
+#include "NetworkPacket.h"
+#include "NetworkReactor.h"
+#include "NetworkSnapshot.h"
+#include "NetworkSpectator.h"
+#include "NetworkUdp.h"
+
+#ifdef __linux__
+#include <signal.h>
+#include <unistd.h>
+#endif
 
 struct Game
 {
@@ -69,14 +92,1495 @@ void RunClient(ShobuNetwork& network)
     }
 }
 
+// Meets another player running with the same key through a rendezvous server
+void RunRendezvous(ShobuNetwork& network, const char* server, const char* key)
+{
+    if(!network.connectThroughRendezvous(server, RENDEZVOUS_PORT, key)) {
+        printf("Could not meet the other player\n");
+        return;
+    }
+
+    printf("Connected %s in %d ms\n", network.usingRelay() ? "through the relay" : "directly", network.getConnectTime());
+
+    while(network.connected()) {
+        network.update(1);
+        std::this_thread::sleep_for( std::chrono::milliseconds(500));
+    }
+}
+
+// Runs a host and a client in this thread without sockets, as fast as they can update
+void RunLoopback(ShobuNetwork& network, ShobuNetwork& client, VirtualClock& clock)
+{
+    network.setInputDelay(3);
+
+    // Run on virtual time with 3 updates of latency each way
+    network.setClock(clock);
+    client.setClock(clock);
+    network.setPacketDelay(3);
+    client.setPacketDelay(3);
+
+    if(!network.initializeLoopback(client)) {
+        printf("Could not connect the loopback sessions\n");
+        return;
+    }
+
+    for(int i=0; i<300 && network.connected(); i++) {
+        network.update(0);
+        client.update(1);
+        clock.advance(16667);
+    }
+
+    printf("Host Tick: %d Client Tick: %d Synced: %d Ping: %d\n", network.getLocalTick(), client.getLocalTick(),
+           network.stateIsSynced() && client.stateIsSynced(), network.getPing());
+}
+
+// Game used by the checks.  Its state is a hash of every pair of inputs it was run with, host first
+struct CheckGame
+{
+    CheckGame(bool is_host) : state(0), stored(0), updates(0), restores(0), drift(0), host(is_host) {}
+
+    unsigned int state;
+    unsigned int stored;
+    int updates;
+    int restores;
+
+    // Added to the state every update, set to make the simulation differ from the other player's
+    unsigned int drift;
+    bool host;
+};
+
+void checkUpdate(void* game_ptr, int local_input, int remote_input)
+{
+    CheckGame& game = *((CheckGame*)game_ptr);
+    game.state = game.state*31 + (game.host ? local_input : remote_input)*7 + (game.host ? remote_input : local_input) + game.drift;
+    game.updates++;
+}
+
+void checkStore(void* game_ptr)
+{
+    CheckGame& game = *((CheckGame*)game_ptr);
+    game.stored = game.state;
+}
+
+void checkRestore(void* game_ptr)
+{
+    CheckGame& game = *((CheckGame*)game_ptr);
+    game.state = game.stored;
+    game.restores++;
+}
+
+int checkSync(void* game_ptr)
+{
+    return (int)((CheckGame*)game_ptr)->state;
+}
+
+static int failures = 0;
+
+// Prints a claim and whether it held
+void check(bool held, const char* claim)
+{
+    printf("%s: %s\n", held ? "ok" : "FAILED", claim);
+    if(!held) {
+        failures++;
+    }
+}
+
+/*! Runs a loopback match on virtual time, each player changing input about every 8 frames
+ * \return milliseconds it took
+ */
+double PlayLoopback(ShobuNetwork& host, ShobuNetwork& client, VirtualClock& clock, int frames)
+{
+    srand(3);
+    int host_input = 0;
+    int client_input = 0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int i=0; i<frames && host.connected(); i++) {
+        if(rand() % 8 == 0) {
+            host_input = rand() % 16;
+        }
+        if(rand() % 8 == 0) {
+            client_input = rand() % 16;
+        }
+
+        host.update(host_input);
+        client.update(client_input);
+        clock.advance(16667);
+    }
+
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Varints, bit fields and runs of inputs read back as they were written, and reading past the end is an error
+void CheckPacketCodec()
+{
+    char buffer[MAX_PACKET_SIZE];
+
+    const uint32_t values[] = { 0, 1, 127, 128, 16383, 16384, 0xFFFFFFFFu };
+    const int sizes[] = { 1, 1, 1, 2, 2, 3, 5 };
+    bool varints = true;
+    for(unsigned int i=0; i<sizeof(values)/sizeof(values[0]); i++) {
+        PacketWriter writer(buffer, sizeof(buffer));
+        writer.writeVarint(values[i]);
+        PacketReader reader(buffer, writer.size());
+        varints = varints && writer.size() == sizes[i] && reader.readVarint() == values[i] && !reader.error();
+    }
+    check(varints, "varints round trip, 7 bits per byte up to 2^32-1");
+
+    const int32_t signed_values[] = { 0, -1, 1, -64, 63, 64, -65, 2147483647, -2147483647-1 };
+    bool signed_varints = true;
+    for(unsigned int i=0; i<sizeof(signed_values)/sizeof(signed_values[0]); i++) {
+        PacketWriter writer(buffer, sizeof(buffer));
+        writer.writeSignedVarint(signed_values[i]);
+        PacketReader reader(buffer, writer.size());
+        signed_varints = signed_varints && reader.readSignedVarint() == signed_values[i] && !reader.error();
+        if(signed_values[i] >= -64 && signed_values[i] <= 63) {
+            signed_varints = signed_varints && writer.size() == 1;
+        }
+    }
+    check(signed_varints, "signed varints round trip and small ones take a byte");
+
+    {
+        PacketWriter writer(buffer, sizeof(buffer));
+        writer.writeBits(1, 1);
+        writer.writeBits(0x5555555u, 31);
+        writer.writeBits(0xDEADBEEFu, 32);
+        writer.writeByte(0xA5);
+        PacketReader reader(buffer, writer.size());
+        uint32_t one = reader.readBits(1);
+        uint32_t middle = reader.readBits(31);
+        uint32_t last = reader.readBits(32);
+        check(one == 1 && middle == 0x5555555u && last == 0xDEADBEEFu && reader.readByte() == 0xA5 && !reader.error(),
+              "bit fields of 1, 31 and 32 bits round trip between bytes");
+    }
+
+    // Runs of held inputs with every word changing now and then
+    srand(11);
+    const int count = 40;
+    NetworkInput inputs[count];
+    memset(inputs, 0, sizeof(inputs));
+    for(int i=1; i<count; i++) {
+        inputs[i] = inputs[i-1];
+        if(rand() % 4 == 0) {
+            inputs[i].words[rand() % INPUT_WORDS] = (static_cast<uint32_t>(rand()) << 16) ^ rand();
+        }
+    }
+
+    const int widths[] = { 1, 31, 32 };
+    for(int w=0; w<3; w++) {
+        int bits = widths[w];
+        uint32_t mask = bits >= 32 ? 0xFFFFFFFFu : (1u << bits) - 1;
+
+        PacketWriter writer(buffer, sizeof(buffer));
+        writer.writeInputs(inputs, count, bits);
+        NetworkInput read[count];
+        PacketReader reader(buffer, writer.size());
+        bool same = !writer.overflow() && reader.readInputs(read, count, bits);
+        for(int i=0; i<count && same; i++) {
+            for(int word=0; word<INPUT_WORDS; word++) {
+                same = same && read[i].words[word] == (inputs[i].words[word] & mask);
+            }
+        }
+
+        char claim[64];
+        snprintf(claim, sizeof(claim), "inputs of %d bits round trip", bits);
+        check(same, claim);
+
+        PacketReader truncated(buffer, writer.size()/2);
+        check(!truncated.readInputs(read, count, bits) && truncated.error(), "reading inputs past the end is an error");
+    }
+
+    {
+        buffer[0] = static_cast<char>(0x80);
+        PacketReader reader(buffer, 1);
+        reader.readVarint();
+        bool varint_error = reader.error();
+
+        PacketReader short_reader(buffer, 2);
+        short_reader.readBits(16);
+        bool bits_ok = !short_reader.error();
+        short_reader.readBits(1);
+
+        PacketWriter writer(buffer, 2);
+        writer.writeVarint(16384);
+        check(varint_error && bits_ok && short_reader.error() && writer.overflow(),
+              "reading past the end sets error() and writing past it sets overflow()");
+    }
+}
+
+// A parity packet rebuilds the one packet of its group that was lost, and one with a corrupt length rebuilds nothing
+void CheckFec()
+{
+    FecEncoder encoder;
+    FecDecoder decoder;
+    encoder.setRedundancy(4, 4);
+
+    char packets[4][MAX_PACKET_SIZE];
+    int sizes[4] = { 40, 97, 12, 200 };
+    char parity[MAX_PACKET_SIZE];
+    int parity_size = 0;
+    for(int i=0; i<4; i++) {
+        for(int j=0; j<sizes[i]; j++) {
+            packets[i][j] = static_cast<char>(i*31 + j*7);
+        }
+
+        parity_size = encoder.addPacket(packets[i], sizes[i], 10+i, 's', parity);
+        if(i != 1) {
+            decoder.addPacket(packets[i], sizes[i], 10+i);
+        }
+    }
+    check(parity_size > 0, "a parity packet is sent after a whole group");
+
+    char rebuilt[MAX_PACKET_SIZE];
+    int size = decoder.recover(parity, parity_size, rebuilt);
+    check(size == sizes[1] && memcmp(rebuilt, packets[1], size) == 0, "parity rebuilds the lost packet");
+
+    // The lost packet's length as the largest varint, which is -1 as an int
+    char corrupt[MAX_PACKET_SIZE];
+    PacketWriter writer(corrupt, sizeof(corrupt));
+    writer.writeByte('x');
+    writer.writeByte('s');
+    writer.writeByte(PACKET_VERSION);
+    writer.writeVarint(10);
+    writer.writeByte(4);
+    for(int i=0; i<4; i++) {
+        writer.writeVarint(i == 1 ? 0xFFFFFFFFu : sizes[i]);
+    }
+    for(int i=0; i<16; i++) {
+        writer.writeByte(0);
+    }
+    check(decoder.recover(corrupt, writer.size(), rebuilt) == 0, "a parity packet with a corrupt length rebuilds nothing");
+}
+
+// Two peers over the loopback transport stay synced for 10000 frames, with and without 20% loss
+void CheckLoopback()
+{
+    // No loss, loss set before connecting and loss set once connected
+    for(int run=0; run<3; run++) {
+        int loss = run > 0 ? 5 : 0;
+        bool live = run == 2;
+        VirtualClock clock;
+        ShobuNetwork host, client;
+        CheckGame host_game(true), client_game(false);
+
+        host.registerCallbacks(checkUpdate, checkStore, checkRestore, checkSync, &host_game);
+        client.registerCallbacks(checkUpdate, checkStore, checkRestore, checkSync, &client_game);
+        host.setClock(clock);
+        client.setClock(clock);
+        host.setInputBits(4);
+        if(loss > 0 && !live) {
+            host.setPacketLoss(loss);
+            client.setPacketLoss(loss);
+        }
+
+        check(host.initializeLoopback(client), "loopback sessions connect");
+        if(live) {
+            host.setPacketLoss(loss);
+            client.setPacketLoss(loss);
+        }
+        double ms = PlayLoopback(host, client, clock, 10000);
+        printf("10000 frames with %d%% loss%s took %.1f ms, host at frame %d, client at frame %d\n",
+               loss ? 100/loss : 0, live ? " set once connected" : "", ms, host.getLocalTick(), client.getLocalTick());
+
+        check(host.getLocalTick() >= 9900 && client.getLocalTick() >= 9900, "both peers ran nearly every one of 10000 frames");
+        check(host.stateIsSynced() && client.stateIsSynced() && host.getDesyncFrame() < 0 && client.getDesyncFrame() < 0,
+              "both peers stayed synced");
+        check(loss == 0 || host.getPacketLoss() > 10, "packet loss was simulated");
+        check(ms < 10000*16.667, "loopback matches run faster than real time");
+    }
+}
+
+/*! Rollbacks only happen when a predicted input was wrong.  With the store and restore callbacks
+ *  the stored state also has to be brought up to date every MAX_ROLLBACK frames, while snapshots of every frame never need it
+ */
+void CheckPrediction()
+{
+    for(int run=0; run<4; run++) {
+        bool changing = run % 2 == 1;
+        bool snapshots = run >= 2;
+        VirtualClock clock;
+        ShobuNetwork host, client;
+        CheckGame host_game(true), client_game(false);
+
+        host.registerCallbacks(checkUpdate, checkStore, checkRestore, checkSync, &host_game);
+        client.registerCallbacks(checkUpdate, checkStore, checkRestore, checkSync, &client_game);
+        if(snapshots) {
+            host.addStateRegion(&host_game.state, sizeof(host_game.state));
+            client.addStateRegion(&client_game.state, sizeof(client_game.state));
+        }
+        host.setClock(clock);
+        client.setClock(clock);
+        host.setPacketDelay(3);
+        client.setPacketDelay(3);
+        host.setInputBits(4);
+        check(host.initializeLoopback(client), "loopback sessions connect");
+
+        // Each player's input changes about every 8 frames when it changes at all
+        srand(7);
+        int host_input = 5, client_input = 9;
+        int host_changes = 0, client_changes = 0;
+        const int frames = 2000;
+        for(int i=0; i<frames && host.connected(); i++) {
+            if(changing && rand() % 8 == 0) {
+                host_input = (host_input + 1 + rand() % 15) % 16;
+                host_changes++;
+            }
+            if(changing && rand() % 8 == 0) {
+                client_input = (client_input + 1 + rand() % 15) % 16;
+                client_changes++;
+            }
+
+            host.update(host_input);
+            client.update(client_input);
+            clock.advance(16667);
+        }
+
+        int host_extra = host_game.updates - (host.getLocalTick()+1);
+        int client_extra = client_game.updates - (client.getLocalTick()+1);
+        printf("%d frames with %d and %d input changes%s: host restored %d times and ran %d frames again, client restored %d times and ran %d frames again\n",
+               frames, host_changes, client_changes, snapshots ? " and snapshots" : "", host_game.restores, host_extra, client_game.restores, client_extra);
+
+        check(host.stateIsSynced() && client.stateIsSynced(), "predicting peers stay synced");
+
+        // The very first prediction is of an input nothing was heard of yet
+        int refreshes = frames / MAX_ROLLBACK + 1;
+        if(snapshots && !changing) {
+            check(host_extra <= MAX_ROLLBACK && client_extra <= MAX_ROLLBACK, "with snapshots held inputs run each frame once");
+        } else if(snapshots) {
+            check(host_extra < client_changes * (MAX_ROLLBACK+1) && client_extra < host_changes * (MAX_ROLLBACK+1) && host_extra < frames,
+                  "with snapshots only frames after a wrong prediction run again");
+        } else if(!changing) {
+            check(host_game.restores <= refreshes && client_game.restores <= refreshes,
+                  "held inputs only restore to bring the stored state up to date");
+        } else {
+            check(host_game.restores <= client_changes + refreshes && client_game.restores <= host_changes + refreshes,
+                  "only wrong predictions and bringing the stored state up to date restore it");
+        }
+    }
+}
+
+// Game whose frame counter is part of its snapshots, so it notices each rollback as a frame it already ran
+struct RollbackGame
+{
+    RollbackGame() : frame(0), last_run(-1), rollbacks(0) {}
+
+    int frame;
+    int last_run;
+    int rollbacks;
+};
+
+void rollbackUpdate(void* game_ptr, int, int)
+{
+    RollbackGame& game = *((RollbackGame*)game_ptr);
+    if(game.frame <= game.last_run) {
+        game.rollbacks++;
+    }
+    game.last_run = game.frame;
+    game.frame++;
+}
+
+// A button held for 6 frames and let go for 10
+int heldScript(int frame)
+{
+    return frame % 16 < 6 ? 1 : 0;
+}
+
+// A combo of four moves, each held for its own few frames
+int comboScript(int frame)
+{
+    int step = frame % 16;
+    return step < 4 ? 3 : step < 7 ? 6 : step < 12 ? 9 : 12;
+}
+
+// Rollbacks the host needs to follow the client playing a script, with both predicting the same way
+int CountRollbacks(PredictionStrategy strategy, int (*script)(int))
+{
+    VirtualClock clock;
+    ShobuNetwork host, client;
+    RollbackGame host_game, client_game;
+
+    host.registerCallbacks(rollbackUpdate, nullptr, nullptr, nullptr, &host_game);
+    client.registerCallbacks(rollbackUpdate, nullptr, nullptr, nullptr, &client_game);
+    host.addStateRegion(&host_game.frame, sizeof(host_game.frame));
+    client.addStateRegion(&client_game.frame, sizeof(client_game.frame));
+    host.setPrediction(strategy);
+    client.setPrediction(strategy);
+
+    // Wide inputs have no buttons unless told, the scripts only use the low bits
+    host.setPredictionButtons(NetworkInput::fromInt(15));
+    client.setPredictionButtons(NetworkInput::fromInt(15));
+    host.setClock(clock);
+    client.setClock(clock);
+    host.setPacketDelay(3);
+    client.setPacketDelay(3);
+    host.setInputBits(4);
+    if(!host.initializeLoopback(client)) {
+        return -1;
+    }
+
+    for(int i=0; i<2000 && host.connected(); i++) {
+        host.update(0);
+        client.update(script(i));
+        clock.advance(16667);
+    }
+
+    return host.stateIsSynced() ? host_game.rollbacks : -1;
+}
+
+/*! The hold and Markov predictors each need far fewer rollbacks than repeating the last input
+ *  on the patterns they're made for, a steady button rhythm and a repeated combo
+ */
+void CheckPredictors()
+{
+    int repeat_held = CountRollbacks(PREDICT_REPEAT, heldScript);
+    int hold_held = CountRollbacks(PREDICT_HOLD, heldScript);
+    int repeat_combo = CountRollbacks(PREDICT_REPEAT, comboScript);
+    int markov_combo = CountRollbacks(PREDICT_MARKOV, comboScript);
+    printf("Held button: %d rollbacks repeating, %d with the hold predictor.  Combo: %d repeating, %d with the Markov predictor\n",
+           repeat_held, hold_held, repeat_combo, markov_combo);
+
+    // Repeating mispredicts every change, twice and four times every 16 frames
+    check(repeat_held >= 2000/16*2 - 10 && repeat_combo >= 2000/16*4 - 10, "repeating the last input rolls back at every change");
+    check(hold_held >= 0 && hold_held <= repeat_held/5, "the hold predictor follows a steady button rhythm");
+    check(markov_combo >= 0 && markov_combo <= repeat_combo/10, "the Markov predictor follows a repeated combo");
+}
+
+// A rollback to a frame whose snapshot was dropped reports a desync instead of running on from the wrong state
+void CheckLostSnapshot()
+{
+    VirtualClock clock;
+    ShobuNetwork host, client;
+    CheckGame host_game(true), client_game(false);
+    unsigned int extra = 0;
+
+    host.registerCallbacks(checkUpdate, nullptr, nullptr, checkSync, &host_game);
+    client.registerCallbacks(checkUpdate, nullptr, nullptr, checkSync, &client_game);
+    host.addStateRegion(&host_game.state, sizeof(host_game.state));
+    client.addStateRegion(&client_game.state, sizeof(client_game.state));
+    host.setClock(clock);
+    client.setClock(clock);
+    host.setPacketDelay(3);
+    client.setPacketDelay(3);
+    host.setInputBits(4);
+    check(host.initializeLoopback(client), "loopback sessions connect");
+
+    PlayLoopback(host, client, clock, 300);
+    check(host.stateIsSynced() && client.stateIsSynced(), "peers with snapshots stay synced");
+
+    // Drops the host's snapshots, so its next rollback has nothing to go back to
+    int dropped = host.getLocalTick();
+    host.addStateRegion(&extra, sizeof(extra));
+    PlayLoopback(host, client, clock, 300);
+
+    check(!host.stateIsSynced() && host.getDesyncFrame() > 0 && host.getDesyncFrame() <= dropped,
+          "a rollback to a dropped snapshot reports a desync");
+}
+
+// Object in a state arena linked to the one allocated before it
+struct ArenaNode
+{
+    ArenaNode(int v) : value(v) {}
+
+    int value;
+    ArenaPtr<ArenaNode> next;
+};
+
+// Links nodes in an arena into a list, newest first
+ArenaNode* BuildArenaList(StateArena& arena, int count)
+{
+    ArenaNode* head = nullptr;
+    for(int i=0; i<count; i++) {
+        ArenaNode* node = arena.create<ArenaNode>(i);
+        node->next = head;
+        head = node;
+    }
+    return head;
+}
+
+/*! Objects linked with ArenaPtr leave the same bytes in arenas mapped at different addresses, so peers' states hash the same.
+ *  Restoring a snapshot of the arena frees what was allocated after it and the links still hold
+ */
+void CheckArena()
+{
+    StateArena first, second;
+    check(first.initialize(1 << 16) && second.initialize(1 << 16), "state arenas are mapped");
+
+    ArenaNode* head = BuildArenaList(first, 100);
+    BuildArenaList(second, 100);
+    check(first.used() == second.used() && memcmp(first.data(), second.data(), first.used()) == 0,
+          "arenas at different addresses hold the same bytes");
+
+    SnapshotRing ring;
+    ring.addRegion(first.data(), first.capacity(), first.usedCounter());
+    ring.save(0);
+    size_t used = first.used();
+
+    ArenaNode* extra = first.create<ArenaNode>(100);
+    extra->next = head;
+    head->value = -1;
+    ring.save(1);
+
+    int sum = 0;
+    int count = 0;
+    bool restored = ring.restore(0);
+    for(ArenaNode* node=head; node; node=node->next.get()) {
+        sum += node->value;
+        count++;
+    }
+    check(restored && first.used() == used && count == 100 && sum == 99*100/2,
+          "restoring an arena frees later objects and keeps the links");
+}
+
+// Object in an arena holding its own address, which differs between the peers
+struct AddressNode
+{
+    AddressNode* self;
+};
+
+/*! Without a sync callback the library hashes the state regions, but not arenas holding addresses.
+ *  Once one player's simulation drifts, both find the desync at about the frame it started within a round trip
+ */
+void CheckStateHash()
+{
+    for(int run=0; run<2; run++) {
+        bool drift = run == 1;
+        VirtualClock clock;
+        ShobuNetwork host, client;
+        CheckGame host_game(true), client_game(false);
+        StateArena host_arena, client_arena;
+
+        host_arena.initialize(4096);
+        client_arena.initialize(4096);
+        AddressNode* host_node = host_arena.create<AddressNode>();
+        AddressNode* client_node = client_arena.create<AddressNode>();
+        host_node->self = host_node;
+        client_node->self = client_node;
+
+        host.registerCallbacks(checkUpdate, nullptr, nullptr, nullptr, &host_game);
+        client.registerCallbacks(checkUpdate, nullptr, nullptr, nullptr, &client_game);
+        host.addStateRegion(&host_game.state, sizeof(host_game.state));
+        client.addStateRegion(&client_game.state, sizeof(client_game.state));
+        host.addStateArena(host_arena);
+        client.addStateArena(client_arena);
+        host.setClock(clock);
+        client.setClock(clock);
+        host.setPacketDelay(3);
+        client.setPacketDelay(3);
+        host.setInputBits(4);
+        check(host.initializeLoopback(client), "loopback sessions connect");
+
+        PlayLoopback(host, client, clock, 300);
+        if(!drift) {
+            PlayLoopback(host, client, clock, 300);
+            check(host.stateIsSynced() && client.stateIsSynced(), "arenas holding addresses aren't hashed");
+            continue;
+        }
+
+        int drifted = client.getLocalTick();
+        client_game.drift = 1;
+
+        int found = -1;
+        for(int i=0; i<300 && found < 0; i++) {
+            host.update(i % 16);
+            client.update(i % 5);
+            clock.advance(16667);
+            if(host.getDesyncFrame() >= 0 && client.getDesyncFrame() >= 0) {
+                found = host.getLocalTick();
+            }
+        }
+
+        printf("Client drifted at frame %d, desync found at frame %d by the host and %d by the client, at frame %d\n",
+               drifted, host.getDesyncFrame(), client.getDesyncFrame(), found);
+        check(!host.stateIsSynced() && !client.stateIsSynced(), "both players find a drifting simulation");
+        check(host.getDesyncFrame() == client.getDesyncFrame() && host.getDesyncFrame() > drifted - MAX_ROLLBACK
+              && host.getDesyncFrame() <= drifted + 1, "the desync is found at the frame the drift started on");
+        check(found >= 0 && found - drifted <= 30, "the desync is found within about a round trip");
+    }
+}
+
+#ifdef __linux__
+// Two pages of state each frame writes one byte of, alternating between them
+struct TrackedState
+{
+    TrackedState(size_t page_size) : memory(page_size*3)
+    {
+        uintptr_t start = reinterpret_cast<uintptr_t>(&memory[0]);
+        pages = &memory[0] + (page_size - start % page_size) % page_size;
+        size = page_size*2;
+    }
+
+    std::vector<char> memory;
+    char* pages;
+    size_t size;
+};
+
+// Plays frames on rings tracking written pages, rolling back a few frames every 10, and counts frames restored wrong
+void PlayTracked(std::vector<SnapshotRing*>& rings, std::vector<TrackedState*>& states, std::atomic<int>& wrong, int frames)
+{
+    size_t page_size = states[0]->size / 2;
+    std::vector<std::vector<char>> history(rings.size(), std::vector<char>(frames*2));
+
+    for(int frame=0; frame<frames; frame++) {
+        for(unsigned int i=0; i<rings.size(); i++) {
+            char* pages = states[i]->pages;
+            pages[(frame % 2) * page_size] = static_cast<char>(frame + i);
+            rings[i]->save(frame);
+            history[i][frame*2] = pages[0];
+            history[i][frame*2+1] = pages[page_size];
+
+            if(frame > 0 && rings[i]->getPagesSaved() != 1) {
+                wrong++;
+            }
+        }
+
+        if(frame % 10 == 9) {
+            for(unsigned int i=0; i<rings.size(); i++) {
+                char* pages = states[i]->pages;
+                if(!rings[i]->restore(frame-4) || pages[0] != history[i][(frame-4)*2] || pages[page_size] != history[i][(frame-4)*2+1]) {
+                    wrong++;
+                }
+
+                // Run the frames again as they were
+                for(int again=frame-3; again<=frame; again++) {
+                    pages[(again % 2) * page_size] = static_cast<char>(again + i);
+                    rings[i]->save(again);
+                }
+            }
+        }
+    }
+}
+
+/*! Rings on several threads track their pages at once, more runs of pages than fit in one block of the fault handler's
+ *  table, while another thread keeps adding and removing ranges.  The handler is removed with the last ring
+ */
+void CheckTrackedPages()
+{
+    struct sigaction before;
+    sigaction(SIGSEGV, nullptr, &before);
+
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const int threads = 4;
+    const int rings_per_thread = 24;
+
+    std::vector<std::vector<SnapshotRing*>> rings(threads);
+    std::vector<std::vector<TrackedState*>> states(threads);
+    bool tracking = true;
+    for(int t=0; t<threads; t++) {
+        for(int i=0; i<rings_per_thread; i++) {
+            states[t].push_back(new TrackedState(page_size));
+            rings[t].push_back(new SnapshotRing());
+            rings[t][i]->addRegion(states[t][i]->pages, states[t][i]->size);
+            tracking = rings[t][i]->setIncremental(true) && tracking;
+        }
+    }
+    check(tracking, "every ring tracks its pages, past the first block of ranges");
+
+    std::atomic<int> wrong(0);
+    std::atomic<bool> playing(true);
+    std::thread churn([&]() {
+        TrackedState state(page_size);
+        while(playing) {
+            SnapshotRing ring;
+            ring.addRegion(state.pages, state.size);
+            ring.setIncremental(true);
+            ring.save(0);
+            state.pages[0]++;
+            ring.save(1);
+        }
+    });
+
+    std::vector<std::thread> players;
+    for(int t=0; t<threads; t++) {
+        players.push_back(std::thread(PlayTracked, std::ref(rings[t]), std::ref(states[t]), std::ref(wrong), 1000));
+    }
+    for(int t=0; t<threads; t++) {
+        players[t].join();
+    }
+    playing = false;
+    churn.join();
+
+    check(wrong == 0, "rings on several threads save and restore exactly the pages written");
+
+    for(int t=0; t<threads; t++) {
+        for(int i=0; i<rings_per_thread; i++) {
+            delete rings[t][i];
+            delete states[t][i];
+        }
+    }
+
+    struct sigaction after;
+    sigaction(SIGSEGV, nullptr, &after);
+    check(after.sa_handler == before.sa_handler, "the fault handler is removed with the last ring tracking pages");
+}
+#endif
+
+// Real time without the pause after a handshake, so many clients connect quickly
+class NoSleepClock : public NetworkClock
+{
+    public:
+    long long now() { return systemClock().now(); }
+    void sleep(long long) {}
+};
+
+// Sessions a server accepted, with their games
+struct ServerMatches
+{
+    std::mutex mutex;
+    std::vector<ShobuNetwork*> sessions;
+    std::vector<CheckGame*> games;
+
+    ~ServerMatches()
+    {
+        for(unsigned int i=0; i<games.size(); i++) {
+            delete games[i];
+        }
+    }
+};
+
+// Server session updated by an executor, with the input it plays this frame
+struct ServerUpdate
+{
+    ShobuNetwork* session;
+    int input;
+};
+
+void serverUpdateTask(void* item)
+{
+    ServerUpdate& update = *((ServerUpdate*)item);
+    update.session->update(update.input);
+}
+
+bool acceptMatch(void* data, ShobuNetwork* session, const struct sockaddr_in&)
+{
+    ServerMatches& matches = *static_cast<ServerMatches*>(data);
+    CheckGame* game = new CheckGame(true);
+    session->registerCallbacks(checkUpdate, checkStore, checkRestore, checkSync, game);
+
+    std::lock_guard<std::mutex> lock(matches.mutex);
+    matches.sessions.push_back(session);
+    matches.games.push_back(game);
+    return true;
+}
+
+// Client sessions of the server checks
+struct ServerClient
+{
+    ServerClient() : game(false) {}
+
+    ShobuNetwork network;
+    CheckGame game;
+};
+
+// Writes bytes to a file, replacing it
+void writeFile(const char* filename, const std::vector<char>& data)
+{
+    std::ofstream file(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write(data.data(), data.size());
+}
+
+// Reads every event of a trace
+bool readTrace(const char* filename, std::vector<TraceEvent>& events, bool& malformed)
+{
+    TraceReader reader;
+    events.clear();
+    malformed = false;
+    if(!reader.open(filename)) {
+        return false;
+    }
+
+    TraceEvent event;
+    while(reader.next(event)) {
+        events.push_back(event);
+    }
+    malformed = reader.malformed();
+    return true;
+}
+
+/*! Events written to a trace read back as they were, a lossy match's capture replays its losses on another match,
+ *  and truncated traces, unknown events and other versions are turned away
+ */
+void CheckTrace()
+{
+    const char* filename = "check_trace.shtr";
+    const char* replayed = "check_replay.shtr";
+
+    // Every kind of event, including a received one written after a later event
+    VirtualClock clock;
+    TraceWriter writer;
+    check(writer.open(filename, clock), "trace opens");
+
+    TraceEvent written[5];
+    memset(written, 0, sizeof(written));
+    written[0].type = TRACE_SEND;
+    written[0].packet_type = 'f';
+    written[0].size = 40;
+    written[0].packet_id = 300;
+    written[1].type = TRACE_PING;
+    written[1].round_trip = 48;
+    written[2].type = TRACE_RECEIVE;
+    written[2].packet_type = 'f';
+    written[2].size = 36;
+    written[2].packet_id = 299;
+    written[2].lost = 2;
+    written[3].type = TRACE_ROLLBACK;
+    written[4].type = TRACE_WAIT;
+
+    for(int i=0; i<5; i++) {
+        clock.advance(1000 + i*250000);
+        written[i].time = writer.now();
+    }
+    writer.record(written[0]);
+    writer.record(written[1]);
+    writer.record(written[3]);
+    writer.recordReceived(written[2]);
+    writer.flush();
+    writer.record(written[4]);
+    writer.close();
+
+    std::vector<TraceEvent> events;
+    bool malformed = false;
+    bool read = readTrace(filename, events, malformed);
+    int order[5] = { 0, 1, 3, 2, 4 };
+    bool same = read && !malformed && events.size() == 5;
+    for(unsigned int i=0; same && i<5; i++) {
+        const TraceEvent& a = events[i];
+        const TraceEvent& b = written[order[i]];
+        same = a.type == b.type && a.time == b.time && a.packet_type == b.packet_type && a.size == b.size &&
+               a.packet_id == b.packet_id && a.lost == b.lost && a.old == b.old && a.round_trip == b.round_trip;
+    }
+    check(same, "trace events read back as they were written");
+
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+    TraceSummary summary;
+    std::vector<PacketFate> fates;
+
+    std::vector<char> truncated(data.begin(), data.end()-1);
+    writeFile(filename, truncated);
+    read = readTrace(filename, events, malformed);
+    check(read && malformed && events.size() == 4 && !summarizeTrace(filename, summary) && !loadTraceReplay(filename, fates),
+          "a truncated trace is turned away");
+
+    std::vector<char> unknown(data);
+    unknown.push_back('z');
+    unknown.push_back(0);
+    writeFile(filename, unknown);
+    read = readTrace(filename, events, malformed);
+    check(read && malformed && events.size() == 5 && !summarizeTrace(filename, summary) && !loadTraceReplay(filename, fates),
+          "a trace with an unknown event is turned away");
+
+    std::vector<char> version(data);
+    version[4] = TRACE_VERSION+1;
+    writeFile(filename, version);
+    check(!readTrace(filename, events, malformed) && !summarizeTrace(filename, summary), "a trace of another version is turned away");
+
+    // Capture a match where the client loses about a fifth of what it receives
+    TraceSummary captured;
+    {
+        VirtualClock match_clock;
+        ShobuNetwork host, client;
+        CheckGame host_game(true), client_game(false);
+
+        host.registerCallbacks(checkUpdate, checkStore, checkRestore, checkSync, &host_game);
+        client.registerCallbacks(checkUpdate, checkStore, checkRestore, checkSync, &client_game);
+        host.setClock(match_clock);
+        client.setClock(match_clock);
+        host.setPacketDelay(3);
+        client.setPacketDelay(3);
+        host.setInputBits(4);
+
+        NetworkConditions none, lossy;
+        lossy.loss_good = 0.2f;
+        client.setNetworkConditions(none, lossy);
+
+        check(client.startCapture(filename) && host.initializeLoopback(client), "a lossy match is captured");
+        PlayLoopback(host, client, match_clock, 1000);
+        client.stopCapture();
+        check(client.stateIsSynced() && summarizeTrace(filename, captured) && captured.sent > 0 && captured.received > 0 && captured.lost > 0,
+              "a captured trace sums up");
+    }
+
+    int lost = 0;
+    bool loaded = loadTraceReplay(filename, fates);
+    for(unsigned int i=0; i<fates.size(); i++) {
+        lost += fates[i].lost ? 1 : 0;
+    }
+    check(loaded && lost > 0, "a captured trace loads for replay");
+
+    // Replaying it on another match loses as many packets, which shows up in that match's own capture
+    TraceSummary replay;
+    {
+        VirtualClock match_clock;
+        ShobuNetwork host, client;
+        CheckGame host_game(true), client_game(false);
+
+        host.registerCallbacks(checkUpdate, checkStore, checkRestore, checkSync, &host_game);
+        client.registerCallbacks(checkUpdate, checkStore, checkRestore, checkSync, &client_game);
+        host.setClock(match_clock);
+        client.setClock(match_clock);
+        host.setPacketDelay(3);
+        client.setPacketDelay(3);
+        host.setInputBits(4);
+
+        check(client.replayCapture(filename) && client.startCapture(replayed) && host.initializeLoopback(client), "a trace is replayed");
+        PlayLoopback(host, client, match_clock, 1000);
+        client.stopCapture();
+        check(client.stateIsSynced() && summarizeTrace(replayed, replay), "a replayed match stays synced");
+    }
+
+    printf("Captured %d received and %d lost, replayed %d received and %d lost\n", captured.received, captured.lost, replay.received, replay.lost);
+    check(replay.lost > captured.lost/2 && replay.lost < captured.lost*2, "replaying a trace loses packets like the captured match");
+
+    std::remove(filename);
+    std::remove(replayed);
+}
+
+// Item of the executor checks, counting how often it was run
+struct ExecutorItem
+{
+    std::atomic<int> runs;
+    bool slow;
+};
+
+// Items in the first quarter take longer, so the thread they're shared to falls behind and the others steal them
+void executorTask(void* item_ptr)
+{
+    ExecutorItem& item = *((ExecutorItem*)item_ptr);
+    item.runs.fetch_add(1, std::memory_order_relaxed);
+
+    if(item.slow) {
+        volatile int spin = 0;
+        for(int i=0; i<2000; i++) {
+            spin = spin + i;
+        }
+    }
+}
+
+/*! Items pushed to a work stealing deque are taken exactly once while its owner pops and three thieves steal,
+ *  and the executor runs every item exactly once each run, with idle threads stealing from busy ones
+ */
+void CheckExecutor()
+{
+    const int count = 200000;
+    std::unique_ptr<std::atomic<int>[]> taken(new std::atomic<int>[count]);
+    for(int i=0; i<count; i++) {
+        taken[i] = 0;
+    }
+
+    WorkStealingDeque<256> deque;
+    std::atomic<int> total(0);
+    std::atomic<int> stolen(0);
+
+    std::vector<std::thread> thieves;
+    for(int t=0; t<3; t++) {
+        thieves.push_back(std::thread([&deque, &total, &stolen, count]() {
+            while(total.load(std::memory_order_acquire) < count) {
+                void* item = deque.steal();
+                if(item) {
+                    ((std::atomic<int>*)item)->fetch_add(1, std::memory_order_relaxed);
+                    stolen.fetch_add(1, std::memory_order_relaxed);
+                    total.fetch_add(1, std::memory_order_acq_rel);
+                }
+            }
+        }));
+    }
+
+    std::function<void()> pop = [&deque, &total]() {
+        void* item = deque.pop();
+        if(item) {
+            ((std::atomic<int>*)item)->fetch_add(1, std::memory_order_relaxed);
+            total.fetch_add(1, std::memory_order_acq_rel);
+        }
+    };
+
+    // The owner pops whenever the deque is full and after every third push, then until the thieves and it took everything
+    for(int i=0; i<count; i++) {
+        while(!deque.push(&taken[i])) {
+            pop();
+        }
+        if(i % 3 == 2) {
+            pop();
+        }
+    }
+    while(total.load(std::memory_order_acquire) < count) {
+        pop();
+    }
+    for(unsigned int t=0; t<thieves.size(); t++) {
+        thieves[t].join();
+    }
+
+    int once = 0;
+    for(int i=0; i<count; i++) {
+        once += taken[i] == 1 ? 1 : 0;
+    }
+    printf("%d items pushed, %d stolen\n", count, stolen.load());
+    check(once == count && stolen > 0 && deque.pop() == nullptr && deque.steal() == nullptr, "every item in a work stealing deque is taken exactly once");
+
+    // More items than the deques hold, so each thread also runs part of its share without queueing it
+    const int items = 20000;
+    const int runs = 20;
+    std::unique_ptr<ExecutorItem[]> work(new ExecutorItem[items]);
+    std::vector<void*> pointers(items);
+    for(int i=0; i<items; i++) {
+        work[i].runs = 0;
+        work[i].slow = i < items/4;
+        pointers[i] = &work[i];
+    }
+
+    NetworkExecutor executor;
+    check(executor.start(4) && executor.getThreads() == 4, "executor starts");
+    for(int run=0; run<runs; run++) {
+        executor.run(executorTask, &pointers[0], items);
+    }
+
+    int exact = 0;
+    for(int i=0; i<items; i++) {
+        exact += work[i].runs == runs ? 1 : 0;
+    }
+    printf("%d runs of %d items on %d threads, %lld steals\n", runs, items, executor.getThreads(), executor.getSteals());
+    check(exact == items, "the executor runs every item exactly once each run");
+    check(executor.getSteals() > 0, "idle threads steal from busy ones");
+    executor.stop();
+}
+
+// 500 clients play against one server, which turns away clients past its limit and times out silent ones
+void CheckServer()
+{
+    const int clients = 500;
+    const int port = 7300;
+
+    ServerMatches matches;
+    NetworkServer server;
+    server.setAcceptCallback(acceptMatch, &matches);
+    server.setSessionLimits(clients, 0);
+    check(server.start(port, 4), "server starts");
+
+    NetworkReactor reactor;
+    reactor.start();
+    NoSleepClock clock;
+
+    std::vector<ServerClient*> peers;
+    for(int i=0; i<clients; i++) {
+        ServerClient* peer = new ServerClient();
+        peer->network.registerCallbacks(checkUpdate, checkStore, checkRestore, checkSync, &peer->game);
+        peer->network.setReactor(&reactor);
+        peer->network.setClock(clock);
+        peers.push_back(peer);
+    }
+
+    // Connect a few at a time
+    std::vector<std::thread> connectors;
+    for(int t=0; t<10; t++) {
+        connectors.push_back(std::thread([&peers, t, clients, port]() {
+            for(int i=t; i<clients; i+=10) {
+                if(peers[i]->network.initializeClient("127.0.0.1", port)) {
+                    peers[i]->network.connectToHost();
+                }
+            }
+        }));
+    }
+    for(unsigned int i=0; i<connectors.size(); i++) {
+        connectors[i].join();
+    }
+
+    // Clients are answered before their sessions are handed over
+    int accepted = 0;
+    for(int wait=0; wait<100 && accepted < clients; wait++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::lock_guard<std::mutex> lock(matches.mutex);
+        accepted = matches.sessions.size();
+    }
+
+    int connected = 0;
+    for(int i=0; i<clients; i++) {
+        connected += peers[i]->network.connected() ? 1 : 0;
+    }
+    check(connected == clients && accepted == clients, "500 clients connect to one server");
+
+    // One more is never answered
+    UdpTransport extra;
+    char request[2] = { 'c', static_cast<char>(SHOBU_INPUT_SIZE) };
+    bool answered = extra.open() && extra.setRemote("127.0.0.1", port);
+    if(answered) {
+        extra.sendNow(request, sizeof(request));
+        answered = extra.wait(200);
+    }
+    extra.close();
+
+    ServerStats stats;
+    server.getStats(stats);
+    check(!answered && stats.rejected == 1 && stats.sessions == clients, "clients past the session limit are turned away");
+
+    // Play a couple hundred frames at about 500 frames a second, the server's sessions updated by an executor like a server's are
+    NetworkExecutor executor;
+    executor.start(4);
+    std::vector<ServerUpdate> updates(clients);
+    std::vector<void*> work(clients);
+    for(int i=0; i<clients; i++) {
+        updates[i].session = matches.sessions[i];
+        work[i] = &updates[i];
+    }
+    for(int frame=0; frame<200; frame++) {
+        for(int i=0; i<clients; i++) {
+            peers[i]->network.update((frame/8 + i) & 15);
+            updates[i].input = (frame/5 + i) & 15;
+        }
+        executor.run(serverUpdateTask, &work[0], clients);
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    executor.stop();
+
+    int synced = 0;
+    int ticks = 0;
+    for(int i=0; i<clients; i++) {
+        synced += peers[i]->network.stateIsSynced() && matches.sessions[i]->stateIsSynced() ? 1 : 0;
+        ticks += peers[i]->network.getLocalTick() > 100 ? 1 : 0;
+    }
+    printf("%d of %d matches synced, %d past frame 100\n", synced, clients, ticks);
+    check(synced == clients && ticks == clients, "every match against the server stays synced");
+
+    int measured = 0;
+    long long update_time = 0;
+    for(int i=0; i<clients; i++) {
+        SessionStats session;
+        if(server.getSessionStats(matches.sessions[i], session) && session.packets > 0 && session.receive_time > 0 && session.update_time > 0 && session.memory > 0) {
+            measured++;
+            update_time += session.update_time;
+        }
+    }
+    printf("%d sessions measured, %lld us updating them\n", measured, update_time);
+    check(measured == clients, "the server measures every session's packets, receive and update time and memory");
+
+    for(int i=0; i<clients; i++) {
+        peers[i]->network.disconnect();
+    }
+
+    // Sessions of clients that left are no longer handed packets and free their place once removed
+    std::this_thread::sleep_for(std::chrono::milliseconds(3*SERVER_POLL_MS));
+    int closed = 0;
+    for(int i=0; i<clients; i++) {
+        closed += matches.sessions[i]->connected() ? 0 : 1;
+        server.removeSession(matches.sessions[i]);
+    }
+    server.getStats(stats);
+    check(closed == clients && stats.sessions == 0, "disconnected sessions are removed");
+
+    // A client that goes silent is timed out
+    server.stop();
+    server.setSessionLimits(clients, 200);
+    server.start(port, 1);
+    ShobuNetwork silent;
+    silent.setReactor(&reactor);
+    silent.setClock(clock);
+    if(silent.initializeClient("127.0.0.1", port)) {
+        silent.connectToHost();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    server.getStats(stats);
+    check(silent.connected() && stats.timeouts == 1, "sessions that receive nothing time out");
+
+    silent.disconnect();
+    reactor.stop();
+    server.stop();
+    for(unsigned int i=0; i<peers.size(); i++) {
+        delete peers[i];
+    }
+}
+
+// Meets the other player in its own thread, since both players wait for each other
+void meetThroughRendezvous(ShobuNetwork* network, int port, const char* key, bool* connected)
+{
+    *connected = network->connectThroughRendezvous("127.0.0.1", port, key);
+}
+
+// Two players meet through a rendezvous server, and when either one relays the other one relays too
+void CheckRendezvous()
+{
+    const int port = 7411;
+
+    RendezvousServer server;
+    check(server.start(port), "rendezvous server starts");
+
+    for(int run=0; run<2; run++) {
+        bool host_relays = run == 1;
+        ShobuNetwork host, client;
+        CheckGame host_game(true), client_game(false);
+
+        host.registerCallbacks(checkUpdate, checkStore, checkRestore, checkSync, &host_game);
+        client.registerCallbacks(checkUpdate, checkStore, checkRestore, checkSync, &client_game);
+        (host_relays ? host : client).setForceRelay(true);
+
+        // The first player to register hosts
+        const char* key = host_relays ? "host relays" : "client relays";
+        bool host_connected = false, client_connected = false;
+        std::thread host_thread(meetThroughRendezvous, &host, port, key, &host_connected);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        std::thread client_thread(meetThroughRendezvous, &client, port, key, &client_connected);
+        host_thread.join();
+        client_thread.join();
+
+        printf("Players met in %d and %d ms with the %s relaying\n", host.getConnectTime(), client.getConnectTime(), host_relays ? "host" : "client");
+        check(host_connected && client_connected, "players meet through the rendezvous server");
+        check(host.usingRelay() && client.usingRelay(), "the other player relays too");
+        check(host.getConnectTime() < RENDEZVOUS_PUNCH_MS && client.getConnectTime() < RENDEZVOUS_PUNCH_MS,
+              "the other player goes to the relay without waiting to punch through");
+
+        for(int i=0; i<120 && host.connected() && client.connected(); i++) {
+            host.update(i/8 % 16);
+            client.update(i/5 % 16);
+            std::this_thread::sleep_for(std::chrono::milliseconds(16));
+        }
+
+        check(host.getLocalTick() >= 100 && client.getLocalTick() >= 100 && host.stateIsSynced() && client.stateIsSynced(),
+              "relayed players play in sync");
+
+        host.disconnect();
+        client.disconnect();
+    }
+
+    server.stop();
+}
+
+// Game that keeps the inputs it ran each frame with, its frame counter being part of its snapshots
+struct RecordGame
+{
+    RecordGame() : frame(0), inputs(4096, -1) {}
+
+    int frame;
+    std::vector<int> inputs;
+};
+
+void recordUpdate(void* game_ptr, int player1, int player2)
+{
+    RecordGame& game = *((RecordGame*)game_ptr);
+    if(game.frame < (int)game.inputs.size()) {
+        game.inputs[game.frame] = player1*16 + player2;
+    }
+    game.frame++;
+}
+
+// Keeps the inputs of every frame a spectator ran, in order
+void spectatorUpdate(void* inputs_ptr, int player1, int player2)
+{
+    ((std::vector<int>*)inputs_ptr)->push_back(player1*16 + player2);
+}
+
+// Passes packets between one spectator and a broadcaster, dropping some of the broadcaster's frames
+struct LossyForwarder
+{
+    LossyForwarder() : running(false), spectator_known(false), frames(0), dropped(0) {}
+
+    UdpTransport transport;
+    struct sockaddr_in broadcaster;
+    struct sockaddr_in spectator;
+    std::atomic<bool> running;
+    bool spectator_known;
+    int frames;
+    std::atomic<int> dropped;
+};
+
+void runForwarder(LossyForwarder* forwarder)
+{
+    char packet[MAX_PACKET_SIZE];
+
+    while(forwarder->running) {
+        if(!forwarder->transport.wait(10)) {
+            continue;
+        }
+
+        int size = forwarder->transport.receiveOne(packet, sizeof(packet));
+        if(size <= 0) {
+            continue;
+        }
+
+        const struct sockaddr_in& sender = forwarder->transport.getSender();
+        if(sender.sin_port != forwarder->broadcaster.sin_port) {
+            forwarder->spectator = sender;
+            forwarder->spectator_known = true;
+            forwarder->transport.sendTo(forwarder->broadcaster, packet, size);
+            continue;
+        }
+
+        // Every third broadcast is lost, and a run of them early on so the spectator has to be caught up
+        if(packet[0] == 'v') {
+            int count = forwarder->frames++;
+            if(count % 3 == 1 || (count >= 10 && count < 20)) {
+                forwarder->dropped++;
+                continue;
+            }
+        }
+        if(forwarder->spectator_known) {
+            forwarder->transport.sendTo(forwarder->spectator, packet, size);
+        }
+    }
+}
+
+// Updates spectators until each one ran up to a frame, or a few seconds went by
+bool watchUntil(ShobuSpectator& first, ShobuSpectator& second, int frame)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while(first.getFrame() < frame || second.getFrame() < frame) {
+        if(std::chrono::steady_clock::now() - start > std::chrono::seconds(5)) {
+            return false;
+        }
+
+        int before = first.getFrame() + second.getFrame();
+        first.update();
+        second.update();
+        if(first.getFrame() + second.getFrame() == before) {
+            first.wait(1);
+        }
+    }
+    return true;
+}
+
+/*! A spectator watching through a lossy link relays to a second spectator.  Both run the players' confirmed inputs,
+ *  the first one asking again for what it lost, and both skip ahead when the broadcaster starts again after a gap
+ */
+void CheckSpectators()
+{
+    const int port = 7520;
+    const int frames = 2000;
+
+    VirtualClock clock;
+    ShobuNetwork host, client;
+    RecordGame host_game, client_game;
+
+    host.registerCallbacks(recordUpdate, nullptr, nullptr, nullptr, &host_game);
+    client.registerCallbacks(recordUpdate, nullptr, nullptr, nullptr, &client_game);
+    host.addStateRegion(&host_game.frame, sizeof(host_game.frame));
+    client.addStateRegion(&client_game.frame, sizeof(client_game.frame));
+    host.setClock(clock);
+    client.setClock(clock);
+    host.setPacketDelay(3);
+    client.setPacketDelay(3);
+    host.setInputBits(4);
+
+    SpectatorBroadcaster broadcaster, relay_broadcaster;
+    check(broadcaster.start(port) && relay_broadcaster.start(port+2), "spectator broadcasters start");
+    host.setBroadcaster(&broadcaster);
+
+    LossyForwarder forwarder;
+    check(forwarder.transport.open() && forwarder.transport.bind(port+1) && UdpTransport::resolve("127.0.0.1", port, forwarder.broadcaster),
+          "lossy forwarder starts");
+    forwarder.running = true;
+    std::thread forwarder_thread(runForwarder, &forwarder);
+
+    // The relay watches through the lossy forwarder, the second spectator watches the relay
+    std::vector<int> relay_inputs, watcher_inputs;
+    ShobuSpectator relay, watcher;
+    relay.registerCallback(spectatorUpdate, &relay_inputs);
+    relay.setRelay(&relay_broadcaster);
+    watcher.registerCallback(spectatorUpdate, &watcher_inputs);
+    check(relay.connect("127.0.0.1", port+1) && watcher.connect("127.0.0.1", port+2), "spectators connect");
+
+    check(host.initializeLoopback(client), "loopback sessions connect");
+
+    // About 4 frames a millisecond, so the session never hands over more frames than the broadcaster takes at once
+    srand(11);
+    int host_input = 0, client_input = 0;
+    for(int i=0; i<frames && host.connected(); i++) {
+        if(rand() % 8 == 0) {
+            host_input = rand() % 16;
+        }
+        if(rand() % 8 == 0) {
+            client_input = rand() % 16;
+        }
+
+        host.update(host_input);
+        client.update(client_input);
+        clock.advance(16667);
+
+        relay.update();
+        watcher.update();
+        if(i % 4 == 3) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    host.setBroadcaster(nullptr);
+
+    // Give the broadcaster time to take the last frames
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    BroadcastStats stats;
+    broadcaster.getStats(stats);
+    int confirmed = stats.frames - 1;
+    bool watched = watchUntil(relay, watcher, confirmed);
+
+    printf("Spectators watched %d of %d frames, %d broadcasts dropped, %lld catch up packets\n",
+           confirmed+1, frames, forwarder.dropped.load(), stats.catchup_packets);
+    check(host.stateIsSynced() && confirmed >= frames - 50 && watched, "spectators run every confirmed frame through a lossy link and a relay");
+    check(forwarder.dropped > 0 && stats.catchup_packets > 0 && relay.getSkipped() == 0, "lost broadcasts are sent again");
+
+    // The broadcaster starts again after a gap, like a session that fell too far behind
+    const int gap = 40;
+    const int extra = 60;
+    std::vector<int> expected(host_game.inputs.begin(), host_game.inputs.begin() + confirmed+1);
+    for(int i=0; i<extra; i++) {
+        int frame = confirmed+1 + gap + i;
+        while(!broadcaster.addFrame(frame, NetworkInput::fromInt(i % 16), NetworkInput::fromInt((i*5) % 16))) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        expected.push_back((i % 16)*16 + (i*5) % 16);
+    }
+    watched = watchUntil(relay, watcher, confirmed + gap + extra);
+
+    printf("Spectators skipped %d and %d frames\n", relay.getSkipped(), watcher.getSkipped());
+    check(watched && relay.getSkipped() == gap && watcher.getSkipped() == gap, "spectators and relays skip frames the broadcaster no longer has");
+    check(relay_inputs == expected && watcher_inputs == expected, "spectators run the players' inputs");
+
+    relay.disconnect();
+    watcher.disconnect();
+    forwarder.running = false;
+    forwarder_thread.join();
+    forwarder.transport.close();
+    relay_broadcaster.stop();
+    broadcaster.stop();
+}
+
+int RunChecks()
+{
+    CheckPacketCodec();
+    CheckFec();
+    CheckLoopback();
+    CheckPrediction();
+    CheckPredictors();
+    CheckLostSnapshot();
+    CheckArena();
+    CheckStateHash();
+    CheckTrace();
+    CheckExecutor();
+#ifdef __linux__
+    CheckTrackedPages();
+#endif
+    CheckServer();
+    CheckRendezvous();
+    CheckSpectators();
+
+    if(failures > 0) {
+        printf("%d checks failed\n", failures);
+    }
+
+    return failures > 0 ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
 
     if(argc < 2) {
-        printf("Usage: pass -c for running a client, pass -h for hosting.\n");
+        printf("Usage: pass -c for running a client, pass -h for hosting, pass -l for a host and client in one process.\n");
+        printf("Pass -r <server> <key> to meet another player with the same key through a rendezvous server.\n");
+        printf("Pass -t to check the library's behavior, exits with 1 when a check fails.\n");
         return 0;
     }
 
+    if(argv[1][1] == 't') {
+        return RunChecks();
+    }
+
+    // Declared first so it outlives the sessions using it
+    VirtualClock clock;
+
     ShobuNetwork network;
     Game game;
     game.tick = 0;
@@ -87,6 +1591,16 @@ int main(int argc, char **argv)
         RunClient(network);
     } else if(argv[1][1] == 'h') {
         RunHost(network);
+    } else if(argv[1][1] == 'l') {
+        ShobuNetwork client;
+        Game client_game;
+        client_game.tick = 0;
+
+        client.registerCallbacks(networkGameUpdate, networkStoreState, networkRestoreState, networkCheckSync, (void *)&client_game);
+
+        RunLoopback(network, client, clock);
+    } else if(argv[1][1] == 'r' && argc > 3) {
+        RunRendezvous(network, argv[2], argv[3]);
     }
 
     return 0;
@@ -0,0 +1,194 @@
+#ifndef SHOBU_LOAD_MATCH_H
+#define SHOBU_LOAD_MATCH_H
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "Network.h"
+#include "NetworkServer.h"
+#include "NetworkPacket.h"
+
+// Ticks each scripted input is held for, like a button held down
+const int INPUT_HOLD = 8;
+
+// Port a ShobuServer answers report requests on, after the port clients connect to
+const int REPORT_PORT_OFFSET = 1;
+
+// Version of the report packets
+const unsigned char REPORT_VERSION = 1;
+
+// Game both ends of each match run, just enough to check they stay in sync
+struct Game
+{
+    bool host;
+    unsigned int state;
+    unsigned int saved;
+};
+
+inline void gameUpdate(void* data, int local_input, int remote_input)
+{
+    Game& game = *static_cast<Game*>(data);
+    int first = game.host ? local_input : remote_input;
+    int second = game.host ? remote_input : local_input;
+    game.state = game.state*31 + first*7 + second;
+}
+
+inline void gameStore(void* data)
+{
+    static_cast<Game*>(data)->saved = static_cast<Game*>(data)->state;
+}
+
+inline void gameRestore(void* data)
+{
+    static_cast<Game*>(data)->state = static_cast<Game*>(data)->saved;
+}
+
+inline int gameCheck(void* data)
+{
+    return static_cast<int>(static_cast<Game*>(data)->state);
+}
+
+// Same inputs for a peer every run
+inline int scriptedInput(int peer, int tick)
+{
+    unsigned int x = peer*2654435761u ^ (tick / INPUT_HOLD)*40503u;
+    x ^= x >> 13;
+    x *= 0x5bd1e995u;
+    x ^= x >> 15;
+    return x & 15;
+}
+
+// Datagrams the kernel dropped on UDP sockets bound to the port
+inline long long kernelDrops(int port)
+{
+    long long drops = 0;
+#ifdef __linux__
+    FILE* file = fopen("/proc/net/udp", "r");
+    if(!file) {
+        return 0;
+    }
+
+    char line[512];
+    fgets(line, sizeof(line), file);
+    while(fgets(line, sizeof(line), file)) {
+        unsigned int local_port = 0;
+        long long line_drops = 0;
+        if(sscanf(line, "%*d: %*x:%x", &local_port) != 1 || static_cast<int>(local_port) != port) {
+            continue;
+        }
+
+        // Drops are the last column
+        char* last = strrchr(line, ' ');
+        if(last && sscanf(last, "%lld", &line_drops) == 1) {
+            drops += line_drops;
+        }
+    }
+    fclose(file);
+#endif
+    return drops;
+}
+
+// What the server side of a load test looks like, from a server in this process or from a ShobuServer
+struct ServerReport
+{
+    int sessions;
+    int synced;
+    long long packets;
+
+    // Microseconds spent handling and updating the sessions, in total
+    long long session_time;
+
+    // Nanoseconds from the kernel receiving packets to their session having handled them, since the last reset
+    long long latency_p50;
+    long long latency_p99;
+    long long latency_p999;
+
+    long long unknown_packets;
+    long long kernel_drops;
+};
+
+/*! Read the report of a server and its sessions
+ * \param reset_latency start counting latencies again afterwards
+ */
+inline void collectReport(NetworkServer& server, const std::vector<ShobuNetwork*>& sessions, int port, bool reset_latency, ServerReport& report)
+{
+    ServerStats stats;
+    server.getStats(stats);
+
+    LatencyHistogram latency;
+    server.getLatency(latency, reset_latency);
+
+    report.sessions = stats.sessions;
+    report.synced = 0;
+    report.packets = stats.packets;
+    report.session_time = 0;
+    for(unsigned int i=0; i<sessions.size(); i++) {
+        SessionStats session;
+        if(server.getSessionStats(sessions[i], session)) {
+            report.session_time += session.receive_time + session.update_time;
+        }
+        report.synced += sessions[i]->stateIsSynced() ? 1 : 0;
+    }
+
+    report.latency_p50 = latency.percentile(0.5);
+    report.latency_p99 = latency.percentile(0.99);
+    report.latency_p999 = latency.percentile(0.999);
+    report.unknown_packets = stats.unknown_packets;
+    report.kernel_drops = kernelDrops(port);
+}
+
+// Varints only hold 32 bits
+inline void writeLong(PacketWriter& writer, long long value)
+{
+    writer.writeVarint(static_cast<uint32_t>(value));
+    writer.writeVarint(static_cast<uint32_t>(static_cast<unsigned long long>(value) >> 32));
+}
+
+inline long long readLong(PacketReader& reader)
+{
+    unsigned long long low = reader.readVarint();
+    unsigned long long high = reader.readVarint();
+    return static_cast<long long>(low | (high << 32));
+}
+
+// Encode a report as the answer to a request, returns its size
+inline int writeReport(const ServerReport& report, char* packet, int size)
+{
+    PacketWriter writer(packet, size);
+    writer.writeByte('q');
+    writer.writeByte(REPORT_VERSION);
+    writer.writeVarint(report.sessions);
+    writer.writeVarint(report.synced);
+    writeLong(writer, report.packets);
+    writeLong(writer, report.session_time);
+    writeLong(writer, report.latency_p50);
+    writeLong(writer, report.latency_p99);
+    writeLong(writer, report.latency_p999);
+    writeLong(writer, report.unknown_packets);
+    writeLong(writer, report.kernel_drops);
+
+    return writer.overflow() ? 0 : writer.size();
+}
+
+inline bool readReport(const char* packet, int size, ServerReport& report)
+{
+    if(size < 2 || packet[0] != 'q') {
+        return false;
+    }
+
+    PacketReader reader(packet+1, size-1);
+    unsigned char version = reader.readByte();
+    report.sessions = reader.readVarint();
+    report.synced = reader.readVarint();
+    report.packets = readLong(reader);
+    report.session_time = readLong(reader);
+    report.latency_p50 = readLong(reader);
+    report.latency_p99 = readLong(reader);
+    report.latency_p999 = readLong(reader);
+    report.unknown_packets = readLong(reader);
+    report.kernel_drops = readLong(reader);
+
+    return !reader.error() && version == REPORT_VERSION;
+}
+
+#endif // SHOBU_LOAD_MATCH_H
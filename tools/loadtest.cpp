@@ -0,0 +1,351 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Network.h"
+#include "NetworkServer.h"
+#include "NetworkReactor.h"
+#include "NetworkExecutor.h"
+#include "NetworkUdp.h"
+#include "NetworkPacketPool.h"
+#include "loadmatch.h"
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+// Peers connecting at the same time
+const int CONNECT_THREADS = 32;
+
+// Seconds the peers play before measuring, so every session is past its handshake
+const int WARMUP_SECONDS = 1;
+
+// Milliseconds to wait for a server's report before asking again, and how many times to ask
+const int REPORT_TIMEOUT_MS = 200;
+const int REPORT_ATTEMPTS = 5;
+
+struct Options
+{
+    int peers;
+    int rate;
+    int seconds;
+    int port;
+    int shards;
+    int threads;
+
+    // Server to connect to instead of starting one, or nullptr
+    const char* host;
+};
+
+struct Peer
+{
+    ShobuNetwork network;
+    Game game;
+    int index;
+};
+
+// Real time, except the pause after a handshake is skipped so thousands of peers connect quickly
+class LoadClock : public NetworkClock
+{
+    public:
+    long long now() { return systemClock().now(); }
+    void sleep(long long) {}
+};
+
+// Sessions the server accepted, with their games
+static std::mutex g_server_mutex;
+static std::vector<ShobuNetwork*> g_server_sessions;
+static std::vector<Game*> g_server_games;
+static std::atomic<int> g_tick(0);
+
+static bool acceptPeer(void*, ShobuNetwork* session, const struct sockaddr_in&)
+{
+    Game* game = new Game();
+    game->host = true;
+    game->state = 0;
+    session->registerCallbacks(gameUpdate, gameStore, gameRestore, gameCheck, game);
+
+    std::lock_guard<std::mutex> lock(g_server_mutex);
+    g_server_sessions.push_back(session);
+    g_server_games.push_back(game);
+    return true;
+}
+
+struct Item
+{
+    ShobuNetwork* network;
+    int index;
+};
+
+static void updateItem(void* data)
+{
+    Item& item = *static_cast<Item*>(data);
+    item.network->update(scriptedInput(item.index, g_tick));
+}
+
+static double cpuSeconds()
+{
+#ifdef __linux__
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#else
+    return 0;
+#endif
+}
+
+// Report of the server in this process
+static void localReport(NetworkServer& server, int port, bool reset_latency, ServerReport& report)
+{
+    std::lock_guard<std::mutex> lock(g_server_mutex);
+    collectReport(server, g_server_sessions, port, reset_latency, report);
+}
+
+// Ask a ShobuServer for its report
+static bool requestReport(UdpTransport& transport, bool reset_latency, ServerReport& report)
+{
+    char request[3];
+    request[0] = 'q';
+    request[1] = REPORT_VERSION;
+    request[2] = reset_latency ? 1 : 0;
+
+    char packet[MAX_PACKET_SIZE];
+    for(int attempt=0; attempt<REPORT_ATTEMPTS; attempt++) {
+        transport.sendNow(request, sizeof(request));
+        while(transport.wait(REPORT_TIMEOUT_MS)) {
+            if(readReport(packet, transport.receiveOne(packet, sizeof(packet)), report)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static void raiseFileLimit()
+{
+#ifdef __linux__
+    // Every peer has a socket of its own
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+static bool parseOptions(int argc, char** argv, Options& options)
+{
+    options.peers = 100;
+    options.rate = 60;
+    options.seconds = 10;
+    options.port = 7200;
+    options.shards = 0;
+    options.threads = 0;
+    options.host = nullptr;
+
+    for(int i=1; i<argc; i++) {
+        if(argv[i][0] != '-' || i+1 >= argc) {
+            return false;
+        }
+
+        const char* value = argv[++i];
+        switch(argv[i-1][1]) {
+        case 'n': options.peers = atoi(value); break;
+        case 'r': options.rate = atoi(value); break;
+        case 't': options.seconds = atoi(value); break;
+        case 'p': options.port = atoi(value); break;
+        case 's': options.shards = atoi(value); break;
+        case 'w': options.threads = atoi(value); break;
+        case 'e': options.host = value; break;
+        default: return false;
+        }
+    }
+
+    return options.peers > 0 && options.rate > 0 && options.seconds > 0;
+}
+
+/*! Plays N synthetic matches against a NetworkServer on this machine and reports how it holds up.
+ *  Each peer is a real client session sending scripted inputs at the tick rate, and unless another server is given
+ *  the matching server sessions are updated at the same rate by the same thread pool
+ */
+int main(int argc, char **argv)
+{
+    Options options;
+    if(!parseOptions(argc, argv, options)) {
+        printf("Usage: ShobuLoadTest [-n peers] [-r ticks per second] [-t seconds] [-p port] [-s server shards] [-w update threads] [-e external server]\n");
+        return 1;
+    }
+
+    raiseFileLimit();
+
+    NetworkServer server;
+    UdpTransport report_transport;
+    if(!options.host) {
+        server.setAcceptCallback(acceptPeer, nullptr);
+        if(!server.start(options.port, options.shards)) {
+            printf("Could not start the server on port %d\n", options.port);
+            return 1;
+        }
+    } else if(!report_transport.open() || !report_transport.setRemote(options.host, options.port + REPORT_PORT_OFFSET)) {
+        printf("Could not reach %s for the server's report\n", options.host);
+        return 1;
+    }
+
+    NetworkReactor reactor;
+    reactor.start();
+    LoadClock clock;
+
+    std::vector<Peer*> peers;
+    for(int i=0; i<options.peers; i++) {
+        Peer* peer = new Peer();
+        peer->index = i;
+        peer->game.host = false;
+        peer->game.state = 0;
+        peer->network.registerCallbacks(gameUpdate, gameStore, gameRestore, gameCheck, &peer->game);
+        peer->network.setReactor(&reactor);
+        peer->network.setClock(clock);
+        peers.push_back(peer);
+    }
+
+    // Connect a few peers at a time
+    std::chrono::steady_clock::time_point connect_start = std::chrono::steady_clock::now();
+    std::atomic<int> next(0);
+    std::vector<std::thread> connectors;
+    for(int i=0; i<CONNECT_THREADS; i++) {
+        connectors.push_back(std::thread([&]() {
+            for(int index = next++; index < options.peers; index = next++) {
+                ShobuNetwork& network = peers[index]->network;
+                if(network.initializeClient(options.host ? options.host : "127.0.0.1", options.port)) {
+                    network.connectToHost();
+                }
+            }
+        }));
+    }
+    for(unsigned int i=0; i<connectors.size(); i++) {
+        connectors[i].join();
+    }
+    double connect_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - connect_start).count();
+
+    int connected = 0;
+    for(int i=0; i<options.peers; i++) {
+        connected += peers[i]->network.connected() ? 1 : 0;
+    }
+    printf("Connected %d of %d peers in %.2f s\n", connected, options.peers, connect_time);
+
+    std::vector<Item> items;
+    for(int i=0; i<options.peers; i++) {
+        Item item;
+        item.network = &peers[i]->network;
+        item.index = i;
+        items.push_back(item);
+    }
+    if(!options.host) {
+        std::lock_guard<std::mutex> lock(g_server_mutex);
+        for(unsigned int i=0; i<g_server_sessions.size(); i++) {
+            Item item;
+            item.network = g_server_sessions[i];
+            item.index = i;
+            items.push_back(item);
+        }
+    }
+
+    NetworkExecutor executor;
+    executor.start(options.threads);
+
+    std::vector<void*> work;
+    for(unsigned int i=0; i<items.size(); i++) {
+        work.push_back(&items[i]);
+    }
+
+    int ticks = (WARMUP_SECONDS + options.seconds) * options.rate;
+    std::chrono::nanoseconds tick_length(1000000000LL / options.rate);
+    std::chrono::steady_clock::time_point next_tick = std::chrono::steady_clock::now();
+
+    int late_ticks = 0;
+    ServerReport start_report;
+    bool reported = false;
+    double start_cpu = 0;
+    std::chrono::steady_clock::time_point start;
+
+    for(int tick=0; tick<ticks; tick++) {
+        if(tick == WARMUP_SECONDS * options.rate) {
+            // Start measuring
+            if(options.host) {
+                reported = requestReport(report_transport, true, start_report);
+            } else {
+                localReport(server, options.port, true, start_report);
+                reported = true;
+            }
+
+            start_cpu = cpuSeconds();
+            start = std::chrono::steady_clock::now();
+            late_ticks = 0;
+        }
+
+        g_tick = tick;
+        executor.run(updateItem, &work[0], work.size());
+
+        next_tick += tick_length;
+        if(std::chrono::steady_clock::now() > next_tick) {
+            late_ticks++;
+        }
+        std::this_thread::sleep_until(next_tick);
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = cpuSeconds() - start_cpu;
+
+    int synced = 0;
+    long long loss = 0;
+    long long ping = 0;
+    for(int i=0; i<options.peers; i++) {
+        synced += peers[i]->network.stateIsSynced() ? 1 : 0;
+        loss += peers[i]->network.getPacketLoss();
+        ping += peers[i]->network.getPing();
+    }
+
+    printf("Peers: %d Tick rate: %d Seconds: %.1f Late ticks: %d\n", options.peers, options.rate, seconds, late_ticks);
+    printf("Clients synced: %d Average ping: %.1f ms Average packet loss: %.2f%%\n", synced,
+           static_cast<double>(ping) / options.peers, static_cast<double>(loss) / options.peers);
+    printf("Process CPU: %.1f%% of a core\n", cpu / seconds * 100);
+
+    ServerReport report;
+    if(options.host) {
+        reported = reported && requestReport(report_transport, false, report);
+    } else {
+        localReport(server, options.port, false, report);
+    }
+
+    if(reported) {
+        double per_session = report.sessions > 0 ? (report.session_time - start_report.session_time) / seconds / report.sessions : 0;
+
+        printf("Server sessions: %d synced: %d Packets: %.0f/s\n", report.sessions, report.synced, (report.packets - start_report.packets) / seconds);
+        printf("Processing latency: p50 %.1f us p99 %.1f us p999 %.1f us\n", report.latency_p50 / 1000.0,
+               report.latency_p99 / 1000.0, report.latency_p999 / 1000.0);
+        printf("Server CPU per session: %.1f us/s (%.3f%% of a core)\n", per_session, per_session / 10000.0);
+        printf("Drops: %lld unknown packets, %lld in the kernel\n", report.unknown_packets, report.kernel_drops);
+    } else {
+        printf("%s didn't answer for the server's report, is it a ShobuServer?\n", options.host);
+    }
+
+    executor.stop();
+    for(int i=0; i<options.peers; i++) {
+        peers[i]->network.disconnect();
+    }
+    reactor.stop();
+    server.stop();
+
+    for(int i=0; i<options.peers; i++) {
+        delete peers[i];
+    }
+    for(unsigned int i=0; i<g_server_games.size(); i++) {
+        delete g_server_games[i];
+    }
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include "NetworkRendezvous.h"
+
+// Seconds between printing the server's statistics
+const int STATS_INTERVAL = 5;
+
+// Runs a rendezvous server players can meet through, printing how busy it is every few seconds
+int main(int argc, char **argv)
+{
+    int port = argc > 1 ? atoi(argv[1]) : RENDEZVOUS_PORT;
+
+    RendezvousServer server;
+    if(!server.start(port)) {
+        printf("Could not start the rendezvous server on port %d\n", port);
+        return 1;
+    }
+
+    printf("Rendezvous server listening on port %d\n", port);
+    fflush(stdout);
+
+    while(true) {
+        std::this_thread::sleep_for(std::chrono::seconds(STATS_INTERVAL));
+
+        RendezvousStats stats;
+        server.getStats(stats);
+
+        double average = stats.relayed_packets > 0 ? stats.forward_time / 1000.0 / stats.relayed_packets : 0;
+        printf("Waiting: %d Matches: %d Relays: %d Relayed: %lld packets %lld bytes Forwarding: %.1f us average %.1f us most Unknown: %lld\n",
+               stats.waiting, stats.matches, stats.relays, stats.relayed_packets, stats.relayed_bytes,
+               average, stats.max_forward_time / 1000.0, stats.unknown_packets);
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Network.h"
+#include "NetworkServer.h"
+#include "NetworkExecutor.h"
+#include "NetworkUdp.h"
+#include "NetworkPacketPool.h"
+#include "loadmatch.h"
+
+// Seconds between printing the server's statistics
+const int STATS_INTERVAL = 5;
+
+struct Options
+{
+    int rate;
+    int port;
+    int shards;
+    int threads;
+};
+
+// Sessions the server accepted and not yet removed, with their games
+static std::mutex g_mutex;
+static std::vector<ShobuNetwork*> g_sessions;
+static std::vector<Game*> g_games;
+static std::atomic<int> g_tick(0);
+
+static bool acceptPeer(void*, ShobuNetwork* session, const struct sockaddr_in&)
+{
+    Game* game = new Game();
+    game->host = true;
+    game->state = 0;
+    session->registerCallbacks(gameUpdate, gameStore, gameRestore, gameCheck, game);
+
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_sessions.push_back(session);
+    g_games.push_back(game);
+    return true;
+}
+
+struct Item
+{
+    ShobuNetwork* network;
+    int index;
+};
+
+static void updateItem(void* data)
+{
+    Item& item = *static_cast<Item*>(data);
+    item.network->update(scriptedInput(item.index, g_tick));
+}
+
+// Remove the sessions whose clients left, between updates
+static void removeClosed(NetworkServer& server)
+{
+    std::lock_guard<std::mutex> lock(g_mutex);
+    for(unsigned int i=0; i<g_sessions.size();) {
+        if(g_sessions[i]->connected()) {
+            i++;
+            continue;
+        }
+
+        server.removeSession(g_sessions[i]);
+        delete g_games[i];
+        g_sessions[i] = g_sessions.back();
+        g_games[i] = g_games.back();
+        g_sessions.pop_back();
+        g_games.pop_back();
+    }
+}
+
+// Answer ShobuLoadTest's requests for the server's report
+static void answerReports(NetworkServer& server, UdpTransport& transport, int port)
+{
+    char packet[MAX_PACKET_SIZE];
+    while(transport.wait(0)) {
+        int size = transport.receiveOne(packet, sizeof(packet));
+        if(size < 3 || packet[0] != 'q' || static_cast<unsigned char>(packet[1]) != REPORT_VERSION) {
+            continue;
+        }
+
+        ServerReport report;
+        {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            collectReport(server, g_sessions, port, packet[2] != 0, report);
+        }
+
+        int reply_size = writeReport(report, packet, sizeof(packet));
+        if(reply_size > 0) {
+            transport.sendTo(transport.getSender(), packet, reply_size);
+        }
+    }
+}
+
+static bool parseOptions(int argc, char** argv, Options& options)
+{
+    options.rate = 60;
+    options.port = 7200;
+    options.shards = 0;
+    options.threads = 0;
+
+    for(int i=1; i<argc; i++) {
+        if(argv[i][0] != '-' || i+1 >= argc) {
+            return false;
+        }
+
+        const char* value = argv[++i];
+        switch(argv[i-1][1]) {
+        case 'r': options.rate = atoi(value); break;
+        case 'p': options.port = atoi(value); break;
+        case 's': options.shards = atoi(value); break;
+        case 'w': options.threads = atoi(value); break;
+        default: return false;
+        }
+    }
+
+    return options.rate > 0;
+}
+
+/*! Hosts matches on a NetworkServer and updates every session at the tick rate, for ShobuLoadTest -e to play against.
+ *  Prints how busy it is every few seconds, and answers the load test's requests for its report on the next port
+ */
+int main(int argc, char **argv)
+{
+    Options options;
+    if(!parseOptions(argc, argv, options)) {
+        printf("Usage: ShobuServer [-r ticks per second] [-p port] [-s shards] [-w update threads]\n");
+        return 1;
+    }
+
+    NetworkServer server;
+    server.setAcceptCallback(acceptPeer, nullptr);
+    if(!server.start(options.port, options.shards)) {
+        printf("Could not start the server on port %d\n", options.port);
+        return 1;
+    }
+
+    UdpTransport reports;
+    if(!reports.open() || !reports.bind(options.port + REPORT_PORT_OFFSET)) {
+        printf("Could not listen for report requests on port %d\n", options.port + REPORT_PORT_OFFSET);
+        return 1;
+    }
+
+    printf("Server listening on port %d, reports on port %d\n", options.port, options.port + REPORT_PORT_OFFSET);
+    fflush(stdout);
+
+    NetworkExecutor executor;
+    executor.start(options.threads);
+
+    std::chrono::nanoseconds tick_length(1000000000LL / options.rate);
+    std::chrono::steady_clock::time_point next_tick = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point next_stats = next_tick + std::chrono::seconds(STATS_INTERVAL);
+
+    std::vector<Item> items;
+    std::vector<void*> work;
+    long long last_packets = 0;
+    int late_ticks = 0;
+
+    while(true) {
+        removeClosed(server);
+        answerReports(server, reports, options.port);
+
+        // Only this thread removes sessions, so the pointers stay valid outside the lock
+        {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            items.resize(g_sessions.size());
+            for(unsigned int i=0; i<g_sessions.size(); i++) {
+                items[i].network = g_sessions[i];
+                items[i].index = i;
+            }
+        }
+
+        work.resize(items.size());
+        for(unsigned int i=0; i<items.size(); i++) {
+            work[i] = &items[i];
+        }
+
+        if(!work.empty()) {
+            executor.run(updateItem, &work[0], work.size());
+        }
+        g_tick++;
+
+        next_tick += tick_length;
+        if(std::chrono::steady_clock::now() > next_tick) {
+            late_ticks++;
+        }
+
+        if(std::chrono::steady_clock::now() >= next_stats) {
+            next_stats += std::chrono::seconds(STATS_INTERVAL);
+
+            ServerStats stats;
+            server.getStats(stats);
+
+            printf("Sessions: %d Packets: %.0f/s Late ticks: %d Rejected: %lld Timeouts: %lld Unknown: %lld\n",
+                   stats.sessions, static_cast<double>(stats.packets - last_packets) / STATS_INTERVAL, late_ticks,
+                   stats.rejected, stats.timeouts, stats.unknown_packets);
+            fflush(stdout);
+
+            last_packets = stats.packets;
+            late_ticks = 0;
+        }
+
+        std::this_thread::sleep_until(next_tick);
+    }
+
+    return 0;
+}